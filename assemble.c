@@ -0,0 +1,1068 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gbuild.h"
+
+/* function type byte for functions taking their arguments in locals */
+#define FUNC_LOCALS_ARGS    0xC1
+
+/* glulx operand addressing modes */
+#define MODE_ZERO           0x0
+#define MODE_CONST_BYTE     0x1
+#define MODE_CONST_SHORT    0x2
+#define MODE_CONST_WORD     0x3
+#define MODE_ADDR_BYTE      0x5
+#define MODE_ADDR_SHORT     0x6
+#define MODE_ADDR_WORD      0x7
+#define MODE_STACK          0x8
+#define MODE_LOCAL_BYTE     0x9
+#define MODE_LOCAL_SHORT    0xA
+#define MODE_LOCAL_WORD     0xB
+
+
+/*
+The functions of a game divided between worker threads. Each worker takes
+functions from the front of its own range and, once that is empty, steals
+from the back of the other workers' ranges.
+*/
+typedef struct WORK_RANGE {
+    pthread_mutex_t lock;
+    unsigned next;
+    unsigned end;
+} workrange_t;
+
+typedef struct ASM_WORKER {
+    glulxfile_t *gamefile;
+    function_t **functions;
+    workrange_t *ranges;
+    unsigned index;
+    unsigned thread_count;
+    int has_errors;
+} asmworker_t;
+
+/*
+The functions found to be reachable whose own references have not been
+followed yet.
+*/
+typedef struct REACH_WORKLIST {
+    symboltable_t *globals;
+    function_t **functions;
+    unsigned count;
+} worklist_t;
+
+/* guards the game's string table while functions are assembled in parallel */
+static pthread_mutex_t string_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void show_asm_error(function_t *function, const char *message, const char *detail);
+int take_work(workrange_t *range, int from_back, unsigned *result);
+void* assemble_worker(void *data);
+symbol_t* intern_string(glulxfile_t *gamefile, const char *text);
+int collect_labels(function_t *function, codeblock_t *code);
+int reset_function(glulxfile_t *gamefile, function_t *function);
+void visit_identifiers(codeblock_t *code, void (*visit)(asmoperand_t*, void*), void *data);
+void declare_import(asmoperand_t *operand, void *data);
+void mark_reachable(worklist_t *worklist, symbol_t *symbol);
+void mark_operand_reachable(asmoperand_t *operand, void *data);
+int parse_all_bodies(glulxfile_t *gamefile);
+void mark_branch_targets(function_t *function, codeblock_t *code);
+void add_counter(glulxfile_t *gamefile, function_t *function, int type, const char *name);
+void add_profile_call(codebuf_t *out, reloctable_t *relocations, symbol_t *target);
+function_t* new_profile_function(glulxfile_t *gamefile, const char *name);
+void build_profile_dump(glulxfile_t *gamefile, function_t *function);
+int assemble_codeblock(glulxfile_t *gamefile, function_t *function, codeblock_t *code);
+int assemble_asmblock(glulxfile_t *gamefile, function_t *function, asmblock_t *code);
+int is_stack_push(asmblock_t *code, unsigned index);
+int call_argument_count(asmblock_t *code, unsigned index);
+int is_tail_call(asmblock_t *code, unsigned index);
+int specialize_call(glulxfile_t *gamefile, function_t *function, asmblock_t *code,
+                    unsigned index, unsigned *consumed);
+int assemble_instruction(glulxfile_t *gamefile, function_t *function, asmblock_t *code, asmstmt_t *stmt);
+int assemble_data(glulxfile_t *gamefile, function_t *function, asmblock_t *code, asmstmt_t *stmt);
+void add_opcode(codebuf_t *buffer, int opcode);
+int integer_mode(int value, int is_indirect);
+int local_mode(unsigned offset);
+
+
+void show_asm_error(function_t *function, const char *message, const char *detail) {
+    fprintf(stderr, "%s: asm-error: %s \"%s\"\n",
+            function->name, message, detail);
+}
+
+/*
+Append a byte to a code buffer, growing it as needed.
+*/
+void codebuf_add_byte(codebuf_t *buffer, int value) {
+    if (buffer->size >= buffer->capacity) {
+        buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 256;
+        buffer->data = realloc(buffer->data, buffer->capacity);
+    }
+    buffer->data[buffer->size] = value & 0xFF;
+    ++buffer->size;
+}
+
+/*
+Append a four byte, big-endian value to a code buffer.
+*/
+void codebuf_add_word(codebuf_t *buffer, unsigned value) {
+    codebuf_add_byte(buffer, value >> 24);
+    codebuf_add_byte(buffer, value >> 16);
+    codebuf_add_byte(buffer, value >> 8);
+    codebuf_add_byte(buffer, value);
+}
+
+/*
+Overwrite a four byte, big-endian value already in a code buffer.
+*/
+void codebuf_set_word(codebuf_t *buffer, unsigned offset, unsigned value) {
+    buffer->data[offset]     = (value >> 24) & 0xFF;
+    buffer->data[offset + 1] = (value >> 16) & 0xFF;
+    buffer->data[offset + 2] = (value >> 8) & 0xFF;
+    buffer->data[offset + 3] = value & 0xFF;
+}
+
+/*
+Append a relocation to a table. Callers add relocations in increasing order of
+offset so the table never needs sorting.
+*/
+void add_relocation(reloctable_t *table, unsigned offset, int type, symbol_t *symbol) {
+    add_relocation_addend(table, offset, type, symbol, 0);
+}
+
+void add_relocation_addend(reloctable_t *table, unsigned offset, int type, symbol_t *symbol,
+                           unsigned addend) {
+    if (table->count >= table->capacity) {
+        table->capacity = table->capacity ? table->capacity * 2 : 16;
+        table->entries = realloc(table->entries,
+                                 table->capacity * sizeof(relocation_t));
+    }
+    relocation_t *reloc = &table->entries[table->count];
+    reloc->offset = offset;
+    reloc->type = type;
+    reloc->symbol = symbol;
+    reloc->addend = addend;
+    ++table->count;
+}
+
+
+/*
+Add every label in a code block to the function's local symbol table so that
+forward references can be resolved while assembling.
+*/
+int collect_labels(function_t *function, codeblock_t *code) {
+    int has_errors = 0;
+    statement_t *stmt = code->content;
+    while (stmt) {
+        if (stmt->type == STMT_BLOCK) {
+            has_errors |= collect_labels(function, stmt->data.code);
+        } else if (stmt->type == STMT_ASM) {
+            asmblock_t *block = stmt->data.asm;
+            for (unsigned i = 0; i < block->count; ++i) {
+                asmstmt_t *asmstmt = &block->content[i];
+                if (asmstmt->type == ASM_LABEL) {
+                    asmoperand_t *name_op = get_asm_operand(block, asmstmt, 0);
+                    const char *name = name_op->data.name;
+                    if (get_symbol_hashed(function->locals, name, name_op->hash)) {
+                        show_asm_error(function, "duplicate label", name);
+                        has_errors = 1;
+                    } else {
+                        symbol_t *symbol = calloc(sizeof(symbol_t), 1);
+                        symbol->name = strdup(name);
+                        symbol->type = SYM_LABEL;
+                        add_symbol_hashed(function->locals, symbol, name_op->hash);
+                    }
+                }
+            }
+        }
+        stmt = stmt->next;
+    }
+    return has_errors;
+}
+
+/*
+Discard any previous encoding of a function, lay out its call frame and give
+it a fresh local symbol table holding its local variables and labels.
+Returns non-zero if errors occured.
+*/
+int reset_function(glulxfile_t *gamefile, function_t *function) {
+    free_codebuf(&function->output);
+    free_reloctable(&function->relocations);
+    if (function->locals) {
+        free_symbol_table(function->locals);
+    }
+    function->locals = calloc(sizeof(symboltable_t), 1);
+    function->locals->parent = gamefile->global_symbols;
+    function->counter_count = 0;
+    layout_frame(function);
+    for (unsigned i = 0; i < function->local_count; ++i) {
+        symbol_t *symbol = calloc(sizeof(symbol_t), 1);
+        symbol->name = strdup(function->local_names[i]);
+        symbol->type = SYM_LOCAL;
+        symbol->data.value = function->local_offsets[i];
+        add_symbol(function->locals, symbol);
+    }
+    if (collect_labels(function, function->code)) {
+        return 1;
+    }
+    if (gamefile->profile) {
+        mark_branch_targets(function, function->code);
+    }
+    return 0;
+}
+
+/*
+Mark each label that a branch jumps to, so that a counter can be added where
+it is placed.
+*/
+void mark_branch_targets(function_t *function, codeblock_t *code) {
+    for (statement_t *stmt = code->content; stmt; stmt = stmt->next) {
+        if (stmt->type == STMT_BLOCK) {
+            mark_branch_targets(function, stmt->data.code);
+        } else if (stmt->type == STMT_ASM) {
+            asmblock_t *block = stmt->data.asm;
+            for (unsigned i = 0; i < block->count; ++i) {
+                asmstmt_t *asmstmt = &block->content[i];
+                if (asmstmt->type != ASM_INSTRUCTION || asmstmt->operand_count == 0
+                        || !(mnemonics[asmstmt->mnemonic].flags & MNE_RELJUMP)) {
+                    continue;
+                }
+                asmoperand_t *operand = get_asm_operand(block, asmstmt,
+                                                        asmstmt->operand_count - 1);
+                if (operand->type != OP_IDENTIFIER) continue;
+                symbol_t *label = get_symbol_hashed(function->locals, operand->data.name,
+                                                    operand->hash);
+                if (label && label->type == SYM_LABEL) {
+                    label->is_branch_target = 1;
+                }
+            }
+        }
+    }
+}
+
+/*
+Add a counter to a function and the code to increment it. Counters are
+numbered within the function until the functions are put in their final
+order; the relocations against the counter table are then moved along by
+the function's first counter.
+*/
+void add_counter(glulxfile_t *gamefile, function_t *function, int type, const char *name) {
+    if (function->counter_count >= function->counter_capacity) {
+        function->counter_capacity = function->counter_capacity
+                                   ? function->counter_capacity * 2 : 8;
+        function->counters = realloc(function->counters,
+                                     function->counter_capacity * sizeof(profcounter_t));
+    }
+    unsigned index = function->counter_count++;
+    function->counters[index].type = type;
+    function->counters[index].name = name;
+
+    /* add *counter 1 *counter */
+    codebuf_t *out = &function->output;
+    add_opcode(out, get_mnemonic("add")->opcode);
+    codebuf_add_byte(out, MODE_ADDR_WORD | (MODE_CONST_BYTE << 4));
+    codebuf_add_byte(out, MODE_ADDR_WORD);
+    add_relocation_addend(&function->relocations, out->size, RELOC_ABSOLUTE,
+                          gamefile->profile_counters, index * 4);
+    codebuf_add_word(out, 0);
+    codebuf_add_byte(out, 1);
+    add_relocation_addend(&function->relocations, out->size, RELOC_ABSOLUTE,
+                          gamefile->profile_counters, index * 4);
+    codebuf_add_word(out, 0);
+}
+
+/*
+Append a call with no arguments whose result is discarded.
+*/
+void add_profile_call(codebuf_t *out, reloctable_t *relocations, symbol_t *target) {
+    add_opcode(out, get_mnemonic("call")->opcode);
+    codebuf_add_byte(out, MODE_CONST_WORD | (MODE_ZERO << 4));
+    codebuf_add_byte(out, MODE_ZERO);
+    add_relocation(relocations, out->size, RELOC_ABSOLUTE, target);
+    codebuf_add_word(out, 0);
+}
+
+/*
+Call visit for every identifier operand of every instruction in a code block.
+*/
+void visit_identifiers(codeblock_t *code, void (*visit)(asmoperand_t*, void*), void *data) {
+    for (statement_t *stmt = code->content; stmt; stmt = stmt->next) {
+        if (stmt->type == STMT_BLOCK) {
+            visit_identifiers(stmt->data.code, visit, data);
+        } else if (stmt->type == STMT_ASM) {
+            asmblock_t *block = stmt->data.asm;
+            for (unsigned i = 0; i < block->count; ++i) {
+                if (block->content[i].type != ASM_INSTRUCTION) continue;
+                for (int j = 0; j < block->content[i].operand_count; ++j) {
+                    asmoperand_t *operand = get_asm_operand(block, &block->content[i], j);
+                    if (operand->type == OP_IDENTIFIER) {
+                        visit(operand, data);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void declare_import(asmoperand_t *operand, void *data) {
+    function_t *function = data;
+    if (lookup_symbol_hashed(function->locals, operand->data.name, operand->hash)) {
+        return;
+    }
+    symbol_t *symbol = calloc(sizeof(symbol_t), 1);
+    symbol->name = strdup(operand->data.name);
+    symbol->type = SYM_IMPORT;
+    add_symbol_hashed(function->locals->parent, symbol, operand->hash);
+}
+
+/*
+Add a placeholder symbol for every name used by the game's functions that is
+neither a label nor a defined symbol. This is used when compiling an object
+file, where such names refer to functions that the linker will find in other
+objects. Must be called before assemble_game, since the global symbol table is
+not safe to change while functions are assembled in parallel. Returns non-zero
+if errors occured.
+*/
+int declare_imports(glulxfile_t *gamefile) {
+    int has_errors = parse_all_bodies(gamefile);
+    for (function_t *func = gamefile->functions; func; func = func->next) {
+        if (!func->code) continue;
+        if (reset_function(gamefile, func)) {
+            has_errors = 1;
+            continue;
+        }
+        visit_identifiers(func->code, declare_import, func);
+    }
+    for (object_t *object = gamefile->objects; object; object = object->next) {
+        for (unsigned i = 0; i < object->property_count; ++i) {
+            asmoperand_t *value = &object->properties[i].value;
+            if (value->type != OP_IDENTIFIER
+                    || get_symbol_hashed(gamefile->global_symbols, value->data.name,
+                                         value->hash)) {
+                continue;
+            }
+            symbol_t *symbol = calloc(sizeof(symbol_t), 1);
+            symbol->name = strdup(value->data.name);
+            symbol->type = SYM_IMPORT;
+            add_symbol_hashed(gamefile->global_symbols, symbol, value->hash);
+        }
+    }
+    return has_errors;
+}
+
+void mark_reachable(worklist_t *worklist, symbol_t *symbol) {
+    if (!symbol || symbol->type != SYM_FUNCTION || !symbol->data.func
+            || symbol->data.func->is_reachable) {
+        return;
+    }
+    symbol->data.func->is_reachable = 1;
+    worklist->functions[worklist->count++] = symbol->data.func;
+}
+
+void mark_operand_reachable(asmoperand_t *operand, void *data) {
+    worklist_t *worklist = data;
+    mark_reachable(worklist, get_symbol_hashed(worklist->globals, operand->data.name,
+                                               operand->hash));
+}
+
+/*
+Remove every function that cannot be reached from the start function, parsing
+the bodies of the reachable functions as they are found. Bodies skipped by
+lazy parsing are never parsed for functions that are removed. Any name that
+matches a function counts as a reference to it, so a label sharing a
+function's name may keep the function. Every object is kept, along with the
+functions its properties name. Returns non-zero if errors occured.
+*/
+int remove_unreachable(glulxfile_t *gamefile) {
+    unsigned function_count = 0;
+    for (function_t *func = gamefile->functions; func; func = func->next) {
+        func->is_reachable = 0;
+        ++function_count;
+    }
+
+    worklist_t worklist;
+    worklist.globals = gamefile->global_symbols;
+    worklist.functions = malloc((function_count + 1) * sizeof(function_t*));
+    worklist.count = 0;
+    mark_reachable(&worklist, get_symbol(gamefile->global_symbols, START_FUNCTION));
+    for (object_t *object = gamefile->objects; object; object = object->next) {
+        for (unsigned i = 0; i < object->property_count; ++i) {
+            if (object->properties[i].value.type == OP_IDENTIFIER) {
+                mark_operand_reachable(&object->properties[i].value, &worklist);
+            }
+        }
+    }
+
+    int has_errors = 0;
+    while (worklist.count) {
+        function_t *func = worklist.functions[--worklist.count];
+        has_errors |= parse_function_body(gamefile, func);
+        if (func->code) {
+            visit_identifiers(func->code, mark_operand_reachable, &worklist);
+        } else {
+            for (unsigned i = 0; i < func->relocations.count; ++i) {
+                mark_reachable(&worklist, func->relocations.entries[i].symbol);
+            }
+        }
+    }
+    free(worklist.functions);
+
+    function_t *func = gamefile->functions;
+    while (func) {
+        function_t *next = func->next;
+        if (!func->is_reachable) {
+            if (func->prev) {
+                func->prev->next = next;
+            } else {
+                gamefile->functions = next;
+            }
+            if (next) {
+                next->prev = func->prev;
+            }
+            get_symbol(gamefile->global_symbols, func->name)->data.func = 0;
+            free_function(func);
+        }
+        func = next;
+    }
+    return has_errors;
+}
+
+/*
+Parse any function bodies skipped by lazy parsing. Parsing is not safe to do
+from worker threads, so this is done before functions are assembled. Returns
+non-zero if errors occured.
+*/
+int parse_all_bodies(glulxfile_t *gamefile) {
+    int has_errors = 0;
+    for (function_t *func = gamefile->functions; func; func = func->next) {
+        has_errors |= parse_function_body(gamefile, func);
+    }
+    return has_errors;
+}
+
+/*
+Encode a single function into its own output buffer. References to other
+symbols are left as zero and recorded in the function's relocation list.
+Returns non-zero if errors occured.
+*/
+int assemble_function(glulxfile_t *gamefile, function_t *function) {
+    /* functions loaded from an object file are already encoded */
+    if (!function->code) {
+        return 0;
+    }
+
+    if (reset_function(gamefile, function)) {
+        return 1;
+    }
+
+    /* the slots are laid out largest first, as layout_frame expects */
+    static const int slot_sizes[FRAME_SLOT_SIZES] = { 4, 2, 1 };
+    codebuf_add_byte(&function->output, FUNC_LOCALS_ARGS);
+    for (unsigned kind = 0; kind < FRAME_SLOT_SIZES; ++kind) {
+        for (unsigned left = function->frame_slots[kind]; left > 0; ) {
+            unsigned count = left < MAX_FORMAT_LOCALS ? left : MAX_FORMAT_LOCALS;
+            codebuf_add_byte(&function->output, slot_sizes[kind]);
+            codebuf_add_byte(&function->output, count);
+            left -= count;
+        }
+    }
+    codebuf_add_byte(&function->output, 0);
+    codebuf_add_byte(&function->output, 0);
+    if (gamefile->profile) {
+        add_counter(gamefile, function, COUNTER_CALL, 0);
+    }
+    return assemble_codeblock(gamefile, function, function->code);
+}
+
+/*
+Add the symbols used by the counters of a profiling build. Must be called
+before the game is assembled. Returns non-zero if errors occured.
+*/
+int declare_profile(glulxfile_t *gamefile) {
+    const char *names[] = { PROFILE_COUNTERS, PROFILE_DUMP, PROFILE_START };
+    for (int i = 0; i < 3; ++i) {
+        if (get_symbol(gamefile->global_symbols, names[i])) {
+            fprintf(stderr, "ERROR: \"%s\" is reserved for profiling builds.\n", names[i]);
+            return 1;
+        }
+    }
+    gamefile->profile = 1;
+    gamefile->profile_counters = calloc(sizeof(symbol_t), 1);
+    gamefile->profile_counters->name = strdup(PROFILE_COUNTERS);
+    gamefile->profile_counters->type = SYM_CONSTANT;
+    add_symbol(gamefile->global_symbols, gamefile->profile_counters);
+
+    /* filled in by add_profile_functions */
+    gamefile->profile_dump = calloc(sizeof(symbol_t), 1);
+    gamefile->profile_dump->name = strdup(PROFILE_DUMP);
+    gamefile->profile_dump->type = SYM_IMPORT;
+    add_symbol(gamefile->global_symbols, gamefile->profile_dump);
+    return 0;
+}
+
+/*
+Create an encoded function with no locals at the end of the game's function
+list.
+*/
+function_t* new_profile_function(glulxfile_t *gamefile, const char *name) {
+    function_t *function = calloc(sizeof(function_t), 1);
+    function->name = strdup(name);
+    function->locals = calloc(sizeof(symboltable_t), 1);
+    function->locals->parent = gamefile->global_symbols;
+    codebuf_add_byte(&function->output, FUNC_LOCALS_ARGS);
+    codebuf_add_byte(&function->output, 0);
+    codebuf_add_byte(&function->output, 0);
+
+    function_t **end = &gamefile->functions;
+    while (*end) {
+        function->prev = *end;
+        end = &(*end)->next;
+    }
+    *end = function;
+    return function;
+}
+
+/*
+Write out each counter that is not zero as a line giving its number and
+value. The loop is unrolled, so the function needs no locals.
+*/
+void build_profile_dump(glulxfile_t *gamefile, function_t *function) {
+    codebuf_t *out = &function->output;
+    reloctable_t *relocations = &function->relocations;
+    symbol_t *prefix = add_string(gamefile, PROFILE_DUMP_PREFIX);
+    int jz = get_mnemonic("jz")->opcode;
+    int streamstr = get_mnemonic("streamstr")->opcode;
+    int streamnum = get_mnemonic("streamnum")->opcode;
+    int streamchar = get_mnemonic("streamchar")->opcode;
+    static const int mode_size[] = { 0, 1, 2, 4 };
+
+    for (unsigned i = 0; i < gamefile->counter_count; ++i) {
+        int index_mode = integer_mode(i, 0);
+
+        /* jz *counter skip, where skip is filled in once the line is written */
+        add_opcode(out, jz);
+        codebuf_add_byte(out, MODE_ADDR_WORD | (MODE_CONST_BYTE << 4));
+        add_relocation_addend(relocations, out->size, RELOC_ABSOLUTE,
+                              gamefile->profile_counters, i * 4);
+        codebuf_add_word(out, 0);
+        unsigned branch = out->size;
+        codebuf_add_byte(out, 0);
+
+        add_opcode(out, streamstr);
+        codebuf_add_byte(out, MODE_CONST_WORD);
+        add_relocation(relocations, out->size, RELOC_ABSOLUTE, prefix);
+        codebuf_add_word(out, 0);
+
+        add_opcode(out, streamnum);
+        codebuf_add_byte(out, index_mode);
+        for (int j = mode_size[index_mode] - 1; j >= 0; --j) {
+            codebuf_add_byte(out, i >> (j * 8));
+        }
+
+        add_opcode(out, streamchar);
+        codebuf_add_byte(out, MODE_CONST_BYTE);
+        codebuf_add_byte(out, ' ');
+
+        add_opcode(out, streamnum);
+        codebuf_add_byte(out, MODE_ADDR_WORD);
+        add_relocation_addend(relocations, out->size, RELOC_ABSOLUTE,
+                              gamefile->profile_counters, i * 4);
+        codebuf_add_word(out, 0);
+
+        add_opcode(out, streamchar);
+        codebuf_add_byte(out, MODE_CONST_BYTE);
+        codebuf_add_byte(out, '\n');
+
+        /* a branch offset counts from the end of the jz, less two */
+        out->data[branch] = out->size - (branch + 1) + 2;
+    }
+
+    add_opcode(out, get_mnemonic("return")->opcode);
+    codebuf_add_byte(out, MODE_ZERO);
+}
+
+/*
+Number the counters of every function in the order the functions will be
+laid out, then add the function that writes out the counters and the function
+that runs the game and then calls it. The game's own quit instructions call
+the dump function too. Must be called once the functions are in their final
+order. Returns non-zero if errors occured.
+*/
+int add_profile_functions(glulxfile_t *gamefile) {
+    symbol_t *start = get_symbol(gamefile->global_symbols, START_FUNCTION);
+    if (!start || start->type != SYM_FUNCTION) {
+        fprintf(stderr, "LINK: no function named \"%s\" to begin execution at.\n",
+                START_FUNCTION);
+        return 1;
+    }
+
+    gamefile->counter_count = 0;
+    for (function_t *func = gamefile->functions; func; func = func->next) {
+        func->first_counter = gamefile->counter_count;
+        gamefile->counter_count += func->counter_count;
+    }
+
+    function_t *dump = new_profile_function(gamefile, PROFILE_DUMP);
+    build_profile_dump(gamefile, dump);
+    gamefile->profile_dump->type = SYM_FUNCTION;
+    gamefile->profile_dump->data.func = dump;
+
+    function_t *run = new_profile_function(gamefile, PROFILE_START);
+    add_profile_call(&run->output, &run->relocations, start);
+    add_profile_call(&run->output, &run->relocations, gamefile->profile_dump);
+    add_opcode(&run->output, get_mnemonic("quit")->opcode);
+    symbol_t *symbol = calloc(sizeof(symbol_t), 1);
+    symbol->name = strdup(PROFILE_START);
+    symbol->type = SYM_FUNCTION;
+    symbol->data.func = run;
+    add_symbol(gamefile->global_symbols, symbol);
+    return 0;
+}
+
+/*
+Remove one function index from a work range, taking it from either the front
+or the back. Returns zero if the range was empty.
+*/
+int take_work(workrange_t *range, int from_back, unsigned *result) {
+    int found = 0;
+    pthread_mutex_lock(&range->lock);
+    if (range->next < range->end) {
+        *result = from_back ? --range->end : range->next++;
+        found = 1;
+    }
+    pthread_mutex_unlock(&range->lock);
+    return found;
+}
+
+void* assemble_worker(void *data) {
+    asmworker_t *worker = data;
+    unsigned index;
+    while (1) {
+        int found = take_work(&worker->ranges[worker->index], 0, &index);
+        for (unsigned i = 1; !found && i < worker->thread_count; ++i) {
+            unsigned victim = (worker->index + i) % worker->thread_count;
+            found = take_work(&worker->ranges[victim], 1, &index);
+        }
+        if (!found) {
+            break;
+        }
+        worker->has_errors |= assemble_function(worker->gamefile,
+                                                worker->functions[index]);
+    }
+    return 0;
+}
+
+/*
+Encode every function in the game, using up to thread_count threads. Since
+each function is encoded into its own buffer and the layout order is fixed,
+the result does not depend on the number of threads. Returns non-zero if
+errors occured.
+*/
+int assemble_game(glulxfile_t *gamefile, unsigned thread_count) {
+    if (parse_all_bodies(gamefile)) {
+        return 1;
+    }
+
+    unsigned function_count = 0;
+    function_t *func = gamefile->functions;
+    while (func) {
+        ++function_count;
+        func = func->next;
+    }
+    if (thread_count > function_count) {
+        thread_count = function_count;
+    }
+
+    int has_errors = 0;
+    if (thread_count <= 1) {
+        func = gamefile->functions;
+        while (func) {
+            has_errors |= assemble_function(gamefile, func);
+            func = func->next;
+        }
+        return has_errors;
+    }
+
+    function_t **functions = malloc(function_count * sizeof(function_t*));
+    func = gamefile->functions;
+    for (unsigned i = 0; i < function_count; ++i) {
+        functions[i] = func;
+        func = func->next;
+    }
+
+    workrange_t *ranges = calloc(sizeof(workrange_t), thread_count);
+    asmworker_t *workers = calloc(sizeof(asmworker_t), thread_count);
+    pthread_t *threads = calloc(sizeof(pthread_t), thread_count);
+    for (unsigned i = 0; i < thread_count; ++i) {
+        pthread_mutex_init(&ranges[i].lock, 0);
+        ranges[i].next = function_count * i / thread_count;
+        ranges[i].end = function_count * (i + 1) / thread_count;
+        workers[i].gamefile = gamefile;
+        workers[i].functions = functions;
+        workers[i].ranges = ranges;
+        workers[i].index = i;
+        workers[i].thread_count = thread_count;
+    }
+
+    unsigned started = 0;
+    for (unsigned i = 1; i < thread_count; ++i) {
+        if (pthread_create(&threads[i], 0, assemble_worker, &workers[i]) != 0) {
+            break;
+        }
+        ++started;
+    }
+    /* the calling thread works too; it will steal any range whose thread
+       could not be started */
+    assemble_worker(&workers[0]);
+    has_errors |= workers[0].has_errors;
+    for (unsigned i = 1; i <= started; ++i) {
+        pthread_join(threads[i], 0);
+        has_errors |= workers[i].has_errors;
+    }
+
+    for (unsigned i = 0; i < thread_count; ++i) {
+        pthread_mutex_destroy(&ranges[i].lock);
+    }
+    free(threads);
+    free(workers);
+    free(ranges);
+    free(functions);
+    return has_errors;
+}
+
+/*
+Add a string to the game's string table; safe to call from worker threads.
+*/
+symbol_t* intern_string(glulxfile_t *gamefile, const char *text) {
+    pthread_mutex_lock(&string_lock);
+    symbol_t *symbol = add_string(gamefile, text);
+    pthread_mutex_unlock(&string_lock);
+    return symbol;
+}
+
+int assemble_codeblock(glulxfile_t *gamefile, function_t *function, codeblock_t *code) {
+    int has_errors = 0;
+    statement_t *stmt = code->content;
+    while (stmt) {
+        switch(stmt->type) {
+            case STMT_BLOCK:
+                has_errors |= assemble_codeblock(gamefile, function, stmt->data.code);
+                break;
+            case STMT_ASM:
+                has_errors |= assemble_asmblock(gamefile, function, stmt->data.asm);
+                break;
+            default:
+                fprintf(stderr, "unhandled statement type %d in assemble_codeblock\n", stmt->type);
+                has_errors = 1;
+        }
+        stmt = stmt->next;
+    }
+    return has_errors;
+}
+
+int assemble_asmblock(glulxfile_t *gamefile, function_t *function, asmblock_t *code) {
+    int has_errors = 0;
+    for (unsigned i = 0; i < code->count; ++i) {
+        asmstmt_t *stmt = &code->content[i];
+        if (stmt->type == ASM_LABEL) {
+            asmoperand_t *name = get_asm_operand(code, stmt, 0);
+            symbol_t *label = get_symbol_hashed(function->locals, name->data.name, name->hash);
+            label->data.value = function->output.size;
+            if (label->is_branch_target) {
+                add_counter(gamefile, function, COUNTER_BRANCH, label->name);
+            }
+        } else if (stmt->type == ASM_INSTRUCTION) {
+            unsigned consumed = 0;
+            has_errors |= specialize_call(gamefile, function, code, i, &consumed);
+            if (consumed) {
+                i += consumed - 1;
+            } else {
+                has_errors |= assemble_instruction(gamefile, function, code, stmt);
+            }
+        } else if (stmt->type == ASM_DATA) {
+            has_errors |= assemble_data(gamefile, function, code, stmt);
+        }
+    }
+    return has_errors;
+}
+
+/*
+Returns true if the statement at index pushes a value onto the stack without
+reading the stack itself, so that the value could be given as an operand of
+a later instruction instead.
+*/
+int is_stack_push(asmblock_t *code, unsigned index) {
+    asmstmt_t *stmt = &code->content[index];
+    if (stmt->type != ASM_INSTRUCTION || stmt->operand_count != 2
+            || stmt->mnemonic != get_mnemonic_index("copy")) {
+        return 0;
+    }
+    return get_asm_operand(code, stmt, 0)->type != OP_STACK
+        && get_asm_operand(code, stmt, 1)->type == OP_STACK;
+}
+
+/*
+Returns the number of arguments passed by the call at index, or -1 if the
+statement is not a call that can be specialized: one whose argument count is
+a constant and whose function is not taken from the stack, since that is
+popped before the arguments.
+*/
+int call_argument_count(asmblock_t *code, unsigned index) {
+    asmstmt_t *stmt = &code->content[index];
+    if (stmt->type != ASM_INSTRUCTION || stmt->operand_count != 3
+            || stmt->mnemonic != get_mnemonic_index("call")) {
+        return -1;
+    }
+    asmoperand_t *count = get_asm_operand(code, stmt, 1);
+    if (get_asm_operand(code, stmt, 0)->type == OP_STACK
+            || count->type != OP_INTEGER || count->is_indirect || count->data.value < 0) {
+        return -1;
+    }
+    return count->data.value;
+}
+
+/*
+Returns true if the call at index pushes its result and is followed directly
+by returning that result.
+*/
+int is_tail_call(asmblock_t *code, unsigned index) {
+    if (call_argument_count(code, index) < 0 || index + 1 >= code->count) {
+        return 0;
+    }
+    asmstmt_t *next = &code->content[index + 1];
+    return get_asm_operand(code, &code->content[index], 2)->type == OP_STACK
+        && next->type == ASM_INSTRUCTION && next->operand_count == 1
+        && next->mnemonic == get_mnemonic_index("return")
+        && get_asm_operand(code, next, 0)->type == OP_STACK;
+}
+
+/*
+Replace a call with a shorter instruction where one does the same thing. A
+call whose result is returned at once becomes tailcall, and a call of up to
+three arguments pushed just before it becomes callf, callfi, callfii or
+callfiii taking the arguments as operands. Calls at a label are never part of
+a match since the label separates them from the pushes before them. Sets
+consumed to the number of statements replaced, or zero if the statement at
+index was left alone. Returns non-zero if errors occured.
+*/
+int specialize_call(glulxfile_t *gamefile, function_t *function, asmblock_t *code,
+                    unsigned index, unsigned *consumed) {
+    static const char *call_mnemonics[] = { "callf", "callfi", "callfii", "callfiii" };
+    asmstmt_t *stmt = &code->content[index];
+
+    asmstmt_t call = {0};
+    asmoperand_t operands[MAX_OPERANDS];
+    asmblock_t block = { &call, 1, 1, operands, 0, MAX_OPERANDS };
+    call.type = ASM_INSTRUCTION;
+    if (is_tail_call(code, index)) {
+        call.mnemonic = get_mnemonic_index("tailcall");
+        operands[0] = *get_asm_operand(code, stmt, 0);
+        operands[1] = *get_asm_operand(code, stmt, 1);
+        call.operand_count = 2;
+        *consumed = 2;
+        return assemble_instruction(gamefile, function, &block, &call);
+    }
+
+    unsigned pushes = 0;
+    while (pushes < 3 && index + pushes < code->count && is_stack_push(code, index + pushes)) {
+        ++pushes;
+    }
+    unsigned call_index = index + pushes;
+    if (call_index >= code->count || call_argument_count(code, call_index) != (int)pushes
+            || is_tail_call(code, call_index)) {
+        return 0;
+    }
+
+    /* the last argument pushed is the first one popped */
+    asmstmt_t *generic = &code->content[call_index];
+    call.mnemonic = get_mnemonic_index(call_mnemonics[pushes]);
+    operands[0] = *get_asm_operand(code, generic, 0);
+    for (unsigned i = 0; i < pushes; ++i) {
+        operands[1 + i] = *get_asm_operand(code, &code->content[call_index - 1 - i], 0);
+    }
+    operands[1 + pushes] = *get_asm_operand(code, generic, 2);
+    call.operand_count = pushes + 2;
+    *consumed = pushes + 1;
+    return assemble_instruction(gamefile, function, &block, &call);
+}
+
+/*
+Append an opcode number to a code buffer using the shortest form that can
+represent it.
+*/
+void add_opcode(codebuf_t *buffer, int opcode) {
+    if (opcode < 0x80) {
+        codebuf_add_byte(buffer, opcode);
+    } else if (opcode < 0x4000) {
+        codebuf_add_byte(buffer, 0x80 | (opcode >> 8));
+        codebuf_add_byte(buffer, opcode);
+    } else {
+        codebuf_add_word(buffer, 0xC0000000 | opcode);
+    }
+}
+
+/*
+Determine the smallest addressing mode that can hold an integer operand.
+*/
+int integer_mode(int value, int is_indirect) {
+    if (is_indirect) {
+        unsigned address = value;
+        if (address <= 0xFF)    return MODE_ADDR_BYTE;
+        if (address <= 0xFFFF)  return MODE_ADDR_SHORT;
+        return MODE_ADDR_WORD;
+    }
+    if (value == 0)                         return MODE_ZERO;
+    if (value >= -128 && value <= 127)      return MODE_CONST_BYTE;
+    if (value >= -32768 && value <= 32767)  return MODE_CONST_SHORT;
+    return MODE_CONST_WORD;
+}
+
+/*
+Determine the smallest addressing mode that can reach a local at an offset in
+the frame.
+*/
+int local_mode(unsigned offset) {
+    if (offset <= 0xFF)     return MODE_LOCAL_BYTE;
+    if (offset <= 0xFFFF)   return MODE_LOCAL_SHORT;
+    return MODE_LOCAL_WORD;
+}
+
+int assemble_instruction(glulxfile_t *gamefile, function_t *function, asmblock_t *code, asmstmt_t *stmt) {
+    mnemonic_t *mnemonic = &mnemonics[stmt->mnemonic];
+    if (stmt->operand_count != mnemonic->operands) {
+        show_asm_error(function, "wrong number of operands for", mnemonic->mnemonic);
+        return 1;
+    }
+
+    int modes[MAX_OPERANDS] = {0};
+    int values[MAX_OPERANDS] = {0};
+    symbol_t *targets[MAX_OPERANDS] = {0};
+    for (int i = 0; i < stmt->operand_count; ++i) {
+        asmoperand_t *operand = get_asm_operand(code, stmt, i);
+        switch(operand->type) {
+            case OP_INTEGER:
+                modes[i] = integer_mode(operand->data.value, operand->is_indirect);
+                values[i] = operand->data.value;
+                break;
+            case OP_STACK:
+                modes[i] = MODE_STACK;
+                break;
+            case OP_IDENTIFIER:
+                targets[i] = lookup_symbol_hashed(function->locals, operand->data.name,
+                                                  operand->hash);
+                if (!targets[i]) {
+                    show_asm_error(function, "undefined symbol", operand->data.name);
+                    return 1;
+                }
+                /* locals are found by their offset in the frame and globals
+                   by their address, so neither needs the symbol again */
+                if (targets[i]->type == SYM_LOCAL) {
+                    if (operand->is_indirect) {
+                        show_asm_error(function, "local used as an address", operand->data.name);
+                        return 1;
+                    }
+                    values[i] = targets[i]->data.value;
+                    modes[i] = local_mode(values[i]);
+                    targets[i] = 0;
+                    break;
+                }
+                if ((mnemonic->stores & (1 << i)) && !operand->is_indirect
+                        && targets[i]->type != SYM_GLOBAL) {
+                    show_asm_error(function, "cannot store to", operand->data.name);
+                    return 1;
+                }
+                modes[i] = operand->is_indirect || targets[i]->type == SYM_GLOBAL
+                         ? MODE_ADDR_WORD : MODE_CONST_WORD;
+                break;
+            case OP_STRING:
+                targets[i] = intern_string(gamefile, operand->data.name);
+                modes[i] = MODE_CONST_WORD;
+                break;
+            default:
+                fprintf(stderr, "unhandled operand type %d in assemble_instruction\n", operand->type);
+                return 1;
+        }
+    }
+
+    codebuf_t *out = &function->output;
+    if (gamefile->profile) {
+        if ((mnemonic->flags & MNE_CALL) && targets[0] && targets[0]->type == SYM_FUNCTION) {
+            add_counter(gamefile, function, COUNTER_EDGE, targets[0]->name);
+        } else if (mnemonic->flags & MNE_QUIT) {
+            add_profile_call(out, &function->relocations, gamefile->profile_dump);
+        }
+    }
+    add_opcode(out, mnemonic->opcode);
+    for (int i = 0; i < stmt->operand_count; i += 2) {
+        codebuf_add_byte(out, modes[i] | (modes[i + 1] << 4));
+    }
+
+    for (int i = 0; i < stmt->operand_count; ++i) {
+        if (targets[i]) {
+            int reloc_type = RELOC_ABSOLUTE;
+            /* the branch target is always the final operand of a jump */
+            if ((mnemonic->flags & MNE_RELJUMP) && i == stmt->operand_count - 1) {
+                if (targets[i]->type != SYM_LABEL) {
+                    show_asm_error(function, "branch target is not a label", targets[i]->name);
+                    return 1;
+                }
+                reloc_type = RELOC_BRANCH;
+            }
+            add_relocation(&function->relocations, out->size, reloc_type, targets[i]);
+            codebuf_add_word(out, 0);
+            continue;
+        }
+
+        int value = values[i];
+        switch(modes[i]) {
+            case MODE_CONST_BYTE:
+            case MODE_ADDR_BYTE:
+            case MODE_LOCAL_BYTE:
+                codebuf_add_byte(out, value);
+                break;
+            case MODE_CONST_SHORT:
+            case MODE_ADDR_SHORT:
+            case MODE_LOCAL_SHORT:
+                codebuf_add_byte(out, value >> 8);
+                codebuf_add_byte(out, value);
+                break;
+            case MODE_CONST_WORD:
+            case MODE_ADDR_WORD:
+            case MODE_LOCAL_WORD:
+                codebuf_add_word(out, value);
+                break;
+        }
+    }
+    return 0;
+}
+
+/*
+Append a word of data holding the value of a statement's operand, which may
+be the address of a label, function or string. Returns non-zero if errors
+occured.
+*/
+int assemble_data(glulxfile_t *gamefile, function_t *function, asmblock_t *code, asmstmt_t *stmt) {
+    asmoperand_t *operand = get_asm_operand(code, stmt, 0);
+    symbol_t *target = 0;
+    if (operand->type == OP_IDENTIFIER) {
+        target = lookup_symbol_hashed(function->locals, operand->data.name, operand->hash);
+        if (!target) {
+            show_asm_error(function, "undefined symbol", operand->data.name);
+            return 1;
+        }
+        if (target->type == SYM_LOCAL) {
+            show_asm_error(function, "local has no address", operand->data.name);
+            return 1;
+        }
+    } else if (operand->type == OP_STRING) {
+        target = intern_string(gamefile, operand->data.name);
+    }
+
+    if (target) {
+        add_relocation(&function->relocations, function->output.size, RELOC_ABSOLUTE, target);
+        codebuf_add_word(&function->output, 0);
+    } else {
+        codebuf_add_word(&function->output, operand->data.value);
+    }
+    return 0;
+}
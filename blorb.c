@@ -0,0 +1,315 @@
+/* copy_file_range, sendfile and pread are not part of C99 */
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#define HAVE_SENDFILE
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define HAVE_COPY_FILE_RANGE
+#endif
+#endif
+
+#include "gbuild.h"
+
+#define BLORB_HEADER_SIZE  12
+#define CHUNK_HEADER_SIZE  8
+#define INDEX_ENTRY_SIZE   12
+#define COPY_BUFFER_SIZE   65536
+
+/*
+A chunk of a Blorb file: the story itself, or a resource to be copied in
+from its file.
+*/
+typedef struct BLORB_CHUNK {
+    resource_t *resource;
+    const char *usage;
+    unsigned number;
+    char type[5];
+    /* size of the chunk's data, not counting its header or padding */
+    unsigned long long size;
+    /* an AIFF sound is already an IFF chunk and is copied with its header */
+    int has_header;
+    unsigned long long position;
+} blorbchunk_t;
+
+void add_chunk_id(codebuf_t *buffer, const char *id);
+int compare_chunks(const void *a, const void *b);
+int find_chunk_type(blorbchunk_t *chunk);
+int write_bytes(int fd, const void *data, size_t size);
+int copy_file_data(int in, int out, unsigned long long size);
+int write_chunk(int fd, blorbchunk_t *chunk);
+
+
+/*
+Append a four character IFF identifier to a buffer.
+*/
+void add_chunk_id(codebuf_t *buffer, const char *id) {
+    for (int i = 0; i < 4; ++i) {
+        codebuf_add_byte(buffer, id[i]);
+    }
+}
+
+/*
+Sort resources by usage and then by number, pictures first.
+*/
+int compare_chunks(const void *a, const void *b) {
+    const blorbchunk_t *left = a;
+    const blorbchunk_t *right = b;
+    if (left->resource->usage != right->resource->usage) {
+        return left->resource->usage - right->resource->usage;
+    }
+    if (left->number != right->number) {
+        return left->number < right->number ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+Find the size of a resource's file and the chunk type to store it as from
+the first bytes of the file. Returns non-zero if the file cannot be read or
+is not a format Blorb allows for the resource.
+*/
+int find_chunk_type(blorbchunk_t *chunk) {
+    const char *filename = chunk->resource->filename;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "BLORB: could not open resource file \"%s\".\n", filename);
+        return 1;
+    }
+    struct stat info;
+    unsigned char magic[12] = {0};
+    if (fstat(fd, &info) != 0 || pread(fd, magic, sizeof(magic), 0) < 0) {
+        fprintf(stderr, "BLORB: could not read resource file \"%s\".\n", filename);
+        close(fd);
+        return 1;
+    }
+    close(fd);
+    chunk->size = info.st_size;
+    chunk->has_header = 1;
+
+    const char *type = 0;
+    if (chunk->resource->usage == RESOURCE_PICTURE) {
+        if (memcmp(magic, "\x89PNG", 4) == 0) {
+            type = "PNG ";
+        } else if (magic[0] == 0xFF && magic[1] == 0xD8) {
+            type = "JPEG";
+        }
+    } else {
+        const char *ext = strrchr(filename, '.');
+        if (memcmp(magic, "OggS", 4) == 0) {
+            type = "OGGV";
+        } else if (memcmp(magic, "FORM", 4) == 0 && memcmp(&magic[8], "AIFF", 4) == 0) {
+            type = "FORM";
+            chunk->has_header = 0;
+        } else if (ext && strcmp(ext, ".mod") == 0) {
+            /* a MOD file has no signature at its start */
+            type = "MOD ";
+        }
+    }
+    if (!type) {
+        fprintf(stderr, "BLORB: \"%s\" is not %s.\n", filename,
+                chunk->resource->usage == RESOURCE_PICTURE
+                    ? "a PNG or JPEG picture" : "an Ogg, AIFF or MOD sound");
+        return 1;
+    }
+    strcpy(chunk->type, type);
+    return 0;
+}
+
+/*
+Write all of a block of memory to a file. Returns non-zero on failure.
+*/
+int write_bytes(int fd, const void *data, size_t size) {
+    const char *bytes = data;
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if (written <= 0) {
+            return 1;
+        }
+        bytes += written;
+        size -= written;
+    }
+    return 0;
+}
+
+/*
+Copy the next size bytes of one file to another. Where the kernel can, it
+moves the data between the files itself, so resources are never read into
+memory; anything it can't is copied through a buffer. Returns non-zero if
+the input ends early or either file can't be used.
+*/
+int copy_file_data(int in, int out, unsigned long long size) {
+#ifdef HAVE_COPY_FILE_RANGE
+    while (size > 0) {
+        ssize_t copied = copy_file_range(in, 0, out, 0, size, 0);
+        if (copied <= 0) {
+            break;
+        }
+        size -= copied;
+    }
+#endif
+#ifdef HAVE_SENDFILE
+    while (size > 0) {
+        ssize_t copied = sendfile(out, in, 0, size);
+        if (copied <= 0) {
+            break;
+        }
+        size -= copied;
+    }
+#endif
+    if (size == 0) {
+        return 0;
+    }
+    char *buffer = malloc(COPY_BUFFER_SIZE);
+    while (size > 0) {
+        ssize_t count = read(in, buffer, size < COPY_BUFFER_SIZE ? size : COPY_BUFFER_SIZE);
+        if (count <= 0 || write_bytes(out, buffer, count)) {
+            break;
+        }
+        size -= count;
+    }
+    free(buffer);
+    return size != 0;
+}
+
+/*
+Write a resource chunk, copying its data from the resource's file. Returns
+non-zero on failure.
+*/
+int write_chunk(int fd, blorbchunk_t *chunk) {
+    const char *filename = chunk->resource->filename;
+    int in = open(filename, O_RDONLY);
+    if (in < 0) {
+        fprintf(stderr, "BLORB: could not open resource file \"%s\".\n", filename);
+        return 1;
+    }
+    int has_errors = 0;
+    int copy_failed = 0;
+    if (chunk->has_header) {
+        codebuf_t header = {0};
+        add_chunk_id(&header, chunk->type);
+        codebuf_add_word(&header, chunk->size);
+        has_errors = write_bytes(fd, header.data, header.size);
+        free_codebuf(&header);
+    }
+    if (!has_errors) {
+        copy_failed = copy_file_data(in, fd, chunk->size);
+    }
+    if (!has_errors && !copy_failed && chunk->size % 2) {
+        has_errors = write_bytes(fd, "", 1);
+    }
+    if (copy_failed) {
+        fprintf(stderr, "BLORB: could not copy resource file \"%s\"; "
+                "it may have changed while being copied.\n", filename);
+    } else if (has_errors) {
+        fprintf(stderr, "BLORB: error writing resource \"%s\".\n", filename);
+    }
+    close(in);
+    return has_errors || copy_failed;
+}
+
+/*
+Write a linked story to disk in a Blorb file along with the pictures and
+sounds the project names. Chunk sizes come from the size of each file, so
+the index can be written first and each resource then copied straight from
+its file. Returns non-zero on failure.
+*/
+int write_blorb(glulxfile_t *gamefile, project_t *project, const char *filename) {
+    unsigned count = 0;
+    for (resource_t *resource = project->resources; resource; resource = resource->next) {
+        ++count;
+    }
+
+    int has_errors = 0;
+    blorbchunk_t *chunks = calloc(sizeof(blorbchunk_t), count + 1);
+    unsigned i = 1;
+    for (resource_t *resource = project->resources; resource; resource = resource->next) {
+        chunks[i].resource = resource;
+        chunks[i].number = resource->number;
+        chunks[i].usage = resource->usage == RESOURCE_PICTURE ? "Pict" : "Snd ";
+        has_errors |= find_chunk_type(&chunks[i]);
+        ++i;
+    }
+    if (has_errors) {
+        free(chunks);
+        return 1;
+    }
+    qsort(&chunks[1], count, sizeof(blorbchunk_t), compare_chunks);
+    for (i = 2; i <= count; ++i) {
+        if (compare_chunks(&chunks[i - 1], &chunks[i]) == 0) {
+            fprintf(stderr, "BLORB: \"%s\" and \"%s\" are both %s %u.\n",
+                    chunks[i - 1].resource->filename, chunks[i].resource->filename,
+                    chunks[i].resource->usage == RESOURCE_PICTURE ? "picture" : "sound",
+                    chunks[i].number);
+            has_errors = 1;
+        }
+    }
+    if (has_errors) {
+        free(chunks);
+        return 1;
+    }
+
+    /* the story is the first chunk after the index */
+    strcpy(chunks[0].type, "GLUL");
+    chunks[0].usage = "Exec";
+    chunks[0].size = gamefile->image.size;
+    chunks[0].has_header = 1;
+    unsigned long long position = BLORB_HEADER_SIZE + CHUNK_HEADER_SIZE
+                                + 4 + INDEX_ENTRY_SIZE * (count + 1);
+    for (i = 0; i <= count; ++i) {
+        chunks[i].position = position;
+        position += (chunks[i].has_header ? CHUNK_HEADER_SIZE : 0)
+                  + chunks[i].size + chunks[i].size % 2;
+    }
+    if (position > 0xFFFFFFFFULL) {
+        fprintf(stderr, "BLORB: resources are too large for a Blorb file.\n");
+        free(chunks);
+        return 1;
+    }
+
+    codebuf_t header = {0};
+    add_chunk_id(&header, "FORM");
+    codebuf_add_word(&header, position - CHUNK_HEADER_SIZE);
+    add_chunk_id(&header, "IFRS");
+    add_chunk_id(&header, "RIdx");
+    codebuf_add_word(&header, 4 + INDEX_ENTRY_SIZE * (count + 1));
+    codebuf_add_word(&header, count + 1);
+    for (i = 0; i <= count; ++i) {
+        add_chunk_id(&header, chunks[i].usage);
+        codebuf_add_word(&header, chunks[i].number);
+        codebuf_add_word(&header, chunks[i].position);
+    }
+    add_chunk_id(&header, chunks[0].type);
+    codebuf_add_word(&header, chunks[0].size);
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open output file \"%s\"\n", filename);
+        free_codebuf(&header);
+        free(chunks);
+        return 1;
+    }
+    has_errors = write_bytes(fd, header.data, header.size)
+              || write_bytes(fd, gamefile->image.data, gamefile->image.size)
+              || (gamefile->image.size % 2 && write_bytes(fd, "", 1));
+    if (has_errors) {
+        fprintf(stderr, "Error writing output file \"%s\"\n", filename);
+    }
+    for (i = 1; i <= count && !has_errors; ++i) {
+        has_errors = write_chunk(fd, &chunks[i]);
+    }
+    if (close(fd) != 0 && !has_errors) {
+        fprintf(stderr, "Error writing output file \"%s\"\n", filename);
+        has_errors = 1;
+    }
+    free_codebuf(&header);
+    free(chunks);
+    return has_errors;
+}
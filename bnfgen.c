@@ -0,0 +1,633 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+Generates the parser's tables from the grammar in language.bnf.
+
+    bnfgen GRAMMAR-FILE OUTPUT-NAME RULE...
+
+Writes OUTPUT-NAME.h and OUTPUT-NAME.c. Every quoted word in the grammar
+becomes a reserved word with a number of its own; for each rule named on
+the command line, a table gives the alternative of the rule that a token
+begins, so the parser chooses between alternatives by indexing the table
+with the token instead of testing for each in turn. A rule that cannot be
+chosen by its first token alone is an error, so changes to the grammar
+that would make the parser ambiguous are found when it is built.
+
+A token with a name in capitals is a token type of the lexer, unless its
+definition is a single word, which the lexer gives as an identifier.
+*/
+
+#define MAX_RULES      64
+#define MAX_TERMINALS  64
+#define MAX_NAME       64
+
+enum node_type_t {
+    NODE_TERMINAL,
+    NODE_RULE,
+    NODE_SEQUENCE,
+    NODE_CHOICE,
+    NODE_OPTIONAL,
+    NODE_REPEAT
+};
+
+/*
+A part of the body of a rule. Sequences and choices hold a list of parts;
+optional and repeated parts hold the single part they apply to.
+*/
+typedef struct GRAMMAR_NODE {
+    int type;
+    /* the terminal or rule named by a terminal or rule node */
+    int index;
+    char *name;
+    struct GRAMMAR_NODE *children;
+    struct GRAMMAR_NODE *next;
+} grammarnode_t;
+
+typedef struct GRAMMAR_RULE {
+    char name[MAX_NAME];
+    grammarnode_t *body;
+    int line;
+    /* the terminals the rule can begin with, and whether it can be empty */
+    char first[MAX_TERMINALS];
+    int is_nullable;
+} grammarrule_t;
+
+/*
+A terminal is a token type of the lexer or a reserved word, numbered in the
+order they are first used.
+*/
+typedef struct GRAMMAR {
+    grammarrule_t rules[MAX_RULES];
+    int rule_count;
+    char terminals[MAX_TERMINALS][MAX_NAME];
+    int is_keyword[MAX_TERMINALS];
+    int terminal_count;
+    /* fixed-word tokens and the token type the lexer gives them */
+    char aliases[MAX_TERMINALS][2][MAX_NAME];
+    int alias_count;
+
+    const char *filename;
+    const char *pos;
+    int line;
+    int has_errors;
+} grammar_t;
+
+void grammar_error(grammar_t *grammar, const char *message, const char *detail);
+int add_terminal(grammar_t *grammar, const char *name, int is_keyword);
+int find_rule(grammar_t *grammar, const char *name);
+const char* literal_terminal(const char *literal);
+void skip_space(grammar_t *grammar);
+int read_name(grammar_t *grammar, char open, char close, char *name);
+grammarnode_t* new_node(int type, int index);
+grammarnode_t* parse_choice(grammar_t *grammar);
+grammarnode_t* parse_sequence(grammar_t *grammar);
+grammarnode_t* parse_item(grammar_t *grammar);
+void free_node(grammarnode_t *node);
+int resolve_names(grammar_t *grammar, grammarnode_t *node);
+int add_first(grammar_t *grammar, grammarnode_t *node, char *first);
+void find_first_sets(grammar_t *grammar);
+void make_identifier(const char *name, char *out);
+int read_grammar(grammar_t *grammar, const char *filename);
+int write_tables(grammar_t *grammar, const char *output, char **rules, int rule_count);
+
+
+void grammar_error(grammar_t *grammar, const char *message, const char *detail) {
+    fprintf(stderr, "%s:%d: %s \"%s\"\n", grammar->filename, grammar->line, message, detail);
+    grammar->has_errors = 1;
+}
+
+/*
+Return the number of a terminal, adding it if it hasn't been seen.
+*/
+int add_terminal(grammar_t *grammar, const char *name, int is_keyword) {
+    for (int i = 0; i < grammar->alias_count; ++i) {
+        if (strcmp(grammar->aliases[i][0], name) == 0) {
+            name = grammar->aliases[i][1];
+        }
+    }
+    for (int i = 0; i < grammar->terminal_count; ++i) {
+        if (grammar->is_keyword[i] == is_keyword && strcmp(grammar->terminals[i], name) == 0) {
+            return i;
+        }
+    }
+    if (grammar->terminal_count >= MAX_TERMINALS) {
+        grammar_error(grammar, "too many terminals at", name);
+        return 0;
+    }
+    strcpy(grammar->terminals[grammar->terminal_count], name);
+    grammar->is_keyword[grammar->terminal_count] = is_keyword;
+    return grammar->terminal_count++;
+}
+
+int find_rule(grammar_t *grammar, const char *name) {
+    for (int i = 0; i < grammar->rule_count; ++i) {
+        if (strcmp(grammar->rules[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+Return the token type of a quoted symbol. Symbols the lexer doesn't give a
+type of their own are operators.
+*/
+const char* literal_terminal(const char *literal) {
+    static const char *symbols[][2] = {
+        { "(", "OPEN_PARAN" },  { ")", "CLOSE_PARAN" },
+        { "{", "OPEN_BRACE" },  { "}", "CLOSE_BRACE" },
+        { ",", "COMMA" },       { ";", "SEMICOLON" },
+        { ":", "COLON" },       { 0, 0 }
+    };
+    for (int i = 0; symbols[i][0]; ++i) {
+        if (strcmp(symbols[i][0], literal) == 0) {
+            return symbols[i][1];
+        }
+    }
+    return "OPERATOR";
+}
+
+/*
+Skip spaces within a rule. A rule continues onto the following line only if
+that line is indented.
+*/
+void skip_space(grammar_t *grammar) {
+    while (*grammar->pos == ' ' || *grammar->pos == '\t'
+            || (*grammar->pos == '\n' && (grammar->pos[1] == ' ' || grammar->pos[1] == '\t'))) {
+        if (*grammar->pos == '\n') {
+            ++grammar->line;
+        }
+        ++grammar->pos;
+    }
+}
+
+/*
+Read a name enclosed by a pair of characters, leaving the position after
+the closing one. Returns non-zero on success.
+*/
+int read_name(grammar_t *grammar, char open, char close, char *name) {
+    if (*grammar->pos != open) {
+        return 0;
+    }
+    const char *start = ++grammar->pos;
+    while (*grammar->pos && *grammar->pos != close && *grammar->pos != '\n') {
+        ++grammar->pos;
+    }
+    size_t length = grammar->pos - start;
+    if (*grammar->pos != close || length == 0 || length >= MAX_NAME) {
+        grammar_error(grammar, "bad name or symbol starting", open == '"' ? "\"" : "<");
+        return 0;
+    }
+    memcpy(name, start, length);
+    name[length] = 0;
+    ++grammar->pos;
+    return 1;
+}
+
+grammarnode_t* new_node(int type, int index) {
+    grammarnode_t *node = calloc(sizeof(grammarnode_t), 1);
+    node->type = type;
+    node->index = index;
+    return node;
+}
+
+/*
+Parse alternatives separated by bars. A single alternative is returned
+without a choice around it.
+*/
+grammarnode_t* parse_choice(grammar_t *grammar) {
+    grammarnode_t *first = parse_sequence(grammar);
+    skip_space(grammar);
+    if (*grammar->pos != '|') {
+        return first;
+    }
+    grammarnode_t *choice = new_node(NODE_CHOICE, 0);
+    choice->children = first;
+    grammarnode_t *last = first;
+    while (*grammar->pos == '|') {
+        ++grammar->pos;
+        last->next = parse_sequence(grammar);
+        last = last->next;
+        skip_space(grammar);
+    }
+    return choice;
+}
+
+grammarnode_t* parse_sequence(grammar_t *grammar) {
+    grammarnode_t *sequence = new_node(NODE_SEQUENCE, 0);
+    grammarnode_t *last = 0;
+    while (1) {
+        grammarnode_t *item = parse_item(grammar);
+        if (!item) {
+            break;
+        }
+        if (last) {
+            last->next = item;
+        } else {
+            sequence->children = item;
+        }
+        last = item;
+    }
+    return sequence;
+}
+
+/*
+Parse a name, a quoted symbol, or a part in brackets, any of which may be
+followed by a star to repeat it. Returns null at the end of a sequence.
+*/
+grammarnode_t* parse_item(grammar_t *grammar) {
+    skip_space(grammar);
+    char name[MAX_NAME];
+    grammarnode_t *item = 0;
+    char open = *grammar->pos;
+    if (open == '<' && read_name(grammar, '<', '>', name)) {
+        if (isupper((unsigned char)name[0])) {
+            item = new_node(NODE_TERMINAL, add_terminal(grammar, name, 0));
+        } else {
+            /* rules may be used before they are defined, so are found by
+               name once the whole grammar has been read */
+            item = new_node(NODE_RULE, -1);
+            item->name = malloc(strlen(name) + 1);
+            strcpy(item->name, name);
+        }
+    } else if (open == '"' && read_name(grammar, '"', '"', name)) {
+        int is_keyword = isalpha((unsigned char)name[0]);
+        item = new_node(NODE_TERMINAL, add_terminal(grammar, is_keyword
+                                                    ? name : literal_terminal(name),
+                                                    is_keyword));
+    } else if (open == '[' || open == '(') {
+        ++grammar->pos;
+        grammarnode_t *inner = parse_choice(grammar);
+        if (*grammar->pos != (open == '[' ? ']' : ')')) {
+            grammar_error(grammar, "unclosed", open == '[' ? "[" : "(");
+            free_node(inner);
+            return 0;
+        }
+        ++grammar->pos;
+        if (open == '[') {
+            item = new_node(NODE_OPTIONAL, 0);
+            item->children = inner;
+        } else {
+            item = inner;
+        }
+    } else {
+        return 0;
+    }
+    if (*grammar->pos == '*') {
+        ++grammar->pos;
+        grammarnode_t *repeat = new_node(NODE_REPEAT, 0);
+        repeat->children = item;
+        item = repeat;
+    }
+    return item;
+}
+
+void free_node(grammarnode_t *node) {
+    while (node) {
+        grammarnode_t *next = node->next;
+        free_node(node->children);
+        free(node->name);
+        free(node);
+        node = next;
+    }
+}
+
+/*
+Find the rules named in a rule's body. Returns non-zero if a rule is not
+defined.
+*/
+int resolve_names(grammar_t *grammar, grammarnode_t *node) {
+    int has_errors = 0;
+    for (; node; node = node->next) {
+        if (node->type == NODE_RULE) {
+            node->index = find_rule(grammar, node->name);
+            if (node->index < 0) {
+                grammar_error(grammar, "undefined rule", node->name);
+                has_errors = 1;
+            }
+        } else if (node->type != NODE_TERMINAL) {
+            has_errors |= resolve_names(grammar, node->children);
+        }
+    }
+    return has_errors;
+}
+
+/*
+Add the terminals a part of a rule can begin with to a set. Returns true if
+the part can be empty.
+*/
+int add_first(grammar_t *grammar, grammarnode_t *node, char *first) {
+    switch (node->type) {
+        case NODE_TERMINAL:
+            first[node->index] = 1;
+            return 0;
+        case NODE_RULE: {
+            grammarrule_t *rule = &grammar->rules[node->index];
+            for (int i = 0; i < grammar->terminal_count; ++i) {
+                first[i] |= rule->first[i];
+            }
+            return rule->is_nullable;
+        }
+        case NODE_SEQUENCE:
+            for (grammarnode_t *child = node->children; child; child = child->next) {
+                if (!add_first(grammar, child, first)) {
+                    return 0;
+                }
+            }
+            return 1;
+        case NODE_CHOICE: {
+            int is_nullable = 0;
+            for (grammarnode_t *child = node->children; child; child = child->next) {
+                is_nullable |= add_first(grammar, child, first);
+            }
+            return is_nullable;
+        }
+        default:
+            add_first(grammar, node->children, first);
+            return 1;
+    }
+}
+
+/*
+Find the first set of every rule, repeating until none of them grow, since
+rules may refer to each other in any order.
+*/
+void find_first_sets(grammar_t *grammar) {
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int i = 0; i < grammar->rule_count; ++i) {
+            grammarrule_t *rule = &grammar->rules[i];
+            char first[MAX_TERMINALS];
+            memcpy(first, rule->first, MAX_TERMINALS);
+            int is_nullable = add_first(grammar, rule->body, first);
+            if (memcmp(first, rule->first, MAX_TERMINALS) != 0
+                    || is_nullable != rule->is_nullable) {
+                memcpy(rule->first, first, MAX_TERMINALS);
+                rule->is_nullable = is_nullable;
+                changed = 1;
+            }
+        }
+    }
+}
+
+/*
+Turn a rule or word into a C identifier in capitals.
+*/
+void make_identifier(const char *name, char *out) {
+    while (*name) {
+        *out++ = *name == '-' ? '_' : toupper((unsigned char)*name);
+        ++name;
+    }
+    *out = 0;
+}
+
+/*
+Read the rules of a grammar file. Returns non-zero if errors occured.
+*/
+int read_grammar(grammar_t *grammar, const char *filename) {
+    FILE *fp = fopen(filename, "rt");
+    if (!fp) {
+        fprintf(stderr, "BNFGEN: could not open grammar file \"%s\".\n", filename);
+        return 1;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    char *text = calloc(size + 1, 1);
+    size = fread(text, 1, size, fp);
+    fclose(fp);
+
+    grammar->filename = filename;
+    grammar->pos = text;
+    grammar->line = 1;
+    while (*grammar->pos && !grammar->has_errors) {
+        if (*grammar->pos == '\n') {
+            ++grammar->line;
+            ++grammar->pos;
+            continue;
+        }
+        char name[MAX_NAME];
+        if (!read_name(grammar, '<', '>', name)) {
+            grammar_error(grammar, "expected a rule name at", "");
+            break;
+        }
+        skip_space(grammar);
+        if (strncmp(grammar->pos, "->", 2) != 0) {
+            grammar_error(grammar, "expected \"->\" after", name);
+            break;
+        }
+        grammar->pos += 2;
+        skip_space(grammar);
+
+        if (isupper((unsigned char)name[0])) {
+            /* the lexer defines tokens; only a token that is a fixed word
+               matters here, as the lexer gives it as an identifier */
+            const char *start = grammar->pos;
+            while (isalpha((unsigned char)*grammar->pos)) {
+                ++grammar->pos;
+            }
+            if (grammar->pos > start && (*grammar->pos == '\n' || *grammar->pos == 0)
+                    && grammar->alias_count < MAX_TERMINALS) {
+                strcpy(grammar->aliases[grammar->alias_count][0], name);
+                strcpy(grammar->aliases[grammar->alias_count][1], "IDENTIFIER");
+                ++grammar->alias_count;
+            }
+            while (*grammar->pos && *grammar->pos != '\n') {
+                ++grammar->pos;
+            }
+            continue;
+        }
+
+        if (find_rule(grammar, name) >= 0 || grammar->rule_count >= MAX_RULES) {
+            grammar_error(grammar, "duplicate rule or too many rules at", name);
+            break;
+        }
+        grammarrule_t *rule = &grammar->rules[grammar->rule_count++];
+        strcpy(rule->name, name);
+        rule->line = grammar->line;
+        rule->body = parse_choice(grammar);
+        if (*grammar->pos != '\n' && *grammar->pos != 0) {
+            grammar_error(grammar, "unexpected text in", name);
+        }
+    }
+    free(text);
+    grammar->pos = 0;
+
+    for (int i = 0; i < grammar->rule_count; ++i) {
+        grammar->line = grammar->rules[i].line;
+        grammar->has_errors |= resolve_names(grammar, grammar->rules[i].body);
+    }
+    if (!grammar->has_errors) {
+        find_first_sets(grammar);
+    }
+    return grammar->has_errors;
+}
+
+/*
+Write the reserved words and the tables choosing the alternatives of the
+rules named. Returns non-zero if a rule has alternatives that can begin with
+the same token, or one that can be empty.
+*/
+int write_tables(grammar_t *grammar, const char *output, char **rules, int rule_count) {
+    int has_errors = 0;
+    for (int r = 0; r < rule_count; ++r) {
+        int index = find_rule(grammar, rules[r]);
+        if (index < 0) {
+            fprintf(stderr, "BNFGEN: no rule named \"%s\".\n", rules[r]);
+            return 1;
+        }
+        grammarnode_t *body = grammar->rules[index].body;
+        grammarnode_t *alt = body->type == NODE_CHOICE ? body->children : body;
+        char seen[MAX_TERMINALS] = {0};
+        for (; alt; alt = body->type == NODE_CHOICE ? alt->next : 0) {
+            char first[MAX_TERMINALS] = {0};
+            if (add_first(grammar, alt, first)) {
+                fprintf(stderr, "BNFGEN: an alternative of <%s> can be empty.\n", rules[r]);
+                has_errors = 1;
+            }
+            for (int i = 0; i < grammar->terminal_count; ++i) {
+                if (first[i] && seen[i]) {
+                    fprintf(stderr, "BNFGEN: more than one alternative of <%s> "
+                            "can begin with %s.\n", rules[r], grammar->terminals[i]);
+                    has_errors = 1;
+                }
+                seen[i] |= first[i];
+            }
+        }
+    }
+    if (has_errors) {
+        return 1;
+    }
+
+    size_t length = strlen(output);
+    char *filename = malloc(length + 3);
+    sprintf(filename, "%s.h", output);
+    FILE *header = fopen(filename, "wt");
+    sprintf(filename, "%s.c", output);
+    FILE *source = header ? fopen(filename, "wt") : 0;
+    if (!source) {
+        fprintf(stderr, "BNFGEN: could not open output file \"%s\".\n", filename);
+        if (header) {
+            fclose(header);
+        }
+        free(filename);
+        return 1;
+    }
+
+    char guard[MAX_NAME + 3];
+    make_identifier(output, guard);
+    fprintf(header, "/* generated from %s by bnfgen; do not edit */\n", grammar->filename);
+    fprintf(header, "#ifndef %s_H\n#define %s_H\n\n#include \"gbuild.h\"\n\n", guard, guard);
+    fprintf(source, "/* generated from %s by bnfgen; do not edit */\n", grammar->filename);
+    fprintf(source, "#include \"%s.h\"\n\n", output);
+
+    /* reserved words are numbered alphabetically, so their numbers don't
+       depend on where the grammar uses them */
+    char name[MAX_NAME + MAX_NAME + 1];
+    fprintf(header, "enum keyword_t {\n    KW_NONE,\n");
+    fprintf(source, "const char *const keyword_names[KEYWORD_COUNT] = {\n    0,\n");
+    const char *previous = "";
+    while (1) {
+        const char *next = 0;
+        for (int i = 0; i < grammar->terminal_count; ++i) {
+            if (grammar->is_keyword[i] && strcmp(grammar->terminals[i], previous) > 0
+                    && (!next || strcmp(grammar->terminals[i], next) < 0)) {
+                next = grammar->terminals[i];
+            }
+        }
+        if (!next) {
+            break;
+        }
+        make_identifier(next, name);
+        fprintf(header, "    KW_%s,\n", name);
+        fprintf(source, "    \"%s\",\n", next);
+        previous = next;
+    }
+    fprintf(header, "    KEYWORD_COUNT\n};\n\n");
+    fprintf(source, "};\n");
+    fprintf(header, "/* columns of the tables: the token types, then reserved words */\n");
+    fprintf(header, "#define TERMINAL_KEYWORD   TOKEN_TYPE_COUNT\n");
+    fprintf(header, "#define TERMINAL_COUNT     (TERMINAL_KEYWORD + KEYWORD_COUNT)\n\n");
+    fprintf(header, "extern const char *const keyword_names[KEYWORD_COUNT];\n");
+
+    for (int r = 0; r < rule_count; ++r) {
+        grammarrule_t *rule = &grammar->rules[find_rule(grammar, rules[r])];
+        char rule_name[MAX_NAME];
+        make_identifier(rule->name, rule_name);
+        fprintf(header, "\n/* alternatives of <%s> */\nenum {\n    %s_NONE", rule->name, rule_name);
+        for (int i = 0; rule_name[i]; ++i) {
+            rule_name[i] = tolower((unsigned char)rule_name[i]);
+        }
+        fprintf(source, "\nconst unsigned char %s_table[TERMINAL_COUNT] = {\n", rule_name);
+
+        grammarnode_t *body = rule->body;
+        grammarnode_t *alt = body->type == NODE_CHOICE ? body->children : body;
+        for (int number = 1; alt; alt = body->type == NODE_CHOICE ? alt->next : 0, ++number) {
+            /* an alternative is named for what it begins with */
+            grammarnode_t *start = alt;
+            while (start->type == NODE_SEQUENCE && start->children) {
+                start = start->children;
+            }
+            make_identifier(rule->name, name);
+            if (start->type == NODE_RULE || start->type == NODE_TERMINAL) {
+                strcat(name, "_");
+                make_identifier(start->type == NODE_RULE ? grammar->rules[start->index].name
+                                                         : grammar->terminals[start->index],
+                                &name[strlen(name)]);
+            } else {
+                sprintf(&name[strlen(name)], "_%d", number);
+            }
+            fprintf(header, ",\n    %s", name);
+
+            char first[MAX_TERMINALS] = {0};
+            add_first(grammar, alt, first);
+            for (int i = 0; i < grammar->terminal_count; ++i) {
+                if (!first[i]) {
+                    continue;
+                }
+                if (grammar->is_keyword[i]) {
+                    char keyword[MAX_NAME];
+                    make_identifier(grammar->terminals[i], keyword);
+                    fprintf(source, "    [TERMINAL_KEYWORD + KW_%s] = %s,\n", keyword, name);
+                } else {
+                    fprintf(source, "    [%s] = %s,\n", grammar->terminals[i], name);
+                }
+            }
+        }
+        fprintf(header, "\n};\nextern const unsigned char %s_table[TERMINAL_COUNT];\n",
+                rule_name);
+        fprintf(source, "};\n");
+    }
+    fprintf(header, "\n#endif\n");
+
+    has_errors = ferror(header) | ferror(source);
+    has_errors |= fclose(header) != 0;
+    has_errors |= fclose(source) != 0;
+    if (has_errors) {
+        fprintf(stderr, "BNFGEN: error writing \"%s\".\n", output);
+    }
+    free(filename);
+    return has_errors;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s grammar-file output-name [rule...]\n", argv[0]);
+        return 1;
+    }
+
+    grammar_t *grammar = calloc(sizeof(grammar_t), 1);
+    int has_errors = read_grammar(grammar, argv[1]);
+    if (!has_errors) {
+        has_errors = write_tables(grammar, argv[2], &argv[3], argc - 3);
+    }
+    for (int i = 0; i < grammar->rule_count; ++i) {
+        free_node(grammar->rules[i].body);
+    }
+    free(grammar);
+    return has_errors ? 1 : 0;
+}
@@ -0,0 +1,652 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gbuild.h"
+
+/* fewest cases for which a jump table is used */
+#define SWITCH_TABLE_MIN    4
+/* most cases compared one after another rather than split in two */
+#define SWITCH_CHAIN_MAX    3
+
+/*
+A binary operator that computes a value with a single instruction.
+*/
+typedef struct ARITHMETIC_OP {
+    const char *op;
+    const char *mnemonic;
+    int is_commutative;
+} arithmeticop_t;
+
+/*
+A comparison and the branches taken when it is true or false. Swapped is
+the comparison that gives the same result with its operands exchanged.
+*/
+typedef struct COMPARISON_OP {
+    const char *op;
+    const char *if_true;
+    const char *if_false;
+    const char *swapped;
+} comparisonop_t;
+
+static const arithmeticop_t arithmetic_ops[] = {
+    { "+",  "add",      1 },
+    { "-",  "sub",      0 },
+    { "*",  "mul",      1 },
+    { "/",  "div",      0 },
+    { "%",  "mod",      0 },
+    { "&",  "bitand",   1 },
+    { "|",  "bitor",    1 },
+    { "^",  "bitxor",   1 },
+    { "<<", "shiftl",   0 },
+    { ">>", "sshiftr",  0 },
+    { 0 }
+};
+
+static const comparisonop_t comparison_ops[] = {
+    { "==", "jeq", "jne", "==" },
+    { "!=", "jne", "jeq", "!=" },
+    { "<",  "jlt", "jge", ">"  },
+    { "<=", "jle", "jgt", ">=" },
+    { ">",  "jgt", "jle", "<"  },
+    { ">=", "jge", "jlt", "<=" },
+    { 0 }
+};
+
+static asmoperand_t stack_operand = { OP_STACK, 0, 0, { 0 } };
+
+void add_switch_test(asmblock_t *block, asmoperand_t *value, const char *mnemonic,
+                     int constant, const char *label);
+void add_switch_index(asmblock_t *block, asmoperand_t *value, int first);
+void add_switch_table(asmblock_t *block, asmoperand_t *value, switchcase_t *cases,
+                      unsigned count, const char *default_label, const char *prefix);
+void add_switch_tree(asmblock_t *block, asmoperand_t *value, switchcase_t *cases,
+                     unsigned count, const char *default_label, const char *prefix,
+                     unsigned *node);
+const arithmeticop_t* find_arithmetic_op(const char *op);
+const comparisonop_t* find_comparison_op(const char *op);
+int is_discard(asmoperand_t *operand);
+char* expression_label(expression_t *expr, const char *name);
+void add_value(asmblock_t *block, expression_t *expr, asmoperand_t *result);
+void add_arithmetic(asmblock_t *block, expression_t *expr, const arithmeticop_t *op,
+                    asmoperand_t *dest);
+void add_boolean(asmblock_t *block, expression_t *expr, asmoperand_t *dest);
+unsigned add_arguments(asmblock_t *block, expression_t *expr);
+void add_call(asmblock_t *block, expression_t *expr, asmoperand_t *dest);
+void add_property_search(asmblock_t *block, expression_t *expr, asmoperand_t *dest);
+void add_property(asmblock_t *block, expression_t *expr, asmoperand_t *dest);
+void add_property_assign(asmblock_t *block, expression_t *expr, asmoperand_t *dest);
+
+
+/*
+Functions for building assembly statements from code rather than source.
+*/
+void add_instruction(asmblock_t *block, const char *mnemonic) {
+    add_asm_statement(block, ASM_INSTRUCTION, get_mnemonic_index(mnemonic));
+}
+
+void add_label(asmblock_t *block, const char *name) {
+    add_asm_statement(block, ASM_LABEL, 0);
+    add_name_operand(block, name);
+}
+
+void add_integer_operand(asmblock_t *block, int value) {
+    asmoperand_t *operand = add_asm_operand(block);
+    operand->type = OP_INTEGER;
+    operand->data.value = value;
+}
+
+void add_stack_operand(asmblock_t *block) {
+    add_asm_operand(block)->type = OP_STACK;
+}
+
+void add_name_operand(asmblock_t *block, const char *name) {
+    asmoperand_t *operand = add_asm_operand(block);
+    operand->type = OP_IDENTIFIER;
+    operand->hash = hash_string(name);
+    operand->data.name = strdup(name);
+}
+
+void add_operand_copy(asmblock_t *block, asmoperand_t *from) {
+    asmoperand_t *operand = add_asm_operand(block);
+    *operand = *from;
+    if (from->type == OP_IDENTIFIER || from->type == OP_STRING) {
+        operand->data.name = strdup(from->data.name);
+    }
+}
+
+
+/*
+Add a branch comparing the value of a switch with a constant. A value on the
+stack is copied first so that it stays there for the next test.
+*/
+void add_switch_test(asmblock_t *block, asmoperand_t *value, const char *mnemonic,
+                     int constant, const char *label) {
+    if (value->type == OP_STACK) {
+        add_instruction(block, "stkcopy");
+        add_integer_operand(block, 1);
+    }
+    add_instruction(block, mnemonic);
+    add_operand_copy(block, value);
+    add_integer_operand(block, constant);
+    add_name_operand(block, label);
+}
+
+/*
+Push the value of a switch less the first value of its jump table.
+*/
+void add_switch_index(asmblock_t *block, asmoperand_t *value, int first) {
+    if (value->type == OP_STACK) {
+        add_instruction(block, "stkcopy");
+        add_integer_operand(block, 1);
+        if (first == 0) return;
+    }
+    add_instruction(block, first == 0 ? "copy" : "sub");
+    add_operand_copy(block, value);
+    if (first != 0) {
+        add_integer_operand(block, first);
+    }
+    add_stack_operand(block);
+}
+
+/*
+Dispatch through a table holding the address of the code for each value
+from the lowest case to the highest. Values with no case of their own use
+the default. The table follows the jump, which never falls through.
+*/
+void add_switch_table(asmblock_t *block, asmoperand_t *value, switchcase_t *cases,
+                      unsigned count, const char *default_label, const char *prefix) {
+    int first = cases[0].value;
+    unsigned size = (unsigned)cases[count - 1].value - (unsigned)first + 1;
+    char *table = malloc(strlen(prefix) + 8);
+    sprintf(table, "%stable", prefix);
+
+    /* subtracting the first value makes values below it too large, so one
+       unsigned comparison checks both ends of the table */
+    add_switch_index(block, value, first);
+    add_instruction(block, "jgeu");
+    add_stack_operand(block);
+    add_integer_operand(block, size);
+    add_name_operand(block, default_label);
+    add_switch_index(block, value, first);
+    add_instruction(block, "aload");
+    add_name_operand(block, table);
+    add_stack_operand(block);
+    add_stack_operand(block);
+    add_instruction(block, "jumpabs");
+    add_stack_operand(block);
+
+    add_label(block, table);
+    unsigned next = 0;
+    for (unsigned i = 0; i < size; ++i) {
+        add_asm_statement(block, ASM_DATA, 0);
+        if ((unsigned)cases[next].value - (unsigned)first == i) {
+            add_name_operand(block, cases[next++].label);
+        } else {
+            add_name_operand(block, default_label);
+        }
+    }
+    free(table);
+}
+
+/*
+Dispatch by comparing the value with the middle case and searching each
+half the same way, until few enough cases are left to compare one by one.
+*/
+void add_switch_tree(asmblock_t *block, asmoperand_t *value, switchcase_t *cases,
+                     unsigned count, const char *default_label, const char *prefix,
+                     unsigned *node) {
+    if (count <= SWITCH_CHAIN_MAX) {
+        for (unsigned i = 0; i < count; ++i) {
+            add_switch_test(block, value, "jeq", cases[i].value, cases[i].label);
+        }
+        add_instruction(block, "jump");
+        add_name_operand(block, default_label);
+        return;
+    }
+
+    unsigned middle = count / 2;
+    char *lower = malloc(strlen(prefix) + 16);
+    sprintf(lower, "%snode%u", prefix, ++*node);
+    add_switch_test(block, value, "jlt", cases[middle].value, lower);
+    add_switch_tree(block, value, &cases[middle], count - middle, default_label, prefix, node);
+    add_label(block, lower);
+    add_switch_tree(block, value, cases, middle, default_label, prefix, node);
+    free(lower);
+}
+
+/*
+Add the code that jumps to the label of the case matching the value of a
+switch, or to the default label if none does. Cases must be sorted by value
+with no value repeated. Cases that fill most of their range are dispatched
+through a table with jumpabs; other sets of cases are searched by binary
+search, or compared one by one if there are only a few. The value may be on
+the stack, in which case it is still there at whichever label is reached.
+Labels made for the dispatch begin with prefix.
+*/
+void add_switch_dispatch(asmblock_t *block, asmoperand_t *value, switchcase_t *cases,
+                         unsigned count, const char *default_label, const char *prefix) {
+    if (count >= SWITCH_TABLE_MIN) {
+        long long range = (long long)cases[count - 1].value - cases[0].value + 1;
+        if (range <= 2 * (long long)count) {
+            add_switch_table(block, value, cases, count, default_label, prefix);
+            return;
+        }
+    }
+    unsigned node = 0;
+    add_switch_tree(block, value, cases, count, default_label, prefix, &node);
+}
+
+
+const arithmeticop_t* find_arithmetic_op(const char *op) {
+    for (int i = 0; arithmetic_ops[i].op; ++i) {
+        if (strcmp(arithmetic_ops[i].op, op) == 0) {
+            return &arithmetic_ops[i];
+        }
+    }
+    return 0;
+}
+
+const comparisonop_t* find_comparison_op(const char *op) {
+    for (int i = 0; comparison_ops[i].op; ++i) {
+        if (strcmp(comparison_ops[i].op, op) == 0) {
+            return &comparison_ops[i];
+        }
+    }
+    return 0;
+}
+
+/*
+Returns true if an operand is the constant zero, which as a destination
+throws the value away.
+*/
+int is_discard(asmoperand_t *operand) {
+    return operand->type == OP_INTEGER && !operand->is_indirect && operand->data.value == 0;
+}
+
+/*
+Build the name of a label made for an expression. The caller is responsible
+for freeing the result.
+*/
+char* expression_label(expression_t *expr, const char *name) {
+    char *label = malloc(strlen(name) + 32);
+    sprintf(label, "expr$%u$%s", expr->offset, name);
+    return label;
+}
+
+/*
+Find an operand holding the value of an expression, adding the code to
+compute it if there is none already. Constants, names and the stack are used
+where they are, an assignment to a name gives the name assigned to, and
+anything else is computed onto the stack. The operand shares any name with
+the expression.
+*/
+void add_value(asmblock_t *block, expression_t *expr, asmoperand_t *result) {
+    if (expr->type == EXPR_OPERAND) {
+        *result = expr->value;
+    } else if (expr->type == EXPR_ASSIGN && expr->left->type == EXPR_OPERAND) {
+        add_expression(block, expr->right, &expr->left->value);
+        *result = expr->left->value;
+    } else {
+        add_expression(block, expr, &stack_operand);
+        *result = stack_operand;
+    }
+}
+
+/*
+Add an arithmetic operator storing directly to its destination. When both
+operands were computed onto the stack the right one is on top, where the
+instruction would take it as its first operand, so for operators where the
+order matters the two are swapped first.
+*/
+void add_arithmetic(asmblock_t *block, expression_t *expr, const arithmeticop_t *op,
+                    asmoperand_t *dest) {
+    asmoperand_t left, right;
+    add_value(block, expr->left, &left);
+    add_value(block, expr->right, &right);
+    if (left.type == OP_STACK && right.type == OP_STACK && !op->is_commutative) {
+        add_instruction(block, "stkswap");
+    }
+    add_instruction(block, op->mnemonic);
+    add_operand_copy(block, &left);
+    add_operand_copy(block, &right);
+    add_operand_copy(block, dest);
+}
+
+/*
+Store one or zero in the destination depending on whether a condition is
+true. A condition whose value is thrown away is still tested, since it may
+have side effects.
+*/
+void add_boolean(asmblock_t *block, expression_t *expr, asmoperand_t *dest) {
+    char *is_true = expression_label(expr, "true");
+    char *end = expression_label(expr, "end");
+    if (is_discard(dest)) {
+        add_condition(block, expr, 1, end);
+    } else {
+        add_condition(block, expr, 1, is_true);
+        add_instruction(block, "copy");
+        add_integer_operand(block, 0);
+        add_operand_copy(block, dest);
+        add_instruction(block, "jump");
+        add_name_operand(block, end);
+        add_label(block, is_true);
+        add_instruction(block, "copy");
+        add_integer_operand(block, 1);
+        add_operand_copy(block, dest);
+    }
+    add_label(block, end);
+    free(is_true);
+    free(end);
+}
+
+/*
+Push the arguments of a call onto the stack. The call pops its first
+argument first, so they are evaluated from last to first. Returns the number
+of arguments.
+*/
+unsigned add_arguments(asmblock_t *block, expression_t *expr) {
+    unsigned count = 0;
+    for (expression_t *arg = expr->right; arg; arg = arg->next) {
+        ++count;
+    }
+    expression_t **args = malloc((count ? count : 1) * sizeof(expression_t*));
+    count = 0;
+    for (expression_t *arg = expr->right; arg; arg = arg->next) {
+        args[count++] = arg;
+    }
+    for (unsigned i = count; i > 0; --i) {
+        add_expression(block, args[i - 1], &stack_operand);
+    }
+    free(args);
+    return count;
+}
+
+/*
+Add a call storing its result in the destination. Calls of up to three
+arguments use callf, callfi, callfii or callfiii with each argument as an
+operand where it is, or on the stack if it must be computed. The arguments
+are still evaluated from last to first, which leaves the first one on top of
+the stack to be loaded by the first operand. Longer calls push all of their
+arguments.
+*/
+void add_call(asmblock_t *block, expression_t *expr, asmoperand_t *dest) {
+    static const char *call_mnemonics[] = { "callf", "callfi", "callfii", "callfiii" };
+    asmoperand_t args[3];
+    unsigned count = 0;
+    for (expression_t *arg = expr->right; arg; arg = arg->next) {
+        ++count;
+    }
+
+    asmoperand_t function;
+    if (count > 3) {
+        count = add_arguments(block, expr);
+        add_value(block, expr->left, &function);
+        add_instruction(block, "call");
+        add_operand_copy(block, &function);
+        add_integer_operand(block, count);
+        add_operand_copy(block, dest);
+        return;
+    }
+
+    expression_t *list[3];
+    count = 0;
+    for (expression_t *arg = expr->right; arg; arg = arg->next) {
+        list[count++] = arg;
+    }
+    for (unsigned i = count; i > 0; --i) {
+        add_value(block, list[i - 1], &args[i - 1]);
+    }
+    add_value(block, expr->left, &function);
+    add_instruction(block, call_mnemonics[count]);
+    add_operand_copy(block, &function);
+    for (unsigned i = 0; i < count; ++i) {
+        add_operand_copy(block, &args[i]);
+    }
+    add_operand_copy(block, dest);
+}
+
+/*
+Find the record of a property in the table of an object, storing its address
+in dest, or zero if the object has no such property. The table is a count
+of records followed by a record for each property, holding the number of
+the property and then its value, sorted by number so that binarysearch can
+find it. The object's address is that of its first record, so the count is
+just before it.
+*/
+void add_property_search(asmblock_t *block, expression_t *expr, asmoperand_t *dest) {
+    asmoperand_t object;
+    add_value(block, expr->left, &object);
+    if (object.type == OP_STACK) {
+        /* keep the object under its count, where the search loads it first */
+        add_instruction(block, "stkcopy");
+        add_integer_operand(block, 1);
+    }
+    add_instruction(block, "aload");
+    add_operand_copy(block, &object);
+    add_integer_operand(block, -1);
+    add_stack_operand(block);
+    if (object.type == OP_STACK) {
+        add_instruction(block, "stkswap");
+    }
+    add_instruction(block, "binarysearch");
+    add_operand_copy(block, &expr->value);
+    add_integer_operand(block, 4);
+    add_operand_copy(block, &object);
+    add_integer_operand(block, 8);
+    add_stack_operand(block);
+    add_integer_operand(block, 0);
+    add_integer_operand(block, 0);
+    add_operand_copy(block, dest);
+}
+
+/*
+Store the value of a property of an object in dest, or zero if the object
+does not have the property.
+*/
+void add_property(asmblock_t *block, expression_t *expr, asmoperand_t *dest) {
+    if (is_discard(dest)) {
+        add_expression(block, expr->left, dest);
+        return;
+    }
+    char *end = expression_label(expr, "end");
+    add_property_search(block, expr, dest);
+    if (dest->type == OP_STACK) {
+        add_instruction(block, "stkcopy");
+        add_integer_operand(block, 1);
+    }
+    add_instruction(block, "jz");
+    add_operand_copy(block, dest);
+    add_name_operand(block, end);
+    add_instruction(block, "aload");
+    add_operand_copy(block, dest);
+    add_integer_operand(block, 1);
+    add_operand_copy(block, dest);
+    add_label(block, end);
+    free(end);
+}
+
+/*
+Store a value in a property of an object and then in dest. The value is
+computed before the object. Objects can't gain properties while the game
+runs, so a store to a property the object lacks is skipped; the interpreter
+would not stop a store through the zero the search gives.
+*/
+void add_property_assign(asmblock_t *block, expression_t *expr, asmoperand_t *dest) {
+    asmoperand_t value;
+    add_value(block, expr->right, &value);
+    if (value.type == OP_STACK && !is_discard(dest)) {
+        add_instruction(block, "stkcopy");
+        add_integer_operand(block, 1);
+    }
+    char *missing = expression_label(expr, "missing");
+    char *stored = expression_label(expr, "stored");
+    add_property_search(block, expr->left, &stack_operand);
+    add_instruction(block, "stkcopy");
+    add_integer_operand(block, 1);
+    add_instruction(block, "jz");
+    add_stack_operand(block);
+    add_name_operand(block, missing);
+    add_instruction(block, "astore");
+    add_stack_operand(block);
+    add_integer_operand(block, 1);
+    add_operand_copy(block, &value);
+    add_instruction(block, "jump");
+    add_name_operand(block, stored);
+    /* pop what the store would have */
+    add_label(block, missing);
+    add_instruction(block, "copy");
+    add_stack_operand(block);
+    add_integer_operand(block, 0);
+    if (value.type == OP_STACK) {
+        add_instruction(block, "copy");
+        add_stack_operand(block);
+        add_integer_operand(block, 0);
+    }
+    add_label(block, stored);
+    free(missing);
+    free(stored);
+    if (!is_discard(dest) && !(value.type == OP_STACK && dest->type == OP_STACK)) {
+        add_instruction(block, "copy");
+        add_operand_copy(block, &value);
+        add_operand_copy(block, dest);
+    }
+}
+
+/*
+Add the code to compute an expression and store its value in dest, which may
+be a name, the stack, or zero to throw the value away. Values are computed
+straight into their destination, so assigning the result of an operator
+takes a single instruction.
+*/
+void add_expression(asmblock_t *block, expression_t *expr, asmoperand_t *dest) {
+    switch(expr->type) {
+        case EXPR_OPERAND:
+            if (!is_discard(dest) || expr->value.type == OP_STACK) {
+                add_instruction(block, "copy");
+                add_operand_copy(block, &expr->value);
+                add_operand_copy(block, dest);
+            }
+            break;
+        case EXPR_UNARY: {
+            if (strcmp(expr->op, "!") == 0) {
+                add_boolean(block, expr, dest);
+                break;
+            }
+            asmoperand_t value;
+            add_value(block, expr->left, &value);
+            add_instruction(block, strcmp(expr->op, "-") == 0 ? "neg" : "bitnot");
+            add_operand_copy(block, &value);
+            add_operand_copy(block, dest);
+            break;
+        }
+        case EXPR_BINARY: {
+            const arithmeticop_t *op = find_arithmetic_op(expr->op);
+            if (op) {
+                add_arithmetic(block, expr, op, dest);
+            } else {
+                add_boolean(block, expr, dest);
+            }
+            break;
+        }
+        case EXPR_ASSIGN:
+            if (expr->left->type == EXPR_PROPERTY) {
+                add_property_assign(block, expr, dest);
+                break;
+            }
+            add_expression(block, expr->right, &expr->left->value);
+            if (!is_discard(dest)) {
+                add_instruction(block, "copy");
+                add_operand_copy(block, &expr->left->value);
+                add_operand_copy(block, dest);
+            }
+            break;
+        case EXPR_CALL:
+            add_call(block, expr, dest);
+            break;
+        case EXPR_PROPERTY:
+            add_property(block, expr, dest);
+            break;
+    }
+}
+
+/*
+Add a return of an expression's value, or of zero if there is no expression.
+Returning the result of a call becomes a tailcall.
+*/
+void add_return(asmblock_t *block, expression_t *expr) {
+    asmoperand_t value = { OP_INTEGER, 0, 0, { 0 } };
+    if (expr && expr->type == EXPR_CALL) {
+        unsigned count = add_arguments(block, expr);
+        add_value(block, expr->left, &value);
+        add_instruction(block, "tailcall");
+        add_operand_copy(block, &value);
+        add_integer_operand(block, count);
+        return;
+    }
+    if (expr) {
+        add_value(block, expr, &value);
+    }
+    add_instruction(block, "return");
+    add_operand_copy(block, &value);
+}
+
+/*
+Add the code to jump to a label if the truth of a condition matches when.
+Comparisons branch on their operands directly and && and || skip the rest
+of the condition once its result is known, so no truth value is ever
+stored. A constant condition needs no test at all.
+*/
+void add_condition(asmblock_t *block, expression_t *expr, int when, const char *label) {
+    if (expr->type == EXPR_OPERAND && expr->value.type == OP_INTEGER
+            && !expr->value.is_indirect) {
+        if ((expr->value.data.value != 0) == when) {
+            add_instruction(block, "jump");
+            add_name_operand(block, label);
+        }
+        return;
+    }
+    if (expr->type == EXPR_UNARY && strcmp(expr->op, "!") == 0) {
+        add_condition(block, expr->left, !when, label);
+        return;
+    }
+
+    if (expr->type == EXPR_BINARY
+            && (strcmp(expr->op, "&&") == 0 || strcmp(expr->op, "||") == 0)) {
+        int is_and = expr->op[0] == '&';
+        if (when != is_and) {
+            /* either side alone decides the jump */
+            add_condition(block, expr->left, when, label);
+            add_condition(block, expr->right, when, label);
+        } else {
+            /* the left side alone can only decide against the jump */
+            char *skip = expression_label(expr, "skip");
+            add_condition(block, expr->left, !when, skip);
+            add_condition(block, expr->right, when, label);
+            add_label(block, skip);
+            free(skip);
+        }
+        return;
+    }
+
+    const comparisonop_t *op = expr->type == EXPR_BINARY ? find_comparison_op(expr->op) : 0;
+    if (op) {
+        asmoperand_t left, right;
+        add_value(block, expr->left, &left);
+        add_value(block, expr->right, &right);
+        if (left.type == OP_STACK && right.type == OP_STACK) {
+            op = find_comparison_op(op->swapped);
+        }
+        add_instruction(block, when ? op->if_true : op->if_false);
+        add_operand_copy(block, &left);
+        add_operand_copy(block, &right);
+        add_name_operand(block, label);
+        return;
+    }
+
+    asmoperand_t value;
+    add_value(block, expr, &value);
+    add_instruction(block, when ? "jnz" : "jz");
+    add_operand_copy(block, &value);
+    add_name_operand(block, label);
+}
@@ -1,135 +1,142 @@
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "gbuild.h"
+#include "grammar.h"
 
-const char *reserved_words[] = {
-    "asm",
-    "function",
-    "return",
-    0
-};
+/* number of buckets in the mnemonic lookup index */
+#define MNEMONIC_BUCKETS 64
+
+/* chains of mnemonic table positions, indexed by hash; built on first use,
+   which may be from several assembler threads at once */
+static int mnemonic_buckets[MNEMONIC_BUCKETS];
+static int mnemonic_chain[256];
+static unsigned mnemonic_hashes[256];
+static pthread_once_t mnemonic_index_once = PTHREAD_ONCE_INIT;
+
+void build_mnemonic_index(void);
 
 mnemonic_t mnemonics[] = {
-    // mnemonic        opcode  operands  flags
-    { "nop",           0x00,   0,        0 },
-    { "add",           0x10,   3,        0 },
-    { "sub",           0x11,   3,        0 },
-    { "mul",           0x12,   3,        0 },
-    { "div",           0x13,   3,        0 },
-    { "mod",           0x14,   3,        0 },
-    { "neg",           0x15,   2,        0 },
-    { "numtof",        0x190,  2,        MNE_FLOAT },
-    { "ftonumz",       0x191,  2,        MNE_FLOAT },
-    { "ftonumn",       0x192,  2,        MNE_FLOAT },
-    { "ceil",          0x198,  2,        MNE_FLOAT },
-    { "floor",         0x199,  2,        MNE_FLOAT },
-    { "fadd",          0x1A0,  3,        MNE_FLOAT },
-    { "fsub",          0x1A1,  3,        MNE_FLOAT },
-    { "fmul",          0x1A2,  3,        MNE_FLOAT },
-    { "fdiv",          0x1A3,  3,        MNE_FLOAT },
-    { "fmod",          0x1A4,  4,        MNE_FLOAT },
-    { "sqrt",          0x1A8,  2,        MNE_FLOAT },
-    { "exp",           0x1A9,  2,        MNE_FLOAT },
-    { "log",           0x1AA,  2,        MNE_FLOAT },
-    { "pow",           0x1AB,  3,        MNE_FLOAT },
-    { "sin",           0x1B0,  2,        MNE_FLOAT },
-    { "cos",           0x1B1,  2,        MNE_FLOAT },
-    { "tan",           0x1B2,  2,        MNE_FLOAT },
-    { "asin",          0x1B3,  2,        MNE_FLOAT },
-    { "acos",          0x1B4,  2,        MNE_FLOAT },
-    { "atan",          0x1B5,  2,        MNE_FLOAT },
-    { "atan2",         0x1B6,  3,        MNE_FLOAT },
-    { "bitand",        0x18,   3,        0 },
-    { "bitor",         0x19,   3,        0 },
-    { "bitxor",        0x1A,   3,        0 },
-    { "bitnot",        0x1B,   3,        0 },
-    { "shiftl",        0x1C,   3,        0 },
-    { "sshiftr",       0x1D,   3,        0 },
-    { "ushiftr",       0x1E,   3,        0 },
-    { "jump",          0x20,   1,        MNE_RELJUMP },
-    { "jz",            0x22,   2,        MNE_RELJUMP },
-    { "jnz",           0x23,   2,        MNE_RELJUMP },
-    { "jeq",           0x24,   3,        MNE_RELJUMP },
-    { "jne",           0x25,   3,        MNE_RELJUMP },
-    { "jlt",           0x26,   3,        MNE_RELJUMP },
-    { "jge",           0x27,   3,        MNE_RELJUMP },
-    { "jgt",           0x28,   3,        MNE_RELJUMP },
-    { "jle",           0x29,   3,        MNE_RELJUMP },
-    { "jltu",          0x2A,   3,        MNE_RELJUMP },
-    { "jgeu",          0x2B,   3,        MNE_RELJUMP },
-    { "jgtu",          0x2C,   3,        MNE_RELJUMP },
-    { "jleu",          0x2D,   3,        MNE_RELJUMP },
-    { "jumpabs",       0x104,  1,        0 },
-    { "jfeq",          0x1C0,  4,        MNE_RELJUMP|MNE_FLOAT },
-    { "jfne",          0x1C1,  4,        MNE_RELJUMP|MNE_FLOAT },
-    { "jflt",          0x1C2,  3,        MNE_RELJUMP|MNE_FLOAT },
-    { "jfle",          0x1C3,  3,        MNE_RELJUMP|MNE_FLOAT },
-    { "jfgt",          0x1C4,  3,        MNE_RELJUMP|MNE_FLOAT },
-    { "jfge",          0x1C5,  3,        MNE_RELJUMP|MNE_FLOAT },
-    { "jisnan",        0x1C8,  2,        MNE_RELJUMP|MNE_FLOAT },
-    { "jisinf",        0x1C9,  2,        MNE_RELJUMP|MNE_FLOAT },
-    { "call",          0x30,   3,        0 },
-    { "return",        0x31,   1,        0 },
-    { "catch",         0x32,   2,        0 },
-    { "throw",         0x33,   2,        0 },
-    { "tailcall",      0x34,   2,        0 },
-    { "callf",         0x160,  2,        0 },
-    { "callfi",        0x161,  3,        0 },
-    { "callfii",       0x162,  4,        0 },
-    { "callfiii",      0x163,  5,        0 },
-    { "copy",          0x40,   2,        0 },
-    { "copys",         0x41,   2,        0 },
-    { "copyb",         0x42,   2,        0 },
-    { "sexs",          0x44,   2,        0 },
-    { "sexb",          0x45,   2,        0 },
-    { "aload",         0x48,   3,        0 },
-    { "aloads",        0x49,   3,        0 },
-    { "aloadb",        0x4A,   3,        0 },
-    { "aloadbit",      0x4B,   3,        0 },
-    { "astore",        0x4C,   3,        0 },
-    { "astores",       0x4D,   3,        0 },
-    { "astoreb",       0x4E,   3,        0 },
-    { "astorebit",     0x4F,   3,        0 },
-    { "stkcount",      0x50,   1,        0 },
-    { "stkpeek",       0x51,   2,        0 },
-    { "stkswap",       0x52,   0,        0 },
-    { "stkroll",       0x53,   2,        0 },
-    { "stkcopy",       0x54,   1,        0 },
-    { "streamchar",    0x70,   1,        0 },
-    { "streamnum",     0x71,   1,        0 },
-    { "streamstr",     0x72,   1,        0 },
-    { "streamunichar", 0x73,   1,        0 },
-    { "gestalt",       0x100,  3,        0 },
-    { "debugtrap",     0x101,  1,        0 },
-    { "getmemsize",    0x102,  1,        0 },
-    { "setmemsize",    0x103,  2,        MNE_RESIZE },
-    { "random",        0x110,  2,        0 },
-    { "setrandom",     0x111,  1,        0 },
-    { "quit",          0x120,  0,        0 },
-    { "verify",        0x121,  1,        0 },
-    { "restart",       0x122,  0,        0 },
-    { "save",          0x123,  2,        0 },
-    { "restore",       0x124,  2,        0 },
-    { "saveundo",      0x125,  1,        0 },
-    { "restoreundo",   0x126,  1,        0 },
-    { "protect",       0x127,  2,        0 },
-    { "glk",           0x130,  3,        0 },
-    { "getstringtbl",  0x140,  1,        0 },
-    { "setstringtbl",  0x141,  1,        0 },
-    { "getiosys",      0x148,  2,        0 },
-    { "setiosys",      0x149,  2,        0 },
-    { "linearsearch",  0x150,  8,        0 },
-    { "binarysearch",  0x151,  8,        0 },
-    { "linkedsearch",  0x152,  7,        0 },
-    { "mzero",         0x170,  2,        0 },
-    { "mcopy",         0x171,  3,        0 },
-    { "malloc",        0x178,  2,        MNE_MALLOC },
-    { "mfree",         0x179,  1,        0 },
-    { "accelfunc",     0x180,  2,        0 },
-    { "accelparam",    0x181,  2,        0 },
-    { 0,               0,      0,        0 }
+    // mnemonic        opcode  operands  stores  flags
+    { "nop",           0x00,   0,        0x00,   0 },
+    { "add",           0x10,   3,        0x04,   0 },
+    { "sub",           0x11,   3,        0x04,   0 },
+    { "mul",           0x12,   3,        0x04,   0 },
+    { "div",           0x13,   3,        0x04,   0 },
+    { "mod",           0x14,   3,        0x04,   0 },
+    { "neg",           0x15,   2,        0x02,   0 },
+    { "numtof",        0x190,  2,        0x02,   MNE_FLOAT },
+    { "ftonumz",       0x191,  2,        0x02,   MNE_FLOAT },
+    { "ftonumn",       0x192,  2,        0x02,   MNE_FLOAT },
+    { "ceil",          0x198,  2,        0x02,   MNE_FLOAT },
+    { "floor",         0x199,  2,        0x02,   MNE_FLOAT },
+    { "fadd",          0x1A0,  3,        0x04,   MNE_FLOAT },
+    { "fsub",          0x1A1,  3,        0x04,   MNE_FLOAT },
+    { "fmul",          0x1A2,  3,        0x04,   MNE_FLOAT },
+    { "fdiv",          0x1A3,  3,        0x04,   MNE_FLOAT },
+    { "fmod",          0x1A4,  4,        0x0C,   MNE_FLOAT },
+    { "sqrt",          0x1A8,  2,        0x02,   MNE_FLOAT },
+    { "exp",           0x1A9,  2,        0x02,   MNE_FLOAT },
+    { "log",           0x1AA,  2,        0x02,   MNE_FLOAT },
+    { "pow",           0x1AB,  3,        0x04,   MNE_FLOAT },
+    { "sin",           0x1B0,  2,        0x02,   MNE_FLOAT },
+    { "cos",           0x1B1,  2,        0x02,   MNE_FLOAT },
+    { "tan",           0x1B2,  2,        0x02,   MNE_FLOAT },
+    { "asin",          0x1B3,  2,        0x02,   MNE_FLOAT },
+    { "acos",          0x1B4,  2,        0x02,   MNE_FLOAT },
+    { "atan",          0x1B5,  2,        0x02,   MNE_FLOAT },
+    { "atan2",          0x1B6,  3,        0x04,   MNE_FLOAT },
+    { "bitand",        0x18,   3,        0x04,   0 },
+    { "bitor",         0x19,   3,        0x04,   0 },
+    { "bitxor",        0x1A,   3,        0x04,   0 },
+    { "bitnot",        0x1B,   2,        0x02,   0 },
+    { "shiftl",        0x1C,   3,        0x04,   0 },
+    { "sshiftr",       0x1D,   3,        0x04,   0 },
+    { "ushiftr",       0x1E,   3,        0x04,   0 },
+    { "jump",          0x20,   1,        0x00,   MNE_RELJUMP },
+    { "jz",            0x22,   2,        0x00,   MNE_RELJUMP },
+    { "jnz",           0x23,   2,        0x00,   MNE_RELJUMP },
+    { "jeq",           0x24,   3,        0x00,   MNE_RELJUMP },
+    { "jne",           0x25,   3,        0x00,   MNE_RELJUMP },
+    { "jlt",           0x26,   3,        0x00,   MNE_RELJUMP },
+    { "jge",           0x27,   3,        0x00,   MNE_RELJUMP },
+    { "jgt",           0x28,   3,        0x00,   MNE_RELJUMP },
+    { "jle",           0x29,   3,        0x00,   MNE_RELJUMP },
+    { "jltu",          0x2A,   3,        0x00,   MNE_RELJUMP },
+    { "jgeu",          0x2B,   3,        0x00,   MNE_RELJUMP },
+    { "jgtu",          0x2C,   3,        0x00,   MNE_RELJUMP },
+    { "jleu",          0x2D,   3,        0x00,   MNE_RELJUMP },
+    { "jumpabs",       0x104,  1,        0x00,   MNE_FRAME },
+    { "jfeq",          0x1C0,  4,        0x00,   MNE_RELJUMP|MNE_FLOAT },
+    { "jfne",          0x1C1,  4,        0x00,   MNE_RELJUMP|MNE_FLOAT },
+    { "jflt",          0x1C2,  3,        0x00,   MNE_RELJUMP|MNE_FLOAT },
+    { "jfle",          0x1C3,  3,        0x00,   MNE_RELJUMP|MNE_FLOAT },
+    { "jfgt",          0x1C4,  3,        0x00,   MNE_RELJUMP|MNE_FLOAT },
+    { "jfge",          0x1C5,  3,        0x00,   MNE_RELJUMP|MNE_FLOAT },
+    { "jisnan",        0x1C8,  2,        0x00,   MNE_RELJUMP|MNE_FLOAT },
+    { "jisinf",        0x1C9,  2,        0x00,   MNE_RELJUMP|MNE_FLOAT },
+    { "call",          0x30,   3,        0x04,   MNE_CALL },
+    { "return",        0x31,   1,        0x00,   0 },
+    { "catch",         0x32,   2,        0x01,   MNE_FRAME },
+    { "throw",         0x33,   2,        0x00,   MNE_FRAME },
+    { "tailcall",      0x34,   2,        0x00,   MNE_CALL },
+    { "callf",         0x160,  2,        0x02,   MNE_CALL },
+    { "callfi",        0x161,  3,        0x04,   MNE_CALL },
+    { "callfii",       0x162,  4,        0x08,   MNE_CALL },
+    { "callfiii",      0x163,  5,        0x10,   MNE_CALL },
+    { "copy",          0x40,   2,        0x02,   0 },
+    { "copys",         0x41,   2,        0x02,   0 },
+    { "copyb",         0x42,   2,        0x02,   0 },
+    { "sexs",          0x44,   2,        0x02,   0 },
+    { "sexb",          0x45,   2,        0x02,   0 },
+    { "aload",         0x48,   3,        0x04,   0 },
+    { "aloads",        0x49,   3,        0x04,   0 },
+    { "aloadb",        0x4A,   3,        0x04,   0 },
+    { "aloadbit",      0x4B,   3,        0x04,   0 },
+    { "astore",        0x4C,   3,        0x00,   0 },
+    { "astores",       0x4D,   3,        0x00,   0 },
+    { "astoreb",       0x4E,   3,        0x00,   0 },
+    { "astorebit",     0x4F,   3,        0x00,   0 },
+    { "stkcount",      0x50,   1,        0x01,   MNE_FRAME },
+    { "stkpeek",       0x51,   2,        0x02,   MNE_FRAME },
+    { "stkswap",       0x52,   0,        0x00,   MNE_FRAME },
+    { "stkroll",       0x53,   2,        0x00,   MNE_FRAME },
+    { "stkcopy",       0x54,   1,        0x00,   MNE_FRAME },
+    { "streamchar",    0x70,   1,        0x00,   0 },
+    { "streamnum",     0x71,   1,        0x00,   0 },
+    { "streamstr",     0x72,   1,        0x00,   0 },
+    { "streamunichar", 0x73,   1,        0x00,   0 },
+    { "gestalt",       0x100,  3,        0x04,   0 },
+    { "debugtrap",     0x101,  1,        0x00,   0 },
+    { "getmemsize",    0x102,  1,        0x01,   0 },
+    { "setmemsize",    0x103,  2,        0x02,   MNE_RESIZE },
+    { "random",        0x110,  2,        0x02,   0 },
+    { "setrandom",     0x111,  1,        0x00,   0 },
+    { "quit",          0x120,  0,        0x00,   MNE_QUIT },
+    { "verify",        0x121,  1,        0x01,   0 },
+    { "restart",       0x122,  0,        0x00,   0 },
+    { "save",          0x123,  2,        0x02,   MNE_FRAME },
+    { "restore",       0x124,  2,        0x02,   MNE_FRAME },
+    { "saveundo",      0x125,  1,        0x01,   MNE_FRAME },
+    { "restoreundo",   0x126,  1,        0x01,   MNE_FRAME },
+    { "protect",       0x127,  2,        0x00,   0 },
+    { "glk",           0x130,  3,        0x04,   MNE_FRAME },
+    { "getstringtbl",  0x140,  1,        0x01,   0 },
+    { "setstringtbl",  0x141,  1,        0x00,   0 },
+    { "getiosys",      0x148,  2,        0x03,   0 },
+    { "setiosys",      0x149,  2,        0x00,   0 },
+    { "linearsearch",  0x150,  8,        0x80,   0 },
+    { "binarysearch",  0x151,  8,        0x80,   0 },
+    { "linkedsearch",  0x152,  7,        0x40,   0 },
+    { "mzero",         0x170,  2,        0x00,   0 },
+    { "mcopy",         0x171,  3,        0x00,   0 },
+    { "malloc",        0x178,  2,        0x02,   MNE_MALLOC },
+    { "mfree",         0x179,  1,        0x00,   0 },
+    { "accelfunc",     0x180,  2,        0x00,   0 },
+    { "accelparam",    0x181,  2,        0x00,   0 },
+    { 0,               0,      0,        0,      0 }
 };
 
 
@@ -146,36 +153,147 @@ char *strdup (const char *source_string) {
 }
 
 /*
-returns true if the value passed is a reserved word.
+returns the keyword number of the value passed if it is a reserved word, or
+zero if it is not.
 */
 int is_reserved_word(const char *word) {
-    int i = 0;
-    while (reserved_words[i]) {
-        if (strcmp(reserved_words[i], word) == 0) {
-            return 1;
+    return is_reserved_word_length(word, strlen(word));
+}
+
+/*
+returns the keyword number of the value passed if it is a reserved word, or
+zero if it is not. The word need not be terminated, as its length is given.
+*/
+int is_reserved_word_length(const char *word, unsigned length) {
+    for (int i = 1; i < KEYWORD_COUNT; ++i) {
+        if (strncmp(keyword_names[i], word, length) == 0 && keyword_names[i][length] == 0) {
+            return i;
         }
-        ++i;
     }
     return 0;
 }
 
+/*
+Build the hash index used to look up mnemonics by name.
+*/
+void build_mnemonic_index(void) {
+    for (int i = 0; i < MNEMONIC_BUCKETS; ++i) {
+        mnemonic_buckets[i] = -1;
+    }
+    for (int i = 0; mnemonics[i].mnemonic; ++i) {
+        unsigned hash = hash_string(mnemonics[i].mnemonic);
+        mnemonic_hashes[i] = hash;
+        mnemonic_chain[i] = mnemonic_buckets[hash % MNEMONIC_BUCKETS];
+        mnemonic_buckets[hash % MNEMONIC_BUCKETS] = i;
+    }
+}
+
 /*
 Get information about an assembly mnemonic. Returns null if the mnemonic isn't valid.
 */
 mnemonic_t* get_mnemonic(const char *name) {
-    size_t i = 0;
-    while (mnemonics[i].mnemonic) {
-        if (strcmp(mnemonics[i].mnemonic, name) == 0) {
-            return &mnemonics[i];
+    int index = get_mnemonic_index(name);
+    return index < 0 ? 0 : &mnemonics[index];
+}
+
+/*
+Get the position of an assembly mnemonic in the mnemonics table. Returns -1
+if the mnemonic isn't valid.
+*/
+int get_mnemonic_index(const char *name) {
+    return get_mnemonic_index_hashed(name, hash_string(name));
+}
+
+/*
+Get the position of an assembly mnemonic in the mnemonics table given the
+hash of its name. Returns -1 if the mnemonic isn't valid.
+*/
+int get_mnemonic_index_hashed(const char *name, unsigned hash) {
+    pthread_once(&mnemonic_index_once, build_mnemonic_index);
+    int i = mnemonic_buckets[hash % MNEMONIC_BUCKETS];
+    while (i >= 0) {
+        if (mnemonic_hashes[i] == hash && strcmp(mnemonics[i].mnemonic, name) == 0) {
+            return i;
         }
-        ++i;
+        i = mnemonic_chain[i];
     }
-    return 0;
+    return -1;
+}
+
+
+/*
+Append a new statement with no operands to an assembly block. The returned
+pointer is only valid until the next statement is added.
+*/
+asmstmt_t* add_asm_statement(asmblock_t *block, int type, int mnemonic) {
+    if (block->count >= block->capacity) {
+        block->capacity = block->capacity ? block->capacity * 2 : 16;
+        block->content = realloc(block->content, block->capacity * sizeof(asmstmt_t));
+    }
+    asmstmt_t *stmt = &block->content[block->count];
+    ++block->count;
+    stmt->type = type;
+    stmt->operand_count = 0;
+    stmt->mnemonic = mnemonic;
+    stmt->first_operand = block->operand_count;
+    return stmt;
+}
+
+/*
+Append a new, empty operand to the last statement of an assembly block. The
+returned pointer is only valid until the next operand is added.
+*/
+asmoperand_t* add_asm_operand(asmblock_t *block) {
+    if (block->operand_count >= block->operand_capacity) {
+        block->operand_capacity = block->operand_capacity ? block->operand_capacity * 2 : 32;
+        block->operands = realloc(block->operands,
+                                  block->operand_capacity * sizeof(asmoperand_t));
+    }
+    asmoperand_t *operand = &block->operands[block->operand_count];
+    ++block->operand_count;
+    ++block->content[block->count - 1].operand_count;
+    memset(operand, 0, sizeof(asmoperand_t));
+    return operand;
+}
+
+/*
+Return one of the operands of a statement in an assembly block.
+*/
+asmoperand_t* get_asm_operand(asmblock_t *block, asmstmt_t *stmt, int index) {
+    return &block->operands[stmt->first_operand + index];
 }
 
 
+/*
+Build the name of the symbol for a dictionary word. The caller is
+responsible for freeing the result.
+*/
+char* dictionary_symbol_name(const char *word) {
+    char *name = malloc(strlen(word) + 2);
+    name[0] = '`';
+    strcpy(&name[1], word);
+    return name;
+}
+
+/*
+Add a word to a table's dictionary, which is kept in sorted order. Words
+already in the dictionary are not added again. Each word has a symbol in the
+table giving the address of its entry, and once there are words the
+dictionary has a symbol of its own.
+*/
 void add_dictionary_word(symboltable_t *table, const char *word) {
     if (table == 0 || word == 0) return;
+    char *name = dictionary_symbol_name(word);
+    for (int i = 0; i < 2; ++i) {
+        const char *symbol_name = i == 0 ? name : DICTIONARY_TABLE;
+        if (get_symbol(table, symbol_name)) continue;
+        symbol_t *symbol = calloc(sizeof(symbol_t), 1);
+        symbol->name = strdup(symbol_name);
+        symbol->type = SYM_DICT_WORD;
+        add_symbol(table, symbol);
+    }
+    free(name);
+    if (table->dictionary && strcmp(word, table->dictionary->word) == 0) return;
     dictword_t *new_word = calloc(sizeof(dictword_t), 1);
     new_word->word = strdup(word);
     if (table->dictionary == 0) {
@@ -186,7 +304,13 @@ void add_dictionary_word(symboltable_t *table, const char *word) {
     } else {
         dictword_t *current = table->dictionary;
         while (current->next) {
-            if (strcmp(word, current->next->word) < 0) {
+            int order = strcmp(word, current->next->word);
+            if (order == 0) {
+                free(new_word->word);
+                free(new_word);
+                return;
+            }
+            if (order < 0) {
                 new_word->next = current->next;
                 current->next = new_word;
                 return;
@@ -207,27 +331,42 @@ void index_dictionary(symboltable_t *symbols) {
 }
 
 unsigned hash_string(const char *text) {
-    unsigned hash = 0x811c9dc5;
+    unsigned hash = FNV_OFFSET_BASIS;
     size_t len = strlen(text);
     for (size_t i = 0; i < len; ++i) {
         hash ^= text[i];
-        hash *= 16777619;
+        hash *= FNV_PRIME;
     }
     return hash;
 }
 
 int add_symbol(symboltable_t *table, symbol_t *symbol) {
-    unsigned bucket = hash_string(symbol->name) % SYMBOL_TABLE_BUCKETS;
+    return add_symbol_hashed(table, symbol, hash_string(symbol->name));
+}
+
+/*
+Add a symbol to a table when the hash of its name is already known.
+*/
+int add_symbol_hashed(symboltable_t *table, symbol_t *symbol, unsigned hash) {
+    unsigned bucket = hash % SYMBOL_TABLE_BUCKETS;
+    symbol->hash = hash;
     symbol->next = table->symbol_buckets[bucket];
     table->symbol_buckets[bucket] = symbol;
     return 0;
 }
 
 symbol_t* get_symbol(symboltable_t *table, const char *symbol) {
-    unsigned bucket = hash_string(symbol) % SYMBOL_TABLE_BUCKETS;
-    symbol_t *cur = table->symbol_buckets[bucket];
+    return get_symbol_hashed(table, symbol, hash_string(symbol));
+}
+
+/*
+Find a symbol in a table when the hash of its name is already known. Names
+are only compared for symbols with a matching hash.
+*/
+symbol_t* get_symbol_hashed(symboltable_t *table, const char *symbol, unsigned hash) {
+    symbol_t *cur = table->symbol_buckets[hash % SYMBOL_TABLE_BUCKETS];
     while (cur) {
-        if (strcmp(cur->name, symbol) == 0) {
+        if (cur->hash == hash && strcmp(cur->name, symbol) == 0) {
             return cur;
         }
         cur = cur->next;
@@ -235,6 +374,104 @@ symbol_t* get_symbol(symboltable_t *table, const char *symbol) {
     return 0;
 }
 
+/*
+Find a symbol in a table or, failing that, in any of its parent tables.
+*/
+symbol_t* lookup_symbol(symboltable_t *table, const char *symbol) {
+    return lookup_symbol_hashed(table, symbol, hash_string(symbol));
+}
+
+symbol_t* lookup_symbol_hashed(symboltable_t *table, const char *symbol, unsigned hash) {
+    while (table) {
+        symbol_t *found = get_symbol_hashed(table, symbol, hash);
+        if (found) {
+            return found;
+        }
+        table = table->parent;
+    }
+    return 0;
+}
+
+/*
+Add a function to the front of the game's function list and define its name
+in the global symbol table, filling in any placeholder left by an object that
+imports it. Returns null without adding the function if a function of the same
+name is already defined.
+*/
+symbol_t* define_function(glulxfile_t *gamefile, function_t *function) {
+    symbol_t *symbol = get_symbol(gamefile->global_symbols, function->name);
+    if (symbol && symbol->type != SYM_IMPORT) {
+        fprintf(stderr, "ERROR: function \"%s\" is already defined\n", function->name);
+        return 0;
+    }
+    if (!symbol) {
+        symbol = calloc(sizeof(symbol_t), 1);
+        symbol->name = strdup(function->name);
+        add_symbol(gamefile->global_symbols, symbol);
+    }
+    symbol->type = SYM_FUNCTION;
+    symbol->data.func = function;
+
+    function->next = gamefile->functions;
+    if (gamefile->functions) {
+        gamefile->functions->prev = function;
+    }
+    gamefile->functions = function;
+    return symbol;
+}
+
+/*
+Return the symbol for a string literal, adding it to the game's string table
+if it has not been seen before. Identical strings share a single symbol.
+*/
+symbol_t* add_string(glulxfile_t *gamefile, const char *text) {
+    if (gamefile->strings == 0) {
+        gamefile->strings = calloc(sizeof(symboltable_t), 1);
+    }
+    symbol_t *symbol = get_symbol(gamefile->strings, text);
+    if (symbol) {
+        return symbol;
+    }
+    symbol = calloc(sizeof(symbol_t), 1);
+    symbol->name = strdup(text);
+    symbol->type = SYM_STRING;
+    add_symbol(gamefile->strings, symbol);
+    return symbol;
+}
+
+/*
+Returns the index of a function's local variable, or -1 if the function has
+no local of that name.
+*/
+int find_local(function_t *function, const char *name) {
+    for (unsigned i = 0; i < function->local_count; ++i) {
+        if (strcmp(function->local_names[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+Add a local variable to a function and return its index.
+*/
+unsigned add_local(function_t *function, const char *name) {
+    function->local_names = realloc(function->local_names,
+                                    (function->local_count + 1) * sizeof(char*));
+    function->local_names[function->local_count] = strdup(name);
+    return function->local_count++;
+}
+
+/*
+Remove the locals declared in a function's body, keeping its parameters, so
+that the body can be parsed again.
+*/
+void clear_locals(function_t *function) {
+    while (function->local_count > function->parameter_count) {
+        free(function->local_names[--function->local_count]);
+    }
+}
+
 void free_symbol_table(symboltable_t *table) {
     for (int i = 0; i < SYMBOL_TABLE_BUCKETS; ++i) {
         symbol_t *current = table->symbol_buckets[i];
@@ -257,18 +494,69 @@ void free_symbol_table(symboltable_t *table) {
 
 void free_gamefile(glulxfile_t *what) {
     free_symbol_table(what->global_symbols);
+    if (what->strings) {
+        free_symbol_table(what->strings);
+    }
+    if (what->constants) {
+        free_symbol_table(what->constants);
+    }
     function_t *func = what->functions;
     while (func) {
         function_t *next = func->next;
         free_function(func);
         func = next;
     }
+    object_t *object = what->objects;
+    while (object) {
+        object_t *next = object->next;
+        free_object(object);
+        object = next;
+    }
+    free_codebuf(&what->image);
+    free_reloctable(&what->relocations);
+    sourcefile_t *source = what->sources;
+    while (source) {
+        sourcefile_t *next = source->next;
+        free_sourcefile(source);
+        source = next;
+    }
+    free(what);
+}
+
+void free_object(object_t *what) {
+    free(what->name);
+    for (unsigned i = 0; i < what->property_count; ++i) {
+        asmoperand_t *value = &what->properties[i].value;
+        if (value->type == OP_IDENTIFIER || value->type == OP_STRING) {
+            free(value->data.name);
+        }
+    }
+    free(what->properties);
+    free(what);
+}
+
+void free_sourcefile(sourcefile_t *what) {
+    free(what->filename);
+    free(what->text);
     free(what);
 }
 
 void free_function(function_t *what) {
     free(what->name);
-    free_codeblock(what->code);
+    if (what->code) {
+        free_codeblock(what->code);
+    }
+    if (what->locals) {
+        free_symbol_table(what->locals);
+    }
+    for (unsigned i = 0; i < what->local_count; ++i) {
+        free(what->local_names[i]);
+    }
+    free(what->local_names);
+    free(what->local_offsets);
+    free_codebuf(&what->output);
+    free_reloctable(&what->relocations);
+    free(what->counters);
     free(what);
 }
 
@@ -289,24 +577,42 @@ void free_codeblock(codeblock_t *what) {
 }
 
 void free_asmblock(asmblock_t *what) {
+    for (unsigned i = 0; i < what->operand_count; ++i) {
+        if (what->operands[i].type == OP_IDENTIFIER
+                || what->operands[i].type == OP_STRING) {
+            free(what->operands[i].data.name);
+        }
+    }
+    free(what->operands);
+    free(what->content);
     free(what);
 }
 
-void free_asmstmt(asmstmt_t *what) {
-    switch(what->type) {
-        case ASM_LABEL:         free_asmlabel(what->data.label); break;
-        case ASM_INSTRUCTION:   free_asminst(what->data.inst); break;
-        default:
-            fprintf(stderr, "unhandled statement type %d in free_asmstmt\n", what->type);
+void free_expression(expression_t *what) {
+    while (what) {
+        expression_t *next = what->next;
+        if (what->value.type == OP_IDENTIFIER || what->value.type == OP_STRING) {
+            free(what->value.data.name);
+        }
+        if (what->left) {
+            free_expression(what->left);
+        }
+        if (what->right) {
+            free_expression(what->right);
+        }
+        free(what);
+        what = next;
     }
-    free(what);
 }
-void free_asmlabel(asmlabel_t *what) {
-    free(what->name);
-    free(what);
+
+void free_codebuf(codebuf_t *what) {
+    free(what->data);
+    what->data = 0;
+    what->size = what->capacity = 0;
 }
 
-void free_asminst(asminst_t *what) {
-    free(what->mnemonic);
-    free(what);
+void free_reloctable(reloctable_t *what) {
+    free(what->entries);
+    what->entries = 0;
+    what->count = what->capacity = 0;
 }
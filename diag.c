@@ -0,0 +1,225 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gbuild.h"
+
+#define DIAG_BUCKETS    256
+
+/*
+An error or other message found while reading the source, kept until the
+diagnostics are flushed.
+*/
+typedef struct DIAGNOSTIC {
+    int severity;
+    const char *code;
+    char *filename;
+    int line;
+    int column;
+    char *message;
+    unsigned hash;
+    /* index of the next diagnostic in the same bucket, or -1 */
+    int next;
+} diagnostic_t;
+
+/*
+Every diagnostic reported since the buffer was last cleared. Those before
+flushed have already been written out but are kept so repeats of them are
+still recognized.
+*/
+typedef struct DIAGNOSTIC_BUFFER {
+    diagnostic_t *items;
+    unsigned count;
+    unsigned capacity;
+    unsigned flushed;
+    int buckets[DIAG_BUCKETS];
+
+    unsigned counts[DIAG_SEVERITY_COUNT];
+    /* errors counted but not kept because the limit had been reached */
+    unsigned dropped;
+
+    int verbosity;
+    unsigned max_errors;
+} diagbuffer_t;
+
+/* the lexer and parser may report from more than one thread */
+static pthread_mutex_t diag_lock = PTHREAD_MUTEX_INITIALIZER;
+static diagbuffer_t diagnostics = { .verbosity = 0, .max_errors = DEFAULT_MAX_ERRORS };
+
+static const char *severity_names[DIAG_SEVERITY_COUNT] = { "trace", "warning", "error" };
+
+unsigned diagnostic_hash(const char *filename, int line, int column, const char *message);
+int find_diagnostic(unsigned hash, int severity, const char *filename, int line, int column,
+                    const char *message);
+
+
+/*
+Set how much is reported: traces of what the parser is doing are only kept
+when verbosity is above zero, and no more than max_errors errors are kept,
+though all are counted. A limit of zero keeps every error.
+*/
+void set_diagnostic_options(int verbosity, unsigned max_errors) {
+    pthread_mutex_lock(&diag_lock);
+    diagnostics.verbosity = verbosity;
+    diagnostics.max_errors = max_errors;
+    pthread_mutex_unlock(&diag_lock);
+}
+
+unsigned diagnostic_hash(const char *filename, int line, int column, const char *message) {
+    unsigned hash = FNV_OFFSET_BASIS;
+    for (const char *c = filename ? filename : ""; *c; ++c) {
+        hash = (hash ^ (unsigned char)*c) * FNV_PRIME;
+    }
+    hash = (hash ^ (unsigned)line) * FNV_PRIME;
+    hash = (hash ^ (unsigned)column) * FNV_PRIME;
+    for (const char *c = message; *c; ++c) {
+        hash = (hash ^ (unsigned char)*c) * FNV_PRIME;
+    }
+    return hash;
+}
+
+/*
+Returns non-zero if the same diagnostic has already been reported.
+*/
+int find_diagnostic(unsigned hash, int severity, const char *filename, int line, int column,
+                    const char *message) {
+    int index = diagnostics.buckets[hash % DIAG_BUCKETS];
+    while (index >= 0) {
+        diagnostic_t *item = &diagnostics.items[index];
+        if (item->hash == hash && item->severity == severity
+                && item->line == line && item->column == column
+                && strcmp(item->message, message) == 0
+                && (item->filename && filename ? strcmp(item->filename, filename) == 0
+                                               : item->filename == filename)) {
+            return 1;
+        }
+        index = item->next;
+    }
+    return 0;
+}
+
+/*
+Add a diagnostic to the buffer to be written out when the buffer is next
+flushed. The filename may be null for a problem found at the end of a file.
+A diagnostic identical to one already reported is ignored.
+*/
+void report_diagnostic(int severity, const char *code, const char *filename,
+                       int line, int column, const char *format, ...) {
+    /* traces are dropped before any work is done to format them */
+    if (severity == DIAG_TRACE) {
+        pthread_mutex_lock(&diag_lock);
+        int verbosity = diagnostics.verbosity;
+        pthread_mutex_unlock(&diag_lock);
+        if (verbosity <= 0) {
+            return;
+        }
+    }
+
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(0, 0, format, args);
+    va_end(args);
+    if (length < 0) {
+        return;
+    }
+    char *message = malloc(length + 1);
+    va_start(args, format);
+    vsnprintf(message, length + 1, format, args);
+    va_end(args);
+
+    unsigned hash = diagnostic_hash(filename, line, column, message);
+    pthread_mutex_lock(&diag_lock);
+    if (diagnostics.count == 0) {
+        memset(diagnostics.buckets, -1, sizeof(diagnostics.buckets));
+    }
+    if (find_diagnostic(hash, severity, filename, line, column, message)) {
+        pthread_mutex_unlock(&diag_lock);
+        free(message);
+        return;
+    }
+    ++diagnostics.counts[severity];
+    if (severity == DIAG_ERROR && diagnostics.max_errors > 0
+            && diagnostics.counts[DIAG_ERROR] > diagnostics.max_errors) {
+        ++diagnostics.dropped;
+        pthread_mutex_unlock(&diag_lock);
+        free(message);
+        return;
+    }
+
+    if (diagnostics.count >= diagnostics.capacity) {
+        diagnostics.capacity = diagnostics.capacity ? diagnostics.capacity * 2 : 32;
+        diagnostics.items = realloc(diagnostics.items,
+                                    diagnostics.capacity * sizeof(diagnostic_t));
+    }
+    diagnostic_t *item = &diagnostics.items[diagnostics.count];
+    item->severity = severity;
+    item->code = code;
+    item->filename = 0;
+    if (filename) {
+        item->filename = malloc(strlen(filename) + 1);
+        strcpy(item->filename, filename);
+    }
+    item->line = line;
+    item->column = column;
+    item->message = message;
+    item->hash = hash;
+    item->next = diagnostics.buckets[hash % DIAG_BUCKETS];
+    diagnostics.buckets[hash % DIAG_BUCKETS] = diagnostics.count;
+    ++diagnostics.count;
+    pthread_mutex_unlock(&diag_lock);
+}
+
+/*
+Returns how many diagnostics of a severity have been reported since the
+buffer was cleared. Errors past the limit are counted; repeats are not.
+*/
+unsigned diagnostic_count(int severity) {
+    pthread_mutex_lock(&diag_lock);
+    unsigned count = diagnostics.counts[severity];
+    pthread_mutex_unlock(&diag_lock);
+    return count;
+}
+
+/*
+Write out every diagnostic reported since the last flush in the order they
+were reported, followed by how many errors were left out by the limit.
+*/
+void flush_diagnostics(FILE *out) {
+    pthread_mutex_lock(&diag_lock);
+    for (unsigned i = diagnostics.flushed; i < diagnostics.count; ++i) {
+        diagnostic_t *item = &diagnostics.items[i];
+        if (item->filename) {
+            fprintf(out, "%s:%d:%d: ", item->filename, item->line, item->column);
+        } else {
+            fprintf(out, "end of file: ");
+        }
+        fprintf(out, "%s: %s [%s]\n", severity_names[item->severity], item->message, item->code);
+    }
+    diagnostics.flushed = diagnostics.count;
+    if (diagnostics.dropped > 0) {
+        fprintf(out, "%u more error%s not shown.\n", diagnostics.dropped,
+                diagnostics.dropped == 1 ? "" : "s");
+        diagnostics.dropped = 0;
+    }
+    fflush(out);
+    pthread_mutex_unlock(&diag_lock);
+}
+
+/*
+Discard every diagnostic reported and reset the counts, keeping the options.
+*/
+void clear_diagnostics(void) {
+    pthread_mutex_lock(&diag_lock);
+    for (unsigned i = 0; i < diagnostics.count; ++i) {
+        free(diagnostics.items[i].filename);
+        free(diagnostics.items[i].message);
+    }
+    free(diagnostics.items);
+    diagnostics.items = 0;
+    diagnostics.count = diagnostics.capacity = diagnostics.flushed = 0;
+    diagnostics.dropped = 0;
+    memset(diagnostics.counts, 0, sizeof(diagnostics.counts));
+    pthread_mutex_unlock(&diag_lock);
+}
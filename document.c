@@ -0,0 +1,461 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gbuild.h"
+
+#define DOCUMENT_GAP_SIZE   4096
+
+int reparse_document(document_t *document);
+int reparse_function(document_t *document, unsigned index);
+void find_parts(document_t *document);
+void index_parts(document_t *document);
+void resize_part(document_t *document, unsigned index, long length, int lines);
+size_t part_start(document_t *document, unsigned index, int *line);
+unsigned find_part(document_t *document, size_t offset);
+unsigned move_tokens(lexertoken_t *first, lexertoken_t *last, long offset, int lines);
+void make_positions_absolute(document_t *document);
+void shift_columns(document_t *document, unsigned index, int column_delta);
+void add_document_words(glulxfile_t *gamefile, lexertoken_t *first, lexertoken_t *last);
+void move_gap(document_t *document, size_t offset);
+void replace_text(document_t *document, size_t offset, size_t removed,
+                  const char *inserted, size_t inserted_length);
+const char* text_from(document_t *document, size_t offset);
+
+
+/*
+Open a document on a copy of the text given and parse all of it.
+*/
+document_t* open_document(const char *filename, const char *text, size_t length) {
+    document_t *document = calloc(sizeof(document_t), 1);
+    document->filename = strdup(filename);
+    /* the gap starts out before the text */
+    document->gap_size = DOCUMENT_GAP_SIZE;
+    document->text = malloc(DOCUMENT_GAP_SIZE + length + 1);
+    memcpy(&document->text[DOCUMENT_GAP_SIZE], text, length);
+    document->text[DOCUMENT_GAP_SIZE + length] = 0;
+    document->length = length;
+    document->tokens = calloc(sizeof(tokenlist_t), 1);
+
+    /* lexing a whole text is the same as inserting all of it into an empty one */
+    textedit_t edit = { 0, 0, length };
+    document->has_errors = relex_tokens(document->tokens, 0, 0, filename, text, length, &edit);
+    document->has_errors |= reparse_document(document);
+    return document;
+}
+
+/*
+Replace removed characters at offset with inserted characters. If the edit
+falls inside the braces of a function, only the tokens of that function's part
+of the text are lexed again or moved and only its body is parsed again, as
+long as the tokens line up again before its closing brace and the body still
+parses as exactly the tokens between its braces. Otherwise the tokens are
+lexed again from the edit on and the whole document is parsed again. Returns
+non-zero if errors were found.
+*/
+int edit_document(document_t *document, size_t offset, size_t removed,
+                  const char *inserted, size_t inserted_length) {
+    if (offset > document->length || removed > document->length - offset) {
+        fprintf(stderr, "DOCUMENT: edit at %lu is outside of \"%s\".\n",
+                (unsigned long)offset, document->filename);
+        return 1;
+    }
+    replace_text(document, offset, removed, inserted, inserted_length);
+    document->tokens_touched = 0;
+
+    textedit_t edit = { offset, removed, inserted_length };
+    int has_errors = -1, result = -1;
+    unsigned index = find_part(document, offset);
+    docpart_t *part = &document->parts[index];
+    int base_line;
+    size_t base = part_start(document, index, &base_line);
+    lexertoken_t *start = token_before(part->first, part->last, offset - base);
+    if (part->function && start && start->offset > part->body_start) {
+        lexertoken_t *close = part->last;
+        int old_line = close->line_no, old_column = close->col_no;
+        edit.base_offset = base;
+        edit.base_line = base_line;
+        has_errors = relex_tokens(document->tokens, start, close, document->filename,
+                                  text_from(document, base + start->offset),
+                                  document->length, &edit);
+        if (has_errors >= 0) {
+            long delta = (long)inserted_length - (long)removed;
+            document->tokens_touched += edit.touched;
+            part->length += delta;
+            part->body_end += delta;
+            resize_part(document, index, delta, close->line_no - old_line);
+            shift_columns(document, index, close->col_no - old_column);
+            result = reparse_function(document, index);
+        }
+    }
+
+    if (result < 0) {
+        make_positions_absolute(document);
+        if (has_errors < 0) {
+            start = token_before(document->tokens->first, 0, offset);
+            edit.base_offset = 0;
+            edit.base_line = 0;
+            has_errors = relex_tokens(document->tokens, start, 0, document->filename,
+                                      text_from(document, start ? start->offset : 0),
+                                      document->length, &edit);
+            document->tokens_touched += edit.touched;
+        }
+        result = reparse_document(document);
+    }
+    document->has_errors = has_errors | result;
+    return document->has_errors;
+}
+
+/*
+Find the token that begins at offset in a document, or null if none does. The
+line the token is on in the whole text is given through line, since the token
+only holds its line within its part of the text.
+*/
+lexertoken_t* find_document_token(document_t *document, size_t offset, int *line) {
+    unsigned index = find_part(document, offset);
+    docpart_t *part = &document->parts[index];
+    int base_line;
+    size_t base = part_start(document, index, &base_line);
+    for (lexertoken_t *token = part->first; token; token = token == part->last ? 0 : token->next) {
+        if (token->offset + base == offset) {
+            *line = token->line_no + base_line;
+            return token;
+        }
+        if (token->offset + base > offset) {
+            break;
+        }
+    }
+    return 0;
+}
+
+void close_document(document_t *document) {
+    free_gamefile(document->gamefile);
+    free_tokens(document->tokens);
+    free(document->parts);
+    free(document->part_offsets);
+    free(document->part_lines);
+    free(document->text);
+    free(document->filename);
+    free(document);
+}
+
+/*
+Parse every token of a document into a new set of functions and constants,
+then divide the tokens into parts again. The tokens must hold their positions
+in the whole text. Returns non-zero if errors occured.
+*/
+int reparse_document(document_t *document) {
+    if (document->gamefile) {
+        free_gamefile(document->gamefile);
+    }
+    document->gamefile = calloc(sizeof(glulxfile_t), 1);
+    document->gamefile->global_symbols = calloc(sizeof(symboltable_t), 1);
+
+    tokenlist_t *tokens = document->tokens;
+    int has_errors = 0;
+    if (tokens->first) {
+        lexer_t *lexer = open_lexer_tokens(tokens->first, tokens->last);
+        has_errors = parse_file(document->gamefile, lexer);
+        close_lexer(lexer);
+    }
+    add_document_words(document->gamefile, tokens->first, tokens->last);
+    find_parts(document);
+    return has_errors;
+}
+
+/*
+Parse a function's body again, keeping the rest of the document. Returns -1
+if the body no longer parses as exactly the tokens between its braces, in
+which case the whole document must be parsed again, and otherwise zero.
+*/
+int reparse_function(document_t *document, unsigned index) {
+    docpart_t *part = &document->parts[index];
+    lexertoken_t *open = part->first;
+    while (open != part->last && open->offset != part->body_start) {
+        open = open->next;
+    }
+    if (open->offset != part->body_start || open->type != OPEN_BRACE) {
+        return -1;
+    }
+    int depth = 0;
+    lexertoken_t *close = open;
+    for (;;) {
+        if (close->type == OPEN_BRACE) {
+            ++depth;
+        } else if (close->type == CLOSE_BRACE && --depth == 0) {
+            break;
+        }
+        if (close == part->last) {
+            return -1;
+        }
+        close = close->next;
+    }
+    if (close != part->last || close->offset + 1 != part->body_end) {
+        return -1;
+    }
+
+    /* the parser reports and records positions in the whole text, so the
+       body's tokens hold those while it is parsed */
+    int line;
+    size_t base = part_start(document, index, &line);
+    document->tokens_touched += move_tokens(open, close, base, line);
+
+    /* the parser's error recovery may not stop where the braces match, in
+       which case the rest of the document could parse differently too */
+    lexer_t *lexer = open_lexer_tokens(open, close);
+    clear_locals(part->function);
+    codeblock_t *code = parse_codeblock(document->gamefile, lexer, part->function);
+    int is_whole_body = lexer_token(lexer, 0) == 0
+                        && lexer_offset(lexer) == base + part->body_end;
+    close_lexer(lexer);
+    move_tokens(open, close, -(long)base, -line);
+    if (!code || !is_whole_body) {
+        if (code) {
+            free_codeblock(code);
+        }
+        return -1;
+    }
+    if (part->function->code) {
+        free_codeblock(part->function->code);
+    }
+    part->function->code = code;
+    add_document_words(document->gamefile, open, close);
+    return 0;
+}
+
+/*
+Divide the tokens of a document into parts, one ending with the closing brace
+of each function parsed from them and one for the rest, and make their
+positions relative to the part they are in.
+*/
+void find_parts(document_t *document) {
+    free(document->parts);
+    free(document->part_offsets);
+    free(document->part_lines);
+
+    /* the game's function list is in reverse source order */
+    unsigned count = 0;
+    for (function_t *func = document->gamefile->functions; func; func = func->next) {
+        ++count;
+    }
+    function_t **functions = calloc(sizeof(function_t*), count ? count : 1);
+    unsigned index = count;
+    for (function_t *func = document->gamefile->functions; func; func = func->next) {
+        functions[--index] = func;
+    }
+
+    document->parts = calloc(sizeof(docpart_t), count + 1);
+    document->part_count = 0;
+    lexertoken_t *token = document->tokens->first;
+    size_t start = 0;
+    int line = 1;
+    for (unsigned i = 0; i < count; ++i) {
+        function_t *func = functions[i];
+        lexertoken_t *close = token;
+        while (close && close->offset + 1 < func->body_end) {
+            close = close->next;
+        }
+        if (!close || close->offset + 1 != func->body_end || close->type != CLOSE_BRACE) {
+            continue;
+        }
+        docpart_t *part = &document->parts[document->part_count++];
+        part->function = func;
+        part->first = token;
+        part->last = close;
+        part->length = func->body_end - start;
+        part->body_start = func->body_start - start;
+        part->body_end = func->body_end - start;
+        int close_line = close->line_no;
+        move_tokens(token, close, -(long)start, -line);
+        start = func->body_end;
+        line = close_line;
+        token = close->next;
+    }
+    docpart_t *rest = &document->parts[document->part_count++];
+    rest->first = token;
+    rest->last = token ? document->tokens->last : 0;
+    rest->length = document->length - start;
+    move_tokens(rest->first, rest->last, -(long)start, -line);
+    free(functions);
+    index_parts(document);
+}
+
+/*
+Build the Fenwick trees giving where each part of a document begins, so that
+a part can be found or resized in time logarithmic in the number of parts.
+A part's lines are the line breaks before its closing brace, which is where
+the next part begins.
+*/
+void index_parts(document_t *document) {
+    unsigned count = document->part_count;
+    document->part_offsets = calloc(sizeof(size_t), count + 1);
+    document->part_lines = calloc(sizeof(int), count + 1);
+    for (unsigned i = 1; i <= count; ++i) {
+        docpart_t *part = &document->parts[i - 1];
+        document->part_offsets[i] += part->length;
+        document->part_lines[i] += part->function ? part->last->line_no : 0;
+        unsigned parent = i + (i & -i);
+        if (parent <= count) {
+            document->part_offsets[parent] += document->part_offsets[i];
+            document->part_lines[parent] += document->part_lines[i];
+        }
+    }
+}
+
+/*
+Record that a part of a document has gained length characters and lines line
+breaks, either of which may be negative.
+*/
+void resize_part(document_t *document, unsigned index, long length, int lines) {
+    for (unsigned i = index + 1; i <= document->part_count; i += i & -i) {
+        document->part_offsets[i] += length;
+        document->part_lines[i] += lines;
+    }
+}
+
+/*
+Return where a part of a document begins, giving the line it begins on
+through line.
+*/
+size_t part_start(document_t *document, unsigned index, int *line) {
+    size_t start = 0;
+    *line = 1;
+    for (unsigned i = index; i > 0; i -= i & -i) {
+        start += document->part_offsets[i];
+        *line += document->part_lines[i];
+    }
+    return start;
+}
+
+/*
+Return the part of a document holding offset: the last part that begins at
+or before it.
+*/
+unsigned find_part(document_t *document, size_t offset) {
+    unsigned count = document->part_count, index = 0, step = 1;
+    while (step * 2 <= count) {
+        step *= 2;
+    }
+    for (; step; step /= 2) {
+        if (index + step <= count && document->part_offsets[index + step] <= offset) {
+            index += step;
+            offset -= document->part_offsets[index];
+        }
+    }
+    return index < count ? index : count - 1;
+}
+
+/*
+Move the tokens from first up to and including last by offset characters and
+lines lines. Returns the number of tokens moved.
+*/
+unsigned move_tokens(lexertoken_t *first, lexertoken_t *last, long offset, int lines) {
+    unsigned count = 0;
+    for (lexertoken_t *token = first; token; token = token == last ? 0 : token->next) {
+        token->offset += offset;
+        token->line_no += lines;
+        ++count;
+    }
+    return count;
+}
+
+/*
+Give every token of a document its position in the whole text again, before
+the document is lexed or parsed as a whole.
+*/
+void make_positions_absolute(document_t *document) {
+    size_t start = 0;
+    int line = 1;
+    for (unsigned i = 0; i < document->part_count; ++i) {
+        docpart_t *part = &document->parts[i];
+        int lines = part->function ? part->last->line_no : 0;
+        document->tokens_touched += move_tokens(part->first, part->last, start, line);
+        start += part->length;
+        line += lines;
+    }
+}
+
+/*
+Once an edit has moved a part's closing brace along its line, move the tokens
+after it on that line, which are at the start of the parts that follow.
+*/
+void shift_columns(document_t *document, unsigned index, int column_delta) {
+    for (unsigned i = index + 1; column_delta && i < document->part_count; ++i) {
+        docpart_t *part = &document->parts[i];
+        for (lexertoken_t *token = part->first; token && token->line_no == 0;
+                token = token == part->last ? 0 : token->next) {
+            token->col_no += column_delta;
+            ++document->tokens_touched;
+        }
+        if (!part->function || part->last->line_no > 0) {
+            break;
+        }
+    }
+}
+
+/*
+Add the dictionary words used by a range of tokens. Words that are no longer
+used stay in the dictionary until the whole document is parsed again.
+*/
+void add_document_words(glulxfile_t *gamefile, lexertoken_t *first, lexertoken_t *last) {
+    for (lexertoken_t *token = first; token; token = token->next) {
+        if (token->type == DICT_WORD) {
+            add_dictionary_word(gamefile->global_symbols, token->data.text);
+        }
+        if (token == last) break;
+    }
+    index_dictionary(gamefile->global_symbols);
+}
+
+/*
+Move the gap in a document's text to offset.
+*/
+void move_gap(document_t *document, size_t offset) {
+    char *text = document->text;
+    size_t gap = document->gap_size;
+    if (offset < document->gap_start) {
+        memmove(&text[offset + gap], &text[offset], document->gap_start - offset);
+    } else {
+        memmove(&text[document->gap_start], &text[document->gap_start + gap],
+                offset - document->gap_start);
+    }
+    document->gap_start = offset;
+}
+
+/*
+Replace removed characters at offset in a document's text with inserted
+characters. Only the text between the gap and the edit is moved, unless the
+gap must be widened.
+*/
+void replace_text(document_t *document, size_t offset, size_t removed,
+                  const char *inserted, size_t inserted_length) {
+    move_gap(document, offset);
+    document->gap_size += removed;
+    document->length -= removed;
+    if (document->gap_size < inserted_length) {
+        /* widen the gap by more than is needed, so a run of insertions only
+           copies the text now and then */
+        size_t after = document->length - offset;
+        size_t gap = inserted_length + document->length / 2 + DOCUMENT_GAP_SIZE;
+        document->text = realloc(document->text, offset + gap + after + 1);
+        memmove(&document->text[offset + gap], &document->text[offset + document->gap_size],
+                after + 1);
+        document->gap_size = gap;
+    }
+    memcpy(&document->text[offset], inserted, inserted_length);
+    document->gap_start += inserted_length;
+    document->gap_size -= inserted_length;
+    document->length += inserted_length;
+}
+
+/*
+Return a document's text such that the characters from offset to the end can
+be read at their offsets, by making sure the gap is not after offset. The
+characters before offset must not be read.
+*/
+const char* text_from(document_t *document, size_t offset) {
+    if (document->gap_start > offset) {
+        move_gap(document, offset);
+    }
+    return &document->text[document->gap_size];
+}
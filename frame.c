@@ -0,0 +1,424 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gbuild.h"
+
+/*
+Locals are given slots in the call frame by the ranges of code over which
+their values are needed. A backward liveness analysis over the statements of
+a function finds which locals hold a value that may still be read at each
+statement; two locals interfere if one is stored to while the other is live,
+and locals that never interfere share a slot. Parameters keep the first
+slots, since arguments fill the frame in order.
+
+A local only ever accessed by instructions that read and write a single byte
+or two bytes, such as copyb and copys, gets a slot of that size, since the
+width of an instruction's operands is also the width of the locals it uses.
+*/
+
+/* the sizes of slot, largest first, in the order they are laid out */
+static const unsigned slot_sizes[FRAME_SLOT_SIZES] = { 4, 2, 1 };
+
+/*
+The statements of a function in order and what is known about the locals
+each one uses. Sets of locals are bitsets of words units each.
+*/
+typedef struct FRAME_ANALYSIS {
+    function_t *function;
+    asmblock_t **blocks;
+    asmstmt_t **statements;
+    unsigned count;
+    unsigned capacity;
+
+    /* labels by name, with the index of the statement each is at as value */
+    symboltable_t *labels;
+    /* labels whose address is taken other than by a branch, which jumpabs
+       may reach */
+    unsigned *address_taken;
+    unsigned address_taken_count;
+    /* set if control flow can't be followed, so no slot is shared */
+    int is_opaque;
+
+    unsigned words;
+    unsigned *uses;
+    unsigned *stores;
+    unsigned *live;
+    unsigned char *interferes;
+    /* the operand width of every access to each local, zero if the local
+       is never used */
+    unsigned *widths;
+} frame_t;
+
+void gather_frame(frame_t *frame, codeblock_t *code);
+void free_frame(frame_t *frame);
+int operand_width(asmstmt_t *stmt);
+int find_frame_label(frame_t *frame, asmoperand_t *name);
+void scan_statements(frame_t *frame);
+int add_successors(frame_t *frame, unsigned index, unsigned *live_out);
+void find_liveness(frame_t *frame);
+void set_interference(frame_t *frame, unsigned a, unsigned b);
+void find_interference(frame_t *frame);
+void assign_slots(frame_t *frame);
+
+
+void gather_frame(frame_t *frame, codeblock_t *code) {
+    for (statement_t *stmt = code->content; stmt; stmt = stmt->next) {
+        if (stmt->type == STMT_BLOCK) {
+            gather_frame(frame, stmt->data.code);
+        } else if (stmt->type == STMT_ASM) {
+            asmblock_t *block = stmt->data.asm;
+            for (unsigned i = 0; i < block->count; ++i) {
+                if (frame->count >= frame->capacity) {
+                    frame->capacity = frame->capacity ? frame->capacity * 2 : 64;
+                    frame->blocks = realloc(frame->blocks,
+                                            frame->capacity * sizeof(asmblock_t*));
+                    frame->statements = realloc(frame->statements,
+                                                frame->capacity * sizeof(asmstmt_t*));
+                }
+                frame->blocks[frame->count] = block;
+                frame->statements[frame->count] = &block->content[i];
+                ++frame->count;
+            }
+        }
+    }
+}
+
+void free_frame(frame_t *frame) {
+    free(frame->blocks);
+    free(frame->statements);
+    if (frame->labels) {
+        free_symbol_table(frame->labels);
+    }
+    free(frame->address_taken);
+    free(frame->uses);
+    free(frame->stores);
+    free(frame->live);
+    free(frame->interferes);
+    free(frame->widths);
+}
+
+/*
+The width in bytes at which an instruction reads and writes its operands.
+*/
+int operand_width(asmstmt_t *stmt) {
+    if (stmt->mnemonic == get_mnemonic_index("copyb")) return 1;
+    if (stmt->mnemonic == get_mnemonic_index("copys")) return 2;
+    return 4;
+}
+
+/*
+Returns the index of the statement a label is at, or -1 if there is no such
+label in the function.
+*/
+int find_frame_label(frame_t *frame, asmoperand_t *name) {
+    symbol_t *label = get_symbol_hashed(frame->labels, name->data.name, name->hash);
+    return label ? (int)label->data.value : -1;
+}
+
+/*
+Find the labels of a function and the locals each statement loads and
+stores, and the width every local is accessed at.
+*/
+void scan_statements(frame_t *frame) {
+    frame->labels = calloc(sizeof(symboltable_t), 1);
+    for (unsigned i = 0; i < frame->count; ++i) {
+        asmstmt_t *stmt = frame->statements[i];
+        if (stmt->type != ASM_LABEL) continue;
+        asmoperand_t *name = get_asm_operand(frame->blocks[i], stmt, 0);
+        if (!get_symbol_hashed(frame->labels, name->data.name, name->hash)) {
+            symbol_t *symbol = calloc(sizeof(symbol_t), 1);
+            symbol->name = strdup(name->data.name);
+            symbol->type = SYM_LABEL;
+            symbol->data.value = i;
+            add_symbol_hashed(frame->labels, symbol, name->hash);
+        }
+    }
+
+    frame->address_taken = malloc((frame->count ? frame->count : 1) * sizeof(unsigned));
+    for (unsigned i = 0; i < frame->count; ++i) {
+        asmstmt_t *stmt = frame->statements[i];
+        if (stmt->type == ASM_LABEL) continue;
+        if (stmt->type == ASM_INSTRUCTION && stmt->mnemonic == get_mnemonic_index("catch")) {
+            frame->is_opaque = 1;
+        }
+        int branch = stmt->type == ASM_INSTRUCTION
+                     && (mnemonics[stmt->mnemonic].flags & MNE_RELJUMP)
+                     ? stmt->operand_count - 1 : -1;
+        for (int j = 0; j < stmt->operand_count; ++j) {
+            asmoperand_t *operand = get_asm_operand(frame->blocks[i], stmt, j);
+            if (operand->type != OP_IDENTIFIER) continue;
+            int label = find_frame_label(frame, operand);
+            if (label >= 0) {
+                if (j != branch) {
+                    frame->address_taken[frame->address_taken_count++] = label;
+                }
+                continue;
+            }
+            int local = find_local(frame->function, operand->data.name);
+            if (local < 0 || operand->is_indirect || stmt->type != ASM_INSTRUCTION) {
+                continue;
+            }
+            unsigned bit = 1u << (local % 32);
+            unsigned word = i * frame->words + local / 32;
+            if (mnemonics[stmt->mnemonic].stores & (1 << j)) {
+                frame->stores[word] |= bit;
+            } else {
+                frame->uses[word] |= bit;
+            }
+            if (j == branch) {
+                frame->is_opaque = 1;
+            }
+            unsigned width = operand_width(stmt);
+            if (frame->widths[local] == 0) {
+                frame->widths[local] = width;
+            } else if (frame->widths[local] != width) {
+                frame->widths[local] = 4;
+            }
+        }
+    }
+}
+
+/*
+Add the locals live at the start of each statement that may run after the
+one at index to a set. Returns true if control can't be followed from the
+statement.
+*/
+int add_successors(frame_t *frame, unsigned index, unsigned *live_out) {
+    asmstmt_t *stmt = frame->statements[index];
+    unsigned successors[2];
+    unsigned count = 0;
+    int falls_through = 1;
+
+    if (stmt->type == ASM_INSTRUCTION) {
+        const char *mnemonic = mnemonics[stmt->mnemonic].mnemonic;
+        if (strcmp(mnemonic, "jump") == 0 || strcmp(mnemonic, "return") == 0
+                || strcmp(mnemonic, "tailcall") == 0 || strcmp(mnemonic, "throw") == 0
+                || (mnemonics[stmt->mnemonic].flags & MNE_QUIT)) {
+            falls_through = 0;
+        }
+        if (strcmp(mnemonic, "jumpabs") == 0) {
+            falls_through = 0;
+            for (unsigned i = 0; i < frame->address_taken_count; ++i) {
+                unsigned *from = &frame->live[frame->address_taken[i] * frame->words];
+                for (unsigned w = 0; w < frame->words; ++w) {
+                    live_out[w] |= from[w];
+                }
+            }
+        }
+        if ((mnemonics[stmt->mnemonic].flags & MNE_RELJUMP) && stmt->operand_count > 0) {
+            asmoperand_t *target = get_asm_operand(frame->blocks[index], stmt,
+                                                   stmt->operand_count - 1);
+            int label = target->type == OP_IDENTIFIER ? find_frame_label(frame, target) : -1;
+            if (label >= 0) {
+                successors[count++] = label;
+            } else if (target->type != OP_INTEGER || target->is_indirect
+                       || (target->data.value != 0 && target->data.value != 1)) {
+                /* branch offsets of zero and one return rather than jump */
+                return 1;
+            }
+        }
+    }
+    if (falls_through && index + 1 < frame->count) {
+        successors[count++] = index + 1;
+    }
+
+    for (unsigned i = 0; i < count; ++i) {
+        unsigned *from = &frame->live[successors[i] * frame->words];
+        for (unsigned w = 0; w < frame->words; ++w) {
+            live_out[w] |= from[w];
+        }
+    }
+    return 0;
+}
+
+/*
+Find the locals live at the start of each statement, repeating backwards
+passes until nothing changes.
+*/
+void find_liveness(frame_t *frame) {
+    unsigned *live_out = malloc(frame->words * sizeof(unsigned));
+    int changed = 1;
+    while (changed && !frame->is_opaque) {
+        changed = 0;
+        for (unsigned i = frame->count; i > 0; --i) {
+            unsigned index = i - 1;
+            memset(live_out, 0, frame->words * sizeof(unsigned));
+            if (add_successors(frame, index, live_out)) {
+                frame->is_opaque = 1;
+                break;
+            }
+            unsigned *live = &frame->live[index * frame->words];
+            for (unsigned w = 0; w < frame->words; ++w) {
+                unsigned word = index * frame->words + w;
+                unsigned value = frame->uses[word] | (live_out[w] & ~frame->stores[word]);
+                if (value != live[w]) {
+                    live[w] = value;
+                    changed = 1;
+                }
+            }
+        }
+    }
+    free(live_out);
+}
+
+void set_interference(frame_t *frame, unsigned a, unsigned b) {
+    unsigned count = frame->function->local_count;
+    frame->interferes[a * count + b] = 1;
+    frame->interferes[b * count + a] = 1;
+}
+
+/*
+Find which locals can't share a slot. Every local is stored to on entry,
+parameters with their arguments and the others with zero, so any local live
+on entry interferes with all the others. Then each store interferes with
+whatever is live after it, as well as with the other locals stored by the
+same instruction.
+*/
+void find_interference(frame_t *frame) {
+    unsigned count = frame->function->local_count;
+    if (frame->is_opaque) {
+        memset(frame->interferes, 1, count * count);
+        return;
+    }
+
+    for (unsigned a = 0; a < count; ++a) {
+        if (frame->count == 0 || !(frame->live[a / 32] & (1u << (a % 32)))) continue;
+        for (unsigned b = 0; b < count; ++b) {
+            if (a != b) set_interference(frame, a, b);
+        }
+    }
+
+    unsigned *live_out = malloc(frame->words * sizeof(unsigned));
+    for (unsigned i = 0; i < frame->count; ++i) {
+        unsigned *stores = &frame->stores[i * frame->words];
+        memset(live_out, 0, frame->words * sizeof(unsigned));
+        add_successors(frame, i, live_out);
+        for (unsigned a = 0; a < count; ++a) {
+            if (!(stores[a / 32] & (1u << (a % 32)))) continue;
+            for (unsigned b = 0; b < count; ++b) {
+                unsigned bit = 1u << (b % 32);
+                if (a != b && ((live_out[b / 32] | stores[b / 32]) & bit)) {
+                    set_interference(frame, a, b);
+                }
+            }
+        }
+    }
+    free(live_out);
+}
+
+/*
+Give each local the first slot of its size not used by a local it interferes
+with, then lay out the slots largest first so that each is aligned to its own
+size.
+*/
+void assign_slots(frame_t *frame) {
+    function_t *function = frame->function;
+    unsigned count = function->local_count;
+    unsigned *slots = calloc(sizeof(unsigned), count ? count : 1);
+    unsigned *kinds = calloc(sizeof(unsigned), count ? count : 1);
+    memset(function->frame_slots, 0, sizeof(function->frame_slots));
+
+    for (unsigned i = 0; i < count; ++i) {
+        /* a local that is never used needs no slot */
+        if (i >= function->parameter_count && frame->widths[i] == 0) {
+            kinds[i] = FRAME_SLOT_SIZES;
+            continue;
+        }
+        unsigned width = i < function->parameter_count ? 4 : frame->widths[i];
+        unsigned kind = 0;
+        while (slot_sizes[kind] != width) {
+            ++kind;
+        }
+        kinds[i] = kind;
+
+        unsigned slot = 0;
+        if (i < function->parameter_count) {
+            slot = i;
+        } else {
+            for (unsigned j = 0; j < i; ++j) {
+                if (kinds[j] == kind && slots[j] == slot && frame->interferes[i * count + j]) {
+                    /* taken; start over with the next slot */
+                    ++slot;
+                    j = (unsigned)-1;
+                }
+            }
+        }
+        slots[i] = slot;
+        if (slot >= function->frame_slots[kind]) {
+            function->frame_slots[kind] = slot + 1;
+        }
+    }
+
+    unsigned starts[FRAME_SLOT_SIZES];
+    unsigned size = 0;
+    unsigned format_entries = 0;
+    for (unsigned kind = 0; kind < FRAME_SLOT_SIZES; ++kind) {
+        starts[kind] = size;
+        size += function->frame_slots[kind] * slot_sizes[kind];
+        format_entries += (function->frame_slots[kind] + MAX_FORMAT_LOCALS - 1)
+                          / MAX_FORMAT_LOCALS;
+    }
+    for (unsigned i = 0; i < count; ++i) {
+        if (kinds[i] < FRAME_SLOT_SIZES) {
+            function->local_offsets[i] = starts[kinds[i]] + slots[i] * slot_sizes[kinds[i]];
+        }
+    }
+
+    /* the frame holds its length, the offset of the locals, the format of
+       the locals with its terminating pair and then the locals, each part
+       padded to four bytes */
+    unsigned format_length = format_entries * 2 + 2;
+    function->frame_size = 8 + ((format_length + 3) & ~3u) + ((size + 3) & ~3u);
+    free(slots);
+    free(kinds);
+}
+
+/*
+Lay out a function's locals in its call frame, setting the offset of each
+local, the number of slots of each size and the size of the frame.
+*/
+void layout_frame(function_t *function) {
+    unsigned count = function->local_count;
+    free(function->local_offsets);
+    function->local_offsets = calloc(sizeof(unsigned), count ? count : 1);
+
+    frame_t frame = {0};
+    frame.function = function;
+    if (function->code) {
+        gather_frame(&frame, function->code);
+    }
+    frame.words = (count + 31) / 32;
+    if (frame.words == 0) {
+        frame.words = 1;
+    }
+    unsigned set_size = (frame.count ? frame.count : 1) * frame.words;
+    frame.uses = calloc(sizeof(unsigned), set_size);
+    frame.stores = calloc(sizeof(unsigned), set_size);
+    frame.live = calloc(sizeof(unsigned), set_size);
+    frame.interferes = calloc(1, count ? count * count : 1);
+    frame.widths = calloc(sizeof(unsigned), count ? count : 1);
+
+    scan_statements(&frame);
+    find_liveness(&frame);
+    find_interference(&frame);
+    assign_slots(&frame);
+    free_frame(&frame);
+}
+
+/*
+Write the size of the call frame of each function assembled from source,
+with the number of locals it has and the slots they share.
+*/
+void print_frame_report(glulxfile_t *gamefile, FILE *out) {
+    fprintf(out, "Frame sizes:\n");
+    for (function_t *function = gamefile->functions; function; function = function->next) {
+        if (!function->code || !function->local_offsets) continue;
+        fprintf(out, "    %-20s %4u bytes, %u locals in", function->name,
+                function->frame_size, function->local_count);
+        for (unsigned kind = 0; kind < FRAME_SLOT_SIZES; ++kind) {
+            fprintf(out, " %u", function->frame_slots[kind]);
+        }
+        fprintf(out, " slots of 4/2/1 bytes\n");
+    }
+}
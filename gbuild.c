@@ -1,10 +1,16 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "gbuild.h"
 
+#define STORY_EXTENSION     ".ulx"
+#define BLORB_EXTENSION     ".gblorb"
+#define OBJECT_EXTENSION    ".gobj"
+#define MAP_EXTENSION       ".map"
+
 void dump_statement(int depth, statement_t *stmt);
-void dump_asmstmt(int depth, asmstmt_t *stmt);
+void dump_asmstmt(int depth, asmblock_t *asmb, asmstmt_t *stmt);
 void dump_asmblock(int depth, asmblock_t *asmb);
 void dump_codeblock(int depth, codeblock_t *code);
 void dump_function(function_t *function);
@@ -33,29 +39,48 @@ void dump_statement(int depth, statement_t *stmt) {
             printf("unknown statement type %d", stmt->type);
     }
 }
-void dump_asmstmt(int depth, asmstmt_t *stmt) {
+void dump_asmstmt(int depth, asmblock_t *asmb, asmstmt_t *stmt) {
     for (int i = 0; i < depth; ++i) printf("    ");
     switch(stmt->type) {
         case ASM_INSTRUCTION:
-            printf("ASM \"%s\"", stmt->data.inst->mnemonic);
-            for (int i = 0; i < stmt->data.inst->operand_count; ++i) {
+            printf("ASM \"%s\"", mnemonics[stmt->mnemonic].mnemonic);
+            for (int i = 0; i < stmt->operand_count; ++i) {
+                asmoperand_t *operand = get_asm_operand(asmb, stmt, i);
                 printf(" ");
-                if (stmt->data.inst->operands[i].is_indirect) {
+                if (operand->is_indirect) {
                     printf("*");
                 }
-                switch(stmt->data.inst->operands[i].type) {
+                switch(operand->type) {
                     case OP_INTEGER:
-                        printf("int(%d)", stmt->data.inst->operands[i].data.value);
+                        printf("int(%d)", operand->data.value);
+                        break;
+                    case OP_IDENTIFIER:
+                        printf("id(%s)", operand->data.name);
+                        break;
+                    case OP_STRING:
+                        printf("str(\"%s\")", operand->data.name);
+                        break;
+                    case OP_STACK:
+                        printf("sp");
                         break;
                     default:
-                        printf("[unknown operand type %d]", stmt->data.inst->operands[i].type);
+                        printf("[unknown operand type %d]", operand->type);
                 }
             }
             printf("\n");
             break;
         case ASM_LABEL:
-            printf("LBL \"%s\"\n", stmt->data.label->name);
+            printf("LBL \"%s\"\n", get_asm_operand(asmb, stmt, 0)->data.name);
             break;
+        case ASM_DATA: {
+            asmoperand_t *operand = get_asm_operand(asmb, stmt, 0);
+            if (operand->type == OP_INTEGER) {
+                printf("DATA int(%d)\n", operand->data.value);
+            } else {
+                printf("DATA id(%s)\n", operand->data.name);
+            }
+            break;
+        }
         default:
             printf("unknown statement type %d", stmt->type);
     }
@@ -64,17 +89,15 @@ void dump_asmblock(int depth, asmblock_t *asmb) {
     for (int i = 0; i < depth; ++i) printf("    ");
     printf("ASM BLOCK\n");
 
-    if (asmb->content == 0) {
+    if (asmb->count == 0) {
         ++depth;
         for (int i = 0; i < depth; ++i) printf("    ");
         printf("(no content)\n");
         return;
     }
 
-    asmstmt_t *stmt = asmb->content;
-    while (stmt) {
-        dump_asmstmt(depth+1,stmt);
-        stmt = stmt->next;
+    for (unsigned i = 0; i < asmb->count; ++i) {
+        dump_asmstmt(depth+1, asmb, &asmb->content[i]);
     }
 }
 void dump_codeblock(int depth, codeblock_t *code) {
@@ -97,7 +120,13 @@ void dump_codeblock(int depth, codeblock_t *code) {
 }
 void dump_function(function_t *function) {
     printf("FUNCTION %s\n", function->name);
-    dump_codeblock(1, function->code);
+    if (function->code) {
+        dump_codeblock(1, function->code);
+    } else if (function->source) {
+        printf("    (not parsed yet)\n");
+    } else {
+        printf("    (from object file)\n");
+    }
 }
 
 void dump_dictionary(symboltable_t *symbols) {
@@ -115,27 +144,161 @@ void dump_dictionary(symboltable_t *symbols) {
     }
 }
 
+/*
+Build the default output filename by replacing the extension of the input
+file with the one given. The caller is responsible for freeing the result.
+*/
+char* default_output_file(const char *input_file, const char *extension) {
+    const char *ext = strrchr(input_file, '.');
+    size_t base_length = ext ? (size_t)(ext - input_file) : strlen(input_file);
+    char *output_file = malloc(base_length + strlen(extension) + 1);
+    strncpy(output_file, input_file, base_length);
+    strcpy(&output_file[base_length], extension);
+    return output_file;
+}
+
+/*
+Returns true if a file named in a project is an object file to be linked in
+rather than source code.
+*/
+int is_object_file(const char *filename) {
+    const char *ext = strrchr(filename, '.');
+    return ext && strcmp(ext, OBJECT_EXTENSION) == 0;
+}
+
+/*
+Run a linked game in the built in interpreter, writing what it prints to
+standard output and how many instructions it executed to standard error.
+Returns non-zero if the game could not be run to its end.
+*/
+int run_game(glulxfile_t *gamefile) {
+    vm_t *vm = open_vm(gamefile->image.data, gamefile->image.size);
+    if (!vm) {
+        return 1;
+    }
+    int status = run_vm(vm, 0);
+    fwrite(vm->output.data, 1, vm->output.size, stdout);
+    print_vm_report(vm, gamefile, stderr);
+    if (status == VM_ERROR) {
+        fprintf(stderr, "VM: %s at $%X.\n", vm->error, vm->pc);
+    }
+    close_vm(vm);
+    return status != VM_QUIT;
+}
+
 int main(int argc, char *argv[]) {
 
     const char *project_file = "test.gproj";
-    project_t *project = open_project(project_file);
-    if (!project) {
-        fprintf(stderr, "FATAL: could not open project file \"%s\".\n",
-                project_file);
+    const char *output_file = 0;
+    const char *profile_file = 0;
+    unsigned thread_count = 1;
+    /* inlining changes the code built, so it is only done when asked for */
+    unsigned inline_limit = 0;
+    unsigned max_errors = DEFAULT_MAX_ERRORS;
+    int verbosity = 0;
+    int compile_only = 0;
+    int frames = 0;
+    int lazy_parse = 0;
+    int memory = 0;
+    int profile = 0;
+    int run = 0;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-c") == 0) {
+            compile_only = 1;
+        } else if (strcmp(argv[i], "-l") == 0) {
+            lazy_parse = 1;
+        } else if (strcmp(argv[i], "--frames") == 0) {
+            frames = 1;
+        } else if (strcmp(argv[i], "--memory") == 0) {
+            memory = 1;
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profile = 1;
+        } else if (strcmp(argv[i], "--run") == 0) {
+            run = 1;
+        } else if (strcmp(argv[i], "-v") == 0) {
+            ++verbosity;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output_file = argv[++i];
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            profile_file = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            thread_count = strtoul(argv[++i], 0, 10);
+        } else if (strcmp(argv[i], "--inline") == 0) {
+            inline_limit = DEFAULT_INLINE_LIMIT;
+        } else if (strcmp(argv[i], "--inline-limit") == 0 && i + 1 < argc) {
+            inline_limit = strtoul(argv[++i], 0, 10);
+        } else if (strcmp(argv[i], "--max-errors") == 0 && i + 1 < argc) {
+            max_errors = strtoul(argv[++i], 0, 10);
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "usage: %s [-l] [--profile] [--run] [-o output-file] [-j threads] [-p profile]\n"
+                            "       %*s [--inline] [--inline-limit instructions] [--frames] [--memory]\n"
+                            "       %*s [-v] [--max-errors count] [project-file]\n"
+                            "       %s -c [-l] [-o object-file] [-j threads] [--inline]\n"
+                            "       %*s [--inline-limit instructions] [--frames] [-v] [--max-errors count]\n"
+                            "       %*s source-file\n",
+                    argv[0], (int)strlen(argv[0]), "", (int)strlen(argv[0]), "",
+                    argv[0], (int)strlen(argv[0]), "", (int)strlen(argv[0]), "");
+            return 1;
+        } else {
+            project_file = argv[i];
+        }
+    }
+
+    set_diagnostic_options(verbosity, max_errors);
+
+    if (compile_only && profile) {
+        fprintf(stderr, "FATAL: --profile cannot be used when compiling an object file.\n");
         return 1;
     }
 
+    /* when compiling an object, the file named is a single source file */
+    project_t *project = 0;
+    if (!compile_only) {
+        project = open_project(project_file);
+        if (!project) {
+            fprintf(stderr, "FATAL: could not open project file \"%s\".\n",
+                    project_file);
+            return 1;
+        }
+    }
+
+    int has_errors = 0;
     glulxfile_t *gamefile = calloc(sizeof(glulxfile_t), 1);
     gamefile->global_symbols = calloc(sizeof(symboltable_t), 1);
-    for (int i = 0; project->files[i]; ++i) {
-        tokenlist_t *list = lex_file(gamefile, project->files[i]);
-        if (list) {
-            parse_file(gamefile, list);
-            free_tokens(list);
+    gamefile->lazy_parse = lazy_parse;
+    if (compile_only) {
+        has_errors = read_source(gamefile, project_file, thread_count);
+    } else {
+        for (int i = 0; project->files[i]; ++i) {
+            if (is_object_file(project->files[i])) {
+                has_errors |= load_object(gamefile, project->files[i]);
+            } else {
+                has_errors |= read_source(gamefile, project->files[i], thread_count);
+            }
         }
     }
     index_dictionary(gamefile->global_symbols);
 
+    /* an object must keep every function, since any may be used by another
+       object; a story only needs the functions its start function reaches */
+    if (!has_errors && lazy_parse && !compile_only) {
+        has_errors = remove_unreachable(gamefile);
+    }
+    /* everything that will be parsed has been, other than the bodies of a
+       lazily parsed object */
+    flush_diagnostics(stderr);
+    /* a limit of zero turns inlining off; functions only called from where
+       they were inlined are unreachable afterwards */
+    if (!has_errors && inline_limit > 0) {
+        inline_functions(gamefile, inline_limit);
+        if (lazy_parse && !compile_only) {
+            has_errors = remove_unreachable(gamefile);
+        }
+    }
+    if (!has_errors && profile) {
+        has_errors = declare_profile(gamefile);
+    }
+
 /*
     if (!list->first) {
         printf("no tokens found\n");
@@ -156,6 +319,9 @@ int main(int argc, char *argv[]) {
 */
 
     dump_symbols(0, gamefile->global_symbols);
+    if (gamefile->constants) {
+        dump_symbols(0, gamefile->constants);
+    }
     function_t *func = gamefile->functions;
     while (func) {
         dump_function(func);
@@ -163,7 +329,59 @@ int main(int argc, char *argv[]) {
     }
     dump_dictionary(gamefile->global_symbols);
 
+    if (!has_errors && compile_only) {
+        has_errors = declare_imports(gamefile);
+    }
+    if (!has_errors) {
+        has_errors = assemble_game(gamefile, thread_count);
+    }
+    if (!has_errors && frames) {
+        print_frame_report(gamefile, stdout);
+    }
+    if (!has_errors && compile_only) {
+        char *default_file = default_output_file(project_file, OBJECT_EXTENSION);
+        has_errors = write_object(gamefile, output_file ? output_file : default_file);
+        free(default_file);
+    } else if (!has_errors) {
+        if (profile_file) {
+            has_errors = order_functions(gamefile, profile_file);
+        }
+        if (!has_errors && profile) {
+            has_errors = add_profile_functions(gamefile);
+        }
+        if (!has_errors) {
+            has_errors = link_game(gamefile);
+        }
+        if (!has_errors && memory) {
+            print_memory_report(gamefile, stdout);
+        }
+        if (!has_errors) {
+            /* a project with pictures or sounds is packaged as a Blorb file */
+            char *default_file = default_output_file(project_file, project->resources
+                                                     ? BLORB_EXTENSION : STORY_EXTENSION);
+            const char *story_file = output_file ? output_file : default_file;
+            if (project->resources) {
+                has_errors = write_blorb(gamefile, project, story_file);
+            } else {
+                has_errors = write_game(gamefile, story_file);
+            }
+            if (!has_errors && profile) {
+                char *map_file = default_output_file(story_file, MAP_EXTENSION);
+                has_errors = write_profile_map(gamefile, map_file);
+                free(map_file);
+            }
+            free(default_file);
+        }
+        if (!has_errors && run) {
+            has_errors = run_game(gamefile);
+        }
+    }
+
+    flush_diagnostics(stderr);
+    clear_diagnostics();
     free_gamefile(gamefile);
-    free_project(project);
-    return 0;
+    if (project) {
+        free_project(project);
+    }
+    return has_errors ? 1 : 0;
 }
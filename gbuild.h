@@ -1,9 +1,27 @@
 #ifndef GBUILD_H
 #define GBUILD_H
 
+#include <stdio.h>
+
 /* maximum number of source files that a project can contain */
 #define MAX_PROJECT_FILES  16
 
+/* number of tokens the parser can look ahead of the current one */
+#define LEXER_LOOKAHEAD    4
+/* smallest part of a string lexed by a thread of its own, and the most
+   threads lex_string uses */
+#define LEX_CHUNK_SIZE     (1 << 20)
+#define DEFAULT_LEX_THREADS 4
+
+/* severities of the diagnostics reported while reading the source; traces
+   of what the parser is doing are only kept at a raised verbosity */
+#define DIAG_TRACE         0
+#define DIAG_WARNING       1
+#define DIAG_ERROR         2
+#define DIAG_SEVERITY_COUNT 3
+/* errors kept for display before the rest are only counted */
+#define DEFAULT_MAX_ERRORS 50
+
 /* mnemonic is a jump opcode using a relative code position */
 #define MNE_RELJUMP        0x01
 /* mnemonic is a floating point operation */
@@ -12,9 +30,51 @@
 #define MNE_MALLOC         0x04
 /* mnemonic memory resize opcode */
 #define MNE_RESIZE         0x08
+/* mnemonic calls the function given by its first operand */
+#define MNE_CALL           0x10
+/* mnemonic ends the game */
+#define MNE_QUIT           0x20
+/* mnemonic depends on the call frame it runs in, on stack values it did not
+   push itself or on absolute code addresses, so it cannot be inlined */
+#define MNE_FRAME          0x40
 
 #define SYMBOL_TABLE_BUCKETS    16
 
+/* number of sizes a local can have in the call frame: four, two and one */
+#define FRAME_SLOT_SIZES        3
+/* most locals of one size that one entry of a function's format can give */
+#define MAX_FORMAT_LOCALS       255
+
+/* parameters of the FNV-1a hash used for identifiers */
+#define FNV_OFFSET_BASIS        0x811c9dc5
+#define FNV_PRIME               16777619
+
+/* size of the glulx header at the start of the story file */
+#define GLULX_HEADER_SIZE       36
+/* default size of the glulx stack, in bytes */
+#define DEFAULT_STACK_SIZE      4096
+/* largest number of instructions in a function that may be inlined when
+   inlining is turned on with --inline */
+#define DEFAULT_INLINE_LIMIT    8
+/* name of the function execution begins at */
+#define START_FUNCTION          "main"
+
+/* names of the symbols added to games built for profiling */
+#define PROFILE_COUNTERS        "__profile_counters"
+#define PROFILE_DUMP            "__profile_dump"
+#define PROFILE_START           "__profile_start"
+/* prefix of each line written by the profile dump function */
+#define PROFILE_DUMP_PREFIX     "@profile "
+
+/* name of the symbol giving the address of the dictionary table */
+#define DICTIONARY_TABLE        "__dictionary"
+/* characters of a word kept in its dictionary entry; longer words are
+   known by their first DICT_RESOLUTION characters */
+#define DICT_RESOLUTION         9
+/* fewest entries for which the dictionary is given an index by first
+   character */
+#define DICT_INDEX_MIN          32
+
 #define MAX_OPERANDS       8
 
 #define OP_NONE            0
@@ -42,7 +102,9 @@ enum tokentype_t {
     CLOSE_BRACE,
     COMMA,
     SEMICOLON,
-    COLON
+    COLON,
+    OPERATOR,
+    TOKEN_TYPE_COUNT
 };
 
 enum statement_type_t {
@@ -54,12 +116,46 @@ enum statement_type_t {
 enum asm_statement_type_t {
     ASM_UNKNOWN,
     ASM_INSTRUCTION,
-    ASM_LABEL
+    ASM_LABEL,
+    /* a word holding the value of its single operand, placed in the code;
+       only made by the code generator */
+    ASM_DATA
 };
 
 enum symbol_type_t {
     SYM_FUNCTION,
-    SYM_LABEL
+    SYM_LABEL,
+    SYM_STRING,
+    SYM_CONSTANT,
+    /* a function defined in another object; resolved when linking */
+    SYM_IMPORT,
+    /* a local variable of a function; its value is its offset in the frame */
+    SYM_LOCAL,
+    /* a word of memory holding a global variable; its value is the initial
+       value of the variable */
+    SYM_GLOBAL,
+    /* an object, whose address is that of its property table */
+    SYM_OBJECT,
+    /* a property of objects, named with a leading dot; its position is its
+       number, given when the game is linked */
+    SYM_PROPERTY,
+    /* a word of the dictionary, named with a leading backtick, or the
+       dictionary itself; its position is the address of its entry */
+    SYM_DICT_WORD
+};
+
+enum relocation_type_t {
+    RELOC_ABSOLUTE,
+    RELOC_BRANCH
+};
+
+enum counter_type_t {
+    /* counts calls of the function */
+    COUNTER_CALL,
+    /* counts the times a label used as a branch target was reached */
+    COUNTER_BRANCH,
+    /* counts the calls from the function to another */
+    COUNTER_EDGE
 };
 
 typedef struct DICT_WORD {
@@ -71,12 +167,20 @@ typedef struct DICT_WORD {
 
 typedef struct SYMBOL_INFO {
     char *name;
+    unsigned hash;
     int type;
     union {
         int value;
         struct FUNCTION_DEF *func;
     } data;
+    /* address of the symbol in the story file; set during layout */
     unsigned position;
+    /* set for a global that code stores to or takes the address of, which
+       must be placed in RAM */
+    int is_written;
+    /* set for a label that a branch jumps to, which is given a counter when
+       the game is profiled */
+    int is_branch_target;
 
     struct SYMBOL_INFO *next;
 } symbol_t;
@@ -88,6 +192,37 @@ typedef struct SYMBOL_TABLE {
     struct SYMBOL_TABLE *parent;
 } symboltable_t;
 
+/*
+A growable buffer of bytes holding encoded code or data.
+*/
+typedef struct CODE_BUFFER {
+    unsigned char *data;
+    unsigned size;
+    unsigned capacity;
+} codebuf_t;
+
+/*
+A reference to a symbol from within encoded code. The offset is the position
+of the four byte field to patch; relative to the start of the function while
+assembling and relative to the start of the story file after layout. The
+addend is added to the symbol's address.
+*/
+typedef struct RELOCATION {
+    unsigned offset;
+    int type;
+    symbol_t *symbol;
+    unsigned addend;
+} relocation_t;
+
+/*
+Stores a list of relocations, kept in order of offset.
+*/
+typedef struct RELOCATION_TABLE {
+    relocation_t *entries;
+    unsigned count;
+    unsigned capacity;
+} reloctable_t;
+
 /*
 Stores information about a single assembly mnemonic.
 */
@@ -95,9 +230,26 @@ typedef struct ASM_MNEMONIC {
     const char *mnemonic;
     int opcode;
     int operands;
+    /* bit n is set if operand n is stored to rather than loaded */
+    int stores;
     int flags;
 } mnemonic_t;
 
+/* how a resource packaged with the story is used */
+#define RESOURCE_PICTURE   0
+#define RESOURCE_SOUND     1
+
+/*
+A picture or sound named in a project, to be packaged with the story in a
+Blorb file.
+*/
+typedef struct RESOURCE {
+    int usage;
+    unsigned number;
+    char *filename;
+    struct RESOURCE *next;
+} resource_t;
+
 /*
 Stores information about a project.
 */
@@ -106,6 +258,8 @@ typedef struct PROJECT {
     unsigned int switches;
     unsigned int file_count;
     char *files[MAX_PROJECT_FILES];
+    /* resources in the order the project names them */
+    resource_t *resources;
 } project_t;
 
 /*
@@ -117,6 +271,17 @@ typedef struct LEXER_TOKEN {
     int line_no;
     int col_no;
 
+    /* position of the token's first character in the text being lexed and
+       the number of characters it covers */
+    unsigned offset;
+    unsigned length;
+    /* hash of the text of identifiers and reserved words */
+    unsigned hash;
+    /* number of a reserved word; see grammar.h */
+    int keyword;
+    /* set for the decimal literal 2147483648, which only fits once negated */
+    int negate_only;
+
     union {
         char *text;
         int integer;
@@ -132,11 +297,41 @@ Stores a list of lexer tokens.
 typedef struct TOKEN_LIST {
     lexertoken_t *first;
     lexertoken_t *last;
+    /* non-zero if errors were found lexing the tokens; the tokens that could
+       be read are still kept */
+    int has_errors;
 } tokenlist_t;
 
+/*
+An edit to a text whose tokens are being lexed again; see relex_tokens.
+*/
+typedef struct TEXT_EDIT {
+    /* where the edit is in the whole text and how many characters it
+       removed and inserted */
+    size_t start;
+    size_t removed;
+    size_t inserted;
+    /* the position in the text the offsets and lines of the tokens are
+       relative to */
+    size_t base_offset;
+    int base_line;
+    /* set to the part of the new text whose tokens were replaced, relative
+       to the base, and the number of tokens lexed or moved */
+    size_t damage_start;
+    size_t damage_end;
+    unsigned touched;
+} textedit_t;
+
+/*
+A lexer that produces tokens on demand; see lexer.c.
+*/
+typedef struct LEXER lexer_t;
+
 typedef struct ASM_OPERAND {
-    int type;
-    int is_indirect;
+    unsigned char type;
+    unsigned char is_indirect;
+    /* hash of the name of identifier operands */
+    unsigned hash;
     union {
         int value;
         char *name;
@@ -144,41 +339,88 @@ typedef struct ASM_OPERAND {
 } asmoperand_t;
 
 /*
-Stores an assembly statement
+Stores a single assembly statement, either an instruction or a label. The
+operands of every statement in a block are stored together in the block's
+operand array; a label has a single identifier operand holding its name.
 */
-typedef struct ASM_INSTRUCTION {
-    char *mnemonic;
+typedef struct ASM_STATEMENT {
+    unsigned char type;
+    unsigned char operand_count;
+    unsigned short mnemonic;
+    unsigned first_operand;
+} asmstmt_t;
 
-    int operand_count;
-    asmoperand_t operands[MAX_OPERANDS];
-} asminst_t;
+/*
+Store a block of assembly statements and their operands
+*/
+typedef struct ASMBLOCK_DEF {
+    asmstmt_t *content;
+    unsigned count;
+    unsigned capacity;
+
+    asmoperand_t *operands;
+    unsigned operand_count;
+    unsigned operand_capacity;
+} asmblock_t;
 
 /*
-Stores a assembly label
+A value of a switch statement and the label of the code for it.
 */
-typedef struct ASM_LABEL {
-    char *name;
-} asmlabel_t;
+typedef struct SWITCH_CASE {
+    int value;
+    const char *label;
+} switchcase_t;
+
+enum expression_type_t {
+    /* a value given by a single operand: a constant, a name or the stack */
+    EXPR_OPERAND,
+    EXPR_UNARY,
+    EXPR_BINARY,
+    EXPR_ASSIGN,
+    EXPR_CALL,
+    EXPR_PROPERTY
+};
 
 /*
-Store an assembly statement and a pointrr to the next statement in this block
+An expression in a function's code, kept only until it has been compiled.
+Unary operators use only the left side. An assignment stores the value on
+the right into the name or property on the left. A call has its function on
+the left and its first argument on the right, with each argument linked to
+the next. A property has its object on the left and the name of the
+property's symbol as its value.
 */
-typedef struct ASM_STATEMENT {
+typedef struct EXPRESSION_DEF {
     int type;
-    union {
-        asminst_t *inst;
-        asmlabel_t *label;
-    } data;
+    char op[3];
+    asmoperand_t value;
+    /* position of the expression's operator in its source file, which keeps
+       the labels made for it apart from those of other expressions */
+    unsigned offset;
 
-    struct ASM_STATEMENT *next;
-} asmstmt_t;
+    struct EXPRESSION_DEF *left;
+    struct EXPRESSION_DEF *right;
+    struct EXPRESSION_DEF *next;
+} expression_t;
 
 /*
-Store a block of assembly opcodes
+A property given to an object and its value, which is either an integer or
+the name of a symbol or string whose address is the value.
 */
-typedef struct ASMBLOCK_DEF {
-    asmstmt_t *content;
-} asmblock_t;
+typedef struct OBJECT_PROPERTY {
+    symbol_t *property;
+    asmoperand_t value;
+} objproperty_t;
+
+/*
+An object and its properties in the order they were given.
+*/
+typedef struct OBJECT_DEF {
+    char *name;
+    objproperty_t *properties;
+    unsigned property_count;
+
+    struct OBJECT_DEF *next;
+} object_t;
 
 /*
 Stores a block of code
@@ -202,12 +444,67 @@ typedef struct STATEMENT_DEF {
     struct STATEMENT_DEF *next;
 } statement_t;
 
+/*
+The text of a source file, kept while the game is built so that function
+bodies can be parsed after the rest of the file.
+*/
+typedef struct SOURCE_FILE {
+    char *filename;
+    char *text;
+    size_t length;
+
+    struct SOURCE_FILE *next;
+} sourcefile_t;
+
+/*
+A counter added to a function by a profiling build. Name is the label for a
+branch counter and the function called for an edge counter.
+*/
+typedef struct PROFILE_COUNTER {
+    int type;
+    const char *name;
+} profcounter_t;
+
 /*
 Store a function definition and associated code block.
 */
 typedef struct FUNCTION_DEF {
     char *name;
     codeblock_t *code;
+    symboltable_t *locals;
+
+    /* where the body is in its source file, from the opening brace to just
+       past the closing one; source is only set while the body is waiting to
+       be parsed */
+    sourcefile_t *source;
+    unsigned body_start;
+    unsigned body_end;
+    int body_line;
+    int body_col;
+    int is_reachable;
+    /* set by the noinline keyword to keep the function from being inlined */
+    int no_inline;
+    /* names of the function's local variables, its parameters first */
+    char **local_names;
+    unsigned local_count;
+    unsigned parameter_count;
+    /* set by layout_frame: the offset of each local in the call frame, the
+       number of slots of four, two and one bytes that the locals share and
+       the size of the whole frame in bytes */
+    unsigned *local_offsets;
+    unsigned frame_slots[FRAME_SLOT_SIZES];
+    unsigned frame_size;
+
+    codebuf_t output;
+    reloctable_t relocations;
+    unsigned position;
+
+    /* profiling counters, numbered from first_counter once the functions
+       are in their final order */
+    profcounter_t *counters;
+    unsigned counter_count;
+    unsigned counter_capacity;
+    unsigned first_counter;
 
     struct FUNCTION_DEF *prev;
     struct FUNCTION_DEF *next;
@@ -217,41 +514,286 @@ typedef struct FUNCTION_DEF {
 Keep track of all data and content that makes up the content of a glulx game file.
 */
 typedef struct GLULXFILE {
-    void *constants;
+    symboltable_t *constants;
     function_t *functions;
     symboltable_t *global_symbols;
+    symboltable_t *strings;
     void *globals;
-    void *objects;
+    object_t *objects;
+
+    codebuf_t image;
+    reloctable_t relocations;
+    unsigned ram_start;
+    unsigned end_mem;
+
+    /* when set, function bodies are only parsed when they are needed */
+    int lazy_parse;
+    sourcefile_t *sources;
+
+    /* when set, functions are instrumented with counters */
+    int profile;
+    symbol_t *profile_counters;
+    symbol_t *profile_dump;
+    unsigned counter_count;
 } glulxfile_t;
 
+/*
+The reasons a game running in the vm can stop.
+*/
+enum vm_status_t {
+    VM_RUNNING,
+    VM_QUIT,
+    VM_ERROR,
+    /* the instruction limit given to run_vm was reached */
+    VM_LIMIT
+};
+
+/*
+How often a function of a game running in the vm was called and how many
+instructions were executed in it, not counting those of the functions it
+called.
+*/
+typedef struct VM_FUNCTION {
+    unsigned address;
+    unsigned long calls;
+    unsigned long instructions;
+} vmfunction_t;
+
+/*
+A call frame on the vm's stack and the function it is running.
+*/
+typedef struct VM_FRAME {
+    unsigned frame_ptr;
+    vmfunction_t *function;
+} vmframe_t;
+
+/*
+A glulx interpreter for running built games in tests; see vm.c. Text written
+through glk is collected in output. The counts of each instruction executed
+are kept by mnemonic in opcode_counts.
+*/
+typedef struct VM_STATE {
+    unsigned char *image;
+    unsigned image_size;
+    unsigned char *memory;
+    unsigned mem_size;
+    unsigned ram_start;
+    unsigned ext_start;
+    unsigned end_mem;
+    unsigned start_func;
+
+    unsigned char *stack;
+    unsigned stack_size;
+    unsigned sp;
+    unsigned fp;
+    unsigned locals;
+    unsigned values;
+    unsigned pc;
+
+    int status;
+    char error[128];
+    unsigned iosys;
+    unsigned iosys_rock;
+    unsigned string_table;
+    unsigned random_state;
+    codebuf_t output;
+
+    unsigned long instruction_count;
+    unsigned long *opcode_counts;
+    vmfunction_t *functions;
+    unsigned function_count;
+    unsigned function_capacity;
+    vmframe_t *frames;
+    unsigned frame_count;
+    unsigned frame_capacity;
+} vm_t;
+
+/*
+A part of the text of a document, running from the end of the previous
+function's body to the end of the body of its own function. The last part has
+no function and holds the rest of the text. The offsets and lines of the
+tokens in a part are relative to where it begins, so an edit only moves the
+tokens of the part it falls in; columns are kept as they are.
+*/
+typedef struct DOCUMENT_PART {
+    function_t *function;
+    /* the part's tokens, which are null if it has none */
+    lexertoken_t *first;
+    lexertoken_t *last;
+    size_t length;
+    /* where the function's body is, from its opening brace to just past its
+       closing brace */
+    size_t body_start;
+    size_t body_end;
+} docpart_t;
+
+/*
+A source file held open for editing along with its tokens and the functions
+and constants parsed from them. Edits relex and reparse as little of the file
+as they can; see document.c.
+*/
+typedef struct DOCUMENT {
+    char *filename;
+    /* the text is held in a buffer with a gap of gap_size characters at
+       gap_start, which edits fill or widen */
+    char *text;
+    size_t length;
+    size_t gap_start;
+    size_t gap_size;
+    tokenlist_t *tokens;
+    glulxfile_t *gamefile;
+
+    /* parts of the text in source order, and Fenwick trees over their
+       lengths and lines from which where each begins is found */
+    docpart_t *parts;
+    unsigned part_count;
+    size_t *part_offsets;
+    int *part_lines;
+    /* number of tokens lexed or moved by the last edit */
+    unsigned tokens_touched;
+    /* non-zero if errors were found the last time the document changed */
+    int has_errors;
+} document_t;
+
+void set_diagnostic_options(int verbosity, unsigned max_errors);
+void report_diagnostic(int severity, const char *code, const char *filename,
+                       int line, int column, const char *format, ...);
+unsigned diagnostic_count(int severity);
+void flush_diagnostics(FILE *out);
+void clear_diagnostics(void);
+
 project_t* open_project(const char *project_file);
 void free_project(project_t *project);
 
 tokenlist_t* lex_file(glulxfile_t *gamefile, const char *filename);
 tokenlist_t* lex_string(glulxfile_t *gamefile, const char *filename, const char *text, size_t length);
+tokenlist_t* lex_string_threads(glulxfile_t *gamefile, const char *filename, const char *text,
+                                size_t length, unsigned thread_count);
 tokenlist_t* merge_tokens(tokenlist_t *first, tokenlist_t *second);
 void free_tokens(tokenlist_t *tokens);
 
-int parse_file(glulxfile_t *gamedata, tokenlist_t *tokens);
+lexer_t* open_lexer_file(glulxfile_t *gamefile, const char *filename);
+lexer_t* open_lexer_file_threads(glulxfile_t *gamefile, const char *filename,
+                                 unsigned thread_count);
+lexer_t* open_lexer_string(glulxfile_t *gamefile, const char *filename, const char *text, size_t length);
+lexer_t* open_lexer_range(glulxfile_t *gamefile, const char *filename, const char *text,
+                          size_t start, size_t end, int line, int column);
+lexer_t* open_lexer_tokens(lexertoken_t *first, lexertoken_t *last);
+sourcefile_t* lexer_source(lexer_t *lexer);
+int relex_tokens(tokenlist_t *tokens, lexertoken_t *start, lexertoken_t *limit,
+                 const char *filename, const char *text, size_t length, textedit_t *edit);
+lexertoken_t* token_before(lexertoken_t *first, lexertoken_t *last, size_t offset);
+lexertoken_t* lexer_token(lexer_t *lexer, unsigned offset);
+void lexer_advance(lexer_t *lexer);
+size_t lexer_offset(const lexer_t *lexer);
+int lexer_consumed_type(const lexer_t *lexer);
+int lexer_has_errors(const lexer_t *lexer);
+void close_lexer(lexer_t *lexer);
+
+size_t find_invalid_utf8(const char *text, size_t length);
+unsigned decode_utf8(const char **text);
+int encode_utf8(unsigned code_point, char *out);
+unsigned utf8_to_latin1(const char *text, char *out);
+
+int parse_file(glulxfile_t *gamedata, lexer_t *lexer);
+int read_source(glulxfile_t *gamedata, const char *filename, unsigned thread_count);
+int parse_function_body(glulxfile_t *gamedata, function_t *function);
+codeblock_t* parse_codeblock(glulxfile_t *gamedata, lexer_t *lexer, function_t *function);
+
+document_t* open_document(const char *filename, const char *text, size_t length);
+int edit_document(document_t *document, size_t offset, size_t removed,
+                  const char *inserted, size_t inserted_length);
+lexertoken_t* find_document_token(document_t *document, size_t offset, int *line);
+void close_document(document_t *document);
+
+void add_switch_dispatch(asmblock_t *block, asmoperand_t *value, switchcase_t *cases,
+                         unsigned count, const char *default_label, const char *prefix);
+void add_instruction(asmblock_t *block, const char *mnemonic);
+void add_label(asmblock_t *block, const char *name);
+void add_integer_operand(asmblock_t *block, int value);
+void add_stack_operand(asmblock_t *block);
+void add_name_operand(asmblock_t *block, const char *name);
+void add_operand_copy(asmblock_t *block, asmoperand_t *operand);
+void add_expression(asmblock_t *block, expression_t *expr, asmoperand_t *dest);
+void add_condition(asmblock_t *block, expression_t *expr, int when, const char *label);
+void add_return(asmblock_t *block, expression_t *expr);
+
+int assemble_function(glulxfile_t *gamefile, function_t *function);
+int assemble_game(glulxfile_t *gamefile, unsigned thread_count);
+int declare_imports(glulxfile_t *gamefile);
+int remove_unreachable(glulxfile_t *gamefile);
+void codebuf_add_byte(codebuf_t *buffer, int value);
+void codebuf_add_word(codebuf_t *buffer, unsigned value);
+void codebuf_set_word(codebuf_t *buffer, unsigned offset, unsigned value);
+void add_relocation(reloctable_t *table, unsigned offset, int type, symbol_t *symbol);
+void add_relocation_addend(reloctable_t *table, unsigned offset, int type, symbol_t *symbol,
+                           unsigned addend);
+int declare_profile(glulxfile_t *gamefile);
+int add_profile_functions(glulxfile_t *gamefile);
+
+void inline_functions(glulxfile_t *gamefile, unsigned limit);
+
+void layout_frame(function_t *function);
+void print_frame_report(glulxfile_t *gamefile, FILE *out);
+
+int order_functions(glulxfile_t *gamefile, const char *profile_file);
+int write_profile_map(glulxfile_t *gamefile, const char *filename);
+
+void find_written_globals(glulxfile_t *gamefile);
+int link_game(glulxfile_t *gamefile);
+void print_memory_report(glulxfile_t *gamefile, FILE *out);
+int write_game(glulxfile_t *gamefile, const char *filename);
+
+int write_blorb(glulxfile_t *gamefile, project_t *project, const char *filename);
+
+int write_object(glulxfile_t *gamefile, const char *filename);
+
+vm_t* open_vm(const unsigned char *image, unsigned size);
+int run_vm(vm_t *vm, unsigned long max_instructions);
+vmfunction_t* vm_function(vm_t *vm, unsigned address);
+void print_vm_report(vm_t *vm, glulxfile_t *gamefile, FILE *out);
+void close_vm(vm_t *vm);
+int load_object(glulxfile_t *gamefile, const char *filename);
+
+extern mnemonic_t mnemonics[];
 
 char *strdup (const char *source_string);
 int is_reserved_word(const char *word);
+int is_reserved_word_length(const char *word, unsigned length);
 mnemonic_t* get_mnemonic(const char *name);
+int get_mnemonic_index(const char *name);
+int get_mnemonic_index_hashed(const char *name, unsigned hash);
+
+asmstmt_t* add_asm_statement(asmblock_t *block, int type, int mnemonic);
+asmoperand_t* add_asm_operand(asmblock_t *block);
+asmoperand_t* get_asm_operand(asmblock_t *block, asmstmt_t *stmt, int index);
 
 void add_dictionary_word(symboltable_t *table, const char *word);
 void index_dictionary(symboltable_t *symbols);
+char* dictionary_symbol_name(const char *word);
 
 unsigned hash_string(const char *text);
 int add_symbol(symboltable_t *table, symbol_t *symbol);
+int add_symbol_hashed(symboltable_t *table, symbol_t *symbol, unsigned hash);
 symbol_t* get_symbol(symboltable_t *table, const char *symbol);
+symbol_t* get_symbol_hashed(symboltable_t *table, const char *symbol, unsigned hash);
+symbol_t* lookup_symbol(symboltable_t *table, const char *symbol);
+symbol_t* lookup_symbol_hashed(symboltable_t *table, const char *symbol, unsigned hash);
+symbol_t* define_function(glulxfile_t *gamefile, function_t *function);
+symbol_t* add_string(glulxfile_t *gamefile, const char *text);
+int find_local(function_t *function, const char *name);
+unsigned add_local(function_t *function, const char *name);
+void clear_locals(function_t *function);
 
 void free_symbol_table(symboltable_t *table);
 void free_gamefile(glulxfile_t *what);
+void free_sourcefile(sourcefile_t *what);
 void free_function(function_t *what);
 void free_codeblock(codeblock_t *what);
 void free_asmblock(asmblock_t *what);
-void free_asmstmt(asmstmt_t *what);
-void free_asmlabel(asmlabel_t *what);
-void free_asminst(asminst_t *what);
+void free_expression(expression_t *what);
+void free_object(object_t *what);
+void free_codebuf(codebuf_t *what);
+void free_reloctable(reloctable_t *what);
 
 #endif
@@ -0,0 +1,43 @@
+/* generated from language.bnf by bnfgen; do not edit */
+#include "grammar.h"
+
+const char *const keyword_names[KEYWORD_COUNT] = {
+    0,
+    "asm",
+    "case",
+    "constant",
+    "default",
+    "else",
+    "function",
+    "global",
+    "if",
+    "local",
+    "noinline",
+    "object",
+    "return",
+    "switch",
+    "while",
+};
+
+const unsigned char top_def_table[TERMINAL_COUNT] = {
+    [TERMINAL_KEYWORD + KW_FUNCTION] = TOP_DEF_FUNCTION_DEF,
+    [TERMINAL_KEYWORD + KW_CONSTANT] = TOP_DEF_CONSTANT_DEF,
+    [TERMINAL_KEYWORD + KW_GLOBAL] = TOP_DEF_GLOBAL_DEF,
+    [TERMINAL_KEYWORD + KW_OBJECT] = TOP_DEF_OBJECT_DEF,
+};
+
+const unsigned char statement_table[TERMINAL_COUNT] = {
+    [OPEN_BRACE] = STATEMENT_CODE_BLOCK,
+    [TERMINAL_KEYWORD + KW_ASM] = STATEMENT_ASM_BLOCK,
+    [TERMINAL_KEYWORD + KW_SWITCH] = STATEMENT_SWITCH,
+    [TERMINAL_KEYWORD + KW_IF] = STATEMENT_IF,
+    [TERMINAL_KEYWORD + KW_WHILE] = STATEMENT_WHILE,
+    [TERMINAL_KEYWORD + KW_LOCAL] = STATEMENT_LOCAL,
+    [TERMINAL_KEYWORD + KW_RETURN] = STATEMENT_RETURN,
+    [IDENTIFIER] = STATEMENT_CODE_EXPR,
+    [OPERATOR] = STATEMENT_CODE_EXPR,
+    [STRING] = STATEMENT_CODE_EXPR,
+    [DICT_WORD] = STATEMENT_CODE_EXPR,
+    [INTEGER] = STATEMENT_CODE_EXPR,
+    [OPEN_PARAN] = STATEMENT_CODE_EXPR,
+};
@@ -0,0 +1,56 @@
+/* generated from language.bnf by bnfgen; do not edit */
+#ifndef GRAMMAR_H
+#define GRAMMAR_H
+
+#include "gbuild.h"
+
+enum keyword_t {
+    KW_NONE,
+    KW_ASM,
+    KW_CASE,
+    KW_CONSTANT,
+    KW_DEFAULT,
+    KW_ELSE,
+    KW_FUNCTION,
+    KW_GLOBAL,
+    KW_IF,
+    KW_LOCAL,
+    KW_NOINLINE,
+    KW_OBJECT,
+    KW_RETURN,
+    KW_SWITCH,
+    KW_WHILE,
+    KEYWORD_COUNT
+};
+
+/* columns of the tables: the token types, then reserved words */
+#define TERMINAL_KEYWORD   TOKEN_TYPE_COUNT
+#define TERMINAL_COUNT     (TERMINAL_KEYWORD + KEYWORD_COUNT)
+
+extern const char *const keyword_names[KEYWORD_COUNT];
+
+/* alternatives of <top-def> */
+enum {
+    TOP_DEF_NONE,
+    TOP_DEF_FUNCTION_DEF,
+    TOP_DEF_CONSTANT_DEF,
+    TOP_DEF_GLOBAL_DEF,
+    TOP_DEF_OBJECT_DEF
+};
+extern const unsigned char top_def_table[TERMINAL_COUNT];
+
+/* alternatives of <statement> */
+enum {
+    STATEMENT_NONE,
+    STATEMENT_CODE_BLOCK,
+    STATEMENT_ASM_BLOCK,
+    STATEMENT_SWITCH,
+    STATEMENT_IF,
+    STATEMENT_WHILE,
+    STATEMENT_LOCAL,
+    STATEMENT_RETURN,
+    STATEMENT_CODE_EXPR
+};
+extern const unsigned char statement_table[TERMINAL_COUNT];
+
+#endif
@@ -0,0 +1,563 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gbuild.h"
+
+/*
+Small leaf functions, those that make no calls of their own, are copied into
+the functions that call them in place of the call. Functions are visited
+callees first, so a function whose calls have all been inlined becomes a leaf
+that can be inlined in turn. Recursive functions never become leaves.
+
+The copied statements run in the caller's frame, so a function is only
+inlined if it leaves the stack as it found it and does nothing else that
+depends on its own frame; see check_inline. Its parameters and locals become
+new locals of the caller, given the arguments or zero before the copy runs.
+Other names in the copy are looked up in the caller, so nothing is inlined
+where one of them would name a local of the caller instead.
+*/
+
+/* how far the inliner has got with a function */
+enum inline_state_t {
+    INLINE_UNVISITED,
+    INLINE_VISITING,
+    INLINE_DONE
+};
+
+/*
+The statements of a function's body in order, gathered from all of its
+blocks, along with the block holding each one.
+*/
+typedef struct INLINE_BODY {
+    function_t *function;
+    asmblock_t **blocks;
+    asmstmt_t **statements;
+    unsigned count;
+    unsigned capacity;
+} inlinebody_t;
+
+/*
+The state of inlining a game's functions. Functions are numbered by their
+place in the game's function list.
+*/
+typedef struct INLINER {
+    glulxfile_t *gamefile;
+    unsigned limit;
+    int *state;
+    int *can_inline;
+    inlinebody_t *bodies;
+} inliner_t;
+
+void gather_body(inlinebody_t *body, codeblock_t *code);
+void free_body(inlinebody_t *body);
+int find_label(inlinebody_t *body, asmoperand_t *name);
+int uses_locals_of(inlinebody_t *body, function_t *caller);
+int stack_reach(asmblock_t *block, asmstmt_t *stmt);
+int check_inline(inliner_t *inliner, function_t *function, inlinebody_t *body);
+function_t* called_function(inliner_t *inliner, inlinebody_t *caller, asmblock_t *block,
+                            asmstmt_t *stmt);
+function_t* inlinable_call(inliner_t *inliner, inlinebody_t *caller, asmblock_t *block,
+                           asmstmt_t *stmt);
+void visit_function(inliner_t *inliner, function_t *function);
+void visit_callees(inliner_t *inliner, inlinebody_t *caller);
+asmblock_t* inline_block(inliner_t *inliner, inlinebody_t *caller, asmblock_t *block,
+                         unsigned *site);
+char* inline_name(const char *function, unsigned site, const char *name);
+void copy_operand(asmblock_t *to, asmoperand_t *from, inlinebody_t *body,
+                  const char *function, unsigned site);
+void copy_statement(asmblock_t *to, asmblock_t *from, asmstmt_t *stmt, inlinebody_t *body,
+                    const char *function, unsigned site);
+void add_discard(asmblock_t *to, asmoperand_t *value);
+void add_local_store(asmblock_t *to, asmoperand_t *value, function_t *caller,
+                     function_t *callee, unsigned site, unsigned local);
+void expand_call(inliner_t *inliner, function_t *caller, asmblock_t *to, asmblock_t *from,
+                 asmstmt_t *call, function_t *callee, unsigned site);
+
+
+void gather_body(inlinebody_t *body, codeblock_t *code) {
+    for (statement_t *stmt = code->content; stmt; stmt = stmt->next) {
+        if (stmt->type == STMT_BLOCK) {
+            gather_body(body, stmt->data.code);
+        } else if (stmt->type == STMT_ASM) {
+            asmblock_t *block = stmt->data.asm;
+            for (unsigned i = 0; i < block->count; ++i) {
+                if (body->count >= body->capacity) {
+                    body->capacity = body->capacity ? body->capacity * 2 : 16;
+                    body->blocks = realloc(body->blocks,
+                                           body->capacity * sizeof(asmblock_t*));
+                    body->statements = realloc(body->statements,
+                                               body->capacity * sizeof(asmstmt_t*));
+                }
+                body->blocks[body->count] = block;
+                body->statements[body->count] = &block->content[i];
+                ++body->count;
+            }
+        }
+    }
+}
+
+void free_body(inlinebody_t *body) {
+    free(body->blocks);
+    free(body->statements);
+    body->blocks = 0;
+    body->statements = 0;
+    body->count = body->capacity = 0;
+}
+
+/*
+Returns the place in a body of the label an identifier names, or -1 if it
+does not name one of the body's labels.
+*/
+int find_label(inlinebody_t *body, asmoperand_t *name) {
+    for (unsigned i = 0; i < body->count; ++i) {
+        if (body->statements[i]->type != ASM_LABEL) continue;
+        asmoperand_t *label = get_asm_operand(body->blocks[i], body->statements[i], 0);
+        if (label->hash == name->hash && strcmp(label->data.name, name->data.name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+Returns true if any name used by a body other than its own labels and locals
+is the name of one of a function's locals.
+*/
+int uses_locals_of(inlinebody_t *body, function_t *caller) {
+    if (caller->local_count == 0) {
+        return 0;
+    }
+    for (unsigned i = 0; i < body->count; ++i) {
+        asmstmt_t *stmt = body->statements[i];
+        if (stmt->type != ASM_INSTRUCTION) continue;
+        for (int j = 0; j < stmt->operand_count; ++j) {
+            asmoperand_t *operand = get_asm_operand(body->blocks[i], stmt, j);
+            if (operand->type == OP_IDENTIFIER && find_label(body, operand) < 0
+                    && find_local(body->function, operand->data.name) < 0
+                    && find_local(caller, operand->data.name) >= 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/*
+Returns how many values from the top of the stack an instruction that works
+on the stack itself reads, or -1 if it is not one that can be inlined. Only
+swaps, and copies and peeks of a constant number of values, are allowed; the
+copy may use them if the function pushed that many itself.
+*/
+int stack_reach(asmblock_t *block, asmstmt_t *stmt) {
+    if (stmt->mnemonic == get_mnemonic_index("stkswap")) {
+        return 2;
+    }
+    int is_copy = stmt->mnemonic == get_mnemonic_index("stkcopy");
+    if (!is_copy && stmt->mnemonic != get_mnemonic_index("stkpeek")) {
+        return -1;
+    }
+    asmoperand_t *count = get_asm_operand(block, stmt, 0);
+    if (count->type != OP_INTEGER || count->is_indirect || count->data.value < 0) {
+        return -1;
+    }
+    return is_copy ? count->data.value : count->data.value + 1;
+}
+
+/*
+Returns true if a function can be copied into its callers. It must be small
+enough, make no calls and use no instruction that depends on its frame,
+other than those that only reach values it pushed itself; see stack_reach. Each
+of its branches must go to one of its own labels, and the stack must be
+empty at every return and the same depth each way a label can be reached,
+so that the copy neither reads nor leaves behind any of the caller's stack.
+Code that cannot be reached must be preceded by a label already jumped to,
+and the body must not run off its end.
+*/
+int check_inline(inliner_t *inliner, function_t *function, inlinebody_t *body) {
+    if (!function->code || function->no_inline) {
+        return 0;
+    }
+    unsigned instructions = 0;
+    for (unsigned i = 0; i < body->count; ++i) {
+        if (body->statements[i]->type == ASM_INSTRUCTION) {
+            ++instructions;
+        }
+    }
+    if (instructions > inliner->limit) {
+        return 0;
+    }
+
+    int *depths = malloc((body->count ? body->count : 1) * sizeof(int));
+    for (unsigned i = 0; i < body->count; ++i) {
+        depths[i] = -1;
+    }
+    int depth = 0;
+    int reachable = 1;
+    int ok = 1;
+    for (unsigned i = 0; ok && i < body->count; ++i) {
+        asmblock_t *block = body->blocks[i];
+        asmstmt_t *stmt = body->statements[i];
+        if (stmt->type == ASM_LABEL) {
+            if (reachable && depths[i] >= 0) {
+                ok = depths[i] == depth;
+            } else if (reachable) {
+                depths[i] = depth;
+            } else {
+                ok = depths[i] >= 0;
+                depth = depths[i];
+                reachable = 1;
+            }
+            continue;
+        }
+
+        mnemonic_t *mnemonic = &mnemonics[stmt->mnemonic];
+        if (!reachable || stmt->type != ASM_INSTRUCTION || stmt->operand_count != mnemonic->operands
+                || (mnemonic->flags & MNE_CALL)) {
+            ok = 0;
+            break;
+        }
+        if (mnemonic->flags & MNE_FRAME) {
+            int reach = stack_reach(block, stmt);
+            if (reach < 0 || reach > depth) {
+                ok = 0;
+                break;
+            }
+            if (stmt->mnemonic == get_mnemonic_index("stkcopy")) {
+                depth += reach;
+            }
+        }
+        for (int j = 0; j < stmt->operand_count; ++j) {
+            if (!(mnemonic->stores & (1 << j))
+                    && get_asm_operand(block, stmt, j)->type == OP_STACK && --depth < 0) {
+                ok = 0;
+            }
+        }
+        for (int j = 0; j < stmt->operand_count; ++j) {
+            if ((mnemonic->stores & (1 << j))
+                    && get_asm_operand(block, stmt, j)->type == OP_STACK) {
+                ++depth;
+            }
+        }
+
+        if (mnemonic->flags & MNE_RELJUMP) {
+            asmoperand_t *target = get_asm_operand(block, stmt, stmt->operand_count - 1);
+            int label = target->type == OP_IDENTIFIER && !target->is_indirect
+                      ? find_label(body, target) : -1;
+            if (label < 0 || (depths[label] >= 0 && depths[label] != depth)) {
+                ok = 0;
+            } else {
+                depths[label] = depth;
+            }
+            reachable = stmt->mnemonic != get_mnemonic_index("jump");
+        } else if (stmt->mnemonic == get_mnemonic_index("return")) {
+            ok &= depth == 0;
+            reachable = 0;
+        }
+    }
+    free(depths);
+    return ok && !reachable;
+}
+
+/*
+Returns the function called by a statement, or null if it is not a call of a
+function of this game. A name that is also one of the caller's labels refers
+to the label.
+*/
+function_t* called_function(inliner_t *inliner, inlinebody_t *caller, asmblock_t *block,
+                            asmstmt_t *stmt) {
+    if (stmt->type != ASM_INSTRUCTION || stmt->operand_count == 0
+            || !(mnemonics[stmt->mnemonic].flags & MNE_CALL)) {
+        return 0;
+    }
+    asmoperand_t *target = get_asm_operand(block, stmt, 0);
+    if (target->type != OP_IDENTIFIER || target->is_indirect
+            || find_label(caller, target) >= 0
+            || find_local(caller->function, target->data.name) >= 0) {
+        return 0;
+    }
+    symbol_t *symbol = get_symbol_hashed(inliner->gamefile->global_symbols,
+                                         target->data.name, target->hash);
+    if (!symbol || symbol->type != SYM_FUNCTION) {
+        return 0;
+    }
+    return symbol->data.func;
+}
+
+/*
+Returns the function called by a statement if the call can be replaced by a
+copy of it, or null otherwise. Calls taking their arguments from the stack
+are only replaced if the number of arguments is known.
+*/
+function_t* inlinable_call(inliner_t *inliner, inlinebody_t *caller, asmblock_t *block,
+                           asmstmt_t *stmt) {
+    function_t *callee = called_function(inliner, caller, block, stmt);
+    if (!callee || inliner->state[callee->position] != INLINE_DONE
+            || !inliner->can_inline[callee->position]
+            || stmt->operand_count != mnemonics[stmt->mnemonic].operands
+            || uses_locals_of(&inliner->bodies[callee->position], caller->function)) {
+        return 0;
+    }
+    if (stmt->mnemonic == get_mnemonic_index("call")
+            || stmt->mnemonic == get_mnemonic_index("tailcall")) {
+        asmoperand_t *count = get_asm_operand(block, stmt, 1);
+        if (count->type != OP_INTEGER || count->is_indirect || count->data.value < 0) {
+            return 0;
+        }
+    }
+    return callee;
+}
+
+/*
+Inline calls into a function, after first doing so for every function it
+calls, then decide whether the function itself can be inlined.
+*/
+void visit_function(inliner_t *inliner, function_t *function) {
+    unsigned index = function->position;
+    inliner->state[index] = INLINE_VISITING;
+    if (function->code) {
+        inlinebody_t *body = &inliner->bodies[index];
+        body->function = function;
+        gather_body(body, function->code);
+        visit_callees(inliner, body);
+
+        /* the body points into the blocks, so the rebuilt blocks only
+           replace them once every block is done */
+        asmblock_t **rebuilt = calloc(sizeof(asmblock_t*), body->count + 1);
+        unsigned site = 0;
+        for (unsigned i = 0; i < body->count; ++i) {
+            if (i == 0 || body->blocks[i] != body->blocks[i - 1]) {
+                rebuilt[i] = inline_block(inliner, body, body->blocks[i], &site);
+            }
+        }
+        for (unsigned i = 0; i < body->count; ++i) {
+            if (rebuilt[i]) {
+                asmblock_t old = *body->blocks[i];
+                *body->blocks[i] = *rebuilt[i];
+                *rebuilt[i] = old;
+                free_asmblock(rebuilt[i]);
+            }
+        }
+        free(rebuilt);
+        free_body(body);
+        gather_body(body, function->code);
+        inliner->can_inline[index] = check_inline(inliner, function, body);
+    }
+    inliner->state[index] = INLINE_DONE;
+}
+
+void visit_callees(inliner_t *inliner, inlinebody_t *caller) {
+    for (unsigned i = 0; i < caller->count; ++i) {
+        function_t *callee = called_function(inliner, caller, caller->blocks[i],
+                                             caller->statements[i]);
+        if (callee && inliner->state[callee->position] == INLINE_UNVISITED) {
+            visit_function(inliner, callee);
+        }
+    }
+}
+
+/*
+Build a copy of an assembly block with its calls of inlinable functions
+replaced by copies of those functions. Returns null if the block has no such
+calls.
+*/
+asmblock_t* inline_block(inliner_t *inliner, inlinebody_t *caller, asmblock_t *block,
+                         unsigned *site) {
+    unsigned i = 0;
+    while (i < block->count && !inlinable_call(inliner, caller, block, &block->content[i])) {
+        ++i;
+    }
+    if (i == block->count) {
+        return 0;
+    }
+
+    asmblock_t *rebuilt = calloc(sizeof(asmblock_t), 1);
+    for (i = 0; i < block->count; ++i) {
+        asmstmt_t *stmt = &block->content[i];
+        function_t *callee = inlinable_call(inliner, caller, block, stmt);
+        if (callee) {
+            expand_call(inliner, caller->function, rebuilt, block, stmt, callee, ++*site);
+        } else {
+            copy_statement(rebuilt, block, stmt, 0, 0, 0);
+        }
+    }
+    return rebuilt;
+}
+
+/*
+Build the name given to a label or local of an inlined function. Names from
+source can never contain $, so these cannot clash with them. The caller is
+responsible for freeing the result.
+*/
+char* inline_name(const char *function, unsigned site, const char *name) {
+    char *result = malloc(strlen(function) + strlen(name) + 16);
+    sprintf(result, "%s$%u$%s", function, site, name);
+    return result;
+}
+
+/*
+Copy an operand to the end of a block. If a body is given, names of the
+body's labels and locals are replaced by the names given to them when
+inlined.
+*/
+void copy_operand(asmblock_t *to, asmoperand_t *from, inlinebody_t *body,
+                  const char *function, unsigned site) {
+    asmoperand_t *operand = add_asm_operand(to);
+    *operand = *from;
+    if (from->type == OP_IDENTIFIER && body && (find_label(body, from) >= 0
+                || find_local(body->function, from->data.name) >= 0)) {
+        operand->data.name = inline_name(function, site, from->data.name);
+        operand->hash = hash_string(operand->data.name);
+    } else if (from->type == OP_IDENTIFIER || from->type == OP_STRING) {
+        operand->data.name = strdup(from->data.name);
+    }
+}
+
+void copy_statement(asmblock_t *to, asmblock_t *from, asmstmt_t *stmt, inlinebody_t *body,
+                    const char *function, unsigned site) {
+    add_asm_statement(to, stmt->type, stmt->mnemonic);
+    for (int i = 0; i < stmt->operand_count; ++i) {
+        copy_operand(to, get_asm_operand(from, stmt, i), body, function, site);
+    }
+}
+
+/*
+Add an instruction that loads a value and throws it away, for values that
+must still be popped from the stack.
+*/
+void add_discard(asmblock_t *to, asmoperand_t *value) {
+    add_asm_statement(to, ASM_INSTRUCTION, get_mnemonic_index("copy"));
+    copy_operand(to, value, 0, 0, 0);
+    add_asm_operand(to)->type = OP_INTEGER;
+}
+
+/*
+Add an instruction that stores a value in the caller's copy of one of an
+inlined function's locals, adding the local to the caller.
+*/
+void add_local_store(asmblock_t *to, asmoperand_t *value, function_t *caller,
+                     function_t *callee, unsigned site, unsigned local) {
+    asmoperand_t name = { OP_IDENTIFIER, 0, 0, { 0 } };
+    name.data.name = inline_name(callee->name, site, callee->local_names[local]);
+    name.hash = hash_string(name.data.name);
+    add_local(caller, name.data.name);
+    add_asm_statement(to, ASM_INSTRUCTION, get_mnemonic_index("copy"));
+    copy_operand(to, value, 0, 0, 0);
+    copy_operand(to, &name, 0, 0, 0);
+    free(name.data.name);
+}
+
+/*
+Add a copy of a function to a block in place of a call to it. The function's
+parameters and locals are given new locals of the caller, the parameters
+taking the arguments and the rest zero as a call would give them; arguments
+past the parameters are popped and thrown away. Each return stores its value
+where the call would have and jumps past the end of the copy. A tail call
+keeps its returns, which return from the caller as the call would have.
+*/
+void expand_call(inliner_t *inliner, function_t *caller, asmblock_t *to, asmblock_t *from,
+                 asmstmt_t *call, function_t *callee, unsigned site) {
+    int is_tail = call->mnemonic == get_mnemonic_index("tailcall");
+    asmoperand_t stack = { OP_STACK, 0, 0, { 0 } };
+    asmoperand_t zero = { OP_INTEGER, 0, 0, { 0 } };
+    unsigned arguments = 0;
+    if (is_tail || call->mnemonic == get_mnemonic_index("call")) {
+        /* the first argument is on top of the stack */
+        arguments = get_asm_operand(from, call, 1)->data.value;
+        for (unsigned i = 0; i < arguments; ++i) {
+            if (i < callee->parameter_count) {
+                add_local_store(to, &stack, caller, callee, site, i);
+            } else {
+                add_discard(to, &stack);
+            }
+        }
+    } else {
+        arguments = call->operand_count - 2;
+        for (unsigned i = 0; i < arguments; ++i) {
+            asmoperand_t *argument = get_asm_operand(from, call, i + 1);
+            if (i < callee->parameter_count) {
+                add_local_store(to, argument, caller, callee, site, i);
+            } else if (argument->type == OP_STACK) {
+                add_discard(to, &stack);
+            }
+        }
+    }
+    if (arguments > callee->parameter_count) {
+        arguments = callee->parameter_count;
+    }
+    for (unsigned i = arguments; i < callee->local_count; ++i) {
+        add_local_store(to, &zero, caller, callee, site, i);
+    }
+
+    inlinebody_t *body = &inliner->bodies[callee->position];
+    asmoperand_t *store = is_tail ? 0 : get_asm_operand(from, call, call->operand_count - 1);
+    int discard = store && store->type == OP_INTEGER && !store->is_indirect
+                        && store->data.value == 0;
+    asmoperand_t end = { OP_IDENTIFIER, 0, 0, { 0 } };
+    end.data.name = inline_name(callee->name, site, "");
+    end.hash = hash_string(end.data.name);
+    int jumps_to_end = 0;
+
+    for (unsigned i = 0; i < body->count; ++i) {
+        asmstmt_t *stmt = body->statements[i];
+        if (is_tail || stmt->type != ASM_INSTRUCTION
+                || stmt->mnemonic != get_mnemonic_index("return")) {
+            copy_statement(to, body->blocks[i], stmt, body, callee->name, site);
+            continue;
+        }
+
+        asmoperand_t *value = get_asm_operand(body->blocks[i], stmt, 0);
+        if (!discard || value->type == OP_STACK) {
+            add_asm_statement(to, ASM_INSTRUCTION, get_mnemonic_index("copy"));
+            copy_operand(to, value, body, callee->name, site);
+            copy_operand(to, store, 0, 0, 0);
+        }
+        if (i + 1 < body->count) {
+            add_asm_statement(to, ASM_INSTRUCTION, get_mnemonic_index("jump"));
+            copy_operand(to, &end, 0, 0, 0);
+            jumps_to_end = 1;
+        }
+    }
+
+    if (jumps_to_end) {
+        add_asm_statement(to, ASM_LABEL, 0);
+        copy_operand(to, &end, 0, 0, 0);
+    }
+    free(end.data.name);
+}
+
+/*
+Inline calls of functions of at most limit instructions throughout the game.
+Functions that are inlined everywhere are kept, since their addresses may
+still be used; removing unreachable functions afterwards drops them.
+*/
+void inline_functions(glulxfile_t *gamefile, unsigned limit) {
+    /* number the functions by using their position, which is not set until
+       they are laid out */
+    unsigned count = 0;
+    for (function_t *func = gamefile->functions; func; func = func->next) {
+        func->position = count++;
+    }
+    if (count == 0) {
+        return;
+    }
+
+    inliner_t inliner;
+    inliner.gamefile = gamefile;
+    inliner.limit = limit;
+    inliner.state = calloc(sizeof(int), count);
+    inliner.can_inline = calloc(sizeof(int), count);
+    inliner.bodies = calloc(sizeof(inlinebody_t), count);
+    for (function_t *func = gamefile->functions; func; func = func->next) {
+        if (inliner.state[func->position] == INLINE_UNVISITED) {
+            visit_function(&inliner, func);
+        }
+    }
+
+    for (unsigned i = 0; i < count; ++i) {
+        free_body(&inliner.bodies[i]);
+    }
+    free(inliner.bodies);
+    free(inliner.can_inline);
+    free(inliner.state);
+}
@@ -1,4 +1,5 @@
 #include <ctype.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -15,51 +16,125 @@ typedef struct LEXER_STATE {
     int has_errors;
 } lexerstate_t;
 
-void show_lexer_error(const char *filename, int line, int column, const char *error, ...);
-int escape_hex_number(const char *filename, int line, int column, char *text, int length);
+/*
+A lexer producing tokens on demand. Tokens not yet consumed are kept in a
+small ring buffer; consumed tokens are kept on a free list for reuse.
+*/
+struct LEXER {
+    glulxfile_t *gamefile;
+    char *filename;
+    char *owned_text;
+    sourcefile_t *source;
+    lexerstate_t state;
+    /* position in the text of the token being read; tokens are only begun
+       before stop, though the last may run on past it */
+    size_t token_start;
+    size_t stop;
+    /* non-zero if the lexer may have begun inside a token or comment, so
+       its errors are not to be reported */
+    int speculative;
+
+    lexertoken_t *lookahead[LEXER_LOOKAHEAD];
+    unsigned head;
+    unsigned count;
+    lexertoken_t *free_tokens;
+    /* position just past the last token consumed, and its type */
+    size_t consumed_end;
+    int consumed_type;
+
+    /* for a lexer reading from an existing token list, the next token to
+       return and the last one in the range, and the list itself if the
+       lexer is to free it */
+    int from_list;
+    lexertoken_t *list_next;
+    lexertoken_t *list_last;
+    tokenlist_t *owned_tokens;
+};
+
+/*
+Part of a text lexed by a thread of its own. Each part after the first begins
+at the start of a line, but that may be inside a comment or string, so its
+tokens are only used from the first one that the lexer reading the text
+before it also begins a token at.
+*/
+typedef struct LEX_CHUNK {
+    lexer_t *lexer;
+    size_t start;
+    size_t end;
+    /* lines the part covers, from which the line the next part begins on is
+       found */
+    size_t newlines;
+    tokenlist_t *tokens;
+} lexchunk_t;
+
+void show_lexer_error(lexer_t *lexer, int line, int column, const char *error, ...);
+int escape_hex_number(lexer_t *lexer, int line, int column, char *text, int length);
 void shift_string(char *text);
-int handle_string_escapes(const char *filename, int line, int column, char *text);
+char* replace_escape(char *text, int length, unsigned code_point);
+int handle_string_escapes(lexer_t *lexer, int line, int column, char *text);
 void add_token(tokenlist_t *tokens, lexertoken_t *token);
 int here(const lexerstate_t *state);
 int peek(const lexerstate_t *state);
-int is_identifier(char what, int first_char);
+int is_identifier(int what, int first_char);
+int is_space(int what);
+int is_double_operator(char first, char second);
 void next(lexerstate_t *state);
+void check_utf8(lexer_t *lexer, size_t start, size_t end);
 lexertoken_t* new_token(int type, const char *filename, int lineNo, int colNo);
+lexertoken_t* new_lexer_token(lexer_t *lexer, int type, int line_no, int col_no);
+lexer_t* new_text_lexer(const char *filename, const char *text, size_t start, size_t end,
+                        int line, int column);
+void* lex_chunk(void *data);
+void take_chunk_tokens(tokenlist_t *tokens, lexchunk_t *chunk, lexertoken_t *first,
+                       size_t line);
+lexertoken_t* read_token(lexer_t *lexer);
+lexertoken_t* scan_token(lexer_t *lexer);
+int has_token_text(const lexertoken_t *token);
+unsigned shift_tokens(lexertoken_t *token, lexertoken_t *last, long delta, int old_line, int line,
+                      int column_delta);
+void free_token(lexertoken_t *token);
 int prev(const lexerstate_t *state);
+char* read_text_file(const char *filename, size_t *length);
 
 
 #define ERROR_BUFFER_SIZE 256
-void show_lexer_error(const char *filename, int line, int column, const char *error, ...) {
+/*
+Report an error found in the text to the diagnostics buffer. The lexer
+carries on past an error, so one build reports every error in a file. A
+lexer reading part of a text speculatively reports nothing, since it may
+have begun in the wrong place.
+*/
+void show_lexer_error(lexer_t *lexer, int line, int column, const char *error, ...) {
+    if (lexer->speculative) {
+        return;
+    }
     char error_buffer[ERROR_BUFFER_SIZE];
 
     va_list args;
     va_start(args, error);
-    int result = vsnprintf(error_buffer, ERROR_BUFFER_SIZE, error, args);
+    vsnprintf(error_buffer, ERROR_BUFFER_SIZE, error, args);
     va_end(args);
 
-    fprintf(stderr, "%s:%d:%d: lexer-error: %s\n", filename, line, column, error_buffer);
-    if (result >= ERROR_BUFFER_SIZE || result < 0) {
-        fprintf(stderr, "ERROR: problem occured while displaying error message.\n");
-    }
+    report_diagnostic(DIAG_ERROR, "lexer", lexer->filename, line, column, "%s", error_buffer);
 }
 
 
-int escape_hex_number(const char *filename, int line, int column, char *text, int length) {
+int escape_hex_number(lexer_t *lexer, int line, int column, char *text, int length) {
     int found_error = 0;
     int number = 0;
 
     for (int i = 0; i < length && text[i] != 0; ++i) {
-        if (!isxdigit(text[i])) {
+        if (!isxdigit((unsigned char)text[i])) {
             found_error = 1;
-            show_lexer_error(filename, line, column,
+            show_lexer_error(lexer, line, column,
                                 "string escape \\x00 contains invalid hex digit %c (%d)",
                                 text[i], text[i]);
         }
         number *= 16;
-        if (isdigit(text[i])) {
+        if (isdigit((unsigned char)text[i])) {
             number += text[i] - '0';
         } else {
-            number += tolower(text[i]) - 'a' + 10;
+            number += tolower((unsigned char)text[i]) - 'a' + 10;
         }
     }
 
@@ -72,7 +147,24 @@ void shift_string(char *text) {
         ++cur;
     }
 }
-int handle_string_escapes(const char *filename, int line, int column, char *text) {
+/*
+Replace an escape of length characters with the UTF-8 encoding of the
+character it gives, which is never longer than the escape. Returns the last
+byte of the encoding.
+*/
+char* replace_escape(char *text, int length, unsigned code_point) {
+    char encoded[4];
+    int size = encode_utf8(code_point, encoded);
+    memmove(&text[size], &text[length], strlen(&text[length]) + 1);
+    memcpy(text, encoded, size);
+    return &text[size - 1];
+}
+/*
+Replace the escapes in a string with the characters they give. \xNN gives
+the character NN, as in Latin-1, and \uNNNN gives any character of the basic
+multilingual plane; both are stored in UTF-8 like the rest of the text.
+*/
+int handle_string_escapes(lexer_t *lexer, int line, int column, char *text) {
     int errors_occured = 0;
     int value;
 
@@ -82,20 +174,21 @@ int handle_string_escapes(const char *filename, int line, int column, char *text
             char escape_char = *(pos+1);
             switch(escape_char) {
                 case 0:
-                    errors_occured = 1;
-                    show_lexer_error(filename, line, column, "unexpected end of string");
-                    break;
-                    case 'x':
-                    shift_string(pos);
-                    shift_string(pos);
-                    value = escape_hex_number(filename, line, column, pos, 2);
-                    if (value < 0) {
-                        errors_occured = 1;
-                    } else {
-                        shift_string(pos);
-                        *pos = value;
+                    show_lexer_error(lexer, line, column, "unexpected end of string");
+                    return 0;
+                case 'x':
+                case 'u': {
+                    int digits = escape_char == 'x' ? 2 : 4;
+                    value = escape_hex_number(lexer, line, column, pos + 2, digits);
+                    if (value < 0 || strlen(pos + 2) < (size_t)digits) {
+                        if (value >= 0) {
+                            show_lexer_error(lexer, line, column, "unexpected end of string");
+                        }
+                        return 0;
                     }
+                    pos = replace_escape(pos, digits + 2, value);
                     break;
+                }
                 case 'n':
                     shift_string(pos);
                     *pos = '\n';
@@ -111,7 +204,7 @@ int handle_string_escapes(const char *filename, int line, int column, char *text
                     break;
                 default:
                     errors_occured = 1;
-                    show_lexer_error(filename, line, column, "unknown string escape: \\%c", escape_char);
+                    show_lexer_error(lexer, line, column, "unknown string escape: \\%c", escape_char);
             }
         }
         ++pos;
@@ -125,58 +218,57 @@ int handle_string_escapes(const char *filename, int line, int column, char *text
 Convert the contents of a file into a series of tokens and add them to the global token list.
 */
 tokenlist_t* lex_file(glulxfile_t *gamefile, const char *filename) {
-    FILE *fp = fopen(filename, "rt");
-    if (!fp) {
-        fprintf(stderr, "Could not open file \"%s\"\n", filename);
+    lexer_t *lexer = open_lexer_file(gamefile, filename);
+    if (!lexer) {
         return 0;
     }
 
-    fseek(fp, 0, SEEK_END);
-    long int readsize = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
-    char *filedata = malloc(readsize + 1);
-    fread(filedata, readsize, 1, fp);
-    filedata[readsize] = 0;
+    tokenlist_t *tokens = calloc(sizeof(tokenlist_t), 1);
+    lexertoken_t *token;
+    while ((token = read_token(lexer)) != 0) {
+        add_token(tokens, token);
+    }
 
-    tokenlist_t *result = lex_string(gamefile, filename, filedata, readsize);
-    free(filedata);
-    return result;
+    tokens->has_errors = lexer->state.has_errors;
+    close_lexer(lexer);
+    return tokens;
 }
 
 
 /*
-Return the previous character, or 0 if we're at the start of the string.
+Return the previous byte, or 0 if we're at the start of the string.
 */
 int prev(const lexerstate_t *state) {
     if (state->pos > 0) {
-        return state->text[state->pos-1];
+        return (unsigned char)state->text[state->pos-1];
     } else {
         return 0;
     }
 }
 /*
-Return the current character, or 0 if we're at the end of the string.
+Return the current byte, or 0 if we're at the end of the string.
 */
 int here(const lexerstate_t *state) {
     if (state->pos < state->length) {
-        return state->text[state->pos];
+        return (unsigned char)state->text[state->pos];
     } else {
         return 0;
     }
 }
 /*
-Return the next character, or 0 if it would be at or past the end of the string.
+Return the next byte, or 0 if it would be at or past the end of the string.
 */
 int peek(const lexerstate_t *state) {
     if (1 + state->pos < state->length) {
-        return state->text[1 + state->pos];
+        return (unsigned char)state->text[1 + state->pos];
     } else {
         return 0;
     }
 }
 /*
-Advance our position in the string by one and update the line and column numbers appropriately.
+Advance our position in the string by one byte and update the line and column
+numbers appropriately. Columns count characters, so the continuation bytes
+of a UTF-8 sequence don't move to the next column.
 */
 void next(lexerstate_t *state) {
     if (state->pos < state->length) {
@@ -185,230 +277,763 @@ void next(lexerstate_t *state) {
             ++state->line;
         }
         ++state->pos;
-        ++state->column;
+        if ((here(state) & 0xC0) != 0x80) {
+            ++state->column;
+        }
     }
 }
 
 /*
-Convert a string into a sequence of tokens and add them to the global token list.
+Read the next token from the text and record how much of the text it covers.
+Returns null at the end of the text.
 */
-tokenlist_t* lex_string(glulxfile_t *gamefile, const char *filename, const char *text, size_t length) {
-    lexerstate_t state;
-    state.text = text;
-    state.length = length;
-    state.line = 1;
-    state.column = 1;
-    state.pos = 0;
-    state.has_errors = 0;
-
-    tokenlist_t *tokens = calloc(sizeof(tokenlist_t), 1);
+lexertoken_t* read_token(lexer_t *lexer) {
+    lexertoken_t *token = scan_token(lexer);
+    if (token) {
+        token->length = lexer->state.pos - token->offset;
+    }
+    return token;
+}
 
-    while (state.pos < state.length) {
-        if (isspace(here(&state))) {
-            while (isspace(here(&state))) {
-                next(&state);
+/*
+Scan forward from the current position to the next token and return it,
+skipping whitespace and comments. Returns null at the end of the text.
+*/
+lexertoken_t* scan_token(lexer_t *lexer) {
+    lexerstate_t *state = &lexer->state;
+    while (state->pos < lexer->stop) {
+        lexer->token_start = state->pos;
+        if (is_space(here(state))) {
+            while (is_space(here(state))) {
+                next(state);
             }
-        } else if (here(&state) == ',') {
-            add_token(tokens, new_token(COMMA, filename, state.line, state.column));
-            next(&state);
-        } else if (here(&state) == ';') {
-            add_token(tokens, new_token(SEMICOLON, filename, state.line, state.column));
-            next(&state);
-        } else if (here(&state) == ':') {
-            add_token(tokens, new_token(COLON, filename, state.line, state.column));
-            next(&state);
-        } else if (here(&state) == '(') {
-            add_token(tokens, new_token(OPEN_PARAN, filename, state.line, state.column));
-            next(&state);
-        } else if (here(&state) == ')') {
-            add_token(tokens, new_token(CLOSE_PARAN, filename, state.line, state.column));
-            next(&state);
-        } else if (here(&state) == '{') {
-            add_token(tokens, new_token(OPEN_BRACE, filename, state.line, state.column));
-            next(&state);
-        } else if (here(&state) == '}') {
-            add_token(tokens, new_token(CLOSE_BRACE, filename, state.line, state.column));
-            next(&state);
-        } else if (here(&state) == '/' && peek(&state) == '/') {
-            while (here(&state) != '\n' && here(&state) != 0) {
-                next(&state);
+        } else if (here(state) == ',') {
+            lexertoken_t *token = new_lexer_token(lexer, COMMA, state->line, state->column);
+            next(state);
+            return token;
+        } else if (here(state) == ';') {
+            lexertoken_t *token = new_lexer_token(lexer, SEMICOLON, state->line, state->column);
+            next(state);
+            return token;
+        } else if (here(state) == ':') {
+            lexertoken_t *token = new_lexer_token(lexer, COLON, state->line, state->column);
+            next(state);
+            return token;
+        } else if (here(state) == '(') {
+            lexertoken_t *token = new_lexer_token(lexer, OPEN_PARAN, state->line, state->column);
+            next(state);
+            return token;
+        } else if (here(state) == ')') {
+            lexertoken_t *token = new_lexer_token(lexer, CLOSE_PARAN, state->line, state->column);
+            next(state);
+            return token;
+        } else if (here(state) == '{') {
+            lexertoken_t *token = new_lexer_token(lexer, OPEN_BRACE, state->line, state->column);
+            next(state);
+            return token;
+        } else if (here(state) == '}') {
+            lexertoken_t *token = new_lexer_token(lexer, CLOSE_BRACE, state->line, state->column);
+            next(state);
+            return token;
+        } else if (here(state) == '/' && peek(state) == '/') {
+            while (here(state) != '\n' && here(state) != 0) {
+                next(state);
             }
-        } else if (here(&state) == '/' && peek(&state) == '*') {
-            size_t token_line = state.line, token_column = state.column;
-            next(&state);
-            next(&state);
-            while ((here(&state) != '*' || peek(&state) != '/') && here(&state) != 0) {
-                next(&state);
-                if (here(&state) == 0) {
-                    state.has_errors = 1;
-                    show_lexer_error(filename, token_line, token_column,
+        } else if (here(state) == '/' && peek(state) == '*') {
+            size_t token_line = state->line, token_column = state->column;
+            next(state);
+            next(state);
+            while ((here(state) != '*' || peek(state) != '/') && here(state) != 0) {
+                next(state);
+                if (here(state) == 0) {
+                    state->has_errors = 1;
+                    show_lexer_error(lexer, token_line, token_column,
                         "unterminated block comment");
                     break;
                 }
             }
-            next(&state);
-            next(&state);
-        } else if (is_identifier(here(&state), 1)) {
-            size_t token_line = state.line, token_column = state.column;
-            size_t start = state.pos;
-            while(is_identifier(here(&state), 0)) {
-                next(&state);
+            next(state);
+            next(state);
+        } else if (here(state) != 0 && peek(state) != 0
+                    && is_double_operator(here(state), peek(state))) {
+            lexertoken_t *op_token = new_lexer_token(lexer, OPERATOR, state->line, state->column);
+            op_token->data.text = malloc(3);
+            op_token->data.text[0] = here(state);
+            op_token->data.text[1] = peek(state);
+            op_token->data.text[2] = 0;
+            next(state);
+            next(state);
+            return op_token;
+        } else if (here(state) != 0 && strchr("+-*/%&|^~=<>!.", here(state))) {
+            lexertoken_t *op_token = new_lexer_token(lexer, OPERATOR, state->line, state->column);
+            op_token->data.text = malloc(2);
+            op_token->data.text[0] = here(state);
+            op_token->data.text[1] = 0;
+            next(state);
+            return op_token;
+        } else if (is_identifier(here(state), 1)) {
+            size_t token_line = state->line, token_column = state->column;
+            size_t start = state->pos;
+            unsigned hash = FNV_OFFSET_BASIS;
+            while(is_identifier(here(state), 0)) {
+                hash ^= here(state);
+                hash *= FNV_PRIME;
+                next(state);
             }
-            int ident_size = state.pos - start;
+            int ident_size = state->pos - start;
             char *token_text = malloc(ident_size + 1);
-            strncpy(token_text, &state.text[start], ident_size);
+            strncpy(token_text, &state->text[start], ident_size);
             token_text[ident_size] = 0;
 
-            lexertoken_t *ident_token = new_token(IDENTIFIER, filename, token_line, token_column);
-            if (is_reserved_word(token_text)) {
+            lexertoken_t *ident_token = new_lexer_token(lexer, IDENTIFIER, token_line, token_column);
+            ident_token->keyword = is_reserved_word_length(token_text, ident_size);
+            if (ident_token->keyword) {
                 ident_token->type = RESERVED;
             }
             ident_token->data.text = token_text;
-            add_token(tokens, ident_token);
-        } else if (here(&state) == '"') {
-            size_t token_line = state.line, token_column = state.column;
-            next(&state);
-            size_t start = state.pos;
-            while(here(&state) != '"' || prev(&state) == '\\') {
-                if (here(&state) == 0) {
-                    state.has_errors = 1;
-                    show_lexer_error(filename, token_line, token_column,
+            ident_token->hash = hash;
+            return ident_token;
+        } else if (here(state) == '"') {
+            size_t token_line = state->line, token_column = state->column;
+            next(state);
+            size_t start = state->pos;
+            while(here(state) != '"' || prev(state) == '\\') {
+                if (here(state) == 0) {
+                    state->has_errors = 1;
+                    show_lexer_error(lexer, token_line, token_column,
                         "unterminated string");
                     break;
                 }
-                next(&state);
+                next(state);
             }
-            int string_size = state.pos - start;
-            next(&state);
+            int string_size = state->pos - start;
+            next(state);
             char *string_text = malloc(string_size + 1);
-            strncpy(string_text, &state.text[start], string_size);
+            strncpy(string_text, &state->text[start], string_size);
             string_text[string_size] = 0;
-            if (!handle_string_escapes(filename, token_line, token_column, string_text)) {
-                state.has_errors = 1;
+            if (!handle_string_escapes(lexer, token_line, token_column, string_text)) {
+                state->has_errors = 1;
             }
 
-            lexertoken_t *string_token = new_token(STRING, filename, token_line, token_column);
+            lexertoken_t *string_token = new_lexer_token(lexer, STRING, token_line, token_column);
             string_token->data.text = string_text;
-            add_token(tokens, string_token);
-        } else if (here(&state) == '`') {
-            size_t token_line = state.line, token_column = state.column;
-            next(&state);
-            size_t start = state.pos;
-            while(here(&state) != '`' || prev(&state) == '\\') {
-                if (here(&state) == 0) {
-                    state.has_errors = 1;
-                    show_lexer_error(filename, token_line, token_column,
+            return string_token;
+        } else if (here(state) == '`') {
+            size_t token_line = state->line, token_column = state->column;
+            next(state);
+            size_t start = state->pos;
+            while(here(state) != '`' || prev(state) == '\\') {
+                if (here(state) == 0) {
+                    state->has_errors = 1;
+                    show_lexer_error(lexer, token_line, token_column,
                         "unterminated dictionary word");
                     break;
                 }
-                next(&state);
+                next(state);
             }
-            int string_size = state.pos - start;
-            next(&state);
+            int string_size = state->pos - start;
+            next(state);
             char *string_text = malloc(string_size + 1);
-            strncpy(string_text, &state.text[start], string_size);
+            strncpy(string_text, &state->text[start], string_size);
             string_text[string_size] = 0;
-            if (!handle_string_escapes(filename, token_line, token_column, string_text)) {
-                state.has_errors = 1;
+            if (!handle_string_escapes(lexer, token_line, token_column, string_text)) {
+                state->has_errors = 1;
             }
 
-            add_dictionary_word(gamefile->global_symbols, string_text);
-            lexertoken_t *string_token = new_token(DICT_WORD, filename, token_line, token_column);
+            if (lexer->gamefile) {
+                add_dictionary_word(lexer->gamefile->global_symbols, string_text);
+            }
+            lexertoken_t *string_token = new_lexer_token(lexer, DICT_WORD, token_line, token_column);
             string_token->data.text = string_text;
-            add_token(tokens, string_token);
-        } else if (here(&state) == '\'') {
-            size_t token_line = state.line, token_column = state.column;
-            next(&state);
-            size_t start = state.pos;
-            while(here(&state) != '\'' || prev(&state) == '\\') {
-                if (here(&state) == 0) {
-                    state.has_errors = 1;
-                    show_lexer_error(filename, token_line, token_column,
+            return string_token;
+        } else if (here(state) == '\'') {
+            size_t token_line = state->line, token_column = state->column;
+            next(state);
+            size_t start = state->pos;
+            while(here(state) != '\'' || prev(state) == '\\') {
+                if (here(state) == 0) {
+                    state->has_errors = 1;
+                    show_lexer_error(lexer, token_line, token_column,
                         "unterminated character constant");
                     break;
                 }
-                next(&state);
+                next(state);
             }
             char char_constant[16] = {0};
-            int string_size = state.pos - start;
-            strncpy(char_constant, &state.text[start], string_size);
-            if (!handle_string_escapes(filename, token_line, token_column, char_constant)) {
-                state.has_errors = 1;
+            int string_size = state->pos - start;
+            if (string_size >= (int)sizeof(char_constant)) {
+                string_size = sizeof(char_constant) - 1;
+            }
+            strncpy(char_constant, &state->text[start], string_size);
+            if (!handle_string_escapes(lexer, token_line, token_column, char_constant)) {
+                state->has_errors = 1;
             }
 
-            int char_value = 0;
-            if (strlen(char_constant) > 1) {
-                state.has_errors = 1;
-                show_lexer_error(filename, token_line, token_column,
+            const char *end = char_constant;
+            int char_value = *end ? decode_utf8(&end) : 0;
+            if (*end) {
+                state->has_errors = 1;
+                show_lexer_error(lexer, token_line, token_column,
                     "oversized character constant \"%s\" (longer than 1 character)",
                     char_constant);
-            } else {
-                char_value = char_constant[0];
+                char_value = 0;
             }
-            next(&state);
-            lexertoken_t *ident_token = new_token(INTEGER, filename, token_line, token_column);
+            next(state);
+            lexertoken_t *ident_token = new_lexer_token(lexer, INTEGER, token_line, token_column);
             ident_token->data.integer = char_value;
-            add_token(tokens, ident_token);
-        } else if (isdigit(here(&state))) {
-            size_t token_line = state.line, token_column = state.column;
-            int number = 0;
-
-            if (here(&state) == '0' && (peek(&state) == 'x' || peek(&state) == 'X')) {
-                next(&state);
-                next(&state);
+            return ident_token;
+        } else if (isdigit(here(state))) {
+            size_t token_line = state->line, token_column = state->column;
+            /* built wider than an int so overflow can be seen; a decimal
+               literal may reach 2147483648 so INT_MIN can be written */
+            unsigned long long number = 0;
+            unsigned long long limit = 2147483648ULL;
+            int too_large = 0;
+
+            if (here(state) == '0' && (peek(state) == 'x' || peek(state) == 'X')) {
+                limit = 0xFFFFFFFFULL;
+                next(state);
+                next(state);
                 do {
                     int digit_value = 0;
-                    if (isdigit(here(&state))) {
-                        digit_value = here(&state) - '0';
+                    if (isdigit(here(state))) {
+                        digit_value = here(state) - '0';
                     } else {
-                        digit_value = tolower(here(&state)) - 'a' + 10;
+                        digit_value = tolower(here(state)) - 'a' + 10;
                     }
-                    number *= 16;
-                    number += digit_value;
-                    next(&state);
-                } while(isxdigit(here(&state)));
+                    number = number * 16 + digit_value;
+                    too_large |= number > limit;
+                    if (too_large) number = 0;
+                    next(state);
+                } while(isxdigit(here(state)));
             } else {
                 do {
-                    int digit_value = here(&state) - '0';
-                    number *= 10;
-                    number += digit_value;
-                    next(&state);
-                } while(isdigit(here(&state)));
+                    int digit_value = here(state) - '0';
+                    number = number * 10 + digit_value;
+                    too_large |= number > limit;
+                    if (too_large) number = 0;
+                    next(state);
+                } while(isdigit(here(state)));
+            }
+            if (too_large) {
+                state->has_errors = 1;
+                show_lexer_error(lexer, token_line, token_column,
+                    limit == 0xFFFFFFFFULL ? "integer constant too large (greater than 0x%llX)"
+                                           : "integer constant too large (greater than %llu)",
+                    limit);
             }
 
-            lexertoken_t *ident_token = new_token(INTEGER, filename, token_line, token_column);
-            ident_token->data.integer = number;
-            add_token(tokens, ident_token);
+            lexertoken_t *ident_token = new_lexer_token(lexer, INTEGER, token_line, token_column);
+            ident_token->negate_only = number == 2147483648ULL && limit == 2147483648ULL;
+            ident_token->data.integer = (int)(unsigned)number;
+            return ident_token;
+        } else if (here(state) >= 0x80) {
+            /* skip the whole character so it is only reported once */
+            const char *text = &state->text[state->pos];
+            const char *end = text;
+            unsigned c = decode_utf8(&end);
+            state->has_errors = 1;
+            show_lexer_error(lexer, state->line, state->column,
+                                "unexpected character U+%04X", c);
+            while (text++ < end) {
+                next(state);
+            }
         } else {
-            state.has_errors = 1;
-            show_lexer_error(filename, state.line, state.column,
+            state->has_errors = 1;
+            show_lexer_error(lexer, state->line, state->column,
                                 "unexpected character '%c' (%d)",
-                                here(&state), here(&state));
-            next(&state);
+                                here(state), here(state));
+            next(state);
         }
     }
+    return 0;
+}
 
-    if (state.has_errors) {
-        free_tokens(tokens);
-        return 0;
+
+/*
+Convert a string into a sequence of tokens and add them to the global token list.
+The tokens that could be read are returned even if errors were found. A long
+string is lexed in parts by up to DEFAULT_LEX_THREADS threads.
+*/
+tokenlist_t* lex_string(glulxfile_t *gamefile, const char *filename, const char *text, size_t length) {
+    return lex_string_threads(gamefile, filename, text, length, DEFAULT_LEX_THREADS);
+}
+
+/*
+Lex a string as lex_string does, dividing a string of at least two
+LEX_CHUNK_SIZE parts between up to thread_count threads. Each part is lexed
+as if nothing came before it. The parts are then joined in order, relexing
+the start of any part whose lexer began inside a token or comment until it
+reaches a token that part's lexer also began, after which the two agree.
+The tokens and errors are the same as if the string were lexed by one
+thread.
+*/
+tokenlist_t* lex_string_threads(glulxfile_t *gamefile, const char *filename, const char *text,
+                                size_t length, unsigned thread_count) {
+    unsigned chunk_count = length / LEX_CHUNK_SIZE;
+    if (chunk_count > thread_count) {
+        chunk_count = thread_count;
+    }
+    tokenlist_t *tokens = calloc(sizeof(tokenlist_t), 1);
+    lexertoken_t *token;
+    if (chunk_count < 2) {
+        lexer_t *lexer = open_lexer_string(gamefile, filename, text, length);
+        while ((token = read_token(lexer)) != 0) {
+            add_token(tokens, token);
+        }
+        tokens->has_errors = lexer->state.has_errors;
+        close_lexer(lexer);
+        return tokens;
+    }
+
+    /* each part ends just after a newline, so every part starts a line */
+    lexchunk_t *chunks = calloc(sizeof(lexchunk_t), chunk_count);
+    unsigned count = 0;
+    size_t start = 0;
+    while (start < length) {
+        size_t end = length;
+        if (count + 1 < chunk_count) {
+            size_t from = length / chunk_count * (count + 1);
+            if (from < start) {
+                from = start;
+            }
+            const char *newline = memchr(&text[from], '\n', length - from);
+            if (newline) {
+                end = newline - text + 1;
+            }
+        }
+        lexchunk_t *chunk = &chunks[count++];
+        chunk->start = start;
+        chunk->end = end;
+        chunk->lexer = new_text_lexer(filename, text, start, length, 1, 1);
+        chunk->lexer->stop = end;
+        chunk->lexer->speculative = start > 0;
+        chunk->tokens = calloc(sizeof(tokenlist_t), 1);
+        start = end;
+    }
+
+    pthread_t *threads = calloc(sizeof(pthread_t), count);
+    unsigned started = 0;
+    for (unsigned i = 1; i < count; ++i) {
+        if (pthread_create(&threads[i], 0, lex_chunk, &chunks[i]) != 0) {
+            break;
+        }
+        ++started;
+    }
+    /* the first part can't be misread, so its errors are reported as it is
+       lexed; the text is checked while the other parts are lexed */
+    lexer_t *check = new_text_lexer(filename, text, 0, length, 1, 1);
+    check_utf8(check, 0, length);
+    tokens->has_errors = check->state.has_errors;
+    close_lexer(check);
+    lex_chunk(&chunks[0]);
+    for (unsigned i = 1; i < count; ++i) {
+        if (i <= started) {
+            pthread_join(threads[i], 0);
+        } else {
+            lex_chunk(&chunks[i]);
+        }
+    }
+    free(threads);
+
+    /* where the tokens taken so far end: the first part is never misread */
+    size_t pos = 0, line = 1, column = 1;
+    size_t chunk_line = 1;
+    for (unsigned i = 0; i < count; ++i) {
+        lexchunk_t *chunk = &chunks[i];
+        /* a part with errors may only have them because it was misread, and
+           its errors weren't reported, so all of it is lexed again */
+        int trusted = !chunk->lexer->speculative || !chunk->lexer->state.has_errors;
+        lexertoken_t *sync = trusted ? chunk->tokens->first : 0;
+        int synced = trusted && pos == chunk->start;
+        lexer_t *lexer = 0;
+        while (!synced) {
+            while (sync && sync->offset < pos) {
+                sync = sync->next;
+            }
+            if (!lexer) {
+                lexer = new_text_lexer(filename, text, pos, length, line, column);
+            }
+            lexer->stop = sync ? sync->offset : chunk->end;
+            while ((token = read_token(lexer)) != 0) {
+                add_token(tokens, token);
+            }
+            pos = lexer->state.pos;
+            line = lexer->state.line;
+            column = lexer->state.column;
+            if (!sync) {
+                break;
+            }
+            synced = pos == sync->offset;
+        }
+        if (lexer) {
+            tokens->has_errors |= lexer->state.has_errors;
+            close_lexer(lexer);
+        }
+        if (synced) {
+            take_chunk_tokens(tokens, chunk, sync, chunk_line);
+            pos = chunk->lexer->state.pos;
+            line = chunk->lexer->state.line + chunk_line - 1;
+            column = chunk->lexer->state.column;
+            tokens->has_errors |= chunk->lexer->state.has_errors;
+        }
+        chunk_line += chunk->newlines;
+        free_tokens(chunk->tokens);
+        close_lexer(chunk->lexer);
+    }
+    free(chunks);
+
+    if (gamefile) {
+        for (token = tokens->first; token; token = token->next) {
+            if (token->type == DICT_WORD) {
+                add_dictionary_word(gamefile->global_symbols, token->data.text);
+            }
+        }
     }
     return tokens;
 }
 
+/*
+Lex one part of a text and count the lines it covers.
+*/
+void* lex_chunk(void *data) {
+    lexchunk_t *chunk = data;
+    lexertoken_t *token;
+    while ((token = read_token(chunk->lexer)) != 0) {
+        add_token(chunk->tokens, token);
+    }
+    const char *text = chunk->lexer->state.text;
+    const char *end = &text[chunk->end];
+    for (const char *c = &text[chunk->start]; (c = memchr(c, '\n', end - c)) != 0; ++c) {
+        ++chunk->newlines;
+    }
+    return 0;
+}
+
+/*
+Move the tokens of a part from first to the end of the part onto the end of
+a list, numbering their lines from the line the part begins on. Tokens
+before first are left in the part's list.
+*/
+void take_chunk_tokens(tokenlist_t *tokens, lexchunk_t *chunk, lexertoken_t *first,
+                       size_t line) {
+    if (!first) {
+        return;
+    }
+    for (lexertoken_t *token = first; token; token = token->next) {
+        token->line_no += line - 1;
+    }
+    lexertoken_t *last = chunk->tokens->last;
+    chunk->tokens->last = first->prev;
+    if (first->prev) {
+        first->prev->next = 0;
+    } else {
+        chunk->tokens->first = 0;
+    }
+
+    first->prev = tokens->last;
+    if (tokens->last) {
+        tokens->last->next = first;
+    } else {
+        tokens->first = first;
+    }
+    tokens->last = last;
+}
+
+
+/*
+Create a lexer that reads tokens on demand from a string. The string is not
+copied and must remain valid until the lexer is closed.
+*/
+lexer_t* open_lexer_string(glulxfile_t *gamefile, const char *filename, const char *text, size_t length) {
+    return open_lexer_range(gamefile, filename, text, 0, length, 1, 1);
+}
+
+/*
+Create a lexer that reads tokens on demand from part of a larger text, such as
+the body of a function, starting at the given line and column. Token offsets
+are relative to the start of the whole text. The text is not copied and must
+remain valid until the lexer is closed.
+*/
+lexer_t* open_lexer_range(glulxfile_t *gamefile, const char *filename, const char *text,
+                          size_t start, size_t end, int line, int column) {
+    lexer_t *lexer = new_text_lexer(filename, text, start, end, line, column);
+    lexer->gamefile = gamefile;
+    check_utf8(lexer, start, end);
+    return lexer;
+}
+
+/*
+Create a lexer for part of a text without checking that the text is valid
+UTF-8. The lexer stops at the end of the part, but may be set to stop
+earlier.
+*/
+lexer_t* new_text_lexer(const char *filename, const char *text, size_t start, size_t end,
+                        int line, int column) {
+    lexer_t *lexer = calloc(sizeof(lexer_t), 1);
+    lexer->filename = strdup(filename);
+    lexer->state.text = text;
+    lexer->state.length = end;
+    lexer->state.pos = start;
+    lexer->state.line = line;
+    lexer->state.column = column;
+    lexer->stop = end;
+    return lexer;
+}
+
+/*
+Create a lexer that returns the tokens of an existing list from first up to
+and including last, rather than reading them from text. The tokens still
+belong to the list and must remain valid until the lexer is closed.
+*/
+lexer_t* open_lexer_tokens(lexertoken_t *first, lexertoken_t *last) {
+    lexer_t *lexer = calloc(sizeof(lexer_t), 1);
+    lexer->filename = strdup(first ? first->filename : "");
+    lexer->from_list = 1;
+    lexer->list_next = first;
+    lexer->list_last = last;
+    return lexer;
+}
+
+/*
+Read the whole of a file into memory with a terminator after it. Returns
+null if the file could not be read.
+*/
+char* read_text_file(const char *filename, size_t *length) {
+    FILE *fp = fopen(filename, "rt");
+    if (!fp) {
+        fprintf(stderr, "Could not open file \"%s\"\n", filename);
+        return 0;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    long int readsize = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    char *filedata = malloc(readsize + 1);
+    readsize = fread(filedata, 1, readsize, fp);
+    filedata[readsize] = 0;
+    fclose(fp);
+    *length = readsize;
+    return filedata;
+}
+
+/*
+Create a lexer that reads tokens on demand from the contents of a file.
+Returns null if the file could not be read.
+*/
+lexer_t* open_lexer_file(glulxfile_t *gamefile, const char *filename) {
+    return open_lexer_file_threads(gamefile, filename, 1);
+}
+
+/*
+Create a lexer for the contents of a file as open_lexer_file does. A file
+large enough to be split is instead lexed all at once by up to thread_count
+threads, and the lexer returns the tokens from that list. The text is kept
+either way, so lexer_source still works. Returns null if the file could not
+be read.
+*/
+lexer_t* open_lexer_file_threads(glulxfile_t *gamefile, const char *filename,
+                                 unsigned thread_count) {
+    size_t length = 0;
+    char *filedata = read_text_file(filename, &length);
+    if (!filedata) {
+        return 0;
+    }
+
+    if (thread_count < 2 || length / LEX_CHUNK_SIZE < 2) {
+        lexer_t *lexer = open_lexer_string(gamefile, filename, filedata, length);
+        lexer->owned_text = filedata;
+        return lexer;
+    }
+
+    tokenlist_t *tokens = lex_string_threads(gamefile, filename, filedata, length,
+                                             thread_count);
+    lexer_t *lexer = open_lexer_tokens(tokens->first, tokens->last);
+    free(lexer->filename);
+    lexer->filename = strdup(filename);
+    lexer->gamefile = gamefile;
+    lexer->owned_tokens = tokens;
+    lexer->owned_text = filedata;
+    lexer->state.text = filedata;
+    lexer->state.length = length;
+    lexer->state.has_errors = tokens->has_errors;
+    return lexer;
+}
+
+/*
+Return the token offset tokens ahead of the current position without
+consuming it, lexing more of the text as needed. Returns null if the end of
+the text is reached first. Offset must be less than LEXER_LOOKAHEAD.
+*/
+lexertoken_t* lexer_token(lexer_t *lexer, unsigned offset) {
+    while (lexer->count <= offset) {
+        lexertoken_t *token;
+        if (lexer->from_list) {
+            token = lexer->list_next;
+            if (token) {
+                lexer->list_next = token == lexer->list_last ? 0 : token->next;
+            }
+        } else {
+            token = read_token(lexer);
+        }
+        if (!token) {
+            return 0;
+        }
+        lexer->lookahead[(lexer->head + lexer->count) % LEXER_LOOKAHEAD] = token;
+        ++lexer->count;
+    }
+    return lexer->lookahead[(lexer->head + offset) % LEXER_LOOKAHEAD];
+}
+
+/*
+Consume the current token. Its memory is recycled for later tokens, so any
+pointers to it or its text become invalid.
+*/
+void lexer_advance(lexer_t *lexer) {
+    if (!lexer_token(lexer, 0)) {
+        return;
+    }
+    lexertoken_t *token = lexer->lookahead[lexer->head];
+    lexer->lookahead[lexer->head] = 0;
+    lexer->head = (lexer->head + 1) % LEXER_LOOKAHEAD;
+    --lexer->count;
+    lexer->consumed_end = token->offset + token->length;
+    lexer->consumed_type = token->type;
+
+    /* tokens from a list still belong to the list */
+    if (lexer->from_list) {
+        return;
+    }
+    if (has_token_text(token)) {
+        free(token->data.text);
+    }
+    token->next = lexer->free_tokens;
+    lexer->free_tokens = token;
+}
+
+/*
+Keep the text being lexed in the game's list of sources so that parts of it
+can be lexed again after the lexer is closed. Returns the same source for
+every call on a lexer.
+*/
+sourcefile_t* lexer_source(lexer_t *lexer) {
+    if (lexer->source) {
+        return lexer->source;
+    }
+    sourcefile_t *source = calloc(sizeof(sourcefile_t), 1);
+    source->filename = strdup(lexer->filename);
+    source->length = lexer->state.length;
+    if (lexer->owned_text) {
+        source->text = lexer->owned_text;
+        lexer->owned_text = 0;
+    } else {
+        source->text = malloc(source->length + 1);
+        memcpy(source->text, lexer->state.text, source->length);
+        source->text[source->length] = 0;
+    }
+    lexer->state.text = source->text;
+
+    source->next = lexer->gamefile->sources;
+    lexer->gamefile->sources = source;
+    lexer->source = source;
+    return source;
+}
+
+/*
+Return the position in the text just past the last token consumed.
+*/
+size_t lexer_offset(const lexer_t *lexer) {
+    return lexer->consumed_end;
+}
+
+/*
+Return the type of the last token consumed, or UNKNOWN if there is none.
+*/
+int lexer_consumed_type(const lexer_t *lexer) {
+    return lexer->consumed_type;
+}
+
+/*
+Returns true if any errors were found in the text lexed so far.
+*/
+int lexer_has_errors(const lexer_t *lexer) {
+    return lexer->state.has_errors;
+}
+
+/*
+Free a lexer along with any tokens it still holds.
+*/
+void close_lexer(lexer_t *lexer) {
+    while (lexer->count) {
+        lexer_advance(lexer);
+    }
+    lexertoken_t *token = lexer->free_tokens;
+    while (token) {
+        lexertoken_t *next = token->next;
+        free(token->filename);
+        free(token);
+        token = next;
+    }
+    if (lexer->owned_tokens) {
+        free_tokens(lexer->owned_tokens);
+    }
+    free(lexer->owned_text);
+    free(lexer->filename);
+    free(lexer);
+}
+
 
 /*
 Determine if a character is a valid character inside an identifier name.
+Identifiers are ASCII whatever the locale.
 */
-int is_identifier(char what, int first_char) {
-    if (isalpha(what) || what == '_') {
+int is_identifier(int what, int first_char) {
+    if ((what >= 'a' && what <= 'z') || (what >= 'A' && what <= 'Z') || what == '_') {
         return 1;
     }
-    if (!first_char && isdigit(what)) {
+    if (!first_char && what >= '0' && what <= '9') {
         return 1;
     }
     return 0;
 }
 
+int is_space(int what) {
+    return what == ' ' || what == '\t' || what == '\n' || what == '\r'
+        || what == '\v' || what == '\f';
+}
+
+/*
+Check that the part of a lexer's text it will read is valid UTF-8, reporting
+where it is not. The text is still lexed, but any string holding invalid
+text is left as it is.
+*/
+void check_utf8(lexer_t *lexer, size_t start, size_t end) {
+    size_t bad = start + find_invalid_utf8(&lexer->state.text[start], end - start);
+    if (bad == end) return;
+
+    lexerstate_t where = lexer->state;
+    while (where.pos < bad) {
+        next(&where);
+    }
+    lexer->state.has_errors = 1;
+    show_lexer_error(lexer, where.line, where.column,
+                     "invalid UTF-8 byte 0x%02X", here(&where));
+}
+
+/*
+Determine if two characters together form a single operator.
+*/
+int is_double_operator(char first, char second) {
+    static const char *operators[] = { "<<", ">>", "<=", ">=", "==", "!=", "&&", "||", 0 };
+    for (int i = 0; operators[i]; ++i) {
+        if (operators[i][0] == first && operators[i][1] == second) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
 
 /*
 Create a new lexer token of the specified type and occuring at the specified location.
@@ -424,6 +1049,30 @@ lexertoken_t* new_token(int type, const char *filename, int line_no, int col_no)
 }
 
 
+/*
+Create a new token for a lexer, reusing the memory of a consumed token if one
+is available.
+*/
+lexertoken_t* new_lexer_token(lexer_t *lexer, int type, int line_no, int col_no) {
+    lexertoken_t *token = lexer->free_tokens;
+    if (!token) {
+        token = new_token(type, lexer->filename, line_no, col_no);
+    } else {
+        lexer->free_tokens = token->next;
+
+        /* recycled tokens always came from this lexer, so the filename is kept */
+        char *filename = token->filename;
+        memset(token, 0, sizeof(lexertoken_t));
+        token->type = type;
+        token->filename = filename;
+        token->line_no = line_no;
+        token->col_no = col_no;
+    }
+    token->offset = lexer->token_start;
+    return token;
+}
+
+
 /*
 Add an existing lexer token to the global linked list of lexer tokens.
 */
@@ -452,10 +1101,12 @@ tokenlist_t* merge_tokens(tokenlist_t *first, tokenlist_t *second) {
     if (second == 0) return first;
 
     if (first->first == 0) {
+        second->has_errors |= first->has_errors;
         free(first);
         return second;
     }
     if (second->first == 0) {
+        first->has_errors |= second->has_errors;
         free(second);
         return first;
     }
@@ -463,6 +1114,7 @@ tokenlist_t* merge_tokens(tokenlist_t *first, tokenlist_t *second) {
     first->last->next = second->first;
     second->first->prev = first->last;
     first->last = second->last;
+    first->has_errors |= second->has_errors;
     free(second);
     return first;
 }
@@ -474,12 +1126,181 @@ void free_tokens(tokenlist_t *tokens) {
     lexertoken_t *token = tokens->first;
     while (token) {
         lexertoken_t *next = token->next;
-        if (token->type == IDENTIFIER || token->type == STRING) {
-            free((void*)token->data.text);
-        }
-        free((void*)token->filename);
-        free(token);
+        free_token(token);
         token = next;
     }
     free(tokens);
 }
+
+void free_token(lexertoken_t *token) {
+    if (has_token_text(token)) {
+        free((void*)token->data.text);
+    }
+    free((void*)token->filename);
+    free(token);
+}
+
+
+/*
+Returns true if a token's data is text that belongs to the token.
+*/
+int has_token_text(const lexertoken_t *token) {
+    return token->type == IDENTIFIER || token->type == RESERVED
+        || token->type == STRING || token->type == OPERATOR
+        || token->type == DICT_WORD;
+}
+
+/*
+Move a token and every token after it up to and including last, or to the end
+of the list if last is null, by delta characters. Tokens on old_line are on
+the line where an edit ended, so they move to line and have their column
+adjusted; tokens on later lines only change line. Returns the number of
+tokens moved.
+*/
+unsigned shift_tokens(lexertoken_t *token, lexertoken_t *last, long delta, int old_line, int line,
+                      int column_delta) {
+    unsigned count = 0;
+    for (; token; token = token == last ? 0 : token->next) {
+        token->offset += delta;
+        if (token->line_no == old_line) {
+            token->col_no += column_delta;
+        }
+        token->line_no += line - old_line;
+        ++count;
+    }
+    return count;
+}
+
+/*
+Find the last token from first up to and including last, or to the end of the
+list if last is null, that ends before offset. This is where relexing must
+start for an edit at offset, since the edit may join onto it. Returns null if
+no token ends before offset.
+*/
+lexertoken_t* token_before(lexertoken_t *first, lexertoken_t *last, size_t offset) {
+    lexertoken_t *before = 0;
+    for (lexertoken_t *token = first; token; token = token == last ? 0 : token->next) {
+        if (token->offset + token->length >= offset) break;
+        before = token;
+    }
+    return before;
+}
+
+/*
+Bring a token list up to date after an edit replaced removed characters at
+edit->start with inserted characters. The text given is the whole text after
+the edit, though only the part from start on is read. Lexing begins at start,
+which should be found with token_before, or at the beginning of the text if
+start is null, and stops as soon as a new token starts where an old token from
+after the edit would now start; the tokens from there on are kept and only
+have their positions moved.
+
+The offsets and lines of the tokens in the list may be relative to a position
+in the text, given by edit->base_offset and edit->base_line; new tokens are
+made relative to it as well. If limit is given, only tokens up to and
+including it are moved, so that the positions of the tokens after it can be
+relative to it. On return, edit->damage_start and edit->damage_end hold the
+part of the new text whose tokens were replaced, relative to the base, and
+edit->touched the number of tokens lexed or moved.
+
+Returns -1 if limit would have been replaced, in which case the list is left
+as it was, and otherwise non-zero if errors occured.
+*/
+int relex_tokens(tokenlist_t *tokens, lexertoken_t *start, lexertoken_t *limit,
+                 const char *filename, const char *text, size_t length, textedit_t *edit) {
+    long delta = (long)edit->inserted - (long)edit->removed;
+    size_t base = edit->base_offset;
+    size_t old_edit_end = edit->start + edit->removed;
+    size_t from = start ? start->offset + base : 0;
+    int line = start ? start->line_no + edit->base_line : 1;
+    int column = start ? start->col_no : 1;
+
+    /* no new token may begin past where the limit now is */
+    lexer_t *lexer = new_text_lexer(filename, text, from, length, line, column);
+    if (limit) {
+        lexer->stop = limit->offset + base + delta + limit->length;
+    }
+    edit->damage_start = start ? start->offset : 0;
+    edit->touched = 0;
+
+    /* lex new tokens until one lines up with an old token; the old tokens
+       passed over on the way, from first_replaced up to old, are replaced */
+    lexertoken_t *before = start ? start->prev : 0;
+    lexertoken_t *first_replaced = start ? start : tokens->first;
+    lexertoken_t *old = first_replaced;
+    tokenlist_t *fresh = calloc(sizeof(tokenlist_t), 1);
+    lexertoken_t *token;
+    int gave_up = 0;
+    while ((token = read_token(lexer)) != 0) {
+        while (old && (old->offset + base < old_edit_end
+                       || (long)(old->offset + base) + delta < (long)token->offset)) {
+            if (old == limit) {
+                gave_up = 1;
+                break;
+            }
+            old = old->next;
+        }
+        if (gave_up || (old && (long)(old->offset + base) + delta == (long)token->offset)) {
+            break;
+        }
+        add_token(fresh, token);
+    }
+    if (gave_up || (limit && !token)) {
+        if (token) {
+            free_token(token);
+        }
+        close_lexer(lexer);
+        free_tokens(fresh);
+        return -1;
+    }
+    if (!token) {
+        old = 0;
+    }
+    size_t lexed_end = old ? token->offset : length;
+    edit->damage_end = lexed_end - base;
+
+    /* the rest of the old tokens are unchanged apart from their position */
+    if (old) {
+        edit->touched += shift_tokens(old, limit, delta, old->line_no,
+                                      token->line_no - edit->base_line,
+                                      token->col_no - old->col_no);
+        free_token(token);
+    }
+    for (token = fresh->first; token; token = token->next) {
+        token->offset -= base;
+        token->line_no -= edit->base_line;
+        ++edit->touched;
+    }
+
+    /* splice the new tokens in between the tokens kept on either side */
+    while (first_replaced != old) {
+        lexertoken_t *next = first_replaced->next;
+        free_token(first_replaced);
+        first_replaced = next;
+    }
+    if (fresh->first) {
+        fresh->first->prev = before;
+        fresh->last->next = old;
+    }
+    lexertoken_t *first_after = fresh->first ? fresh->first : old;
+    lexertoken_t *last_before = fresh->last ? fresh->last : before;
+    if (before) {
+        before->next = first_after;
+    } else {
+        tokens->first = first_after;
+    }
+    if (old) {
+        old->prev = last_before;
+    } else {
+        tokens->last = last_before;
+    }
+
+    /* only the text lexed again needs checking */
+    lexer_t *check = new_text_lexer(filename, text, from, lexed_end, line, column);
+    check_utf8(check, from, lexed_end);
+    int has_errors = lexer_has_errors(lexer) || lexer_has_errors(check);
+    close_lexer(check);
+    close_lexer(lexer);
+    free(fresh);
+    return has_errors;
+}
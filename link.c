@@ -0,0 +1,614 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gbuild.h"
+
+#define GLULX_MAGIC         0x476C756C
+#define GLULX_VERSION       0x00030102
+/* glulx memory segments must begin and end on a multiple of this */
+#define GLULX_PAGE_SIZE     256
+
+/* offsets of fields in the glulx header */
+#define HDR_MAGIC           0
+#define HDR_VERSION         4
+#define HDR_RAMSTART        8
+#define HDR_EXTSTART        12
+#define HDR_ENDMEM          16
+#define HDR_STACKSIZE       20
+#define HDR_STARTFUNC       24
+#define HDR_DECODINGTBL     28
+#define HDR_CHECKSUM        32
+
+/* type bytes of uncompressed strings of bytes and of 32-bit characters */
+#define STRING_E0           0xE0
+#define STRING_E2           0xE2
+
+/* size of the fields before the entries of the dictionary, and of its index
+   by first character */
+#define DICT_HEADER_SIZE    12
+#define DICT_INDEX_SIZE     (256 * 8)
+
+int layout_function(glulxfile_t *gamefile, function_t *function);
+int compare_symbol_names(const void *a, const void *b);
+void mark_written_globals(function_t *function, codeblock_t *code);
+void layout_strings(glulxfile_t *gamefile);
+void layout_globals(glulxfile_t *gamefile, int is_written);
+void number_properties(glulxfile_t *gamefile);
+int is_written_object(object_t *object);
+int compare_object_names(const void *a, const void *b);
+int compare_property_numbers(const void *a, const void *b);
+int layout_object(glulxfile_t *gamefile, object_t *object);
+int layout_objects(glulxfile_t *gamefile, int is_written);
+int layout_dictionary(glulxfile_t *gamefile);
+void patch_relocations(glulxfile_t *gamefile);
+void write_header(glulxfile_t *gamefile, symbol_t *start);
+
+
+/*
+Place a function's encoded code in the story file, give its labels their final
+addresses and move its relocations into the global relocation table. Returns
+non-zero if the function refers to a symbol that no object defines.
+*/
+int layout_function(glulxfile_t *gamefile, function_t *function) {
+    int has_errors = 0;
+    function->position = gamefile->image.size;
+    for (unsigned i = 0; i < function->output.size; ++i) {
+        codebuf_add_byte(&gamefile->image, function->output.data[i]);
+    }
+
+    for (int i = 0; i < SYMBOL_TABLE_BUCKETS; ++i) {
+        symbol_t *label = function->locals->symbol_buckets[i];
+        while (label) {
+            if (label->type == SYM_LABEL) {
+                label->position = function->position + label->data.value;
+            }
+            label = label->next;
+        }
+    }
+
+    symbol_t *symbol = get_symbol(gamefile->global_symbols, function->name);
+    if (symbol) {
+        symbol->position = function->position;
+    }
+
+    for (unsigned i = 0; i < function->relocations.count; ++i) {
+        relocation_t *reloc = &function->relocations.entries[i];
+        if (reloc->symbol->type == SYM_IMPORT) {
+            fprintf(stderr, "LINK: undefined symbol \"%s\" used in function \"%s\".\n",
+                    reloc->symbol->name, function->name);
+            has_errors = 1;
+        }
+        /* counters are numbered within their function until layout */
+        unsigned addend = reloc->addend;
+        if (reloc->symbol == gamefile->profile_counters) {
+            addend += function->first_counter * 4;
+        }
+        add_relocation_addend(&gamefile->relocations, function->position + reloc->offset,
+                              reloc->type, reloc->symbol, addend);
+    }
+    return has_errors;
+}
+
+int compare_symbol_names(const void *a, const void *b) {
+    const symbol_t *first = *(const symbol_t**)a;
+    const symbol_t *second = *(const symbol_t**)b;
+    return strcmp(first->name, second->name);
+}
+
+/*
+Mark the globals that the statements of a block store to or take the
+address of.
+*/
+void mark_written_globals(function_t *function, codeblock_t *code) {
+    for (statement_t *stmt = code->content; stmt; stmt = stmt->next) {
+        if (stmt->type == STMT_BLOCK) {
+            mark_written_globals(function, stmt->data.code);
+            continue;
+        } else if (stmt->type != STMT_ASM) {
+            continue;
+        }
+        asmblock_t *block = stmt->data.asm;
+        for (unsigned i = 0; i < block->count; ++i) {
+            asmstmt_t *asmstmt = &block->content[i];
+            if (asmstmt->type == ASM_LABEL) continue;
+            for (int j = 0; j < asmstmt->operand_count; ++j) {
+                asmoperand_t *operand = get_asm_operand(block, asmstmt, j);
+                if (operand->type != OP_IDENTIFIER) continue;
+                /* a data word holds the global's address, which code may
+                   store through */
+                if (asmstmt->type != ASM_DATA
+                        && !(mnemonics[asmstmt->mnemonic].stores & (1 << j))) {
+                    continue;
+                }
+                symbol_t *symbol = lookup_symbol_hashed(function->locals,
+                                                        operand->data.name, operand->hash);
+                if (symbol && symbol->type == SYM_GLOBAL) {
+                    symbol->is_written = 1;
+                }
+            }
+        }
+    }
+}
+
+/*
+Find the globals that must be placed in RAM. Instructions can only reach a
+global through its name, so one that is never stored to and whose address is
+never taken by a data word keeps its initial value and can be placed in ROM,
+where it costs nothing when the interpreter saves the game or its undo state.
+Globals loaded from an object file were already marked by the code that
+defines them. A global whose address is the value of a property is treated
+like one whose address is in a data word. Functions must be assembled first.
+*/
+void find_written_globals(glulxfile_t *gamefile) {
+    for (function_t *function = gamefile->functions; function; function = function->next) {
+        if (function->code && function->locals) {
+            mark_written_globals(function, function->code);
+        }
+    }
+    for (object_t *object = gamefile->objects; object; object = object->next) {
+        for (unsigned i = 0; i < object->property_count; ++i) {
+            asmoperand_t *value = &object->properties[i].value;
+            if (value->type != OP_IDENTIFIER) continue;
+            symbol_t *symbol = get_symbol_hashed(gamefile->global_symbols,
+                                                 value->data.name, value->hash);
+            if (symbol && symbol->type == SYM_GLOBAL) {
+                symbol->is_written = 1;
+            }
+        }
+    }
+}
+
+/*
+Place every string literal used by the game after the code. Strings are
+placed in sorted order so the layout does not depend on the order in which
+they were added to the string table. Strings are kept in UTF-8 until now; one
+whose characters all fit in Latin-1 is stored a byte per character, and any
+other a word per character.
+*/
+void layout_strings(glulxfile_t *gamefile) {
+    if (gamefile->strings == 0) return;
+
+    unsigned count = 0;
+    for (int i = 0; i < SYMBOL_TABLE_BUCKETS; ++i) {
+        for (symbol_t *string = gamefile->strings->symbol_buckets[i]; string; string = string->next) {
+            ++count;
+        }
+    }
+    symbol_t **strings = malloc(count * sizeof(symbol_t*));
+    count = 0;
+    for (int i = 0; i < SYMBOL_TABLE_BUCKETS; ++i) {
+        for (symbol_t *string = gamefile->strings->symbol_buckets[i]; string; string = string->next) {
+            strings[count++] = string;
+        }
+    }
+    qsort(strings, count, sizeof(symbol_t*), compare_symbol_names);
+
+    codebuf_t *image = &gamefile->image;
+    for (unsigned i = 0; i < count; ++i) {
+        symbol_t *string = strings[i];
+        string->position = image->size;
+        char *latin1 = malloc(strlen(string->name) + 1);
+        if (utf8_to_latin1(string->name, latin1) == 0) {
+            codebuf_add_byte(image, STRING_E0);
+            for (const char *c = latin1; *c; ++c) {
+                codebuf_add_byte(image, *c);
+            }
+            codebuf_add_byte(image, 0);
+        } else {
+            codebuf_add_word(image, STRING_E2 << 24);
+            for (const char *c = string->name; *c; ) {
+                codebuf_add_word(image, decode_utf8(&c));
+            }
+            codebuf_add_word(image, 0);
+        }
+        free(latin1);
+    }
+    free(strings);
+}
+
+/*
+Place either the global variables that are written or those that are not,
+each in a word holding its initial value. Like strings, they are placed in
+sorted order.
+*/
+void layout_globals(glulxfile_t *gamefile, int is_written) {
+    symboltable_t *symbols = gamefile->global_symbols;
+    unsigned count = 0;
+    for (int i = 0; i < SYMBOL_TABLE_BUCKETS; ++i) {
+        for (symbol_t *symbol = symbols->symbol_buckets[i]; symbol; symbol = symbol->next) {
+            count += symbol->type == SYM_GLOBAL && symbol->is_written == is_written;
+        }
+    }
+    symbol_t **globals = malloc((count ? count : 1) * sizeof(symbol_t*));
+    count = 0;
+    for (int i = 0; i < SYMBOL_TABLE_BUCKETS; ++i) {
+        for (symbol_t *symbol = symbols->symbol_buckets[i]; symbol; symbol = symbol->next) {
+            if (symbol->type == SYM_GLOBAL && symbol->is_written == is_written) {
+                globals[count++] = symbol;
+            }
+        }
+    }
+    qsort(globals, count, sizeof(symbol_t*), compare_symbol_names);
+
+    for (unsigned i = 0; i < count; ++i) {
+        globals[i]->position = gamefile->image.size;
+        codebuf_add_word(&gamefile->image, globals[i]->data.value);
+    }
+    free(globals);
+}
+
+/*
+Number every property, in sorted order of their names so that each has the
+same number however the objects that use it were compiled. Numbers start at
+one and are kept in the position of the property's symbol, which is the
+value code uses for the property.
+*/
+void number_properties(glulxfile_t *gamefile) {
+    symboltable_t *symbols = gamefile->global_symbols;
+    unsigned count = 0;
+    for (int i = 0; i < SYMBOL_TABLE_BUCKETS; ++i) {
+        for (symbol_t *symbol = symbols->symbol_buckets[i]; symbol; symbol = symbol->next) {
+            count += symbol->type == SYM_PROPERTY;
+        }
+    }
+    symbol_t **properties = malloc((count ? count : 1) * sizeof(symbol_t*));
+    count = 0;
+    for (int i = 0; i < SYMBOL_TABLE_BUCKETS; ++i) {
+        for (symbol_t *symbol = symbols->symbol_buckets[i]; symbol; symbol = symbol->next) {
+            if (symbol->type == SYM_PROPERTY) {
+                properties[count++] = symbol;
+            }
+        }
+    }
+    qsort(properties, count, sizeof(symbol_t*), compare_symbol_names);
+    for (unsigned i = 0; i < count; ++i) {
+        properties[i]->position = i + 1;
+    }
+    free(properties);
+}
+
+/*
+Returns true if code stores to any of an object's properties, so that its
+table must be placed in RAM.
+*/
+int is_written_object(object_t *object) {
+    for (unsigned i = 0; i < object->property_count; ++i) {
+        if (object->properties[i].property->is_written) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int compare_object_names(const void *a, const void *b) {
+    const object_t *first = *(const object_t**)a;
+    const object_t *second = *(const object_t**)b;
+    return strcmp(first->name, second->name);
+}
+
+int compare_property_numbers(const void *a, const void *b) {
+    const objproperty_t *first = *(const objproperty_t**)a;
+    const objproperty_t *second = *(const objproperty_t**)b;
+    if (first->property->position == second->property->position) return 0;
+    return first->property->position < second->property->position ? -1 : 1;
+}
+
+/*
+Place the property table of an object: the number of properties, followed by
+a record for each of them holding its number and its value, sorted by number
+so that code can find a property with binarysearch. The object's address is
+that of its first record. Returns non-zero if a value names a symbol that no
+object defines.
+*/
+int layout_object(glulxfile_t *gamefile, object_t *object) {
+    int has_errors = 0;
+    objproperty_t **properties = malloc((object->property_count ? object->property_count : 1)
+                                        * sizeof(objproperty_t*));
+    for (unsigned i = 0; i < object->property_count; ++i) {
+        properties[i] = &object->properties[i];
+    }
+    qsort(properties, object->property_count, sizeof(objproperty_t*),
+          compare_property_numbers);
+
+    codebuf_add_word(&gamefile->image, object->property_count);
+    get_symbol(gamefile->global_symbols, object->name)->position = gamefile->image.size;
+    for (unsigned i = 0; i < object->property_count; ++i) {
+        asmoperand_t *value = &properties[i]->value;
+        codebuf_add_word(&gamefile->image, properties[i]->property->position);
+        symbol_t *target = 0;
+        if (value->type == OP_IDENTIFIER) {
+            target = get_symbol_hashed(gamefile->global_symbols, value->data.name, value->hash);
+            if (!target || target->type == SYM_IMPORT) {
+                fprintf(stderr, "LINK: undefined symbol \"%s\" used in object \"%s\".\n",
+                        value->data.name, object->name);
+                has_errors = 1;
+                target = 0;
+            }
+        } else if (value->type == OP_STRING) {
+            target = add_string(gamefile, value->data.name);
+        }
+        if (target) {
+            add_relocation(&gamefile->relocations, gamefile->image.size, RELOC_ABSOLUTE,
+                           target);
+        }
+        codebuf_add_word(&gamefile->image, target ? 0 : value->data.value);
+    }
+    free(properties);
+    return has_errors;
+}
+
+/*
+Place the tables of either the objects whose properties are written or
+those whose properties never are, in sorted order of their names. Returns
+non-zero if errors occured.
+*/
+int layout_objects(glulxfile_t *gamefile, int is_written) {
+    unsigned count = 0;
+    for (object_t *object = gamefile->objects; object; object = object->next) {
+        count += is_written_object(object) == is_written;
+    }
+    object_t **objects = malloc((count ? count : 1) * sizeof(object_t*));
+    count = 0;
+    for (object_t *object = gamefile->objects; object; object = object->next) {
+        if (is_written_object(object) == is_written) {
+            objects[count++] = object;
+        }
+    }
+    qsort(objects, count, sizeof(object_t*), compare_object_names);
+
+    int has_errors = 0;
+    for (unsigned i = 0; i < count; ++i) {
+        has_errors |= layout_object(gamefile, objects[i]);
+    }
+    free(objects);
+    return has_errors;
+}
+
+/*
+Place the dictionary, which the game searches for each word the player types.
+It begins with the size of an entry, the number of entries, and the address
+of its index or zero if it has none. Each entry holds the first
+DICT_RESOLUTION characters of a word padded with zeros, sorted so that
+binarysearch finds a word given a buffer holding it the same way. Characters
+are stored in Latin-1, a byte each. Words that are the same in their first
+DICT_RESOLUTION characters share an entry, which is reported since the
+player can't tell them apart; each word is given the number of its entry. A
+dictionary of at least DICT_INDEX_MIN entries has an index giving the address
+of the first entry and the number of entries for each first character, so a
+search only covers words beginning the same way. Returns non-zero if a word
+has characters that Latin-1 can't hold.
+*/
+int layout_dictionary(glulxfile_t *gamefile) {
+    symboltable_t *symbols = gamefile->global_symbols;
+    symbol_t *table = get_symbol(symbols, DICTIONARY_TABLE);
+    if (!table || !symbols->dictionary) return 0;
+
+    /* UTF-8 and Latin-1 both sort in order of character, so the words stay
+       sorted */
+    unsigned word_count = 0;
+    for (dictword_t *word = symbols->dictionary; word; word = word->next) {
+        ++word_count;
+    }
+    char **latin1 = malloc(word_count * sizeof(char*));
+    unsigned count = 0, i = 0;
+    int has_errors = 0;
+    dictword_t *first = 0;
+    char *first_latin1 = 0;
+    for (dictword_t *word = symbols->dictionary; word; word = word->next, ++i) {
+        latin1[i] = malloc(strlen(word->word) + 1);
+        unsigned c = utf8_to_latin1(word->word, latin1[i]);
+        if (c) {
+            fprintf(stderr, "LINK: dictionary word \"%s\" has character U+%04X, which "
+                    "is not in Latin-1.\n", word->word, c);
+            has_errors = 1;
+        }
+        if (first && strncmp(first_latin1, latin1[i], DICT_RESOLUTION) == 0) {
+            fprintf(stderr, "LINK: dictionary words \"%s\" and \"%s\" are the same in "
+                    "their first %d characters.\n", first->word, word->word, DICT_RESOLUTION);
+        } else {
+            first = word;
+            first_latin1 = latin1[i];
+            ++count;
+        }
+        word->index = count - 1;
+    }
+
+    codebuf_t *image = &gamefile->image;
+    int has_index = count >= DICT_INDEX_MIN;
+    table->position = image->size;
+    unsigned entries = table->position + DICT_HEADER_SIZE + (has_index ? DICT_INDEX_SIZE : 0);
+    codebuf_add_word(image, DICT_RESOLUTION);
+    codebuf_add_word(image, count);
+    codebuf_add_word(image, has_index ? table->position + DICT_HEADER_SIZE : 0);
+
+    /* the words sharing an entry come together, after the one that
+       begins it */
+    if (has_index) {
+        unsigned starts[256] = { 0 }, counts[256] = { 0 };
+        unsigned next = 0;
+        i = 0;
+        for (dictword_t *word = symbols->dictionary; word; word = word->next, ++i) {
+            if (word->index < next) continue;
+            unsigned char c = latin1[i][0];
+            if (counts[c]++ == 0) {
+                starts[c] = word->index;
+            }
+            ++next;
+        }
+        for (int c = 0; c < 256; ++c) {
+            codebuf_add_word(image, counts[c] ? entries + starts[c] * DICT_RESOLUTION : 0);
+            codebuf_add_word(image, counts[c]);
+        }
+    }
+
+    unsigned next = 0;
+    i = 0;
+    for (dictword_t *word = symbols->dictionary; word; word = word->next, ++i) {
+        char *name = dictionary_symbol_name(word->word);
+        get_symbol(symbols, name)->position = entries + word->index * DICT_RESOLUTION;
+        free(name);
+        if (word->index >= next) {
+            size_t length = strlen(latin1[i]);
+            for (unsigned j = 0; j < DICT_RESOLUTION; ++j) {
+                codebuf_add_byte(image, j < length ? latin1[i][j] : 0);
+            }
+            ++next;
+        }
+        free(latin1[i]);
+    }
+    free(latin1);
+    return has_errors;
+}
+
+/*
+Fill in every symbol reference in the story file. Relocations are stored in
+order of offset, so this is a single linear sweep over the image.
+*/
+void patch_relocations(glulxfile_t *gamefile) {
+    for (unsigned i = 0; i < gamefile->relocations.count; ++i) {
+        relocation_t *reloc = &gamefile->relocations.entries[i];
+        unsigned value = reloc->symbol->position + reloc->addend;
+        if (reloc->type == RELOC_BRANCH) {
+            /* branch offsets are relative to the end of the instruction,
+               which ends with the branch operand, less two */
+            value = value - (reloc->offset + 4) + 2;
+        }
+        codebuf_set_word(&gamefile->image, reloc->offset, value);
+    }
+}
+
+void write_header(glulxfile_t *gamefile, symbol_t *start) {
+    codebuf_t *image = &gamefile->image;
+    codebuf_set_word(image, HDR_MAGIC,       GLULX_MAGIC);
+    codebuf_set_word(image, HDR_VERSION,     GLULX_VERSION);
+    codebuf_set_word(image, HDR_RAMSTART,    gamefile->ram_start);
+    codebuf_set_word(image, HDR_EXTSTART,    image->size);
+    codebuf_set_word(image, HDR_ENDMEM,      gamefile->end_mem);
+    codebuf_set_word(image, HDR_STACKSIZE,   DEFAULT_STACK_SIZE);
+    codebuf_set_word(image, HDR_STARTFUNC,   start->position);
+    codebuf_set_word(image, HDR_DECODINGTBL, 0);
+    codebuf_set_word(image, HDR_CHECKSUM,    0);
+
+    unsigned checksum = 0;
+    for (unsigned i = 0; i < image->size; i += 4) {
+        checksum += ((unsigned)image->data[i] << 24) | (image->data[i + 1] << 16)
+                  | (image->data[i + 2] << 8) | image->data[i + 3];
+    }
+    codebuf_set_word(image, HDR_CHECKSUM, checksum);
+}
+
+/*
+Lay out the assembled functions and data into a story file image and resolve
+all symbol references. Returns non-zero if errors occured.
+*/
+int link_game(glulxfile_t *gamefile) {
+    symbol_t *start = get_symbol(gamefile->global_symbols, START_FUNCTION);
+    if (!start || start->type != SYM_FUNCTION) {
+        fprintf(stderr, "LINK: no function named \"%s\" to begin execution at.\n",
+                START_FUNCTION);
+        return 1;
+    }
+
+    free_codebuf(&gamefile->image);
+    free_reloctable(&gamefile->relocations);
+    for (int i = 0; i < GLULX_HEADER_SIZE; ++i) {
+        codebuf_add_byte(&gamefile->image, 0);
+    }
+
+    int has_errors = 0;
+    function_t *func = gamefile->functions;
+    while (func) {
+        has_errors |= layout_function(gamefile, func);
+        func = func->next;
+    }
+    if (has_errors) {
+        return 1;
+    }
+    layout_strings(gamefile);
+    find_written_globals(gamefile);
+    layout_globals(gamefile, 0);
+    number_properties(gamefile);
+    has_errors |= layout_objects(gamefile, 0);
+    has_errors |= layout_dictionary(gamefile);
+
+    while (gamefile->image.size % GLULX_PAGE_SIZE) {
+        codebuf_add_byte(&gamefile->image, 0);
+    }
+    gamefile->ram_start = gamefile->image.size;
+    layout_globals(gamefile, 1);
+    has_errors |= layout_objects(gamefile, 1);
+    if (has_errors) {
+        return 1;
+    }
+    while (gamefile->image.size % GLULX_PAGE_SIZE) {
+        codebuf_add_byte(&gamefile->image, 0);
+    }
+    gamefile->end_mem = gamefile->image.size;
+
+    /* profiling counters start at zero, so they go in the memory past the
+       end of the story file that the interpreter clears */
+    if (gamefile->profile) {
+        gamefile->profile_counters->position = gamefile->end_mem;
+        gamefile->end_mem += gamefile->counter_count * 4;
+        while (gamefile->end_mem % GLULX_PAGE_SIZE) {
+            ++gamefile->end_mem;
+        }
+        start = get_symbol(gamefile->global_symbols, PROFILE_START);
+    }
+
+    patch_relocations(gamefile);
+    write_header(gamefile, start);
+    return 0;
+}
+
+/*
+Write how a linked game's memory is divided between ROM and RAM, and how
+many of its globals and objects are in each.
+*/
+void print_memory_report(glulxfile_t *gamefile, FILE *out) {
+    unsigned rom_globals = 0, ram_globals = 0;
+    unsigned rom_objects = 0, ram_objects = 0;
+    for (object_t *object = gamefile->objects; object; object = object->next) {
+        if (is_written_object(object)) {
+            ++ram_objects;
+        } else {
+            ++rom_objects;
+        }
+    }
+    symboltable_t *symbols = gamefile->global_symbols;
+    for (int i = 0; i < SYMBOL_TABLE_BUCKETS; ++i) {
+        for (symbol_t *symbol = symbols->symbol_buckets[i]; symbol; symbol = symbol->next) {
+            if (symbol->type == SYM_GLOBAL) {
+                if (symbol->is_written) {
+                    ++ram_globals;
+                } else {
+                    ++rom_globals;
+                }
+            }
+        }
+    }
+    fprintf(out, "Memory:\n");
+    fprintf(out, "    ROM  %8u bytes, %u globals and %u objects never written\n",
+            gamefile->ram_start, rom_globals, rom_objects);
+    fprintf(out, "    RAM  %8u bytes, %u globals and %u objects\n",
+            gamefile->end_mem - gamefile->ram_start, ram_globals, ram_objects);
+}
+
+/*
+Write a linked story file to disk. Returns non-zero on failure.
+*/
+int write_game(glulxfile_t *gamefile, const char *filename) {
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        fprintf(stderr, "Could not open output file \"%s\"\n", filename);
+        return 1;
+    }
+    size_t written = fwrite(gamefile->image.data, 1, gamefile->image.size, fp);
+    fclose(fp);
+    if (written != gamefile->image.size) {
+        fprintf(stderr, "Error writing output file \"%s\"\n", filename);
+        return 1;
+    }
+    return 0;
+}
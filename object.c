@@ -0,0 +1,556 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gbuild.h"
+
+/*
+An object file holds the encoded functions of a single source file along with
+everything the linker needs to place them in a story file. Every number is a
+four byte, big-endian value and every name is stored as its length followed by
+its characters. In order, an object contains:
+
+    magic number and format version
+    string literals:    count, then each string
+    dictionary words:   count, then each word
+    global symbols:     count, then each kind (export, import, global,
+                        global that its code never writes, property,
+                        property that its code writes, object, or
+                        dictionary word) and name, followed by the
+                        initial value of a global
+    objects:            count, then for each object
+        index of its name among the global symbols
+        properties:     count, then each property's symbol index, the
+                        kind of its value (number, symbol or string) and
+                        the value or the index of its symbol or string
+    functions:          count, then for each function
+        index of its name among the global symbols
+        size of its code, then the code
+        labels:         count, then each offset and name; locals are not
+                        listed, since the code already holds their offsets
+        relocations:    count, then each offset, type, target kind and index
+
+Functions are stored in source order.
+*/
+
+/* "GOBJ" */
+#define OBJECT_MAGIC        0x474F424A
+#define OBJECT_VERSION      5
+
+/* kinds of global symbol */
+#define OBJSYM_EXPORT       0
+#define OBJSYM_IMPORT       1
+#define OBJSYM_GLOBAL       2
+#define OBJSYM_ROM_GLOBAL   3
+#define OBJSYM_PROPERTY     4
+#define OBJSYM_WRITTEN_PROPERTY 5
+#define OBJSYM_OBJECT       6
+#define OBJSYM_DICT_WORD    7
+
+/* the list a relocation's target index refers to */
+#define TARGET_SYMBOL       0
+#define TARGET_LABEL        1
+#define TARGET_STRING       2
+
+/* the kind of value a property has */
+#define VALUE_NUMBER        0
+#define VALUE_SYMBOL        1
+#define VALUE_STRING        2
+
+/*
+Reads the contents of an object file held in memory. Reading past the end of
+the data sets the error flag and returns zero.
+*/
+typedef struct OBJECT_READER {
+    unsigned char *data;
+    size_t size;
+    size_t pos;
+    int has_errors;
+} objreader_t;
+
+void put_name(codebuf_t *buffer, const char *name);
+void put_symbol_table(codebuf_t *buffer, symboltable_t *table);
+void put_function(codebuf_t *buffer, glulxfile_t *gamefile, function_t *function);
+void put_object(codebuf_t *buffer, glulxfile_t *gamefile, object_t *object);
+unsigned read_word(objreader_t *reader);
+unsigned read_count(objreader_t *reader);
+char* read_name(objreader_t *reader);
+int read_object_file(objreader_t *reader, const char *filename);
+int read_function(objreader_t *reader, glulxfile_t *gamefile, symbol_t **symbols,
+                  unsigned symbol_count, symbol_t **strings, unsigned string_count);
+int read_object(objreader_t *reader, glulxfile_t *gamefile, symbol_t **symbols,
+                unsigned symbol_count, symbol_t **strings, unsigned string_count);
+
+
+void put_name(codebuf_t *buffer, const char *name) {
+    unsigned length = strlen(name);
+    codebuf_add_word(buffer, length);
+    for (unsigned i = 0; i < length; ++i) {
+        codebuf_add_byte(buffer, name[i]);
+    }
+}
+
+/*
+Write every symbol in a table along with any data the symbol's type needs.
+Symbols have no address until the game is linked, so while an object is being
+written each symbol's position holds its index in the object instead.
+*/
+void put_symbol_table(codebuf_t *buffer, symboltable_t *table) {
+    unsigned count = 0;
+    for (int i = 0; table && i < SYMBOL_TABLE_BUCKETS; ++i) {
+        for (symbol_t *symbol = table->symbol_buckets[i]; symbol; symbol = symbol->next) {
+            count += symbol->type != SYM_LOCAL;
+        }
+    }
+    codebuf_add_word(buffer, count);
+
+    count = 0;
+    for (int i = 0; table && i < SYMBOL_TABLE_BUCKETS; ++i) {
+        for (symbol_t *symbol = table->symbol_buckets[i]; symbol; symbol = symbol->next) {
+            if (symbol->type == SYM_LOCAL) continue;
+            symbol->position = count++;
+            switch(symbol->type) {
+                case SYM_FUNCTION:  codebuf_add_word(buffer, OBJSYM_EXPORT);      break;
+                case SYM_IMPORT:    codebuf_add_word(buffer, OBJSYM_IMPORT);      break;
+                case SYM_GLOBAL:
+                    codebuf_add_word(buffer, symbol->is_written ? OBJSYM_GLOBAL
+                                                                : OBJSYM_ROM_GLOBAL);
+                    break;
+                case SYM_LABEL:     codebuf_add_word(buffer, symbol->data.value); break;
+                case SYM_OBJECT:    codebuf_add_word(buffer, OBJSYM_OBJECT);      break;
+                case SYM_DICT_WORD: codebuf_add_word(buffer, OBJSYM_DICT_WORD);   break;
+                case SYM_PROPERTY:
+                    codebuf_add_word(buffer, symbol->is_written ? OBJSYM_WRITTEN_PROPERTY
+                                                                : OBJSYM_PROPERTY);
+                    break;
+            }
+            put_name(buffer, symbol->name);
+            if (symbol->type == SYM_GLOBAL) {
+                codebuf_add_word(buffer, symbol->data.value);
+            }
+        }
+    }
+}
+
+void put_function(codebuf_t *buffer, glulxfile_t *gamefile, function_t *function) {
+    codebuf_add_word(buffer, get_symbol(gamefile->global_symbols, function->name)->position);
+    codebuf_add_word(buffer, function->output.size);
+    for (unsigned i = 0; i < function->output.size; ++i) {
+        codebuf_add_byte(buffer, function->output.data[i]);
+    }
+    put_symbol_table(buffer, function->locals);
+
+    codebuf_add_word(buffer, function->relocations.count);
+    for (unsigned i = 0; i < function->relocations.count; ++i) {
+        relocation_t *reloc = &function->relocations.entries[i];
+        codebuf_add_word(buffer, reloc->offset);
+        codebuf_add_word(buffer, reloc->type);
+        switch(reloc->symbol->type) {
+            case SYM_LABEL:     codebuf_add_word(buffer, TARGET_LABEL);  break;
+            case SYM_STRING:    codebuf_add_word(buffer, TARGET_STRING); break;
+            default:            codebuf_add_word(buffer, TARGET_SYMBOL);
+        }
+        codebuf_add_word(buffer, reloc->symbol->position);
+    }
+}
+
+/*
+Write an object's properties. Strings and symbols named by their values are
+given by their index in the object file.
+*/
+void put_object(codebuf_t *buffer, glulxfile_t *gamefile, object_t *object) {
+    codebuf_add_word(buffer, get_symbol(gamefile->global_symbols, object->name)->position);
+    codebuf_add_word(buffer, object->property_count);
+    for (unsigned i = 0; i < object->property_count; ++i) {
+        asmoperand_t *value = &object->properties[i].value;
+        codebuf_add_word(buffer, object->properties[i].property->position);
+        if (value->type == OP_IDENTIFIER) {
+            codebuf_add_word(buffer, VALUE_SYMBOL);
+            codebuf_add_word(buffer, get_symbol_hashed(gamefile->global_symbols,
+                                                       value->data.name,
+                                                       value->hash)->position);
+        } else if (value->type == OP_STRING) {
+            codebuf_add_word(buffer, VALUE_STRING);
+            codebuf_add_word(buffer, get_symbol(gamefile->strings, value->data.name)->position);
+        } else {
+            codebuf_add_word(buffer, VALUE_NUMBER);
+            codebuf_add_word(buffer, value->data.value);
+        }
+    }
+}
+
+/*
+Write the assembled functions of a game to an object file so they can be
+linked with other objects later. Returns non-zero on failure.
+*/
+int write_object(glulxfile_t *gamefile, const char *filename) {
+    codebuf_t buffer = { 0 };
+    find_written_globals(gamefile);
+    codebuf_add_word(&buffer, OBJECT_MAGIC);
+    codebuf_add_word(&buffer, OBJECT_VERSION);
+    put_symbol_table(&buffer, gamefile->strings);
+
+    unsigned count = 0;
+    for (dictword_t *word = gamefile->global_symbols->dictionary; word; word = word->next) {
+        ++count;
+    }
+    codebuf_add_word(&buffer, count);
+    for (dictword_t *word = gamefile->global_symbols->dictionary; word; word = word->next) {
+        put_name(&buffer, word->word);
+    }
+
+    put_symbol_table(&buffer, gamefile->global_symbols);
+
+    count = 0;
+    for (object_t *object = gamefile->objects; object; object = object->next) {
+        ++count;
+    }
+    codebuf_add_word(&buffer, count);
+    for (object_t *object = gamefile->objects; object; object = object->next) {
+        put_object(&buffer, gamefile, object);
+    }
+
+    /* the function list is in reverse source order */
+    count = 0;
+    function_t *last = gamefile->functions;
+    while (last && last->next) {
+        ++count;
+        last = last->next;
+    }
+    codebuf_add_word(&buffer, last ? count + 1 : 0);
+    for (function_t *func = last; func; func = func->prev) {
+        put_function(&buffer, gamefile, func);
+    }
+
+    int has_errors = 0;
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+        fprintf(stderr, "Could not open output file \"%s\"\n", filename);
+        has_errors = 1;
+    } else {
+        if (fwrite(buffer.data, 1, buffer.size, fp) != buffer.size) {
+            fprintf(stderr, "Error writing output file \"%s\"\n", filename);
+            has_errors = 1;
+        }
+        fclose(fp);
+    }
+    free_codebuf(&buffer);
+    return has_errors;
+}
+
+unsigned read_word(objreader_t *reader) {
+    if (reader->size - reader->pos < 4) {
+        reader->has_errors = 1;
+        reader->pos = reader->size;
+        return 0;
+    }
+    unsigned char *data = &reader->data[reader->pos];
+    reader->pos += 4;
+    return ((unsigned)data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+/*
+Read the number of entries in a list. Every entry takes at least four bytes,
+so a count larger than the rest of the file allows marks the file as damaged
+rather than causing a huge allocation.
+*/
+unsigned read_count(objreader_t *reader) {
+    unsigned count = read_word(reader);
+    if (count > (reader->size - reader->pos) / 4) {
+        reader->has_errors = 1;
+        return 0;
+    }
+    return count;
+}
+
+/*
+Read a name into a newly allocated string. Returns null if the file is
+damaged.
+*/
+char* read_name(objreader_t *reader) {
+    unsigned length = read_word(reader);
+    if (reader->has_errors || length > reader->size - reader->pos) {
+        reader->has_errors = 1;
+        return 0;
+    }
+    char *name = malloc(length + 1);
+    memcpy(name, &reader->data[reader->pos], length);
+    name[length] = 0;
+    reader->pos += length;
+    return name;
+}
+
+int read_object_file(objreader_t *reader, const char *filename) {
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        fprintf(stderr, "OBJECT: could not open \"%s\".\n", filename);
+        return 1;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (size < 0) {
+        fclose(fp);
+        fprintf(stderr, "OBJECT: could not read \"%s\".\n", filename);
+        return 1;
+    }
+
+    reader->data = malloc(size ? size : 1);
+    reader->size = fread(reader->data, 1, size, fp);
+    reader->pos = 0;
+    reader->has_errors = 0;
+    fclose(fp);
+    if (reader->size != (size_t)size) {
+        free(reader->data);
+        fprintf(stderr, "OBJECT: could not read \"%s\".\n", filename);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+Read one function from an object and add it to the game. Returns non-zero if
+errors occured.
+*/
+int read_function(objreader_t *reader, glulxfile_t *gamefile, symbol_t **symbols,
+                  unsigned symbol_count, symbol_t **strings, unsigned string_count) {
+    unsigned name_index = read_word(reader);
+    unsigned code_size = read_word(reader);
+    if (reader->has_errors || name_index >= symbol_count
+            || code_size > reader->size - reader->pos) {
+        reader->has_errors = 1;
+        return 1;
+    }
+
+    function_t *function = calloc(sizeof(function_t), 1);
+    function->name = strdup(symbols[name_index]->name);
+    function->output.data = malloc(code_size ? code_size : 1);
+    function->output.size = function->output.capacity = code_size;
+    memcpy(function->output.data, &reader->data[reader->pos], code_size);
+    reader->pos += code_size;
+
+    function->locals = calloc(sizeof(symboltable_t), 1);
+    function->locals->parent = gamefile->global_symbols;
+    unsigned label_count = read_count(reader);
+    symbol_t **labels = calloc(sizeof(symbol_t*), label_count ? label_count : 1);
+    for (unsigned i = 0; i < label_count && !reader->has_errors; ++i) {
+        unsigned offset = read_word(reader);
+        char *name = read_name(reader);
+        if (!name) break;
+        labels[i] = calloc(sizeof(symbol_t), 1);
+        labels[i]->name = name;
+        labels[i]->type = SYM_LABEL;
+        labels[i]->data.value = offset;
+        add_symbol(function->locals, labels[i]);
+    }
+
+    unsigned reloc_count = read_count(reader);
+    for (unsigned i = 0; i < reloc_count && !reader->has_errors; ++i) {
+        unsigned offset = read_word(reader);
+        unsigned type = read_word(reader);
+        unsigned target_kind = read_word(reader);
+        unsigned target = read_word(reader);
+        symbol_t *symbol = 0;
+        switch(target_kind) {
+            case TARGET_SYMBOL:
+                symbol = target < symbol_count ? symbols[target] : 0;
+                break;
+            case TARGET_LABEL:
+                symbol = target < label_count ? labels[target] : 0;
+                break;
+            case TARGET_STRING:
+                symbol = target < string_count ? strings[target] : 0;
+                break;
+        }
+        if (!symbol || offset > code_size || code_size - offset < 4
+                || (type != RELOC_ABSOLUTE && type != RELOC_BRANCH)) {
+            reader->has_errors = 1;
+            break;
+        }
+        add_relocation(&function->relocations, offset, type, symbol);
+    }
+    free(labels);
+
+    if (reader->has_errors || !define_function(gamefile, function)) {
+        free_function(function);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+Read one object from an object file and add it to the game. Returns non-zero
+if errors occured.
+*/
+int read_object(objreader_t *reader, glulxfile_t *gamefile, symbol_t **symbols,
+                unsigned symbol_count, symbol_t **strings, unsigned string_count) {
+    unsigned name_index = read_word(reader);
+    unsigned property_count = read_count(reader);
+    if (reader->has_errors || name_index >= symbol_count
+            || symbols[name_index]->type != SYM_OBJECT) {
+        reader->has_errors = 1;
+        return 1;
+    }
+
+    object_t *object = calloc(sizeof(object_t), 1);
+    object->name = strdup(symbols[name_index]->name);
+    object->properties = calloc(sizeof(objproperty_t), property_count ? property_count : 1);
+    for (unsigned i = 0; i < property_count && !reader->has_errors; ++i) {
+        unsigned property = read_word(reader);
+        unsigned kind = read_word(reader);
+        unsigned value = read_word(reader);
+        if (reader->has_errors || property >= symbol_count
+                || symbols[property]->type != SYM_PROPERTY) {
+            reader->has_errors = 1;
+            break;
+        }
+        asmoperand_t *operand = &object->properties[i].value;
+        object->properties[i].property = symbols[property];
+        if (kind == VALUE_NUMBER) {
+            operand->type = OP_INTEGER;
+            operand->data.value = value;
+        } else if (kind == VALUE_SYMBOL && value < symbol_count) {
+            operand->type = OP_IDENTIFIER;
+            operand->hash = hash_string(symbols[value]->name);
+            operand->data.name = strdup(symbols[value]->name);
+        } else if (kind == VALUE_STRING && value < string_count && strings[value]) {
+            operand->type = OP_STRING;
+            operand->data.name = strdup(strings[value]->name);
+        } else {
+            reader->has_errors = 1;
+            break;
+        }
+        ++object->property_count;
+    }
+
+    if (reader->has_errors) {
+        free_object(object);
+        return 1;
+    }
+    object_t **last = &gamefile->objects;
+    while (*last) {
+        last = &(*last)->next;
+    }
+    *last = object;
+    return 0;
+}
+
+/*
+Add the functions, strings and dictionary words of an object file to a game.
+Functions imported by the object are resolved against functions already in the
+game or, failing that, left as placeholders to be filled in by later objects
+or source files. Returns non-zero if errors occured.
+*/
+int load_object(glulxfile_t *gamefile, const char *filename) {
+    objreader_t reader;
+    if (read_object_file(&reader, filename)) {
+        return 1;
+    }
+
+    if (read_word(&reader) != OBJECT_MAGIC) {
+        fprintf(stderr, "OBJECT: \"%s\" is not an object file.\n", filename);
+        free(reader.data);
+        return 1;
+    }
+    if (read_word(&reader) != OBJECT_VERSION) {
+        fprintf(stderr, "OBJECT: \"%s\" was written by an unsupported version of gbuild.\n",
+                filename);
+        free(reader.data);
+        return 1;
+    }
+
+    int has_errors = 0;
+    unsigned string_count = read_count(&reader);
+    symbol_t **strings = calloc(sizeof(symbol_t*), string_count ? string_count : 1);
+    for (unsigned i = 0; i < string_count && !reader.has_errors; ++i) {
+        char *text = read_name(&reader);
+        if (text) {
+            strings[i] = add_string(gamefile, text);
+            free(text);
+        }
+    }
+
+    unsigned word_count = read_count(&reader);
+    for (unsigned i = 0; i < word_count && !reader.has_errors; ++i) {
+        char *word = read_name(&reader);
+        if (word) {
+            add_dictionary_word(gamefile->global_symbols, word);
+            free(word);
+        }
+    }
+
+    /* exported names get a placeholder until their function is read */
+    unsigned symbol_count = read_count(&reader);
+    symbol_t **symbols = calloc(sizeof(symbol_t*), symbol_count ? symbol_count : 1);
+    for (unsigned i = 0; i < symbol_count && !reader.has_errors; ++i) {
+        unsigned kind = read_word(&reader);
+        char *name = read_name(&reader);
+        if (!name) break;
+        if (kind > OBJSYM_DICT_WORD) {
+            reader.has_errors = 1;
+            free(name);
+            break;
+        }
+        symbols[i] = get_symbol(gamefile->global_symbols, name);
+        int is_global = kind == OBJSYM_GLOBAL || kind == OBJSYM_ROM_GLOBAL;
+        int is_property = kind == OBJSYM_PROPERTY || kind == OBJSYM_WRITTEN_PROPERTY;
+        if (is_global && symbols[i] && symbols[i]->type != SYM_IMPORT) {
+            fprintf(stderr, "OBJECT: global \"%s\" is already defined.\n", name);
+            has_errors = 1;
+        }
+        if (kind == OBJSYM_OBJECT && symbols[i] && symbols[i]->type != SYM_IMPORT) {
+            fprintf(stderr, "OBJECT: object \"%s\" is already defined.\n", name);
+            has_errors = 1;
+        }
+        /* dictionary words were added along with their symbols */
+        if ((is_property && symbols[i] && symbols[i]->type != SYM_PROPERTY)
+                || (kind == OBJSYM_DICT_WORD
+                    && (!symbols[i] || symbols[i]->type != SYM_DICT_WORD))) {
+            reader.has_errors = 1;
+            free(name);
+            break;
+        }
+        if (symbols[i]) {
+            free(name);
+        } else {
+            symbols[i] = calloc(sizeof(symbol_t), 1);
+            symbols[i]->name = name;
+            symbols[i]->type = SYM_IMPORT;
+            add_symbol(gamefile->global_symbols, symbols[i]);
+        }
+        if (is_global) {
+            int value = read_word(&reader);
+            if (symbols[i]->type == SYM_IMPORT) {
+                symbols[i]->type = SYM_GLOBAL;
+                symbols[i]->data.value = value;
+                symbols[i]->is_written = kind == OBJSYM_GLOBAL;
+            }
+        } else if (is_property) {
+            symbols[i]->type = SYM_PROPERTY;
+            symbols[i]->is_written |= kind == OBJSYM_WRITTEN_PROPERTY;
+        } else if (kind == OBJSYM_OBJECT && symbols[i]->type == SYM_IMPORT) {
+            symbols[i]->type = SYM_OBJECT;
+        }
+    }
+
+    unsigned object_count = read_count(&reader);
+    for (unsigned i = 0; i < object_count && !reader.has_errors; ++i) {
+        has_errors |= read_object(&reader, gamefile, symbols, symbol_count,
+                                  strings, string_count);
+    }
+
+    unsigned function_count = read_count(&reader);
+    for (unsigned i = 0; i < function_count && !reader.has_errors; ++i) {
+        has_errors |= read_function(&reader, gamefile, symbols, symbol_count,
+                                    strings, string_count);
+    }
+
+    if (reader.has_errors) {
+        fprintf(stderr, "OBJECT: \"%s\" is damaged.\n", filename);
+        has_errors = 1;
+    }
+    free(symbols);
+    free(strings);
+    free(reader.data);
+    return has_errors;
+}
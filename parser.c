@@ -1,23 +1,130 @@
 #include <ctype.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "gbuild.h"
+#include "grammar.h"
+
+/*
+The statements following a case or default of a switch statement.
+*/
+typedef struct SWITCH_GROUP {
+    char *label;
+    codeblock_t *code;
+    int is_default;
+} switchgroup_t;
+
+/* statements that contain other statements */
+enum frame_type_t {
+    FRAME_BLOCK,
+    FRAME_IF,
+    FRAME_ELSE,
+    FRAME_WHILE,
+    FRAME_SWITCH
+};
+
+/*
+A statement containing others that the parser has begun but not finished.
+These are kept on a stack rather than parsed by recursion, so how deeply
+statements can be nested is not limited by the C stack.
+*/
+typedef struct PARSE_FRAME {
+    int type;
+    /* the code statements are added to, and how many have been added */
+    codeblock_t *code;
+    unsigned statement_count;
+
+    /* the labels of an if or while, and the condition a while tests after
+       its statement */
+    char labels[2][48];
+    expression_t *condition;
+
+    /* the value a switch tests and its cases so far, and where the switch
+       begins for errors found once it ends */
+    char prefix[32];
+    asmoperand_t value;
+    switchgroup_t *groups;
+    unsigned group_count;
+    switchcase_t *cases;
+    unsigned case_count;
+    const char *filename;
+    int line;
+    int column;
+} parseframe_t;
+
+typedef struct PARSE_STACK {
+    parseframe_t *frames;
+    unsigned count;
+    unsigned capacity;
+} parsestack_t;
 
 int match(lexertoken_t *token, int type);
 int match_text(lexertoken_t *token, int type, const char *text);
 int match_int(lexertoken_t *token, int type, int value);
+int match_keyword(lexertoken_t *token, int keyword);
+int token_terminal(lexertoken_t *token);
 
 void show_error(lexertoken_t *where, const char *message);
-void advance(lexertoken_t **token);
+void show_trace(lexertoken_t *where, const char *message);
+lexertoken_t* current(lexer_t *lexer);
+void advance(lexer_t *lexer);
 
 void add_to_block(codeblock_t *code, statement_t *what);
 
-function_t* parse_function(lexertoken_t **current);
-codeblock_t* parse_codeblock(lexertoken_t **current);
-asmblock_t* parse_asmblock(lexertoken_t **current);
-asmstmt_t* parse_asmstmt(lexertoken_t **current);
+void skip_definition(lexer_t *lexer);
+void skip_statement(lexer_t *lexer, size_t start, int end);
+int parse_constant(glulxfile_t *gamedata, lexer_t *lexer);
+int parse_global(glulxfile_t *gamedata, lexer_t *lexer);
+symbol_t* property_symbol(glulxfile_t *gamedata, const char *name);
+void set_dictionary_operand(asmoperand_t *operand, const char *word);
+int parse_property_value(glulxfile_t *gamedata, lexer_t *lexer, asmoperand_t *value);
+int parse_object(glulxfile_t *gamedata, lexer_t *lexer);
+int parse_expression(glulxfile_t *gamedata, lexer_t *lexer, int min_precedence, int *result);
+int parse_unary(glulxfile_t *gamedata, lexer_t *lexer, int *result);
+int binary_precedence(lexertoken_t *token);
+int fold_binary(lexertoken_t *where, const char *op, int left, int right, int *result);
+function_t* parse_function(glulxfile_t *gamedata, lexer_t *lexer);
+int parse_parameters(glulxfile_t *gamedata, lexer_t *lexer, function_t *function);
+int skip_function_body(lexer_t *lexer, function_t *function);
+parseframe_t* push_frame(parsestack_t *stack, int type, codeblock_t *code);
+codeblock_t* frame_code(parseframe_t *frame);
+void free_parse_frame(parseframe_t *frame);
+codeblock_t* finish_frame(lexer_t *lexer, parsestack_t *stack);
+int parse_statement(glulxfile_t *gamedata, lexer_t *lexer, function_t *function,
+                    parsestack_t *stack);
+expression_t* new_expression(int type, lexertoken_t *where);
+int is_constant_expression(expression_t *expr);
+void fold_expression(expression_t *expr, int value);
+expression_t* parse_code_expression(glulxfile_t *gamedata, lexer_t *lexer, function_t *function);
+expression_t* parse_code_binary(glulxfile_t *gamedata, lexer_t *lexer, function_t *function,
+                                int min_precedence);
+expression_t* parse_code_unary(glulxfile_t *gamedata, lexer_t *lexer, function_t *function);
+expression_t* parse_code_name(glulxfile_t *gamedata, lexer_t *lexer, function_t *function);
+expression_t* parse_code_properties(glulxfile_t *gamedata, lexer_t *lexer, expression_t *expr);
+int parse_call_arguments(glulxfile_t *gamedata, lexer_t *lexer, function_t *function,
+                         expression_t *call);
+expression_t* parse_condition(glulxfile_t *gamedata, lexer_t *lexer, function_t *function);
+int parse_expression_statement(glulxfile_t *gamedata, lexer_t *lexer, function_t *function,
+                               codeblock_t *code);
+int parse_local(glulxfile_t *gamedata, lexer_t *lexer, function_t *function,
+                codeblock_t *code);
+int parse_return(glulxfile_t *gamedata, lexer_t *lexer, function_t *function,
+                 codeblock_t *code);
+int begin_if(glulxfile_t *gamedata, lexer_t *lexer, function_t *function,
+             parsestack_t *stack);
+int begin_while(glulxfile_t *gamedata, lexer_t *lexer, function_t *function,
+                parsestack_t *stack);
+int compare_cases(const void *a, const void *b);
+void add_asm_to_block(codeblock_t *code, asmblock_t *block);
+void add_code_to_block(codeblock_t *code, codeblock_t *inner);
+int parse_switch_value(glulxfile_t *gamedata, lexer_t *lexer, asmoperand_t *value);
+int begin_switch(glulxfile_t *gamedata, lexer_t *lexer, parsestack_t *stack);
+int parse_switch_label(glulxfile_t *gamedata, lexer_t *lexer, parseframe_t *frame);
+codeblock_t* finish_switch(parseframe_t *frame);
+asmblock_t* parse_asmblock(glulxfile_t *gamedata, lexer_t *lexer);
+int parse_asmstmt(glulxfile_t *gamedata, lexer_t *lexer, asmblock_t *block);
 
 
 int match(lexertoken_t *token, int type) {
@@ -47,18 +154,64 @@ int match_int(lexertoken_t *token, int type, int value) {
     return 1;
 }
 
+/*
+Returns true if a token is the reserved word with the number given.
+*/
+int match_keyword(lexertoken_t *token, int keyword) {
+    return token && token->type == RESERVED && token->keyword == keyword;
+}
+
+/*
+Return the column of the parse tables for a token: its type, or a column of
+its own for a reserved word. The end of the file has no column, so gives
+that of unknown tokens.
+*/
+int token_terminal(lexertoken_t *token) {
+    if (token == 0) {
+        return UNKNOWN;
+    }
+    return token->type == RESERVED ? TERMINAL_KEYWORD + token->keyword : token->type;
+}
+
+/*
+Report an error at a token, or at the end of the file if there is no token.
+Errors are collected rather than written out at once; see diag.c.
+*/
 void show_error(lexertoken_t *where, const char *message) {
-    fprintf(stderr, "%s:%d:%d   %s\n",
-            where->filename, where->line_no, where->col_no,
-            message);
+    if (where == 0) {
+        report_diagnostic(DIAG_ERROR, "parser", 0, 0, 0, "%s", message);
+        return;
+    }
+    report_diagnostic(DIAG_ERROR, "parser", where->filename, where->line_no, where->col_no,
+                      "%s", message);
 }
 
-void advance(lexertoken_t **token) {
-    if (*token != 0) {
-        *token = (*token)->next;
+/*
+Report what the parser has begun at a token, which is only kept when the
+verbosity has been raised.
+*/
+void show_trace(lexertoken_t *where, const char *message) {
+    if (where) {
+        report_diagnostic(DIAG_TRACE, "parser", where->filename, where->line_no, where->col_no,
+                          "%s", message);
     }
 }
 
+/*
+Return the token at the current position, or null at the end of the file.
+*/
+lexertoken_t* current(lexer_t *lexer) {
+    return lexer_token(lexer, 0);
+}
+
+/*
+Move past the current token. Tokens are recycled once they are passed, so
+anything needed from a token must be copied before advancing.
+*/
+void advance(lexer_t *lexer) {
+    lexer_advance(lexer);
+}
+
 void add_to_block(codeblock_t *code, statement_t *what) {
     if (code == 0 || what == 0) return;
 
@@ -74,87 +227,637 @@ void add_to_block(codeblock_t *code, statement_t *what) {
     work->next = what;
 }
 
-void add_to_asmblock(asmblock_t *asmb, asmstmt_t *what) {
-    if (asmb == 0 || what == 0) return;
+/*
+Parse every definition in a file. After an error the parser skips to the next
+definition and carries on, so that one build reports the errors in all of
+them. Returns non-zero if errors occured.
+*/
+int parse_file(glulxfile_t *gamedata, lexer_t *lexer) {
+    int has_errors = 0;
+
+    while (current(lexer)) {
+        int failed = 0;
+        switch (top_def_table[token_terminal(current(lexer))]) {
+            case TOP_DEF_FUNCTION_DEF: {
+                function_t *new_func = parse_function(gamedata, lexer);
+                if (!new_func) {
+                    failed = 1;
+                } else if (!define_function(gamedata, new_func)) {
+                    free_function(new_func);
+                    has_errors = 1;
+                }
+                break;
+            }
+            case TOP_DEF_CONSTANT_DEF:
+                failed = parse_constant(gamedata, lexer);
+                break;
+            case TOP_DEF_GLOBAL_DEF:
+                failed = parse_global(gamedata, lexer);
+                break;
+            case TOP_DEF_OBJECT_DEF:
+                failed = parse_object(gamedata, lexer);
+                break;
+            default:
+                show_error(current(lexer), "Unexpected token type");
+                advance(lexer);
+                failed = 1;
+        }
+        if (failed) {
+            skip_definition(lexer);
+            has_errors = 1;
+        }
+    }
 
-    if (asmb->content == 0) {
-        asmb->content = what;
+    return has_errors;
+}
+
+/*
+Parse a source file into the game. A large file is lexed by up to
+thread_count threads before it is parsed. Returns non-zero if errors
+occured.
+*/
+int read_source(glulxfile_t *gamedata, const char *filename, unsigned thread_count) {
+    lexer_t *lexer = open_lexer_file_threads(gamedata, filename, thread_count);
+    if (!lexer) {
+        return 1;
+    }
+    int has_errors = parse_file(gamedata, lexer);
+    has_errors |= lexer_has_errors(lexer);
+    close_lexer(lexer);
+    return has_errors;
+}
+
+/*
+Skip the rest of a definition that could not be parsed, up to the next token
+outside of braces that begins a definition.
+*/
+void skip_definition(lexer_t *lexer) {
+    int depth = 0;
+    while (current(lexer)) {
+        if (depth == 0 && top_def_table[token_terminal(current(lexer))] != TOP_DEF_NONE) {
+            return;
+        } else if (match(current(lexer), OPEN_BRACE)) {
+            ++depth;
+        } else if (match(current(lexer), CLOSE_BRACE) && depth > 0) {
+            --depth;
+        }
+        advance(lexer);
+    }
+}
+
+/*
+Skip the rest of a statement beginning at offset start that could not be
+parsed: up to and past the token given or a semicolon, or past a block begun
+before either, or up to the brace ending the block the statement is in.
+Nothing is skipped if the statement's last token was reached before the
+error.
+*/
+void skip_statement(lexer_t *lexer, size_t start, int end) {
+    int last = lexer_consumed_type(lexer);
+    if (lexer_offset(lexer) != start && (last == end || last == CLOSE_BRACE)) {
         return;
     }
+    int depth = 0;
+    while (current(lexer)) {
+        if (match(current(lexer), OPEN_BRACE)) {
+            ++depth;
+        } else if (match(current(lexer), CLOSE_BRACE)) {
+            if (depth == 0) {
+                return;
+            } else if (--depth == 0) {
+                advance(lexer);
+                return;
+            }
+        } else if (depth == 0 && (match(current(lexer), end)
+                                  || match(current(lexer), SEMICOLON))) {
+            advance(lexer);
+            return;
+        }
+        advance(lexer);
+    }
+}
 
-    asmstmt_t *work = asmb->content;
-    while (work->next) {
-        work = work->next;
+
+/*
+Parse a named constant definition and add it to the game's constants. The
+value is evaluated immediately, so constants must be defined before use.
+Returns non-zero if errors occured.
+*/
+int parse_constant(glulxfile_t *gamedata, lexer_t *lexer) {
+    if (!match_keyword(current(lexer), KW_CONSTANT)) {
+        show_error(current(lexer), "Expected keyword \"constant\"");
+        return 1;
     }
-    work->next = what;
+    advance(lexer);
+
+    if (!match(current(lexer), IDENTIFIER)) {
+        show_error(current(lexer), "Expected identifier");
+        return 1;
+    }
+    if (gamedata->constants && get_symbol_hashed(gamedata->constants,
+                                                 current(lexer)->data.text,
+                                                 current(lexer)->hash)) {
+        show_error(current(lexer), "constant already defined");
+        return 1;
+    }
+    char *name = strdup(current(lexer)->data.text);
+    unsigned hash = current(lexer)->hash;
+    advance(lexer);
+
+    if (!match_text(current(lexer), OPERATOR, "=")) {
+        show_error(current(lexer), "Expected '='");
+        free(name);
+        return 1;
+    }
+    advance(lexer);
+
+    int value = 0;
+    if (parse_expression(gamedata, lexer, 0, &value)) {
+        free(name);
+        return 1;
+    }
+
+    if (!match(current(lexer), SEMICOLON)) {
+        show_error(current(lexer), "Expected ';'");
+        free(name);
+        return 1;
+    }
+    advance(lexer);
+
+    if (gamedata->constants == 0) {
+        gamedata->constants = calloc(sizeof(symboltable_t), 1);
+    }
+    symbol_t *symbol = calloc(sizeof(symbol_t), 1);
+    symbol->name = name;
+    symbol->type = SYM_CONSTANT;
+    symbol->data.value = value;
+    add_symbol_hashed(gamedata->constants, symbol, hash);
+    return 0;
 }
 
-int parse_file(glulxfile_t *gamedata, tokenlist_t *tokens) {
-    int has_errors = 0;
+/*
+Parse a global variable definition, which gives the variable a word of
+memory holding the value given, or zero if none is:
 
-    lexertoken_t *current = tokens->first;
-    while (current) {
-        if (match_text(current, RESERVED, "function")) {
-            function_t *new_func = parse_function(&current);
-            if (new_func) {
-                new_func->next = gamedata->functions;
-                if (gamedata->functions) {
-                    gamedata->functions->prev = new_func;
-                }
-                gamedata->functions = new_func;
-                
-                symbol_t *symbol = calloc(sizeof(symbol_t), 1);
-                symbol->name = strdup(new_func->name);
-                symbol->type = SYM_FUNCTION;
-                symbol->data.func = new_func;
-                add_symbol(gamedata->global_symbols, symbol);
-            } else {
+    global score = 10;
+
+Naming a global in code refers to the value in its memory. Returns non-zero
+if errors occured.
+*/
+int parse_global(glulxfile_t *gamedata, lexer_t *lexer) {
+    advance(lexer);
+
+    lexertoken_t *token = current(lexer);
+    if (!match(token, IDENTIFIER) || strcmp(token->data.text, "sp") == 0) {
+        show_error(token, "Expected identifier");
+        return 1;
+    }
+    if (get_symbol_hashed(gamedata->global_symbols, token->data.text, token->hash)
+            || (gamedata->constants && get_symbol_hashed(gamedata->constants,
+                                                         token->data.text, token->hash))) {
+        show_error(token, "name already defined");
+        return 1;
+    }
+    char *name = strdup(token->data.text);
+    unsigned hash = token->hash;
+    advance(lexer);
+
+    int value = 0;
+    if (match_text(current(lexer), OPERATOR, "=")) {
+        advance(lexer);
+        if (parse_expression(gamedata, lexer, 0, &value)) {
+            free(name);
+            return 1;
+        }
+    }
+    if (!match(current(lexer), SEMICOLON)) {
+        show_error(current(lexer), "Expected ';'");
+        free(name);
+        return 1;
+    }
+    advance(lexer);
+
+    symbol_t *symbol = calloc(sizeof(symbol_t), 1);
+    symbol->name = name;
+    symbol->type = SYM_GLOBAL;
+    symbol->data.value = value;
+    add_symbol_hashed(gamedata->global_symbols, symbol, hash);
+    return 0;
+}
+
+/*
+Find the symbol of a property, adding it if this is the first time the
+property is named. Property symbols are named with a leading dot, so they
+never clash with any other name.
+*/
+symbol_t* property_symbol(glulxfile_t *gamedata, const char *name) {
+    char *symbol_name = malloc(strlen(name) + 2);
+    symbol_name[0] = '.';
+    strcpy(&symbol_name[1], name);
+    symbol_t *symbol = get_symbol(gamedata->global_symbols, symbol_name);
+    if (symbol) {
+        free(symbol_name);
+        return symbol;
+    }
+    symbol = calloc(sizeof(symbol_t), 1);
+    symbol->name = symbol_name;
+    symbol->type = SYM_PROPERTY;
+    add_symbol(gamedata->global_symbols, symbol);
+    return symbol;
+}
+
+/*
+Make an operand name the dictionary entry of a word. The lexer added the word
+to the dictionary when it was read.
+*/
+void set_dictionary_operand(asmoperand_t *operand, const char *word) {
+    operand->type = OP_IDENTIFIER;
+    operand->data.name = dictionary_symbol_name(word);
+    operand->hash = hash_string(operand->data.name);
+}
+
+/*
+Parse the value given to a property of an object: a string, a dictionary
+word, the name of a function, object or global whose address is the value,
+or a constant expression. Names are looked up when the game is linked, so they may be
+defined later or in another object. Returns non-zero if errors occured.
+*/
+int parse_property_value(glulxfile_t *gamedata, lexer_t *lexer, asmoperand_t *value) {
+    lexertoken_t *token = current(lexer);
+    memset(value, 0, sizeof(asmoperand_t));
+    if (match(token, STRING)) {
+        value->type = OP_STRING;
+        value->data.name = strdup(token->data.text);
+        add_string(gamedata, value->data.name);
+        advance(lexer);
+    } else if (match(token, DICT_WORD)) {
+        set_dictionary_operand(value, token->data.text);
+        advance(lexer);
+    } else if (match(token, IDENTIFIER) && strcmp(token->data.text, "sp") != 0
+               && !(gamedata->constants && get_symbol_hashed(gamedata->constants,
+                                                             token->data.text, token->hash))) {
+        value->type = OP_IDENTIFIER;
+        value->hash = token->hash;
+        value->data.name = strdup(token->data.text);
+        advance(lexer);
+    } else {
+        value->type = OP_INTEGER;
+        return parse_expression(gamedata, lexer, 0, &value->data.value);
+    }
+    return 0;
+}
+
+/*
+Parse an object definition, which gives the object a table of properties
+and their values:
+
+    object lamp {
+        name = "brass lamp";
+        weight = 3;
+    }
+
+Naming the object in code gives the address of its table, and the value of
+a property is found with lamp.weight. Returns non-zero if errors occured.
+*/
+int parse_object(glulxfile_t *gamedata, lexer_t *lexer) {
+    advance(lexer);
+
+    lexertoken_t *token = current(lexer);
+    if (!match(token, IDENTIFIER) || strcmp(token->data.text, "sp") == 0) {
+        show_error(token, "Expected identifier");
+        return 1;
+    }
+    symbol_t *symbol = get_symbol_hashed(gamedata->global_symbols, token->data.text,
+                                         token->hash);
+    if ((symbol && symbol->type != SYM_IMPORT)
+            || (gamedata->constants && get_symbol_hashed(gamedata->constants,
+                                                         token->data.text, token->hash))) {
+        show_error(token, "name already defined");
+        return 1;
+    }
+    object_t *object = calloc(sizeof(object_t), 1);
+    object->name = strdup(token->data.text);
+    unsigned hash = token->hash;
+    advance(lexer);
+
+    int has_errors = 0;
+    if (!match(current(lexer), OPEN_BRACE)) {
+        show_error(current(lexer), "Expected '{'");
+        has_errors = 1;
+    } else {
+        advance(lexer);
+    }
+    while (!has_errors && !match(current(lexer), CLOSE_BRACE)) {
+        token = current(lexer);
+        if (!match(token, IDENTIFIER)) {
+            show_error(token, "Expected property name");
+            has_errors = 1;
+            break;
+        }
+        symbol_t *property = property_symbol(gamedata, token->data.text);
+        for (unsigned i = 0; i < object->property_count; ++i) {
+            if (object->properties[i].property == property) {
+                show_error(token, "property already given");
                 has_errors = 1;
             }
-        } else {
-            show_error(current, "Unexpected token type");
-            advance(&current);
+        }
+        advance(lexer);
+        if (!has_errors && !match_text(current(lexer), OPERATOR, "=")) {
+            show_error(current(lexer), "Expected '='");
+            has_errors = 1;
+        }
+        if (has_errors) break;
+        advance(lexer);
+
+        asmoperand_t value;
+        if (parse_property_value(gamedata, lexer, &value)) {
+            has_errors = 1;
+            break;
+        }
+        object->properties = realloc(object->properties,
+                                     (object->property_count + 1) * sizeof(objproperty_t));
+        object->properties[object->property_count].property = property;
+        object->properties[object->property_count].value = value;
+        ++object->property_count;
+        if (!match(current(lexer), SEMICOLON)) {
+            show_error(current(lexer), "Expected ';'");
             has_errors = 1;
+            break;
+        }
+        advance(lexer);
+    }
+    if (has_errors || !current(lexer)) {
+        if (!has_errors) {
+            show_error(0, "Unexpected end of file parsing object");
         }
+        free_object(object);
+        return 1;
     }
+    advance(lexer);
 
-    return has_errors;
+    if (!symbol) {
+        symbol = calloc(sizeof(symbol_t), 1);
+        symbol->name = strdup(object->name);
+        add_symbol_hashed(gamedata->global_symbols, symbol, hash);
+    }
+    symbol->type = SYM_OBJECT;
+    object_t **last = &gamedata->objects;
+    while (*last) {
+        last = &(*last)->next;
+    }
+    *last = object;
+    return 0;
+}
+
+/*
+Return the precedence of a binary operator token, or -1 if the token is not
+a binary operator. Higher values bind more tightly.
+*/
+int binary_precedence(lexertoken_t *token) {
+    static const char *levels[][4] = {
+        { "||" },
+        { "&&" },
+        { "|" },
+        { "^" },
+        { "&" },
+        { "==", "!=" },
+        { "<", "<=", ">", ">=" },
+        { "<<", ">>" },
+        { "+", "-" },
+        { "*", "/", "%" },
+        { 0 }
+    };
+    if (!match(token, OPERATOR)) {
+        return -1;
+    }
+    for (int i = 0; levels[i][0]; ++i) {
+        for (int j = 0; j < 4 && levels[i][j]; ++j) {
+            if (strcmp(token->data.text, levels[i][j]) == 0) {
+                return i + 1;
+            }
+        }
+    }
+    return -1;
 }
 
+/*
+Evaluate a binary operator on two constant values, checking that the result
+fits in a 32-bit signed value. Comparisons and logical operators give one or
+zero. Returns non-zero if errors occured.
+*/
+int fold_binary(lexertoken_t *where, const char *op, int left, int right, int *result) {
+    long long a = left, b = right, value = 0;
+    if (strcmp(op, "==") == 0)      value = a == b;
+    else if (strcmp(op, "!=") == 0) value = a != b;
+    else if (strcmp(op, "<=") == 0) value = a <= b;
+    else if (strcmp(op, ">=") == 0) value = a >= b;
+    else if (strcmp(op, "&&") == 0) value = a && b;
+    else if (strcmp(op, "||") == 0) value = a || b;
+    else if (strcmp(op, "<") == 0)  value = a < b;
+    else if (strcmp(op, ">") == 0)  value = a > b;
+    else switch(op[0]) {
+        case '+':   value = a + b; break;
+        case '-':   value = a - b; break;
+        case '*':   value = a * b; break;
+        case '&':   value = left & right; break;
+        case '|':   value = left | right; break;
+        case '^':   value = left ^ right; break;
+        case '/':
+        case '%':
+            if (b == 0) {
+                show_error(where, "division by zero in constant expression");
+                return 1;
+            }
+            value = op[0] == '/' ? a / b : a % b;
+            break;
+        case '<':
+        case '>':
+            if (b < 0 || b > 31) {
+                show_error(where, "shift count out of range in constant expression");
+                return 1;
+            }
+            value = op[0] == '<' ? a * (1LL << b) : a >> b;
+            break;
+        default:
+            show_error(where, "unknown operator in constant expression");
+            return 1;
+    }
 
-function_t* parse_function(lexertoken_t **current) {
-    show_error(*current, "PARSING FUNCTION");
-    if (!match_text(*current, RESERVED, "function")) {
-        show_error(*current, "ERROR: Expected keyword \"function\"");
+    if (value < INT_MIN || value > INT_MAX) {
+        show_error(where, "integer overflow in constant expression");
+        return 1;
+    }
+    *result = value;
+    return 0;
+}
+
+/*
+Parse and evaluate a constant expression using precedence climbing. Returns
+non-zero if errors occured.
+*/
+int parse_expression(glulxfile_t *gamedata, lexer_t *lexer, int min_precedence, int *result) {
+    int left = 0;
+    if (parse_unary(gamedata, lexer, &left)) {
+        return 1;
+    }
+
+    while (binary_precedence(current(lexer)) > min_precedence) {
+        /* keep a copy of the operator since the token will be recycled */
+        lexertoken_t op = *current(lexer);
+        char op_text[3] = {0};
+        strncpy(op_text, op.data.text, 2);
+        op.data.text = op_text;
+        int precedence = binary_precedence(&op);
+        advance(lexer);
+
+        int right = 0;
+        if (parse_expression(gamedata, lexer, precedence, &right)) {
+            return 1;
+        }
+        if (fold_binary(&op, op_text, left, right, &left)) {
+            return 1;
+        }
+    }
+
+    *result = left;
+    return 0;
+}
+
+/*
+Parse and evaluate a single constant value, optionally preceded by unary
+operators. Returns non-zero if errors occured.
+*/
+int parse_unary(glulxfile_t *gamedata, lexer_t *lexer, int *result) {
+    lexertoken_t *start = current(lexer);
+
+    if (match_text(start, OPERATOR, "-")
+            || match_text(start, OPERATOR, "~")
+            || match_text(start, OPERATOR, "!")
+            || match_text(start, OPERATOR, "+")) {
+        lexertoken_t where = *start;
+        int op = start->data.text[0];
+        advance(lexer);
+        if (op == '-' && match(current(lexer), INTEGER) && current(lexer)->negate_only) {
+            *result = INT_MIN;
+            advance(lexer);
+            return 0;
+        }
+        int value = 0;
+        if (parse_unary(gamedata, lexer, &value)) {
+            return 1;
+        }
+        if (op == '-') {
+            if (value == INT_MIN) {
+                show_error(&where, "integer overflow in constant expression");
+                return 1;
+            }
+            value = -value;
+        } else if (op == '~') {
+            value = ~value;
+        } else if (op == '!') {
+            value = !value;
+        }
+        *result = value;
         return 0;
     }
-    advance(current);
 
-    if ((*current)->type != IDENTIFIER) {
-        show_error(*current, "ERROR: Expected identifier");
+    if (match(start, INTEGER)) {
+        if (start->negate_only) {
+            show_error(start, "integer constant too large (greater than 2147483647)");
+            return 1;
+        }
+        *result = start->data.integer;
+        advance(lexer);
+        return 0;
+    }
+
+    if (match(start, IDENTIFIER)) {
+        symbol_t *constant = 0;
+        if (gamedata->constants) {
+            constant = get_symbol_hashed(gamedata->constants, start->data.text, start->hash);
+        }
+        if (!constant) {
+            show_error(start, "unknown constant");
+            return 1;
+        }
+        *result = constant->data.value;
+        advance(lexer);
+        return 0;
+    }
+
+    if (match(start, OPEN_PARAN)) {
+        advance(lexer);
+        if (parse_expression(gamedata, lexer, 0, result)) {
+            return 1;
+        }
+        if (!match(current(lexer), CLOSE_PARAN)) {
+            show_error(current(lexer), "Expected ')'");
+            return 1;
+        }
+        advance(lexer);
+        return 0;
+    }
+
+    show_error(start, "Expected constant expression");
+    return 1;
+}
+
+
+function_t* parse_function(glulxfile_t *gamedata, lexer_t *lexer) {
+    show_trace(current(lexer), "parsing function");
+    if (!match_keyword(current(lexer), KW_FUNCTION)) {
+        show_error(current(lexer), "Expected keyword \"function\"");
+        return 0;
+    }
+    advance(lexer);
+
+    if (!match(current(lexer), IDENTIFIER)) {
+        show_error(current(lexer), "Expected identifier");
         return 0;
     }
     function_t *new_func = calloc(sizeof(function_t), 1);
-    new_func->name = strdup((*current)->data.text);
-    advance(current);
+    new_func->name = strdup(current(lexer)->data.text);
+    advance(lexer);
 
-    if (!match(*current, OPEN_PARAN)) {
+    if (!match(current(lexer), OPEN_PARAN)) {
         free_function(new_func);
-        show_error(*current, "%s:%d:%d  ERROR: Expected '('");
+        show_error(current(lexer), "Expected '('");
         return 0;
     }
-    advance(current);
+    advance(lexer);
 
-    /* parse arguments */
+    if (parse_parameters(gamedata, lexer, new_func)) {
+        free_function(new_func);
+        return 0;
+    }
 
-    if (!match(*current, CLOSE_PARAN)) {
+    if (!match(current(lexer), CLOSE_PARAN)) {
         free_function(new_func);
-        show_error(*current, "%s:%d:%d  ERROR: Expected ')'");
+        show_error(current(lexer), "Expected ')'");
         return 0;
     }
-    advance(current);
+    advance(lexer);
+
+    if (match_keyword(current(lexer), KW_NOINLINE)) {
+        new_func->no_inline = 1;
+        advance(lexer);
+    }
 
-    new_func->code = parse_codeblock(current);
+    if (gamedata->lazy_parse) {
+        if (skip_function_body(lexer, new_func)) {
+            free_function(new_func);
+            return 0;
+        }
+        return new_func;
+    }
+
+    if (current(lexer)) {
+        new_func->body_start = current(lexer)->offset;
+        new_func->body_line = current(lexer)->line_no;
+        new_func->body_col = current(lexer)->col_no;
+    }
+    new_func->code = parse_codeblock(gamedata, lexer, new_func);
+    new_func->body_end = lexer_offset(lexer);
 
     if (new_func->code) {
         return new_func;
@@ -164,132 +867,1176 @@ function_t* parse_function(lexertoken_t **current) {
     }
 }
 
-codeblock_t* parse_codeblock(lexertoken_t **current) {
-    show_error(*current, "PARSING CODE BLOCK");
+/*
+Parse the names of a function's parameters, which become its first locals and
+are given the function's arguments in order. Returns non-zero if errors
+occured.
+*/
+int parse_parameters(glulxfile_t *gamedata, lexer_t *lexer, function_t *function) {
+    while (match(current(lexer), IDENTIFIER)) {
+        lexertoken_t *name = current(lexer);
+        if (strcmp(name->data.text, "sp") == 0 || find_local(function, name->data.text) >= 0
+                || (gamedata->constants && get_symbol_hashed(gamedata->constants,
+                                                             name->data.text, name->hash))) {
+            show_error(name, "bad parameter name");
+            return 1;
+        }
+        add_local(function, name->data.text);
+        ++function->parameter_count;
+        advance(lexer);
+        if (!match(current(lexer), COMMA)) {
+            break;
+        }
+        advance(lexer);
+    }
+    return 0;
+}
+
+/*
+Record where a function's body is in its source file and move past it by
+matching braces, leaving the body to be parsed by parse_function_body when it
+is needed. Returns non-zero if errors occured.
+*/
+int skip_function_body(lexer_t *lexer, function_t *function) {
+    if (!match(current(lexer), OPEN_BRACE)) {
+        show_error(current(lexer), "Expected '{'");
+        return 1;
+    }
+    function->source = lexer_source(lexer);
+    function->body_start = current(lexer)->offset;
+    function->body_line = current(lexer)->line_no;
+    function->body_col = current(lexer)->col_no;
 
-    if (!match(*current, OPEN_BRACE)) {
-        show_error(*current, "ERROR: Expected '{'");
+    int depth = 0;
+    do {
+        if (current(lexer) == 0) {
+            show_error(0, "Unexpected end of file parsing code block");
+            return 1;
+        }
+        if (match(current(lexer), OPEN_BRACE)) {
+            ++depth;
+        } else if (match(current(lexer), CLOSE_BRACE)) {
+            --depth;
+        }
+        function->body_end = current(lexer)->offset + 1;
+        advance(lexer);
+    } while (depth > 0);
+    return 0;
+}
+
+/*
+Parse the body of a function skipped while parsing its file. Does nothing if
+the body has already been parsed or the function came from an object file.
+Returns non-zero if errors occured.
+*/
+int parse_function_body(glulxfile_t *gamedata, function_t *function) {
+    if (function->code || !function->source) {
         return 0;
     }
-    advance(current);
+    sourcefile_t *source = function->source;
+    lexer_t *lexer = open_lexer_range(0, source->filename, source->text,
+                                      function->body_start, function->body_end,
+                                      function->body_line, function->body_col);
+    function->code = parse_codeblock(gamedata, lexer, function);
+    function->source = 0;
+    int has_errors = function->code == 0 || lexer_has_errors(lexer);
+    close_lexer(lexer);
+    return has_errors;
+}
 
-    codeblock_t *code = calloc(sizeof(codeblock_t), 1);
-    while (!match(*current, CLOSE_BRACE)) {
-        if (*current == 0) {
-            free(code);
-            fprintf(stderr, "FATAL: Unexpected end of file parsing code block\n");
-            return 0;
+/*
+Add a frame to the top of the parse stack for a statement whose statements
+are to be added to the code given.
+*/
+parseframe_t* push_frame(parsestack_t *stack, int type, codeblock_t *code) {
+    if (stack->count >= stack->capacity) {
+        stack->capacity = stack->capacity ? stack->capacity * 2 : 16;
+        stack->frames = realloc(stack->frames, stack->capacity * sizeof(parseframe_t));
+    }
+    parseframe_t *frame = &stack->frames[stack->count++];
+    memset(frame, 0, sizeof(parseframe_t));
+    frame->type = type;
+    frame->code = code;
+    return frame;
+}
+
+/*
+Return the code the next statement in a frame is added to. The statements
+of a switch go to its latest case.
+*/
+codeblock_t* frame_code(parseframe_t *frame) {
+    if (frame->type == FRAME_SWITCH) {
+        return frame->groups[frame->group_count - 1].code;
+    }
+    return frame->code;
+}
+
+/*
+Free a frame left unfinished by an error.
+*/
+void free_parse_frame(parseframe_t *frame) {
+    if (frame->code) {
+        free_codeblock(frame->code);
+    }
+    free_expression(frame->condition);
+    for (unsigned i = 0; i < frame->group_count; ++i) {
+        free_codeblock(frame->groups[i].code);
+        free(frame->groups[i].label);
+    }
+    free(frame->groups);
+    free(frame->cases);
+    if (frame->value.type == OP_IDENTIFIER) {
+        free(frame->value.data.name);
+    }
+}
+
+/*
+Finish the statement at the top of the parse stack once all of its
+statements have been parsed. An if followed by else stays on the stack to
+take the else statement; anything else is removed from the stack and its
+code returned. Returns null if the statement stays on the stack or errors
+occured.
+*/
+codeblock_t* finish_frame(lexer_t *lexer, parsestack_t *stack) {
+    parseframe_t *frame = &stack->frames[stack->count - 1];
+    codeblock_t *code = frame->code;
+    asmblock_t *finish;
+    switch (frame->type) {
+        case FRAME_IF:
+            finish = calloc(sizeof(asmblock_t), 1);
+            if (match_keyword(current(lexer), KW_ELSE)) {
+                advance(lexer);
+                add_instruction(finish, "jump");
+                add_name_operand(finish, frame->labels[1]);
+                add_label(finish, frame->labels[0]);
+                add_asm_to_block(code, finish);
+                frame->type = FRAME_ELSE;
+                frame->statement_count = 0;
+                return 0;
+            }
+            add_label(finish, frame->labels[0]);
+            add_asm_to_block(code, finish);
+            break;
+        case FRAME_ELSE:
+            finish = calloc(sizeof(asmblock_t), 1);
+            add_label(finish, frame->labels[1]);
+            add_asm_to_block(code, finish);
+            break;
+        case FRAME_WHILE:
+            finish = calloc(sizeof(asmblock_t), 1);
+            add_label(finish, frame->labels[1]);
+            add_condition(finish, frame->condition, 1, frame->labels[0]);
+            add_asm_to_block(code, finish);
+            free_expression(frame->condition);
+            break;
+        case FRAME_SWITCH:
+            code = finish_switch(frame);
+            break;
+    }
+    --stack->count;
+    return code;
+}
+
+/*
+Parse a code block and every statement within it. Statements containing
+others are pushed on a stack when they begin and taken off when they end,
+so the parser loops rather than recursing however deeply they are nested.
+A statement that can't be parsed is skipped and parsing carries on after it,
+so that every error in the block is reported. Returns null if errors
+occured.
+*/
+codeblock_t* parse_codeblock(glulxfile_t *gamedata, lexer_t *lexer, function_t *function) {
+    show_trace(current(lexer), "parsing code block");
+
+    if (!match(current(lexer), OPEN_BRACE)) {
+        show_error(current(lexer), "Expected '{'");
+        return 0;
+    }
+    advance(lexer);
+
+    parsestack_t stack = { 0, 0, 0 };
+    push_frame(&stack, FRAME_BLOCK, calloc(sizeof(codeblock_t), 1));
+    codeblock_t *result = 0;
+    int has_errors = 0;
+    while (1) {
+        parseframe_t *frame = &stack.frames[stack.count - 1];
+        int is_list = frame->type == FRAME_BLOCK || frame->type == FRAME_SWITCH;
+        size_t start = lexer_offset(lexer);
+        if (is_list && match(current(lexer), CLOSE_BRACE)) {
+            advance(lexer);
+        } else if (!is_list && frame->statement_count > 0) {
+            /* if, else and while each hold a single statement */
+        } else if (current(lexer) == 0) {
+            show_error(0, frame->type == FRAME_SWITCH ? "Unexpected end of file parsing switch"
+                                                      : "Unexpected end of file parsing code block");
+            has_errors = 1;
+            break;
+        } else if (frame->type == FRAME_SWITCH && (match_keyword(current(lexer), KW_CASE)
+                                                   || match_keyword(current(lexer), KW_DEFAULT))) {
+            if (parse_switch_label(gamedata, lexer, frame)) {
+                skip_statement(lexer, start, COLON);
+                has_errors = 1;
+            }
+            continue;
+        } else if (frame->type == FRAME_SWITCH && frame->group_count == 0) {
+            show_error(current(lexer), "Expected 'case' or 'default'");
+            skip_statement(lexer, start, SEMICOLON);
+            has_errors = 1;
+            continue;
+        } else {
+            if (parse_statement(gamedata, lexer, function, &stack)) {
+                skip_statement(lexer, start, SEMICOLON);
+                has_errors = 1;
+            }
+            continue;
         }
 
-        if (match(*current, OPEN_BRACE)) {
-            codeblock_t *inner = parse_codeblock(current);
-            if (inner) {
-                statement_t *stmt = calloc(sizeof(statement_t), 1);
-                stmt->type = STMT_BLOCK;
-                stmt->data.code = inner;
-                add_to_block(code, stmt);
+        /* the statement at the top of the stack has ended */
+        unsigned count = stack.count;
+        codeblock_t *code = finish_frame(lexer, &stack);
+        if (stack.count == count) {
+            continue;
+        } else if (stack.count == 0) {
+            result = code;
+            break;
+        }
+        frame = &stack.frames[stack.count - 1];
+        if (code) {
+            add_code_to_block(frame_code(frame), code);
+        } else {
+            has_errors = 1;
+        }
+        ++frame->statement_count;
+    }
+
+    if (has_errors) {
+        for (unsigned i = 0; i < stack.count; ++i) {
+            free_parse_frame(&stack.frames[i]);
+        }
+        if (result) {
+            free_codeblock(result);
+            result = 0;
+        }
+    }
+    free(stack.frames);
+    return result;
+}
+
+/*
+Parse a single statement and add it to the statement at the top of the
+parse stack; a statement containing others is pushed on the stack instead.
+The statement is chosen by the table generated from the grammar for the
+token it begins with. Tokens that cannot begin a statement are skipped.
+Returns non-zero if the statement could not be parsed.
+*/
+int parse_statement(glulxfile_t *gamedata, lexer_t *lexer, function_t *function,
+                    parsestack_t *stack) {
+    parseframe_t *frame = &stack->frames[stack->count - 1];
+    codeblock_t *code = frame_code(frame);
+    int has_errors = 0;
+    switch (statement_table[token_terminal(current(lexer))]) {
+        case STATEMENT_CODE_BLOCK:
+            advance(lexer);
+            push_frame(stack, FRAME_BLOCK, calloc(sizeof(codeblock_t), 1));
+            return 0;
+        /* a statement that fails to begin is still counted as the statement
+           of any if or while holding it */
+        case STATEMENT_SWITCH:
+            if (!begin_switch(gamedata, lexer, stack)) {
+                return 0;
             }
-        } else if (match_text(*current, RESERVED, "asm")) {
-            asmblock_t *inner = parse_asmblock(current);
+            has_errors = 1;
+            break;
+        case STATEMENT_IF:
+            if (!begin_if(gamedata, lexer, function, stack)) {
+                return 0;
+            }
+            has_errors = 1;
+            break;
+        case STATEMENT_WHILE:
+            if (!begin_while(gamedata, lexer, function, stack)) {
+                return 0;
+            }
+            has_errors = 1;
+            break;
+        case STATEMENT_ASM_BLOCK: {
+            asmblock_t *inner = parse_asmblock(gamedata, lexer);
             if (inner) {
-                statement_t *stmt = calloc(sizeof(statement_t), 1);
-                stmt->type = STMT_ASM;
-                stmt->data.asm = inner;
-                add_to_block(code, stmt);
+                add_asm_to_block(code, inner);
+            } else {
+                has_errors = 1;
             }
+            break;
+        }
+        case STATEMENT_LOCAL:
+            has_errors = parse_local(gamedata, lexer, function, code);
+            break;
+        case STATEMENT_RETURN:
+            has_errors = parse_return(gamedata, lexer, function, code);
+            break;
+        case STATEMENT_CODE_EXPR:
+            has_errors = parse_expression_statement(gamedata, lexer, function, code);
+            break;
+        default:
+            advance(lexer);
+    }
+    ++frame->statement_count;
+    return has_errors;
+}
+
+/*
+Allocate an expression. The position of the token it is made from is kept,
+along with the token's text if it is an operator.
+*/
+expression_t* new_expression(int type, lexertoken_t *where) {
+    expression_t *expr = calloc(sizeof(expression_t), 1);
+    expr->type = type;
+    expr->offset = where->offset;
+    if (where->type == OPERATOR) {
+        strncpy(expr->op, where->data.text, 2);
+    }
+    return expr;
+}
+
+int is_constant_expression(expression_t *expr) {
+    return expr->type == EXPR_OPERAND && expr->value.type == OP_INTEGER
+        && !expr->value.is_indirect;
+}
+
+/*
+Replace an operator whose operands are constant with its value.
+*/
+void fold_expression(expression_t *expr, int value) {
+    free_expression(expr->left);
+    free_expression(expr->right);
+    expr->left = expr->right = 0;
+    expr->type = EXPR_OPERAND;
+    expr->value.type = OP_INTEGER;
+    expr->value.data.value = value;
+}
+
+/*
+Parse an expression in a function's code, where an assignment may appear
+outside of any other operator. Assignments group from the right, so several
+names can be given the same value at once. Returns null if errors occured.
+*/
+expression_t* parse_code_expression(glulxfile_t *gamedata, lexer_t *lexer, function_t *function) {
+    expression_t *left = parse_code_binary(gamedata, lexer, function, 0);
+    if (!left || !match_text(current(lexer), OPERATOR, "=")) {
+        return left;
+    }
+    if (left->type == EXPR_PROPERTY) {
+        /* objects with this property can't be kept in ROM */
+        get_symbol_hashed(gamedata->global_symbols, left->value.data.name,
+                          left->value.hash)->is_written = 1;
+    } else if (left->type != EXPR_OPERAND
+            || (left->value.type != OP_IDENTIFIER && left->value.type != OP_STACK)) {
+        show_error(current(lexer), "Expected a variable to assign to");
+        free_expression(left);
+        return 0;
+    }
+    expression_t *assign = new_expression(EXPR_ASSIGN, current(lexer));
+    advance(lexer);
+    assign->left = left;
+    assign->right = parse_code_expression(gamedata, lexer, function);
+    if (!assign->right) {
+        free_expression(assign);
+        return 0;
+    }
+    return assign;
+}
+
+/*
+Parse binary operators in a function's code using precedence climbing.
+Operators whose operands are both constant are evaluated at once. Returns
+null if errors occured.
+*/
+expression_t* parse_code_binary(glulxfile_t *gamedata, lexer_t *lexer, function_t *function,
+                                int min_precedence) {
+    expression_t *left = parse_code_unary(gamedata, lexer, function);
+    while (left && binary_precedence(current(lexer)) > min_precedence) {
+        /* keep a copy of the operator since the token will be recycled */
+        lexertoken_t where = *current(lexer);
+        int precedence = binary_precedence(current(lexer));
+        expression_t *expr = new_expression(EXPR_BINARY, current(lexer));
+        advance(lexer);
+
+        expr->left = left;
+        expr->right = parse_code_binary(gamedata, lexer, function, precedence);
+        if (!expr->right) {
+            free_expression(expr);
+            return 0;
+        }
+        if (is_constant_expression(expr->left) && is_constant_expression(expr->right)) {
+            int value = 0;
+            if (fold_binary(&where, expr->op, expr->left->value.data.value,
+                            expr->right->value.data.value, &value)) {
+                free_expression(expr);
+                return 0;
+            }
+            fold_expression(expr, value);
+        }
+        left = expr;
+    }
+    return left;
+}
+
+/*
+Parse a single value in a function's code, optionally preceded by unary
+operators. Returns null if errors occured.
+*/
+expression_t* parse_code_unary(glulxfile_t *gamedata, lexer_t *lexer, function_t *function) {
+    lexertoken_t *start = current(lexer);
+
+    if (match_text(start, OPERATOR, "-")
+            || match_text(start, OPERATOR, "~")
+            || match_text(start, OPERATOR, "!")
+            || match_text(start, OPERATOR, "+")) {
+        lexertoken_t where = *start;
+        expression_t *expr = new_expression(EXPR_UNARY, start);
+        advance(lexer);
+        if (expr->op[0] == '-' && match(current(lexer), INTEGER)
+                && current(lexer)->negate_only) {
+            advance(lexer);
+            fold_expression(expr, INT_MIN);
+            return expr;
+        }
+        expr->left = parse_code_unary(gamedata, lexer, function);
+        if (!expr->left) {
+            free_expression(expr);
+            return 0;
+        }
+        if (expr->op[0] == '+') {
+            expression_t *value = expr->left;
+            expr->left = 0;
+            free_expression(expr);
+            return value;
+        }
+        if (is_constant_expression(expr->left)) {
+            int value = expr->left->value.data.value;
+            if (expr->op[0] == '-' && value == INT_MIN) {
+                show_error(&where, "integer overflow in constant expression");
+                free_expression(expr);
+                return 0;
+            }
+            fold_expression(expr, expr->op[0] == '-' ? -value
+                                : expr->op[0] == '~' ? ~value : !value);
+        }
+        return expr;
+    }
+
+    if (match(start, INTEGER) && start->negate_only) {
+        show_error(start, "integer constant too large (greater than 2147483647)");
+        return 0;
+    }
+    if (match(start, INTEGER) || match(start, STRING)) {
+        expression_t *expr = new_expression(EXPR_OPERAND, start);
+        if (match(start, INTEGER)) {
+            expr->value.type = OP_INTEGER;
+            expr->value.data.value = start->data.integer;
         } else {
-            advance(current);
+            expr->value.type = OP_STRING;
+            expr->value.hash = start->hash;
+            expr->value.data.name = strdup(start->data.text);
+        }
+        advance(lexer);
+        return expr;
+    }
+
+    if (match(start, DICT_WORD)) {
+        expression_t *expr = new_expression(EXPR_OPERAND, start);
+        set_dictionary_operand(&expr->value, start->data.text);
+        advance(lexer);
+        return expr;
+    }
+
+    if (match(start, IDENTIFIER)) {
+        return parse_code_properties(gamedata, lexer,
+                                     parse_code_name(gamedata, lexer, function));
+    }
+
+    if (match(start, OPEN_PARAN)) {
+        advance(lexer);
+        expression_t *expr = parse_code_expression(gamedata, lexer, function);
+        if (expr && !match(current(lexer), CLOSE_PARAN)) {
+            show_error(current(lexer), "Expected ')'");
+            free_expression(expr);
+            return 0;
+        }
+        advance(lexer);
+        return parse_code_properties(gamedata, lexer, expr);
+    }
+
+    show_error(start, "Expected expression");
+    return 0;
+}
+
+/*
+Parse a name in a function's code, and the arguments following it if it is
+called. A local, global or function is left as a name for the assembler,
+which knows how each is stored, while a constant is replaced by its value.
+Returns null if errors occured.
+*/
+expression_t* parse_code_name(glulxfile_t *gamedata, lexer_t *lexer, function_t *function) {
+    lexertoken_t *name = current(lexer);
+    expression_t *expr = new_expression(EXPR_OPERAND, name);
+    symbol_t *constant = 0;
+    if (find_local(function, name->data.text) < 0 && gamedata->constants) {
+        constant = get_symbol_hashed(gamedata->constants, name->data.text, name->hash);
+    }
+    if (strcmp(name->data.text, "sp") == 0) {
+        expr->value.type = OP_STACK;
+    } else if (constant) {
+        expr->value.type = OP_INTEGER;
+        expr->value.data.value = constant->data.value;
+    } else {
+        expr->value.type = OP_IDENTIFIER;
+        expr->value.hash = name->hash;
+        expr->value.data.name = strdup(name->data.text);
+    }
+    advance(lexer);
+
+    if (!match(current(lexer), OPEN_PARAN)) {
+        return expr;
+    }
+    expression_t *call = new_expression(EXPR_CALL, current(lexer));
+    call->left = expr;
+    advance(lexer);
+    if (parse_call_arguments(gamedata, lexer, function, call)) {
+        free_expression(call);
+        return 0;
+    }
+    return call;
+}
+
+/*
+Parse any properties taken of a value, as in box.lid.colour. The property is
+kept as the name of its symbol. Returns null if errors occured, freeing the
+value.
+*/
+expression_t* parse_code_properties(glulxfile_t *gamedata, lexer_t *lexer, expression_t *expr) {
+    while (expr && match_text(current(lexer), OPERATOR, ".")) {
+        expression_t *property = new_expression(EXPR_PROPERTY, current(lexer));
+        property->left = expr;
+        expr = property;
+        advance(lexer);
+        if (!match(current(lexer), IDENTIFIER)) {
+            show_error(current(lexer), "Expected property name");
+            free_expression(expr);
+            return 0;
+        }
+        symbol_t *symbol = property_symbol(gamedata, current(lexer)->data.text);
+        property->value.type = OP_IDENTIFIER;
+        property->value.hash = hash_string(symbol->name);
+        property->value.data.name = strdup(symbol->name);
+        advance(lexer);
+    }
+    return expr;
+}
+
+/*
+Parse the arguments of a call up to its closing bracket. Returns non-zero if
+errors occured.
+*/
+int parse_call_arguments(glulxfile_t *gamedata, lexer_t *lexer, function_t *function,
+                         expression_t *call) {
+    expression_t **last = &call->right;
+    while (!match(current(lexer), CLOSE_PARAN)) {
+        *last = parse_code_expression(gamedata, lexer, function);
+        if (!*last) {
+            return 1;
+        }
+        last = &(*last)->next;
+        if (match(current(lexer), COMMA)) {
+            advance(lexer);
+        } else if (!match(current(lexer), CLOSE_PARAN)) {
+            show_error(current(lexer), "Expected ',' or ')'");
+            return 1;
+        }
+    }
+    advance(lexer);
+    return 0;
+}
+
+/*
+Parse the bracketed condition of an if or while statement. Returns null if
+errors occured.
+*/
+expression_t* parse_condition(glulxfile_t *gamedata, lexer_t *lexer, function_t *function) {
+    if (!match(current(lexer), OPEN_PARAN)) {
+        show_error(current(lexer), "Expected '('");
+        return 0;
+    }
+    advance(lexer);
+    expression_t *condition = parse_code_expression(gamedata, lexer, function);
+    if (condition && !match(current(lexer), CLOSE_PARAN)) {
+        show_error(current(lexer), "Expected ')'");
+        free_expression(condition);
+        return 0;
+    }
+    advance(lexer);
+    return condition;
+}
+
+/*
+Parse an expression used as a statement, such as an assignment or a call,
+whose value is thrown away. Returns non-zero if errors occured.
+*/
+int parse_expression_statement(glulxfile_t *gamedata, lexer_t *lexer, function_t *function,
+                               codeblock_t *code) {
+    expression_t *expr = parse_code_expression(gamedata, lexer, function);
+    if (!expr) {
+        return 1;
+    }
+    if (!match(current(lexer), SEMICOLON)) {
+        show_error(current(lexer), "Expected ';'");
+        free_expression(expr);
+        return 1;
+    }
+    advance(lexer);
+
+    asmoperand_t discard = { OP_INTEGER, 0, 0, { 0 } };
+    asmblock_t *block = calloc(sizeof(asmblock_t), 1);
+    add_expression(block, expr, &discard);
+    add_asm_to_block(code, block);
+    free_expression(expr);
+    return 0;
+}
+
+/*
+Parse a declaration of local variables, each of which may be given a value:
+
+    local count = 0, item;
+
+A local belongs to the whole function, wherever it is declared, and holds
+zero until it is first given a value. Returns non-zero if errors occured.
+*/
+int parse_local(glulxfile_t *gamedata, lexer_t *lexer, function_t *function,
+                codeblock_t *code) {
+    advance(lexer);
+    asmblock_t *block = calloc(sizeof(asmblock_t), 1);
+    int has_errors = 0;
+    while (!has_errors) {
+        lexertoken_t *name = current(lexer);
+        if (!match(name, IDENTIFIER) || strcmp(name->data.text, "sp") == 0) {
+            show_error(name, "Expected identifier");
+            has_errors = 1;
+            break;
+        }
+        if (find_local(function, name->data.text) >= 0
+                || (gamedata->constants && get_symbol_hashed(gamedata->constants,
+                                                             name->data.text, name->hash))) {
+            show_error(name, "name already defined");
+            has_errors = 1;
+            break;
         }
+        asmoperand_t local = { OP_IDENTIFIER, 0, name->hash, { 0 } };
+        local.data.name = strdup(name->data.text);
+        add_local(function, local.data.name);
+        advance(lexer);
+
+        if (match_text(current(lexer), OPERATOR, "=")) {
+            advance(lexer);
+            expression_t *value = parse_code_expression(gamedata, lexer, function);
+            if (value) {
+                add_expression(block, value, &local);
+                free_expression(value);
+            } else {
+                has_errors = 1;
+            }
+        }
+        free(local.data.name);
+        if (!match(current(lexer), COMMA)) {
+            break;
+        }
+        advance(lexer);
+    }
+    if (!has_errors && !match(current(lexer), SEMICOLON)) {
+        show_error(current(lexer), "Expected ';'");
+        has_errors = 1;
+    }
+
+    if (has_errors) {
+        free_asmblock(block);
+        return 1;
+    }
+    advance(lexer);
+    add_asm_to_block(code, block);
+    return 0;
+}
+
+/*
+Parse a return statement, which returns zero if no value is given. Returns
+non-zero if errors occured.
+*/
+int parse_return(glulxfile_t *gamedata, lexer_t *lexer, function_t *function,
+                 codeblock_t *code) {
+    advance(lexer);
+    expression_t *value = 0;
+    if (!match(current(lexer), SEMICOLON)) {
+        value = parse_code_expression(gamedata, lexer, function);
+        if (!value) {
+            return 1;
+        }
+    }
+    if (!match(current(lexer), SEMICOLON)) {
+        show_error(current(lexer), "Expected ';'");
+        free_expression(value);
+        return 1;
+    }
+    advance(lexer);
+
+    asmblock_t *block = calloc(sizeof(asmblock_t), 1);
+    add_return(block, value);
+    add_asm_to_block(code, block);
+    free_expression(value);
+    return 0;
+}
+
+/*
+Begin an if statement, with or without an else statement:
+
+    if (count > 3) ... else ...
+
+The condition is tested once, jumping past the statement it guards when it is
+false; the guarded statement then jumps past the else statement. The if is
+pushed on the parse stack to take its statements. Returns non-zero if errors
+occured.
+*/
+int begin_if(glulxfile_t *gamedata, lexer_t *lexer, function_t *function,
+             parsestack_t *stack) {
+    unsigned offset = current(lexer)->offset;
+    advance(lexer);
+
+    expression_t *condition = parse_condition(gamedata, lexer, function);
+    if (!condition) {
+        return 1;
+    }
+    codeblock_t *code = calloc(sizeof(codeblock_t), 1);
+    parseframe_t *frame = push_frame(stack, FRAME_IF, code);
+    sprintf(frame->labels[0], "if$%u$else", offset);
+    sprintf(frame->labels[1], "if$%u$end", offset);
+    asmblock_t *test = calloc(sizeof(asmblock_t), 1);
+    add_condition(test, condition, 0, frame->labels[0]);
+    add_asm_to_block(code, test);
+    free_expression(condition);
+    return 0;
+}
+
+/*
+Begin a while loop:
+
+    while (count < 10) ...
+
+The test follows the loop's statement, so each time round the loop takes a
+single branch; the loop is entered by jumping to the test, unless the
+condition is a constant that is always true. The loop is pushed on the parse
+stack to take its statement, keeping the condition until the test is added
+after it. Returns non-zero if errors occured.
+*/
+int begin_while(glulxfile_t *gamedata, lexer_t *lexer, function_t *function,
+                parsestack_t *stack) {
+    unsigned offset = current(lexer)->offset;
+    advance(lexer);
+
+    expression_t *condition = parse_condition(gamedata, lexer, function);
+    if (!condition) {
+        return 1;
+    }
+    codeblock_t *code = calloc(sizeof(codeblock_t), 1);
+    parseframe_t *frame = push_frame(stack, FRAME_WHILE, code);
+    sprintf(frame->labels[0], "while$%u$top", offset);
+    sprintf(frame->labels[1], "while$%u$test", offset);
+    frame->condition = condition;
+    asmblock_t *start = calloc(sizeof(asmblock_t), 1);
+    if (!is_constant_expression(condition) || condition->value.data.value == 0) {
+        add_instruction(start, "jump");
+        add_name_operand(start, frame->labels[1]);
+    }
+    add_label(start, frame->labels[0]);
+    add_asm_to_block(code, start);
+    return 0;
+}
+
+int compare_cases(const void *a, const void *b) {
+    const switchcase_t *first = a;
+    const switchcase_t *second = b;
+    return first->value < second->value ? -1 : first->value > second->value;
+}
+
+/*
+Add an assembly block to the end of a code block.
+*/
+void add_asm_to_block(codeblock_t *code, asmblock_t *block) {
+    statement_t *stmt = calloc(sizeof(statement_t), 1);
+    stmt->type = STMT_ASM;
+    stmt->data.asm = block;
+    add_to_block(code, stmt);
+}
+
+/*
+Add a code block to the end of another.
+*/
+void add_code_to_block(codeblock_t *code, codeblock_t *inner) {
+    statement_t *stmt = calloc(sizeof(statement_t), 1);
+    stmt->type = STMT_BLOCK;
+    stmt->data.code = inner;
+    add_to_block(code, stmt);
+}
+
+/*
+Parse the value a switch statement tests, which is given in the same way as
+an asm operand. Returns non-zero if errors occured.
+*/
+int parse_switch_value(glulxfile_t *gamedata, lexer_t *lexer, asmoperand_t *value) {
+    lexertoken_t *token = current(lexer);
+    memset(value, 0, sizeof(asmoperand_t));
+    if (match_text(token, IDENTIFIER, "sp")) {
+        value->type = OP_STACK;
+        advance(lexer);
+    } else if (match(token, IDENTIFIER) && !(gamedata->constants
+                && get_symbol_hashed(gamedata->constants, token->data.text, token->hash))) {
+        value->type = OP_IDENTIFIER;
+        value->hash = token->hash;
+        value->data.name = strdup(token->data.text);
+        advance(lexer);
+    } else {
+        value->type = OP_INTEGER;
+        return parse_expression(gamedata, lexer, 0, &value->data.value);
+    }
+    return 0;
+}
+
+/*
+Parse a case or default of a switch statement. Each begins a group of
+statements with a label of its own; the values of a case are added to the
+switch's case list with the label of their group. Returns non-zero if errors
+occured.
+*/
+int parse_switch_label(glulxfile_t *gamedata, lexer_t *lexer, parseframe_t *frame) {
+    int is_case = match_keyword(current(lexer), KW_CASE);
+    frame->groups = realloc(frame->groups, (frame->group_count + 1) * sizeof(switchgroup_t));
+    switchgroup_t *group = &frame->groups[frame->group_count++];
+    group->label = malloc(strlen(frame->prefix) + 16);
+    sprintf(group->label, "%s%u", frame->prefix, frame->group_count);
+    group->code = calloc(sizeof(codeblock_t), 1);
+    group->is_default = !is_case;
+    advance(lexer);
+
+    while (is_case) {
+        int value = 0;
+        if (parse_expression(gamedata, lexer, 0, &value)) {
+            return 1;
+        }
+        frame->cases = realloc(frame->cases, (frame->case_count + 1) * sizeof(switchcase_t));
+        frame->cases[frame->case_count].value = value;
+        frame->cases[frame->case_count].label = group->label;
+        ++frame->case_count;
+        if (!match(current(lexer), COMMA)) {
+            break;
+        }
+        advance(lexer);
+    }
+    if (!match(current(lexer), COLON)) {
+        show_error(current(lexer), "Expected ':'");
+        return 1;
+    }
+    advance(lexer);
+    return 0;
+}
+
+/*
+Begin a switch statement, which runs the statements following the case
+whose value matches, or those following default if no case does:
+
+    switch (sp) {
+        case 1, 2:  ...
+        case LOOK:  ...
+        default:    ...
     }
-    advance(current);
 
+The switch is pushed on the parse stack to take its cases and statements.
+Returns non-zero if errors occured.
+*/
+int begin_switch(glulxfile_t *gamedata, lexer_t *lexer, parsestack_t *stack) {
+    /* the position of the switch keeps its labels apart from those of any
+       other switch in the function */
+    lexertoken_t *start = current(lexer);
+    const char *filename = start->filename;
+    int line = start->line_no;
+    int column = start->col_no;
+    char prefix[32];
+    sprintf(prefix, "switch$%u$", start->offset);
+    advance(lexer);
+
+    if (!match(current(lexer), OPEN_PARAN)) {
+        show_error(current(lexer), "Expected '('");
+        return 1;
+    }
+    advance(lexer);
+    asmoperand_t value;
+    if (parse_switch_value(gamedata, lexer, &value)) {
+        return 1;
+    }
+    if (!match(current(lexer), CLOSE_PARAN) || !match(lexer_token(lexer, 1), OPEN_BRACE)) {
+        show_error(current(lexer), "Expected ') {'");
+        if (value.type == OP_IDENTIFIER) {
+            free(value.data.name);
+        }
+        return 1;
+    }
+    advance(lexer);
+    advance(lexer);
+    parseframe_t *frame = push_frame(stack, FRAME_SWITCH, 0);
+    strcpy(frame->prefix, prefix);
+    frame->value = value;
+    frame->filename = filename;
+    frame->line = line;
+    frame->column = column;
+    return 0;
+}
+
+/*
+Finish a switch statement once its closing brace is reached. Control never
+falls from one case into the next. The switch is lowered into a block of
+ordinary statements: the code choosing a case, then each group of
+statements preceded by its label and followed by a jump past the end. When
+the value is taken from the stack the dispatch leaves it there, so it is
+popped at the start of each group. Returns null if errors occured, having
+freed what the switch held.
+*/
+codeblock_t* finish_switch(parseframe_t *frame) {
+    const char *prefix = frame->prefix;
+    asmoperand_t value = frame->value;
+    switchgroup_t *groups = frame->groups;
+    unsigned group_count = frame->group_count;
+    switchcase_t *cases = frame->cases;
+    unsigned case_count = frame->case_count;
+    int has_errors = 0;
+
+    qsort(cases, case_count, sizeof(switchcase_t), compare_cases);
+    for (unsigned i = 1; !has_errors && i < case_count; ++i) {
+        if (cases[i].value == cases[i - 1].value) {
+            report_diagnostic(DIAG_ERROR, "parser", frame->filename, frame->line, frame->column,
+                              "duplicate case value %d in switch", cases[i].value);
+            has_errors = 1;
+        }
+    }
+    char default_label[48];
+    sprintf(default_label, "%sdefault", prefix);
+    char end_label[48];
+    sprintf(end_label, "%send", prefix);
+    const char *no_match = end_label;
+    for (unsigned i = 0; i < group_count; ++i) {
+        if (groups[i].is_default && no_match != end_label) {
+            report_diagnostic(DIAG_ERROR, "parser", frame->filename, frame->line, frame->column,
+                              "switch has more than one default");
+            has_errors = 1;
+        } else if (groups[i].is_default) {
+            no_match = groups[i].label;
+        }
+    }
+    /* without a default, a value left on the stack must still be popped
+       when no case matches */
+    int add_default = no_match == end_label && value.type == OP_STACK;
+    if (add_default) {
+        no_match = default_label;
+    }
+
+    codeblock_t *code = 0;
+    if (!has_errors) {
+        code = calloc(sizeof(codeblock_t), 1);
+        asmblock_t *dispatch = calloc(sizeof(asmblock_t), 1);
+        add_switch_dispatch(dispatch, &value, cases, case_count, no_match, prefix);
+        add_asm_to_block(code, dispatch);
+    }
+    for (unsigned i = 0; i < group_count; ++i) {
+        if (has_errors) {
+            free_codeblock(groups[i].code);
+            free(groups[i].label);
+            continue;
+        }
+        asmblock_t *start = calloc(sizeof(asmblock_t), 1);
+        add_label(start, groups[i].label);
+        if (value.type == OP_STACK) {
+            add_instruction(start, "copy");
+            add_stack_operand(start);
+            add_integer_operand(start, 0);
+        }
+        add_asm_to_block(code, start);
+
+        add_code_to_block(code, groups[i].code);
+
+        asmblock_t *finish = calloc(sizeof(asmblock_t), 1);
+        if (i + 1 < group_count || add_default) {
+            add_instruction(finish, "jump");
+            add_name_operand(finish, end_label);
+        }
+        if (i + 1 == group_count && add_default) {
+            add_label(finish, default_label);
+            add_instruction(finish, "copy");
+            add_stack_operand(finish);
+            add_integer_operand(finish, 0);
+        }
+        add_asm_to_block(code, finish);
+        free(groups[i].label);
+    }
+    if (code) {
+        asmblock_t *finish = calloc(sizeof(asmblock_t), 1);
+        if (group_count == 0 && add_default) {
+            add_label(finish, default_label);
+            add_instruction(finish, "copy");
+            add_stack_operand(finish);
+            add_integer_operand(finish, 0);
+        }
+        add_label(finish, end_label);
+        add_asm_to_block(code, finish);
+    }
+
+    free(groups);
+    free(cases);
+    if (value.type == OP_IDENTIFIER) {
+        free(value.data.name);
+    }
     return code;
 }
 
-asmblock_t* parse_asmblock(lexertoken_t **current) {
-    show_error(*current, "PARSING ASM BLOCK");
+/*
+Parse a block of assembly statements. A statement with errors is skipped and
+the rest of the block still parsed, so all of its errors are reported.
+Returns null if errors occured.
+*/
+asmblock_t* parse_asmblock(glulxfile_t *gamedata, lexer_t *lexer) {
+    show_trace(current(lexer), "parsing asm block");
 
-    if (!match_text(*current, RESERVED, "asm")) {
-        show_error(*current, "ERROR: Expected 'asm'");
+    if (!match_keyword(current(lexer), KW_ASM)) {
+        show_error(current(lexer), "Expected 'asm'");
         return 0;
     }
-    advance(current);
+    advance(lexer);
 
-    if (!match(*current, OPEN_BRACE)) {
-        show_error(*current, "ERROR: Expected '{'");
+    if (!match(current(lexer), OPEN_BRACE)) {
+        show_error(current(lexer), "Expected '{'");
         return 0;
     }
-    advance(current);
+    advance(lexer);
 
     asmblock_t *code = calloc(sizeof(asmblock_t), 1);
+    int has_errors = 0;
     while (1) {
-        if (*current == 0) {
-            free(code);
-            fprintf(stderr, "FATAL: Unexpected end of file parsing asm block\n");
+        if (current(lexer) == 0) {
+            free_asmblock(code);
+            show_error(0, "Unexpected end of file parsing asm block");
             return 0;
-        } else if (match(*current, CLOSE_BRACE)) {
-            advance(current);
+        } else if (match(current(lexer), CLOSE_BRACE)) {
+            advance(lexer);
             break;
         } else {
-            asmstmt_t *stmt = parse_asmstmt(current);
-            add_to_asmblock(code, stmt);
+            size_t start = lexer_offset(lexer);
+            if (parse_asmstmt(gamedata, lexer, code)) {
+                skip_statement(lexer, start, SEMICOLON);
+                has_errors = 1;
+            }
         }
     }
 
+    if (has_errors) {
+        free_asmblock(code);
+        return 0;
+    }
     return code;
 }
 
-asmstmt_t* parse_asmstmt(lexertoken_t **current) {
-    if (!match(*current, IDENTIFIER)) {
-        show_error(*current, "ERROR: Expected identifier");
-        return 0;
+/*
+Parse a single assembly statement and append it to an assembly block.
+Returns non-zero if errors occured.
+*/
+int parse_asmstmt(glulxfile_t *gamedata, lexer_t *lexer, asmblock_t *block) {
+    /* some mnemonics, such as return, are also reserved words */
+    if (!match(current(lexer), IDENTIFIER) && !match(current(lexer), RESERVED)) {
+        show_error(current(lexer), "Expected identifier");
+        advance(lexer);
+        return 1;
     }
-    const char *mnemonic = (*current)->data.text;
-    advance(current);
 
-    if (match(*current, COLON)) {
-        advance(current);
-        asmlabel_t *label = calloc(sizeof(asmlabel_t), 1);
-        label->name = strdup(mnemonic);
-
-        asmstmt_t *stmt = calloc(sizeof(asmstmt_t), 1);
-        stmt->data.label = label;
-        stmt->type = ASM_LABEL;
-        return stmt;
-    } else {
-        if (get_mnemonic(mnemonic) == 0) {
-            show_error(*current, "ERROR: invalid assembly mnemonic");
-            return 0;
-        }
+    if (match(lexer_token(lexer, 1), COLON)) {
+        add_asm_statement(block, ASM_LABEL, 0);
+        asmoperand_t *name = add_asm_operand(block);
+        name->type = OP_IDENTIFIER;
+        name->hash = current(lexer)->hash;
+        name->data.name = strdup(current(lexer)->data.text);
+        advance(lexer);
+        advance(lexer);
+        return 0;
+    }
 
-        asminst_t *inst = calloc(sizeof(asminst_t), 1);
-        inst->mnemonic = strdup(mnemonic);
+    int mnemonic = get_mnemonic_index_hashed(current(lexer)->data.text, current(lexer)->hash);
+    if (mnemonic < 0) {
+        show_error(current(lexer), "invalid assembly mnemonic");
+        advance(lexer);
+        return 1;
+    }
+    advance(lexer);
 
-        while (1) {
-            if (*current == 0) {
-                fprintf(stderr, "FATAL: Unexpected end of file\n");
-                free_asminst(inst);
-                return 0;
-            } else if (match(*current, SEMICOLON)) {
-                advance(current);
-                break;
-            } else {
-                if (inst->operand_count < MAX_OPERANDS && match(*current, INTEGER)) {
-                    inst->operands[inst->operand_count].type = OP_INTEGER;
-                    inst->operands[inst->operand_count].data.value = (*current)->data.integer;
-                    ++inst->operand_count;
-                    advance(current);
-                } else {
-                    show_error(*current, "ERROR: bad asm operand");
-                    advance(current);
+    int has_errors = 0;
+    asmstmt_t *stmt = add_asm_statement(block, ASM_INSTRUCTION, mnemonic);
+    while (1) {
+        if (current(lexer) == 0) {
+            show_error(0, "Unexpected end of file parsing asm statement");
+            return 1;
+        } else if (match(current(lexer), SEMICOLON)) {
+            advance(lexer);
+            break;
+        } else if (stmt->operand_count >= MAX_OPERANDS) {
+            show_error(current(lexer), "too many asm operands");
+            advance(lexer);
+            has_errors = 1;
+        } else if (match(current(lexer), INTEGER) && current(lexer)->negate_only) {
+            show_error(current(lexer), "integer constant too large (greater than 2147483647)");
+            advance(lexer);
+            has_errors = 1;
+        } else if (match(current(lexer), INTEGER)) {
+            asmoperand_t *operand = add_asm_operand(block);
+            operand->type = OP_INTEGER;
+            operand->data.value = current(lexer)->data.integer;
+            advance(lexer);
+        } else if (match(current(lexer), OPEN_PARAN)
+                    || match(current(lexer), OPERATOR)
+                    || (match(current(lexer), IDENTIFIER) && gamedata->constants
+                        && get_symbol_hashed(gamedata->constants, current(lexer)->data.text,
+                                             current(lexer)->hash))) {
+            /* only a single value is allowed here since operands
+               are not separated; longer expressions need brackets */
+            int value = 0;
+            if (parse_unary(gamedata, lexer, &value)) {
+                while (current(lexer) && !match(current(lexer), SEMICOLON)) {
+                    advance(lexer);
                 }
+                has_errors = 1;
+            } else {
+                asmoperand_t *operand = add_asm_operand(block);
+                operand->type = OP_INTEGER;
+                operand->data.value = value;
             }
+        } else if (match_text(current(lexer), IDENTIFIER, "sp")) {
+            asmoperand_t *operand = add_asm_operand(block);
+            operand->type = OP_STACK;
+            advance(lexer);
+        } else if (match(current(lexer), IDENTIFIER) || match(current(lexer), STRING)) {
+            asmoperand_t *operand = add_asm_operand(block);
+            operand->type = match(current(lexer), STRING) ? OP_STRING : OP_IDENTIFIER;
+            operand->hash = current(lexer)->hash;
+            operand->data.name = strdup(current(lexer)->data.text);
+            advance(lexer);
+        } else if (match(current(lexer), DICT_WORD)) {
+            set_dictionary_operand(add_asm_operand(block), current(lexer)->data.text);
+            advance(lexer);
+        } else {
+            show_error(current(lexer), "bad asm operand");
+            advance(lexer);
+            has_errors = 1;
         }
-
-        asmstmt_t *stmt = calloc(sizeof(asmstmt_t), 1);
-        stmt->data.inst = inst;
-        stmt->type = ASM_INSTRUCTION;
-        return stmt;
     }
 
+    return has_errors;
 }
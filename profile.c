@@ -0,0 +1,362 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gbuild.h"
+
+#define DELIMITERS     " \t\n\r"
+#define MAX_INPUT_SIZE 256
+
+/*
+A count of the calls made from one function to another, as read from a
+profile.
+*/
+typedef struct PROFILE_EDGE {
+    unsigned caller;
+    unsigned callee;
+    unsigned long count;
+    unsigned order;
+} profileedge_t;
+
+/*
+The state of ordering functions by profile. Functions are numbered by their
+place in the game's function list; each belongs to a chain of functions that
+are to be placed one after another.
+*/
+typedef struct PROFILE_ORDER {
+    function_t **functions;
+    unsigned count;
+    unsigned long *calls;
+    int *is_hot;
+
+    unsigned *chain;
+    unsigned *chain_next;
+    unsigned *chain_first;
+    unsigned *chain_last;
+    unsigned long *chain_calls;
+
+    profileedge_t *edges;
+    unsigned edge_count;
+    unsigned edge_size;
+} profileorder_t;
+
+/*
+A chain of functions to be placed together and how often they were called.
+*/
+typedef struct PROFILE_CHAIN {
+    unsigned first;
+    unsigned long calls;
+} profilechain_t;
+
+int read_profile(profileorder_t *order, glulxfile_t *gamefile, const char *profile_file);
+int profile_function(glulxfile_t *gamefile, const char *profile_file, unsigned line,
+                     const char *name, unsigned *index);
+int profile_count(const char *profile_file, unsigned line, const char *text,
+                  unsigned long *count);
+void add_profile_edge(profileorder_t *order, unsigned caller, unsigned callee,
+                      unsigned long count);
+int compare_edges(const void *a, const void *b);
+void merge_chains(profileorder_t *order);
+int compare_chains(const void *a, const void *b);
+function_t* append_function(glulxfile_t *gamefile, function_t *last, function_t *function);
+void free_profile_order(profileorder_t *order);
+
+
+/*
+Look up the number of a function named in a profile. Functions the game no
+longer has are skipped with a warning, since a profile may have been recorded
+from an older version of the game. Returns non-zero if the function was found.
+*/
+int profile_function(glulxfile_t *gamefile, const char *profile_file, unsigned line,
+                     const char *name, unsigned *index) {
+    symbol_t *symbol = get_symbol(gamefile->global_symbols, name);
+    if (!symbol || symbol->type != SYM_FUNCTION || !symbol->data.func) {
+        fprintf(stderr, "PROFILE: %s:%u: unknown function \"%s\" ignored.\n",
+                profile_file, line, name);
+        return 0;
+    }
+    *index = symbol->data.func->position;
+    return 1;
+}
+
+/*
+Read a call count from a profile. Returns non-zero if it is not a number.
+*/
+int profile_count(const char *profile_file, unsigned line, const char *text,
+                  unsigned long *count) {
+    char *end = 0;
+    if (text) {
+        *count = strtoul(text, &end, 10);
+    }
+    if (!text || end == text || *end != 0) {
+        fprintf(stderr, "PROFILE: %s:%u: expected a call count.\n", profile_file, line);
+        return 1;
+    }
+    return 0;
+}
+
+void add_profile_edge(profileorder_t *order, unsigned caller, unsigned callee,
+                      unsigned long count) {
+    if (order->edge_count >= order->edge_size) {
+        order->edge_size = order->edge_size ? order->edge_size * 2 : 64;
+        order->edges = realloc(order->edges, order->edge_size * sizeof(profileedge_t));
+    }
+    profileedge_t *edge = &order->edges[order->edge_count];
+    edge->caller = caller;
+    edge->callee = callee;
+    edge->count = count;
+    edge->order = order->edge_count;
+    ++order->edge_count;
+}
+
+/*
+Read a profile. Each line is either "call NAME COUNT", giving the number of
+times a function was called, or "edge CALLER CALLEE COUNT", giving the number
+of times one function called another. Lines giving the times a branch was
+taken, "branch NAME LABEL COUNT", do not affect the order of functions and
+are skipped, as are blank lines and lines starting with #. Returns non-zero
+if errors occured.
+*/
+int read_profile(profileorder_t *order, glulxfile_t *gamefile, const char *profile_file) {
+    FILE *fp = fopen(profile_file, "rt");
+    if (!fp) {
+        fprintf(stderr, "PROFILE: could not open profile \"%s\".\n", profile_file);
+        return 1;
+    }
+
+    int has_errors = 0;
+    unsigned line = 0;
+    char input_buffer[MAX_INPUT_SIZE];
+    while (fgets(input_buffer, MAX_INPUT_SIZE, fp)) {
+        ++line;
+        char *command = strtok(input_buffer, DELIMITERS);
+        if (command == 0 || command[0] == '#') {
+            continue;
+        }
+
+        unsigned long count;
+        if (strcmp(command, "call") == 0) {
+            const char *name = strtok(0, DELIMITERS);
+            unsigned index;
+            if (profile_count(profile_file, line, strtok(0, DELIMITERS), &count)) {
+                has_errors = 1;
+            } else if (profile_function(gamefile, profile_file, line, name, &index)) {
+                order->calls[index] += count;
+                order->is_hot[index] |= count > 0;
+            }
+        } else if (strcmp(command, "edge") == 0) {
+            const char *caller_name = strtok(0, DELIMITERS);
+            const char *callee_name = strtok(0, DELIMITERS);
+            unsigned caller, callee;
+            if (profile_count(profile_file, line, strtok(0, DELIMITERS), &count)) {
+                has_errors = 1;
+            } else if (profile_function(gamefile, profile_file, line, caller_name, &caller)
+                    && profile_function(gamefile, profile_file, line, callee_name, &callee)
+                    && count > 0) {
+                add_profile_edge(order, caller, callee, count);
+                order->is_hot[caller] = 1;
+                order->is_hot[callee] = 1;
+            }
+        } else if (strcmp(command, "branch") != 0) {
+            fprintf(stderr, "PROFILE: %s:%u: unknown directive \"%s\".\n",
+                    profile_file, line, command);
+            has_errors = 1;
+        }
+    }
+
+    fclose(fp);
+    return has_errors;
+}
+
+/*
+Heaviest edges first; edges of the same weight keep the order they were read
+in so the result does not depend on qsort.
+*/
+int compare_edges(const void *a, const void *b) {
+    const profileedge_t *first = a;
+    const profileedge_t *second = b;
+    if (first->count != second->count) {
+        return first->count > second->count ? -1 : 1;
+    }
+    return first->order < second->order ? -1 : first->order > second->order;
+}
+
+/*
+Join functions into chains, taking the heaviest call edges first. An edge
+joins two chains when its caller ends one chain and its callee begins the
+other, so a caller is followed directly by the function it calls most.
+*/
+void merge_chains(profileorder_t *order) {
+    qsort(order->edges, order->edge_count, sizeof(profileedge_t), compare_edges);
+    for (unsigned i = 0; i < order->edge_count; ++i) {
+        profileedge_t *edge = &order->edges[i];
+        unsigned caller_chain = order->chain[edge->caller];
+        unsigned callee_chain = order->chain[edge->callee];
+        if (caller_chain == callee_chain
+                || order->chain_last[caller_chain] != edge->caller
+                || order->chain_first[callee_chain] != edge->callee) {
+            continue;
+        }
+
+        order->chain_next[edge->caller] = edge->callee;
+        for (unsigned func = edge->callee; func != order->count; func = order->chain_next[func]) {
+            order->chain[func] = caller_chain;
+        }
+        order->chain_last[caller_chain] = order->chain_last[callee_chain];
+        order->chain_calls[caller_chain] += order->chain_calls[callee_chain];
+        order->chain_first[callee_chain] = order->count;
+    }
+}
+
+/*
+Most called chains first. Chains called equally often stay in the order of
+their first function.
+*/
+int compare_chains(const void *a, const void *b) {
+    const profilechain_t *first = a;
+    const profilechain_t *second = b;
+    if (first->calls != second->calls) {
+        return first->calls > second->calls ? -1 : 1;
+    }
+    return first->first < second->first ? -1 : first->first > second->first;
+}
+
+/*
+Add a function to the end of the game's function list, which ends at last.
+Returns the new end of the list.
+*/
+function_t* append_function(glulxfile_t *gamefile, function_t *last, function_t *function) {
+    function->prev = last;
+    function->next = 0;
+    if (last) {
+        last->next = function;
+    } else {
+        gamefile->functions = function;
+    }
+    return function;
+}
+
+void free_profile_order(profileorder_t *order) {
+    free(order->functions);
+    free(order->calls);
+    free(order->is_hot);
+    free(order->chain);
+    free(order->chain_next);
+    free(order->chain_first);
+    free(order->chain_last);
+    free(order->chain_calls);
+    free(order->edges);
+}
+
+/*
+Reorder the game's functions using a profile so that functions which call
+each other often are placed together, the most called first, and functions
+the profile never saw called are placed last in their original order.
+Returns non-zero if errors occured.
+*/
+int order_functions(glulxfile_t *gamefile, const char *profile_file) {
+    profileorder_t order = {0};
+    for (function_t *func = gamefile->functions; func; func = func->next) {
+        ++order.count;
+    }
+    if (order.count == 0) {
+        return 0;
+    }
+
+    /* number the functions by using their position, which is not set until
+       they are laid out */
+    order.functions = malloc(order.count * sizeof(function_t*));
+    unsigned index = 0;
+    for (function_t *func = gamefile->functions; func; func = func->next) {
+        func->position = index;
+        order.functions[index++] = func;
+    }
+    order.calls = calloc(sizeof(unsigned long), order.count);
+    order.is_hot = calloc(sizeof(int), order.count);
+
+    int has_errors = read_profile(&order, gamefile, profile_file);
+    if (has_errors) {
+        free_profile_order(&order);
+        return 1;
+    }
+
+    /* each function begins in a chain of its own; a chain or function number
+       of count marks the end of a chain or a chain merged into another */
+    order.chain = malloc(order.count * sizeof(unsigned));
+    order.chain_next = malloc(order.count * sizeof(unsigned));
+    order.chain_first = malloc(order.count * sizeof(unsigned));
+    order.chain_last = malloc(order.count * sizeof(unsigned));
+    order.chain_calls = malloc(order.count * sizeof(unsigned long));
+    for (unsigned i = 0; i < order.count; ++i) {
+        order.chain[i] = i;
+        order.chain_next[i] = order.count;
+        order.chain_first[i] = i;
+        order.chain_last[i] = i;
+        order.chain_calls[i] = order.calls[i];
+    }
+    merge_chains(&order);
+
+    profilechain_t *chains = malloc(order.count * sizeof(profilechain_t));
+    unsigned chain_count = 0;
+    for (unsigned i = 0; i < order.count; ++i) {
+        if (order.chain_first[i] != order.count && order.is_hot[order.chain_first[i]]) {
+            chains[chain_count].first = order.chain_first[i];
+            chains[chain_count].calls = order.chain_calls[i];
+            ++chain_count;
+        }
+    }
+    qsort(chains, chain_count, sizeof(profilechain_t), compare_chains);
+
+    /* hot chains first, then the cold functions */
+    function_t *last = 0;
+    gamefile->functions = 0;
+    for (unsigned i = 0; i < chain_count; ++i) {
+        for (unsigned func = chains[i].first; func != order.count;
+                func = order.chain_next[func]) {
+            last = append_function(gamefile, last, order.functions[func]);
+        }
+    }
+    for (unsigned func = 0; func < order.count; ++func) {
+        if (!order.is_hot[func]) {
+            last = append_function(gamefile, last, order.functions[func]);
+        }
+    }
+
+    free(chains);
+    free_profile_order(&order);
+    return 0;
+}
+
+/*
+Write the map from counter numbers to what they count for a game built for
+profiling. Each line is "counter NUMBER call FUNCTION", "counter NUMBER
+branch FUNCTION LABEL" or "counter NUMBER edge FUNCTION CALLEE". Returns
+non-zero on failure.
+*/
+int write_profile_map(glulxfile_t *gamefile, const char *filename) {
+    FILE *fp = fopen(filename, "wt");
+    if (!fp) {
+        fprintf(stderr, "PROFILE: could not open map file \"%s\".\n", filename);
+        return 1;
+    }
+
+    static const char *type_names[] = { "call", "branch", "edge" };
+    for (function_t *func = gamefile->functions; func; func = func->next) {
+        for (unsigned i = 0; i < func->counter_count; ++i) {
+            profcounter_t *counter = &func->counters[i];
+            fprintf(fp, "counter %u %s %s", func->first_counter + i,
+                    type_names[counter->type], func->name);
+            if (counter->name) {
+                fprintf(fp, " %s", counter->name);
+            }
+            fprintf(fp, "\n");
+        }
+    }
+
+    int has_errors = ferror(fp);
+    if (fclose(fp) != 0 || has_errors) {
+        fprintf(stderr, "PROFILE: error writing map file \"%s\".\n", filename);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gbuild.h"
+
+#define DELIMITERS     " \t\n\r"
+#define MAX_INPUT_SIZE 256
+
+/*
+Converts the counters written by a game built with --profile back into a
+profile naming functions, which can then be given to gbuild with -p.
+
+    profmap MAP-FILE [DUMP-FILE]
+
+The dump is read from standard input if no file is given. Lines not written
+by the dump function, such as the game's own output, are ignored.
+*/
+
+/*
+A counter from the map file with the total of the values dumped for it.
+*/
+typedef struct MAP_COUNTER {
+    int type;
+    char *function;
+    char *name;
+    unsigned long count;
+} mapcounter_t;
+
+typedef struct COUNTER_MAP {
+    mapcounter_t *counters;
+    unsigned count;
+} countermap_t;
+
+int read_map(countermap_t *map, const char *map_file);
+int read_dump(countermap_t *map, FILE *fp, const char *dump_file);
+int compare_edge_counters(const void *a, const void *b);
+void write_profile(countermap_t *map);
+void free_map(countermap_t *map);
+
+
+/*
+Read the map of counter numbers written alongside a profiling build. Returns
+non-zero if errors occured.
+*/
+int read_map(countermap_t *map, const char *map_file) {
+    FILE *fp = fopen(map_file, "rt");
+    if (!fp) {
+        fprintf(stderr, "PROFMAP: could not open map file \"%s\".\n", map_file);
+        return 1;
+    }
+
+    int has_errors = 0;
+    unsigned line = 0;
+    char input_buffer[MAX_INPUT_SIZE];
+    while (fgets(input_buffer, MAX_INPUT_SIZE, fp)) {
+        ++line;
+        const char *command = strtok(input_buffer, DELIMITERS);
+        if (!command || command[0] == '#') {
+            continue;
+        }
+        const char *number = strtok(0, DELIMITERS);
+        const char *type = strtok(0, DELIMITERS);
+        const char *function = strtok(0, DELIMITERS);
+        const char *name = strtok(0, DELIMITERS);
+        char *end = 0;
+        unsigned long index = number ? strtoul(number, &end, 10) : 0;
+        if (strcmp(command, "counter") != 0 || !number || *end || !type || !function
+                || index != map->count) {
+            fprintf(stderr, "PROFMAP: %s:%u: bad counter.\n", map_file, line);
+            has_errors = 1;
+            break;
+        }
+
+        mapcounter_t counter = {0};
+        if (strcmp(type, "call") == 0) {
+            counter.type = COUNTER_CALL;
+        } else if (strcmp(type, "branch") == 0 && name) {
+            counter.type = COUNTER_BRANCH;
+        } else if (strcmp(type, "edge") == 0 && name) {
+            counter.type = COUNTER_EDGE;
+        } else {
+            fprintf(stderr, "PROFMAP: %s:%u: bad counter type.\n", map_file, line);
+            has_errors = 1;
+            break;
+        }
+        counter.function = strdup(function);
+        counter.name = name ? strdup(name) : 0;
+
+        if ((map->count & (map->count - 1)) == 0) {
+            map->counters = realloc(map->counters,
+                                    (map->count ? map->count * 2 : 1) * sizeof(mapcounter_t));
+        }
+        map->counters[map->count++] = counter;
+    }
+
+    fclose(fp);
+    return has_errors;
+}
+
+/*
+Add up the counters found in a dump. Returns non-zero if errors occured.
+*/
+int read_dump(countermap_t *map, FILE *fp, const char *dump_file) {
+    size_t prefix_length = strlen(PROFILE_DUMP_PREFIX);
+    int has_errors = 0;
+    unsigned line = 0;
+    char input_buffer[MAX_INPUT_SIZE];
+    while (fgets(input_buffer, MAX_INPUT_SIZE, fp)) {
+        ++line;
+        /* the game may not have ended its last line of text */
+        const char *counter = strstr(input_buffer, PROFILE_DUMP_PREFIX);
+        if (!counter) {
+            continue;
+        }
+        unsigned index;
+        unsigned long count;
+        if (sscanf(&counter[prefix_length], "%u %lu", &index, &count) != 2
+                || index >= map->count) {
+            fprintf(stderr, "PROFMAP: %s:%u: bad counter.\n", dump_file, line);
+            has_errors = 1;
+            continue;
+        }
+        map->counters[index].count += count;
+    }
+    return has_errors;
+}
+
+/*
+Order edge counters by caller and then callee so the counters of different
+calls between the same two functions are next to each other.
+*/
+int compare_edge_counters(const void *a, const void *b) {
+    const mapcounter_t *first = *(const mapcounter_t**)a;
+    const mapcounter_t *second = *(const mapcounter_t**)b;
+    int result = strcmp(first->function, second->function);
+    return result ? result : strcmp(first->name, second->name);
+}
+
+/*
+Write the counters as a profile. Calls between the same two functions from
+different places are added together into one edge.
+*/
+void write_profile(countermap_t *map) {
+    mapcounter_t **edges = malloc((map->count ? map->count : 1) * sizeof(mapcounter_t*));
+    unsigned edge_count = 0;
+    for (unsigned i = 0; i < map->count; ++i) {
+        mapcounter_t *counter = &map->counters[i];
+        if (counter->count == 0) continue;
+        if (counter->type == COUNTER_CALL) {
+            printf("call %s %lu\n", counter->function, counter->count);
+        } else if (counter->type == COUNTER_BRANCH) {
+            printf("branch %s %s %lu\n", counter->function, counter->name, counter->count);
+        } else {
+            edges[edge_count++] = counter;
+        }
+    }
+
+    qsort(edges, edge_count, sizeof(mapcounter_t*), compare_edge_counters);
+    for (unsigned i = 0; i < edge_count; ) {
+        unsigned long count = 0;
+        unsigned j = i;
+        while (j < edge_count && compare_edge_counters(&edges[i], &edges[j]) == 0) {
+            count += edges[j++]->count;
+        }
+        printf("edge %s %s %lu\n", edges[i]->function, edges[i]->name, count);
+        i = j;
+    }
+    free(edges);
+}
+
+void free_map(countermap_t *map) {
+    for (unsigned i = 0; i < map->count; ++i) {
+        free(map->counters[i].function);
+        free(map->counters[i].name);
+    }
+    free(map->counters);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s map-file [dump-file]\n", argv[0]);
+        return 1;
+    }
+
+    countermap_t map = {0};
+    int has_errors = read_map(&map, argv[1]);
+    if (!has_errors) {
+        const char *dump_file = argc == 3 ? argv[2] : "(stdin)";
+        FILE *fp = argc == 3 ? fopen(argv[2], "rt") : stdin;
+        if (!fp) {
+            fprintf(stderr, "PROFMAP: could not open dump file \"%s\".\n", dump_file);
+            has_errors = 1;
+        } else {
+            has_errors = read_dump(&map, fp, dump_file);
+            if (fp != stdin) {
+                fclose(fp);
+            }
+        }
+    }
+    if (!has_errors) {
+        write_profile(&map);
+    }
+    free_map(&map);
+    return has_errors ? 1 : 0;
+}
@@ -8,6 +8,39 @@
 #define DELIMITERS     " \t\n\r"
 #define MAX_INPUT_SIZE 256
 
+int add_resource(project_t *project, resource_t **last, int usage);
+
+
+/*
+Read the number and file of a picture or sound directive and add the
+resource to the end of the project's list. Returns non-zero if the
+directive is malformed.
+*/
+int add_resource(project_t *project, resource_t **last, int usage) {
+    char *number = strtok(0, DELIMITERS);
+    char *file = strtok(0, DELIMITERS);
+    if (!number || !file || strtok(0, DELIMITERS)) {
+        return 1;
+    }
+    char *end;
+    unsigned long value = strtoul(number, &end, 10);
+    if (*end != 0 || !isdigit((unsigned char)number[0]) || value > 0xFFFFFFFFUL) {
+        return 1;
+    }
+
+    resource_t *resource = calloc(sizeof(resource_t), 1);
+    resource->usage = usage;
+    resource->number = value;
+    resource->filename = strdup(file);
+    if (*last) {
+        (*last)->next = resource;
+    } else {
+        project->resources = resource;
+    }
+    *last = resource;
+    return 0;
+}
+
 project_t* open_project(const char *project_file) {
     FILE *fp = fopen(project_file, "rt");
     if (!fp) {
@@ -17,6 +50,7 @@ project_t* open_project(const char *project_file) {
     project_t *project = calloc(sizeof(project_t), 1);
     project->project_file = strdup(project_file);
 
+    resource_t *last_resource = 0;
     unsigned int line = 0;
     while (1) {
         char input_buffer[MAX_INPUT_SIZE] = {0};
@@ -48,6 +82,15 @@ project_t* open_project(const char *project_file) {
                     break;
                 }
             }
+        } else if (strcmp(command, "picture") == 0 || strcmp(command, "sound") == 0) {
+            int usage = command[0] == 'p' ? RESOURCE_PICTURE : RESOURCE_SOUND;
+            if (add_resource(project, &last_resource, usage)) {
+                fprintf(stderr, "PROJECT: expected a number and a file after \"%s\" "
+                        "on line %d.\n", command, line);
+                fclose(fp);
+                free_project(project);
+                return 0;
+            }
         } else {
             fprintf(stderr, "PROJECT: unknown directive \"%s\" on line %d.\n",
                     command, line);
@@ -62,6 +105,14 @@ void free_project(project_t *project) {
     for (size_t i = 0; i < MAX_PROJECT_FILES; ++i) {
         free(project->files[i]);
     }
+    resource_t *resource = project->resources;
+    while (resource) {
+        resource_t *next = resource->next;
+        free(resource->filename);
+        free(resource);
+        resource = next;
+    }
+    free(project->project_file);
     free(project);
 }
 
@@ -2,6 +2,7 @@
 #include <check.h>
 
 #include "../gbuild.h"
+#include "../grammar.h"
 
 int count_tokens(tokenlist_t *tokens);
 
@@ -23,7 +24,7 @@ START_TEST(test_lex_identifier_basic)
     tokenlist_t* tokens = lex_string(0, "test", test_string, strlen(test_string));
     ck_assert_int_eq(1, count_tokens(tokens));
     ck_assert_int_eq(IDENTIFIER, tokens->first->type);
-    ck_assert_str_eq(tokens->first->text, "abc");
+    ck_assert_str_eq(tokens->first->data.text, "abc");
     free_tokens(tokens);
 }
 END_TEST
@@ -34,7 +35,7 @@ START_TEST(test_lex_integer_basic)
     tokenlist_t* tokens = lex_string(0, "test", test_string, strlen(test_string));
     ck_assert_int_eq(1, count_tokens(tokens));
     ck_assert_int_eq(INTEGER, tokens->first->type);
-    ck_assert_int_eq(tokens->first->integer, 956357);
+    ck_assert_int_eq(tokens->first->data.integer, 956357);
     free_tokens(tokens);
 }
 END_TEST
@@ -45,18 +46,43 @@ START_TEST(test_lex_integer_hex)
     tokenlist_t* tokens = lex_string(0, "test", test_string, strlen(test_string));
     ck_assert_int_eq(1, count_tokens(tokens));
     ck_assert_int_eq(INTEGER, tokens->first->type);
-    ck_assert_int_eq(tokens->first->integer, 4550561);
+    ck_assert_int_eq(tokens->first->data.integer, 4550561);
     free_tokens(tokens);
 }
 END_TEST
 
+START_TEST(test_lex_integer_limits)
+{
+    const char *test_string = "0xFFFFFFFF 2147483647 2147483648";
+    tokenlist_t* tokens = lex_string(0, "test", test_string, strlen(test_string));
+    ck_assert_int_eq(3, count_tokens(tokens));
+    ck_assert_int_eq(tokens->has_errors, 0);
+    ck_assert_int_eq(tokens->first->data.integer, -1);
+    ck_assert_int_eq(tokens->first->next->data.integer, 2147483647);
+    ck_assert_int_eq(tokens->first->next->negate_only, 0);
+    /* only valid once negated, which the parser checks */
+    ck_assert_int_ne(tokens->last->negate_only, 0);
+    free_tokens(tokens);
+
+    /* larger values are errors rather than wrapping around */
+    const char *too_large[] = { "0x100000000", "4294967296", "99999999999", "2147483649" };
+    for (int i = 0; i < 4; ++i) {
+        tokens = lex_string(0, "test", too_large[i], strlen(too_large[i]));
+        ck_assert_int_eq(1, count_tokens(tokens));
+        ck_assert_int_ne(tokens->has_errors, 0);
+        free_tokens(tokens);
+    }
+    clear_diagnostics();
+}
+END_TEST
+
 START_TEST(test_lex_integer_char_constant)
 {
     const char *test_string = "'a'";
     tokenlist_t* tokens = lex_string(0, "test", test_string, strlen(test_string));
     ck_assert_int_eq(1, count_tokens(tokens));
     ck_assert_int_eq(INTEGER, tokens->first->type);
-    ck_assert_int_eq(tokens->first->integer, 97);
+    ck_assert_int_eq(tokens->first->data.integer, 97);
     free_tokens(tokens);
 }
 END_TEST
@@ -67,7 +93,7 @@ START_TEST(test_lex_integer_char_constant_tightbordered)
     tokenlist_t* tokens = lex_string(0, "test", test_string, strlen(test_string));
     ck_assert_int_eq(3, count_tokens(tokens));
     ck_assert_int_eq(INTEGER, tokens->first->next->type);
-    ck_assert_int_eq(tokens->first->next->integer, 122);
+    ck_assert_int_eq(tokens->first->next->data.integer, 122);
     free_tokens(tokens);
 }
 END_TEST
@@ -78,11 +104,218 @@ START_TEST(test_lex_integer_char_constant_bordered)
     tokenlist_t* tokens = lex_string(0, "test", test_string, strlen(test_string));
     ck_assert_int_eq(3, count_tokens(tokens));
     ck_assert_int_eq(INTEGER, tokens->first->next->type);
-    ck_assert_int_eq(tokens->first->next->integer, 122);
+    ck_assert_int_eq(tokens->first->next->data.integer, 122);
+    free_tokens(tokens);
+}
+END_TEST
+
+START_TEST(test_lex_operators)
+{
+    const char *test_string = "A<<2 - ~B";
+    tokenlist_t* tokens = lex_string(0, "test", test_string, strlen(test_string));
+    ck_assert_int_eq(6, count_tokens(tokens));
+    ck_assert_int_eq(OPERATOR, tokens->first->next->type);
+    ck_assert_str_eq(tokens->first->next->data.text, "<<");
+    ck_assert_int_eq(OPERATOR, tokens->first->next->next->next->type);
+    ck_assert_str_eq(tokens->first->next->next->next->data.text, "-");
+    ck_assert_str_eq(tokens->last->prev->data.text, "~");
+    free_tokens(tokens);
+}
+END_TEST
+
+START_TEST(test_lex_comparison_operators)
+{
+    const char *test_string = "a<=b!=!c&&d";
+    tokenlist_t* tokens = lex_string(0, "test", test_string, strlen(test_string));
+    ck_assert_int_eq(8, count_tokens(tokens));
+    ck_assert_str_eq(tokens->first->next->data.text, "<=");
+    ck_assert_str_eq(tokens->first->next->next->next->data.text, "!=");
+    ck_assert_str_eq(tokens->first->next->next->next->next->data.text, "!");
+    ck_assert_str_eq(tokens->last->prev->data.text, "&&");
+    free_tokens(tokens);
+}
+END_TEST
+
+START_TEST(test_lex_identifier_hash)
+{
+    const char *test_string = "copy function";
+    tokenlist_t* tokens = lex_string(0, "test", test_string, strlen(test_string));
+    ck_assert_int_eq(2, count_tokens(tokens));
+    ck_assert_int_eq(IDENTIFIER, tokens->first->type);
+    ck_assert_uint_eq(hash_string("copy"), tokens->first->hash);
+    ck_assert_uint_eq(4, tokens->first->length);
+    ck_assert_int_eq(KW_NONE, tokens->first->keyword);
+    ck_assert_int_eq(RESERVED, tokens->last->type);
+    ck_assert_int_eq(KW_FUNCTION, tokens->last->keyword);
+    ck_assert_uint_eq(hash_string("function"), tokens->last->hash);
+    ck_assert_uint_eq(8, tokens->last->length);
     free_tokens(tokens);
 }
 END_TEST
 
+START_TEST(test_lex_utf8)
+{
+    /* columns count characters rather than bytes */
+    const char *test_string = "\"h\xC3\xA9\" x '\xC3\xA9' \"\\xE9\\u2713\"";
+    tokenlist_t* tokens = lex_string(0, "test", test_string, strlen(test_string));
+    ck_assert_int_eq(4, count_tokens(tokens));
+    ck_assert_str_eq(tokens->first->data.text, "h\xC3\xA9");
+    ck_assert_int_eq(6, tokens->first->next->col_no);
+    ck_assert_int_eq(0xE9, tokens->first->next->next->data.integer);
+    ck_assert_int_eq(8, tokens->first->next->next->col_no);
+    ck_assert_str_eq(tokens->last->data.text, "\xC3\xA9\xE2\x9C\x93");
+    free_tokens(tokens);
+
+    ck_assert_uint_eq(find_invalid_utf8("abcdefghijklmnopqrstuvwxyz\xF0\x9F\x98\x80", 30), 30);
+    ck_assert_uint_eq(find_invalid_utf8("abcdefghijklmnopqrstuvwxyz\xC0\xAF", 28), 26);
+    ck_assert_uint_eq(find_invalid_utf8("\xED\xA0\x80", 3), 0);
+    ck_assert_uint_eq(find_invalid_utf8("\xE2\x9C", 2), 0);
+    /* the lexer carries on past invalid text, keeping the tokens around it */
+    test_string = "a \"\xFF\" b";
+    tokens = lex_string(0, "test", test_string, strlen(test_string));
+    ck_assert_int_ne(tokens->has_errors, 0);
+    ck_assert_str_eq(tokens->first->data.text, "a");
+    ck_assert_str_eq(tokens->last->data.text, "b");
+    free_tokens(tokens);
+}
+END_TEST
+
+START_TEST(test_lex_string_threads)
+{
+    /* most lines end inside a comment or string, so most of the parts the
+       text is divided into begin inside one */
+    const char *unit = "/* a \"comment\n spanning */ abc 12\n\"a \\\"string\n\" `word`\n"
+                       "// line\n'x' 0x1F <= ;\n";
+    size_t unit_length = strlen(unit);
+    size_t count = 3 * LEX_CHUNK_SIZE / unit_length;
+    char *text = malloc(count * unit_length + 1);
+    for (size_t i = 0; i < count; ++i) {
+        memcpy(&text[i * unit_length], unit, unit_length);
+    }
+    text[count * unit_length] = 0;
+
+    tokenlist_t *serial = lex_string_threads(0, "test", text, count * unit_length, 1);
+    tokenlist_t *parallel = lex_string_threads(0, "test", text, count * unit_length, 4);
+    ck_assert_int_eq(serial->has_errors, 0);
+    ck_assert_int_eq(parallel->has_errors, 0);
+    lexertoken_t *a = serial->first;
+    lexertoken_t *b = parallel->first;
+    int same = 1;
+    while (a && b && same) {
+        same = a->type == b->type && a->offset == b->offset && a->length == b->length
+            && a->line_no == b->line_no && a->col_no == b->col_no;
+        a = a->next;
+        b = b->next;
+    }
+    ck_assert_int_eq(same, 1);
+    ck_assert_ptr_eq(a, 0);
+    ck_assert_ptr_eq(b, 0);
+    ck_assert_int_eq(serial->last->line_no, parallel->last->line_no);
+    ck_assert_int_eq(6 * count, parallel->last->line_no);
+    ck_assert_str_eq(parallel->last->prev->data.text, "<=");
+    free_tokens(serial);
+    free_tokens(parallel);
+    free(text);
+}
+END_TEST
+
+START_TEST(test_lexer_range)
+{
+    const char *test_string = "skip {\n  ab 12 }\nrest";
+    lexer_t *lexer = open_lexer_range(0, "test", test_string, 5, 16, 1, 6);
+    ck_assert_int_eq(OPEN_BRACE, lexer_token(lexer, 0)->type);
+    ck_assert_int_eq(5, lexer_token(lexer, 0)->offset);
+    ck_assert_str_eq(lexer_token(lexer, 1)->data.text, "ab");
+    ck_assert_int_eq(9, lexer_token(lexer, 1)->offset);
+    ck_assert_int_eq(2, lexer_token(lexer, 1)->line_no);
+    ck_assert_int_eq(3, lexer_token(lexer, 1)->col_no);
+    ck_assert_int_eq(15, lexer_token(lexer, 3)->offset);
+    lexer_advance(lexer);
+    lexer_advance(lexer);
+    lexer_advance(lexer);
+    lexer_advance(lexer);
+    ck_assert_ptr_eq(lexer_token(lexer, 0), 0);
+    close_lexer(lexer);
+}
+END_TEST
+
+START_TEST(test_relex_tokens)
+{
+    tokenlist_t *tokens = calloc(sizeof(tokenlist_t), 1);
+    textedit_t edit = { 0, 0, 9 };
+    relex_tokens(tokens, 0, 0, "test", "a bc 12\nd", 9, &edit);
+    lexertoken_t *d = tokens->last;
+    ck_assert_str_eq(d->data.text, "d");
+    ck_assert_int_eq(8, d->offset);
+
+    edit = (textedit_t){ 4, 0, 1 };
+    relex_tokens(tokens, token_before(tokens->first, 0, 4), 0, "test", "a bcx 12\nd", 10, &edit);
+    ck_assert_str_eq(tokens->first->next->data.text, "bcx");
+    ck_assert_int_eq(0, edit.damage_start);
+    ck_assert_int_eq(6, edit.damage_end);
+    ck_assert_ptr_eq(tokens->last, d);
+    ck_assert_int_eq(9, d->offset);
+    ck_assert_int_eq(2, d->line_no);
+
+    free_tokens(tokens);
+
+    /* tokens after a limit are not moved, so their positions can be relative
+       to it, and an edit that would replace the limit leaves the list as it
+       was */
+    tokens = calloc(sizeof(tokenlist_t), 1);
+    edit = (textedit_t){ 0, 0, 8 };
+    relex_tokens(tokens, 0, 0, "test", "a b c }d", 8, &edit);
+    lexertoken_t *close = tokens->last->prev;
+    edit = (textedit_t){ 0, 0, 2 };
+    ck_assert_int_eq(relex_tokens(tokens, 0, close, "test", "x a b c }d", 10, &edit), 0);
+    ck_assert_int_eq(edit.touched, 5);
+    ck_assert_int_eq(8, close->offset);
+    ck_assert_int_eq(7, tokens->last->offset);
+    edit = (textedit_t){ 8, 1, 0 };
+    ck_assert_int_eq(relex_tokens(tokens, token_before(tokens->first, 0, 8), close, "test",
+                                  "x a b c d", 9, &edit), -1);
+    ck_assert_int_eq(close->type, CLOSE_BRACE);
+    ck_assert_ptr_eq(close->prev->next, close);
+    free_tokens(tokens);
+
+    /* positions may be relative to a point in the text, which new tokens are
+       made relative to as well */
+    tokens = calloc(sizeof(tokenlist_t), 1);
+    edit = (textedit_t){ 0, 0, 6, 0, 1 };
+    relex_tokens(tokens, 0, 0, "test", "b a\n c", 6, &edit);
+    ck_assert_int_eq(tokens->last->line_no, 1);
+    edit = (textedit_t){ 7, 0, 1, 5, 1 };
+    ck_assert_int_eq(relex_tokens(tokens, token_before(tokens->first, 0, 2), 0, "test",
+                                  "12345b xa\n c", 12, &edit), 0);
+    ck_assert_str_eq(tokens->first->next->data.text, "xa");
+    ck_assert_int_eq(2, tokens->first->next->offset);
+    ck_assert_int_eq(0, tokens->first->next->line_no);
+    ck_assert_int_eq(6, tokens->last->offset);
+    ck_assert_int_eq(1, tokens->last->line_no);
+    free_tokens(tokens);
+}
+END_TEST
+
+START_TEST(test_lexer_stream_lookahead)
+{
+    const char *test_string = "a b 3 c d e f g";
+    lexer_t *lexer = open_lexer_string(0, "test", test_string, strlen(test_string));
+    ck_assert_str_eq(lexer_token(lexer, 0)->data.text, "a");
+    ck_assert_int_eq(lexer_token(lexer, 2)->data.integer, 3);
+    lexer_advance(lexer);
+    ck_assert_str_eq(lexer_token(lexer, 0)->data.text, "b");
+    for (int i = 0; i < 6; ++i) {
+        lexer_advance(lexer);
+    }
+    ck_assert_str_eq(lexer_token(lexer, 0)->data.text, "g");
+    ck_assert_ptr_eq(lexer_token(lexer, 1), 0);
+    lexer_advance(lexer);
+    ck_assert_ptr_eq(lexer_token(lexer, 0), 0);
+    ck_assert_int_eq(lexer_has_errors(lexer), 0);
+    close_lexer(lexer);
+}
+END_TEST
+
 
 Suite* lexer_suite(void) {
     Suite *s = suite_create("Lexer");
@@ -90,9 +323,18 @@ Suite* lexer_suite(void) {
     tcase_add_test(tc_core, test_lex_identifier_basic);
     tcase_add_test(tc_core, test_lex_integer_basic);
     tcase_add_test(tc_core, test_lex_integer_hex);
+    tcase_add_test(tc_core, test_lex_integer_limits);
     tcase_add_test(tc_core, test_lex_integer_char_constant);
     tcase_add_test(tc_core, test_lex_integer_char_constant_tightbordered);
     tcase_add_test(tc_core, test_lex_integer_char_constant_bordered);
+    tcase_add_test(tc_core, test_lex_operators);
+    tcase_add_test(tc_core, test_lex_comparison_operators);
+    tcase_add_test(tc_core, test_lex_identifier_hash);
+    tcase_add_test(tc_core, test_lex_utf8);
+    tcase_add_test(tc_core, test_lex_string_threads);
+    tcase_add_test(tc_core, test_lexer_range);
+    tcase_add_test(tc_core, test_relex_tokens);
+    tcase_add_test(tc_core, test_lexer_stream_lookahead);
     suite_add_tcase(s, tc_core);
     return s;
 }
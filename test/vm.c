@@ -0,0 +1,1152 @@
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+
+#include "../gbuild.h"
+
+glulxfile_t* build_game(const char *source, unsigned inline_limit);
+vm_t* run_game_source(const char *source, unsigned inline_limit, glulxfile_t **gamefile,
+                      unsigned long limit);
+int function_address(glulxfile_t *gamefile, const char *name);
+void write_test_file(const char *filename, const char *data, size_t size);
+unsigned char* read_test_file(const char *filename, size_t *size);
+unsigned blorb_word(const unsigned char *data);
+int reports_error(const char *source, const char *message);
+
+
+/*
+Build a game from source, inlining functions of up to inline_limit
+instructions. Returns null if the game could not be built.
+*/
+glulxfile_t* build_game(const char *source, unsigned inline_limit) {
+    glulxfile_t *gamefile = calloc(sizeof(glulxfile_t), 1);
+    gamefile->global_symbols = calloc(sizeof(symboltable_t), 1);
+    lexer_t *lexer = open_lexer_string(gamefile, "test", source, strlen(source));
+    int has_errors = parse_file(gamefile, lexer);
+    has_errors |= lexer_has_errors(lexer);
+    close_lexer(lexer);
+    flush_diagnostics(stderr);
+    if (!has_errors && inline_limit > 0) {
+        inline_functions(gamefile, inline_limit);
+    }
+    if (!has_errors) {
+        has_errors = assemble_game(gamefile, 1);
+    }
+    if (!has_errors) {
+        has_errors = link_game(gamefile);
+    }
+    if (has_errors) {
+        free_gamefile(gamefile);
+        return 0;
+    }
+    return gamefile;
+}
+
+/*
+Build a game and run it until it ends or has executed limit instructions.
+The output is terminated so it can be compared as a string.
+*/
+vm_t* run_game_source(const char *source, unsigned inline_limit, glulxfile_t **gamefile,
+                      unsigned long limit) {
+    *gamefile = build_game(source, inline_limit);
+    if (!*gamefile) {
+        return 0;
+    }
+    vm_t *vm = open_vm((*gamefile)->image.data, (*gamefile)->image.size);
+    if (vm) {
+        run_vm(vm, limit);
+        codebuf_add_byte(&vm->output, 0);
+    }
+    return vm;
+}
+
+int function_address(glulxfile_t *gamefile, const char *name) {
+    return get_symbol(gamefile->global_symbols, name)->position;
+}
+
+void write_test_file(const char *filename, const char *data, size_t size) {
+    FILE *fp = fopen(filename, "wb");
+    fwrite(data, 1, size, fp);
+    fclose(fp);
+}
+
+unsigned char* read_test_file(const char *filename, size_t *size) {
+    FILE *fp = fopen(filename, "rb");
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    unsigned char *data = malloc(*size);
+    *size = fread(data, 1, *size, fp);
+    fclose(fp);
+    return data;
+}
+
+unsigned blorb_word(const unsigned char *data) {
+    return ((unsigned)data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+/*
+Parse source and return true if it fails with message as its first error.
+*/
+int reports_error(const char *source, const char *message) {
+    clear_diagnostics();
+    glulxfile_t *gamefile = calloc(sizeof(glulxfile_t), 1);
+    gamefile->global_symbols = calloc(sizeof(symboltable_t), 1);
+    lexer_t *lexer = open_lexer_string(gamefile, "test", source, strlen(source));
+    int has_errors = parse_file(gamefile, lexer);
+    has_errors |= lexer_has_errors(lexer);
+    close_lexer(lexer);
+    free_gamefile(gamefile);
+
+    FILE *out = tmpfile();
+    flush_diagnostics(out);
+    rewind(out);
+    char found[256] = {0};
+    size_t size = fread(found, 1, sizeof(found) - 1, out);
+    fclose(out);
+    clear_diagnostics();
+    const char *line_end = memchr(found, '\n', size);
+    const char *at = strstr(found, message);
+    return has_errors && at && (!line_end || at < line_end);
+}
+
+
+START_TEST(test_vm_output_and_counts)
+{
+    const char *source =
+        "function show() { asm { return 0; } }\n"
+        "function main() {\n"
+        "    asm {\n"
+        "        setiosys 2 0;\n"
+        "        copy 3 sp;\n"
+        "    loop:\n"
+        "        stkcopy 1;\n"
+        "        jz sp done;\n"
+        "        stkcopy 1;\n"
+        "        streamnum sp;\n"
+        "        callf show 0;\n"
+        "        sub sp 1 sp;\n"
+        "        jump loop;\n"
+        "    done:\n"
+        "        streamstr \"!\";\n"
+        "        return 0;\n"
+        "    }\n"
+        "}\n";
+    glulxfile_t *gamefile;
+    vm_t *vm = run_game_source(source, 0, &gamefile, 0);
+    ck_assert_ptr_ne(vm, 0);
+    ck_assert_int_eq(vm->status, VM_QUIT);
+    ck_assert_str_eq((char*)vm->output.data, "321!");
+    ck_assert_int_eq(vm->instruction_count, 30);
+    ck_assert_int_eq(vm->opcode_counts[get_mnemonic_index("stkcopy")], 7);
+    ck_assert_int_eq(vm->opcode_counts[get_mnemonic_index("callf")], 3);
+
+    vmfunction_t *show = vm_function(vm, function_address(gamefile, "show"));
+    ck_assert_ptr_ne(show, 0);
+    ck_assert_int_eq(show->calls, 3);
+    ck_assert_int_eq(show->instructions, 3);
+    vmfunction_t *main = vm_function(vm, function_address(gamefile, "main"));
+    ck_assert_int_eq(main->instructions, 27);
+    close_vm(vm);
+    free_gamefile(gamefile);
+}
+END_TEST
+
+START_TEST(test_vm_arithmetic)
+{
+    const char *source =
+        "function main() {\n"
+        "    asm {\n"
+        "        setiosys 2 0;\n"
+        "        div -7 2 sp;\n"
+        "        streamnum sp;\n"
+        "        mod -7 2 sp;\n"
+        "        streamnum sp;\n"
+        "        sshiftr -8 1 sp;\n"
+        "        streamnum sp;\n"
+        "        ushiftr -8 28 sp;\n"
+        "        streamnum sp;\n"
+        "        numtof 7 sp;\n"
+        "        fdiv sp 1073741824 sp;\n"
+        "        ftonumn sp sp;\n"
+        "        streamnum sp;\n"
+        "        return 0;\n"
+        "    }\n"
+        "}\n";
+    glulxfile_t *gamefile;
+    vm_t *vm = run_game_source(source, 0, &gamefile, 0);
+    ck_assert_ptr_ne(vm, 0);
+    ck_assert_int_eq(vm->status, VM_QUIT);
+    ck_assert_str_eq((char*)vm->output.data, "-3-1-4154");
+    close_vm(vm);
+    free_gamefile(gamefile);
+}
+END_TEST
+
+START_TEST(test_vm_specialized_calls)
+{
+    const char *source =
+        "function seven() { asm { return 7; } }\n"
+        "function twice() { asm { call seven 0 sp; return sp; } }\n"
+        "function main() {\n"
+        "    asm {\n"
+        "        setiosys 2 0;\n"
+        "        copy 1 sp;\n"
+        "        copy 2 sp;\n"
+        "        call twice 2 sp;\n"
+        "        streamnum sp;\n"
+        "        copy 9 sp;\n"
+        "        copy 5 sp;\n"
+        "        call seven 1 0;\n"
+        "        streamnum sp;\n"
+        "        copy 3 sp;\n"
+        "    here:\n"
+        "        call seven 1 sp;\n"
+        "        streamnum sp;\n"
+        "        return 0;\n"
+        "    }\n"
+        "}\n";
+    glulxfile_t *gamefile;
+    vm_t *vm = run_game_source(source, 0, &gamefile, 0);
+    ck_assert_ptr_ne(vm, 0);
+    ck_assert_int_eq(vm->status, VM_QUIT);
+    ck_assert_str_eq((char*)vm->output.data, "797");
+    ck_assert_int_eq(vm->opcode_counts[get_mnemonic_index("callfii")], 1);
+    ck_assert_int_eq(vm->opcode_counts[get_mnemonic_index("callfi")], 1);
+    ck_assert_int_eq(vm->opcode_counts[get_mnemonic_index("tailcall")], 1);
+    /* a call at a label is left alone */
+    ck_assert_int_eq(vm->opcode_counts[get_mnemonic_index("call")], 1);
+    ck_assert_int_eq(vm->opcode_counts[get_mnemonic_index("copy")], 2);
+    ck_assert_int_eq(vm_function(vm, function_address(gamefile, "twice"))->instructions, 1);
+    close_vm(vm);
+    free_gamefile(gamefile);
+}
+END_TEST
+
+START_TEST(test_vm_inlined_calls)
+{
+    const char *source =
+        "function clamp() {\n"
+        "    asm {\n"
+        "        copy 12 sp;\n"
+        "        jlt sp 10 small;\n"
+        "        return 10;\n"
+        "    small:\n"
+        "        return 5;\n"
+        "    }\n"
+        "}\n"
+        "function outer() { asm { callf clamp sp; return sp; } }\n"
+        "function kept() noinline { asm { return 1; } }\n"
+        "function recurse() { asm { callf recurse 0; return 2; } }\n"
+        "function main() {\n"
+        "    asm {\n"
+        "        setiosys 2 0;\n"
+        "        copy 3 sp;\n"
+        "        callf outer sp;\n"
+        "        streamnum sp;\n"
+        "        streamnum sp;\n"
+        "        callf kept sp;\n"
+        "        streamnum sp;\n"
+        "        copy 4 sp;\n"
+        "        call outer 1 sp;\n"
+        "        streamnum sp;\n"
+        "        stkcount sp;\n"
+        "        streamnum sp;\n"
+        "        return 0;\n"
+        "    }\n"
+        "}\n";
+    glulxfile_t *gamefile;
+    vm_t *vm = run_game_source(source, DEFAULT_INLINE_LIMIT, &gamefile, 0);
+    ck_assert_ptr_ne(vm, 0);
+    ck_assert_int_eq(vm->status, VM_QUIT);
+    ck_assert_str_eq((char*)vm->output.data, "1031100");
+    /* only the call of the noinline function is left */
+    ck_assert_int_eq(vm->opcode_counts[get_mnemonic_index("callf")], 1);
+    ck_assert_int_eq(vm->opcode_counts[get_mnemonic_index("call")], 0);
+    ck_assert_ptr_eq(vm_function(vm, function_address(gamefile, "outer")), 0);
+    ck_assert_int_eq(vm_function(vm, function_address(gamefile, "kept"))->calls, 1);
+    close_vm(vm);
+    free_gamefile(gamefile);
+
+    /* stack instructions may be inlined if they only reach values the
+       function pushed itself */
+    source =
+        "function diff(a, b) { asm { copy a sp; copy b sp; stkswap; sub sp sp sp; return sp; } }\n"
+        "function triple(a) {\n"
+        "    asm { copy a sp; stkcopy 1; stkpeek 1 sp; add sp sp sp; add sp sp sp; return sp; }\n"
+        "}\n"
+        "function peek(i) {\n"
+        "    asm { copy 5 sp; copy 6 sp; stkpeek i sp; add sp sp sp; add sp sp sp; return sp; }\n"
+        "}\n"
+        "function main() {\n"
+        "    asm {\n"
+        "        setiosys 2 0;\n"
+        "        callfii diff 10 4 sp;\n"
+        "        streamnum sp;\n"
+        "        callfi triple 7 sp;\n"
+        "        streamnum sp;\n"
+        "        callfi peek 0 sp;\n"
+        "        streamnum sp;\n"
+        "        return 0;\n"
+        "    }\n"
+        "}\n";
+    vm = run_game_source(source, DEFAULT_INLINE_LIMIT, &gamefile, 0);
+    ck_assert_ptr_ne(vm, 0);
+    ck_assert_str_eq((char*)vm->output.data, "62117");
+    ck_assert_int_eq(vm->opcode_counts[get_mnemonic_index("callfi")], 1);
+    ck_assert_ptr_eq(vm_function(vm, function_address(gamefile, "diff")), 0);
+    ck_assert_ptr_eq(vm_function(vm, function_address(gamefile, "triple")), 0);
+    ck_assert_int_eq(vm_function(vm, function_address(gamefile, "peek"))->calls, 1);
+    close_vm(vm);
+    free_gamefile(gamefile);
+
+    /* parameters and locals become locals of the caller, given the arguments
+       or zero each time the copy runs, however the arguments are passed */
+    source =
+        "function next(n) { local seen; asm { add seen 1 seen; add n seen sp; return sp; } }\n"
+        "function main() {\n"
+        "    local n = 3;\n"
+        "    asm { setiosys 2 0; }\n"
+        "    asm { callfi next n sp; streamnum sp; }\n"
+        "    asm { callfi next n sp; streamnum sp; }\n"
+        "    asm { copy 5 sp; call next 1 sp; streamnum sp; }\n"
+        "    asm { copy 2 sp; callfii next 7 sp sp; streamnum sp; }\n"
+        "    asm { callf next sp; streamnum sp; }\n"
+        "    asm { stkcount sp; streamnum sp; }\n"
+        "    return 0;\n"
+        "}\n";
+    vm = run_game_source(source, DEFAULT_INLINE_LIMIT, &gamefile, 0);
+    ck_assert_ptr_ne(vm, 0);
+    ck_assert_int_eq(vm->status, VM_QUIT);
+    ck_assert_str_eq((char*)vm->output.data, "446810");
+    ck_assert_ptr_eq(vm_function(vm, function_address(gamefile, "next")), 0);
+    ck_assert_int_eq(vm->opcode_counts[get_mnemonic_index("callfi")], 0);
+    close_vm(vm);
+    free_gamefile(gamefile);
+}
+END_TEST
+
+START_TEST(test_vm_switch)
+{
+    const char *source =
+        "function main() {\n"
+        "    asm { setiosys 2 0; copy 0 sp; loop: stkcopy 1; jgt sp 7 done; stkcopy 1; }\n"
+        "    switch (sp) {\n"
+        "        case 1: asm { streamchar 97; }\n"
+        "        case 2, 3: asm { streamchar 98; }\n"
+        "        case 4: asm { streamchar 99; }\n"
+        "        case 6: asm { streamchar 100; }\n"
+        "        default: asm { streamchar 46; }\n"
+        "    }\n"
+        "    asm { stkcopy 1; }\n"
+        "    switch (sp) {\n"
+        "        case -100: asm { streamchar 120; }\n"
+        "        case 0: asm { streamchar 48; }\n"
+        "        case 5: asm { streamchar 53; }\n"
+        "        case 1000: asm { streamchar 120; }\n"
+        "        case 50000: asm { streamchar 120; }\n"
+        "    }\n"
+        "    asm { add sp 1 sp; jump loop; done: copy sp 0; }\n"
+        "    switch (3) { case 3: asm { streamchar 33; } }\n"
+        "    asm { stkcount sp; streamnum sp; return 0; }\n"
+        "}\n";
+    glulxfile_t *gamefile;
+    vm_t *vm = run_game_source(source, 0, &gamefile, 0);
+    ck_assert_ptr_ne(vm, 0);
+    ck_assert_int_eq(vm->status, VM_QUIT);
+    ck_assert_str_eq((char*)vm->output.data, ".0abbc.5d.!0");
+    /* the dense cases use a table, missing it for 0 and 7 */
+    ck_assert_int_eq(vm->opcode_counts[get_mnemonic_index("jumpabs")], 6);
+    /* the sparse cases are split once, then compared one by one */
+    ck_assert_int_eq(vm->opcode_counts[get_mnemonic_index("jlt")], 8);
+    close_vm(vm);
+    free_gamefile(gamefile);
+
+    ck_assert_ptr_eq(build_game("function main() { switch (sp) { case 1: case 1: } }", 0), 0);
+    ck_assert_ptr_eq(build_game("function main() { switch (sp) { asm { return 0; } } }", 0), 0);
+}
+END_TEST
+
+START_TEST(test_vm_nested_statements)
+{
+    /* statements are parsed with a stack of their own, so nesting them
+       deeply doesn't use up the C stack */
+    const unsigned depth = 2000;
+    const char *open = "if (0) return 1; else { while (0) { } switch (1) { case 1: ";
+    const char *close = "} }";
+    char *source = malloc(depth * (strlen(open) + strlen(close)) + 256);
+    strcpy(source, "function main() { asm { setiosys 2 0; } ");
+    for (unsigned i = 0; i < depth; ++i) strcat(source, open);
+    strcat(source, "asm { streamstr \"deep\"; } ");
+    for (unsigned i = 0; i < depth; ++i) strcat(source, close);
+    strcat(source, " return 0; }");
+    glulxfile_t *gamefile;
+    vm_t *vm = run_game_source(source, 0, &gamefile, 0);
+    ck_assert_ptr_ne(vm, 0);
+    ck_assert_int_eq(vm->status, VM_QUIT);
+    ck_assert_str_eq((char*)vm->output.data, "deep");
+    close_vm(vm);
+    free_gamefile(gamefile);
+    free(source);
+
+    /* errors part way through nested statements */
+    ck_assert_ptr_eq(build_game("function main() { while (1) { if (1) { switch (sp) {", 0), 0);
+    ck_assert_ptr_eq(build_game("function main() { while (1) { switch (2) { case 1: "
+                                "if (1) return 1 }", 0), 0);
+    ck_assert_ptr_eq(build_game("function main() { if (1) { } else asm { } while (1) ", 0), 0);
+}
+END_TEST
+
+START_TEST(test_vm_error_recovery)
+{
+    /* the parser skips what it can't parse and carries on, so every error
+       is reported by one build */
+    clear_diagnostics();
+    ck_assert_ptr_eq(build_game("constant A = 1 +;\n"
+                                "function main() {\n"
+                                "    local x;\n"
+                                "    x = 3 +;\n"
+                                "    if (x +) { x = 1; x = 2; }\n"
+                                "    asm { bogus 1 2; add 1 2 sp; }\n"
+                                "    switch (x) { case Q: x = 1; default: x = 2; }\n"
+                                "    return x;\n"
+                                "}\n"
+                                "function other(a b) { return 1; }\n"
+                                "function third() { while (1) return 2 +; \"\\q\"; }\n", 0), 0);
+    ck_assert_uint_eq(diagnostic_count(DIAG_ERROR), 8);
+
+    /* repeats are dropped and errors past the limit only counted */
+    clear_diagnostics();
+    set_diagnostic_options(1, 2);
+    report_diagnostic(DIAG_TRACE, "test", "a.g", 1, 1, "parsing %s", "function");
+    for (int i = 0; i < 2; ++i) {
+        report_diagnostic(DIAG_ERROR, "test", "a.g", 2, 5, "Expected ';'");
+    }
+    report_diagnostic(DIAG_ERROR, "test", "a.g", 3, 1, "Expected '('");
+    report_diagnostic(DIAG_ERROR, "test", 0, 0, 0, "Unexpected end of file");
+    ck_assert_uint_eq(diagnostic_count(DIAG_TRACE), 1);
+    ck_assert_uint_eq(diagnostic_count(DIAG_ERROR), 3);
+    FILE *out = tmpfile();
+    flush_diagnostics(out);
+    flush_diagnostics(out);
+    rewind(out);
+    char text[256] = {0};
+    fread(text, 1, sizeof(text) - 1, out);
+    fclose(out);
+    ck_assert_str_eq(text, "a.g:1:1: trace: parsing function [test]\n"
+                           "a.g:2:5: error: Expected ';' [test]\n"
+                           "a.g:3:1: error: Expected '(' [test]\n"
+                           "1 more error not shown.\n");
+    set_diagnostic_options(0, DEFAULT_MAX_ERRORS);
+    clear_diagnostics();
+}
+END_TEST
+
+START_TEST(test_vm_expressions)
+{
+    const char *source =
+        "constant LIMIT = 5;\n"
+        "global total = 100;\n"
+        "function show(value) { asm { streamnum value; streamchar 32; } return; }\n"
+        "function sum(a, b) { return a + b; }\n"
+        "function twice(n) { return sum(n, n); }\n"
+        "function count(n) {\n"
+        "    local i = 0, result;\n"
+        "    result = 0;\n"
+        "    while (i < n) {\n"
+        "        if (i % 2 == 0 && i != 2) result = result + i;\n"
+        "        else result = result - 1;\n"
+        "        i = i + 1;\n"
+        "    }\n"
+        "    return result;\n"
+        "}\n"
+        "function main() {\n"
+        "    local x, y;\n"
+        "    asm { setiosys 2 0; }\n"
+        "    x = 7;\n"
+        "    y = x * 3 - LIMIT;\n"
+        "    show(y);\n"
+        "    show(sum(x, y) - sum(1, 2));\n"
+        "    show(count(LIMIT));\n"
+        "    show(twice(-3));\n"
+        "    total = total + x;\n"
+        "    show(total);\n"
+        "    show(x > 3 || y < 0);\n"
+        "    show(!(x == 7));\n"
+        "    x = y = 2;\n"
+        "    show(x + y);\n"
+        "    asm { stkcount sp; streamnum sp; }\n"
+        "    return 0;\n"
+        "}\n";
+    glulxfile_t *gamefile;
+    vm_t *vm = run_game_source(source, 0, &gamefile, 0);
+    ck_assert_ptr_ne(vm, 0);
+    ck_assert_int_eq(vm->status, VM_QUIT);
+    ck_assert_str_eq((char*)vm->output.data, "16 20 1 -6 107 1 0 4 0");
+    /* values are computed straight into their locals; only plain assignments,
+       the two boolean values shown and the arguments of the tailcall are
+       copied */
+    ck_assert_int_eq(vm->opcode_counts[get_mnemonic_index("mul")], 1);
+    ck_assert_int_eq(vm->opcode_counts[get_mnemonic_index("copy")], 9);
+    /* both sums are on the stack when subtracted */
+    ck_assert_int_eq(vm->opcode_counts[get_mnemonic_index("stkswap")], 1);
+    /* every call takes its arguments as operands, even computed ones */
+    ck_assert_int_eq(vm->opcode_counts[get_mnemonic_index("callfii")], 2);
+    ck_assert_int_eq(vm->opcode_counts[get_mnemonic_index("callfi")], 10);
+    ck_assert_int_eq(vm->opcode_counts[get_mnemonic_index("call")], 0);
+    ck_assert_int_eq(vm->opcode_counts[get_mnemonic_index("tailcall")], 1);
+    close_vm(vm);
+    free_gamefile(gamefile);
+
+    /* inlined functions keep their own parameters and locals apart from
+       those of their callers */
+    vm = run_game_source(source, DEFAULT_INLINE_LIMIT, &gamefile, 0);
+    ck_assert_ptr_ne(vm, 0);
+    ck_assert_str_eq((char*)vm->output.data, "16 20 1 -6 107 1 0 4 0");
+    close_vm(vm);
+    free_gamefile(gamefile);
+
+    ck_assert_ptr_eq(build_game("constant A = 1; function main() { A = 2; }", 0), 0);
+    ck_assert_ptr_eq(build_game("function main() { local a, a; }", 0), 0);
+    ck_assert_ptr_eq(build_game("function f(a, a) { }", 0), 0);
+    ck_assert_ptr_eq(build_game("function main() { main = 2; }", 0), 0);
+    ck_assert_ptr_eq(build_game("function main() { 1 = 2; }", 0), 0);
+
+    /* 2147483648 may only be written negated, giving the smallest integer */
+    vm = run_game_source("constant LOW = -2147483648;\n"
+                         "function main() {\n"
+                         "    asm { setiosys 2 0; streamnum LOW; streamchar 32; }\n"
+                         "    asm { streamnum -2147483648; streamchar 32; }\n"
+                         "    asm { streamnum (-2147483648 == LOW); }\n"
+                         "    return 0;\n"
+                         "}\n", 0, &gamefile, 0);
+    ck_assert_ptr_ne(vm, 0);
+    ck_assert_str_eq((char*)vm->output.data, "-2147483648 -2147483648 1");
+    close_vm(vm);
+    free_gamefile(gamefile);
+    ck_assert_ptr_eq(build_game("constant A = 2147483648;", 0), 0);
+    ck_assert_ptr_eq(build_game("constant A = -(2147483648);", 0), 0);
+    ck_assert_ptr_eq(build_game("constant A = - -2147483648;", 0), 0);
+    ck_assert_ptr_eq(build_game("constant A = 4294967296;", 0), 0);
+    ck_assert_ptr_eq(build_game("function main() { return 2147483648; }", 0), 0);
+    ck_assert_ptr_eq(build_game("function main() { asm { streamnum 2147483648; } }", 0), 0);
+    clear_diagnostics();
+
+    /* constants are evaluated as they are declared, up to the limits of a
+       32-bit signed value */
+    vm = run_game_source("constant HIGH = 2147483646 + 1;\n"
+                         "constant LOWEST = -2147483647 - 1;\n"
+                         "constant SHIFTED = 3 << 29;\n"
+                         "constant PRODUCT = -65536 * 32768;\n"
+                         "constant MIXED = (HIGH - 7) / -2 % 1000;\n"
+                         "function main() {\n"
+                         "    asm { setiosys 2 0; streamnum HIGH; streamchar 32; }\n"
+                         "    asm { streamnum LOWEST; streamchar 32; }\n"
+                         "    asm { streamnum SHIFTED; streamchar 32; }\n"
+                         "    asm { streamnum PRODUCT; streamchar 32; }\n"
+                         "    asm { streamnum MIXED; }\n"
+                         "    return 0;\n"
+                         "}\n", 0, &gamefile, 0);
+    ck_assert_ptr_ne(vm, 0);
+    ck_assert_str_eq((char*)vm->output.data,
+                     "2147483647 -2147483648 1610612736 -2147483648 -820");
+    close_vm(vm);
+    free_gamefile(gamefile);
+    const char *overflow = "integer overflow in constant expression";
+    ck_assert(reports_error("constant A = 2147483647 + 1;", overflow));
+    ck_assert(reports_error("constant A = -2147483647 - 2;", overflow));
+    ck_assert(reports_error("constant A = 65536 * 32768;", overflow));
+    ck_assert(reports_error("constant A = -65536 * -32768;", overflow));
+    ck_assert(reports_error("constant LOWEST = -2147483648; constant A = LOWEST / -1;", overflow));
+    ck_assert(reports_error("constant A = 1 << 31;", overflow));
+    ck_assert(reports_error("constant A = 3 << 30;", overflow));
+    ck_assert(reports_error("constant A = 1 << 32;",
+                            "shift count out of range in constant expression"));
+    ck_assert(reports_error("constant A = 7 / 0;", "division by zero in constant expression"));
+    ck_assert(reports_error("constant A = 7 % (2 - 2);",
+                            "division by zero in constant expression"));
+    ck_assert(!reports_error("constant A = 7 / 0;", overflow));
+    ck_assert(reports_error("constant A = MISSING + 1;", "unknown constant"));
+    ck_assert(reports_error("constant A = 1; constant B = A * C;", "unknown constant"));
+}
+END_TEST
+
+START_TEST(test_vm_frames)
+{
+    const char *source =
+        "function show(value) { asm { streamnum value; streamchar 32; } return; }\n"
+        "function steps(n) {\n"
+        "    local a = n * 2;\n"
+        "    show(a);\n"
+        "    local b = n + 1;\n"
+        "    show(b);\n"
+        "    local total = 0, i = 0;\n"
+        "    while (i < n) {\n"
+        "        local square = i * i;\n"
+        "        total = total + square;\n"
+        "        i = i + 1;\n"
+        "    }\n"
+        "    return total;\n"
+        "}\n"
+        "function bytes() {\n"
+        "    local c, unused;\n"
+        "    asm { copyb 321 c; copyb c sp; streamnum sp; }\n"
+        "    return 0;\n"
+        "}\n"
+        "function main() {\n"
+        "    asm { setiosys 2 0; }\n"
+        "    show(steps(4));\n"
+        "    bytes();\n"
+        "    return 0;\n"
+        "}\n";
+    glulxfile_t *gamefile;
+    vm_t *vm = run_game_source(source, 0, &gamefile, 0);
+    ck_assert_ptr_ne(vm, 0);
+    ck_assert_int_eq(vm->status, VM_QUIT);
+    ck_assert_str_eq((char*)vm->output.data, "8 5 14 65");
+
+    /* a, b and total take one slot in turn, while n, total, i and square
+       are all live inside the loop */
+    function_t *steps = get_symbol(gamefile->global_symbols, "steps")->data.func;
+    ck_assert_int_eq(steps->local_count, 6);
+    ck_assert_int_eq(steps->frame_slots[0], 4);
+    ck_assert_int_eq(steps->frame_size, 8 + 4 + 16);
+    /* c is only used a byte at a time; the unused local takes no slot of
+       its own */
+    function_t *bytes = get_symbol(gamefile->global_symbols, "bytes")->data.func;
+    ck_assert_int_eq(bytes->frame_slots[0], 0);
+    ck_assert_int_eq(bytes->frame_slots[2], 1);
+    ck_assert_int_eq(bytes->frame_size, 8 + 4 + 4);
+    close_vm(vm);
+    free_gamefile(gamefile);
+}
+END_TEST
+
+START_TEST(test_vm_memory_layout)
+{
+    const char *source =
+        "global limit = 3;\n"
+        "global score = 10;\n"
+        "global start = 7;\n"
+        "function main() {\n"
+        "    asm { setiosys 2 0; }\n"
+        "    score = score + limit;\n"
+        "    asm { streamnum score; streamnum start; }\n"
+        "    return 0;\n"
+        "}\n";
+    glulxfile_t *gamefile;
+    vm_t *vm = run_game_source(source, 0, &gamefile, 0);
+    ck_assert_ptr_ne(vm, 0);
+    /* writing to ROM would stop the game with an error */
+    ck_assert_int_eq(vm->status, VM_QUIT);
+    ck_assert_str_eq((char*)vm->output.data, "137");
+    symboltable_t *symbols = gamefile->global_symbols;
+    ck_assert_uint_lt(get_symbol(symbols, "limit")->position, gamefile->ram_start);
+    ck_assert_uint_lt(get_symbol(symbols, "start")->position, gamefile->ram_start);
+    ck_assert_uint_eq(get_symbol(symbols, "score")->position, gamefile->ram_start);
+    ck_assert_uint_eq(gamefile->end_mem - gamefile->ram_start, 256);
+    close_vm(vm);
+    free_gamefile(gamefile);
+
+    gamefile = build_game("global a = 1; function main() { return a; }", 0);
+    ck_assert_ptr_ne(gamefile, 0);
+    ck_assert_uint_eq(gamefile->end_mem, gamefile->ram_start);
+    free_gamefile(gamefile);
+}
+END_TEST
+
+START_TEST(test_vm_objects)
+{
+    const char *source =
+        "object lamp { weight = 3; name = \"lamp\"; next = box; lit = 0; }\n"
+        "object box { weight = 10 * 2; }\n"
+        "function weigh(o) { return o.weight; }\n"
+        "function main() {\n"
+        "    local a = lamp.weight + weigh(box), b = lamp.next.weight, c = box.lit;\n"
+        "    local d = lamp.lit = a + 1, e = lamp.lit, f = lamp.name;\n"
+        "    asm {\n"
+        "        setiosys 2 0;\n"
+        "        streamnum a; streamchar 32; streamnum b; streamchar 32; streamnum c;\n"
+        "        streamchar 32; streamnum d; streamchar 32; streamnum e; streamchar 32;\n"
+        "        streamstr f;\n"
+        "    }\n"
+        "    return 0;\n"
+        "}\n";
+    glulxfile_t *gamefile;
+    vm_t *vm = run_game_source(source, 0, &gamefile, 0);
+    ck_assert_ptr_ne(vm, 0);
+    ck_assert_int_eq(vm->status, VM_QUIT);
+    ck_assert_str_eq((char*)vm->output.data, "23 20 0 24 24 lamp");
+    ck_assert_int_eq(vm->opcode_counts[get_mnemonic_index("binarysearch")], 8);
+    /* only lamp has the property that is written */
+    symboltable_t *symbols = gamefile->global_symbols;
+    ck_assert_uint_lt(get_symbol(symbols, "box")->position, gamefile->ram_start);
+    ck_assert_uint_eq(get_symbol(symbols, "lamp")->position, gamefile->ram_start + 4);
+    ck_assert_uint_eq(get_symbol(symbols, ".lit")->position, 1);
+    ck_assert_uint_eq(get_symbol(symbols, ".weight")->position, 4);
+    close_vm(vm);
+    free_gamefile(gamefile);
+
+    /* a store to a property the object lacks is skipped, leaving the stack
+       as a store would */
+    vm = run_game_source("object lamp { lit = 1; }\n"
+                         "object box { weight = 2; }\n"
+                         "function weigh(o) { return o.weight; }\n"
+                         "function main() {\n"
+                         "    local a = box.lit = weigh(box), b, c, d;\n"
+                         "    box.lit = 5;\n"
+                         "    b = box.lit = lamp.lit = 7;\n"
+                         "    c = box.lit;\n"
+                         "    d = box.weight + lamp.lit;\n"
+                         "    asm { setiosys 2 0; streamnum a; streamnum b; streamnum c; }\n"
+                         "    asm { streamnum d; stkcount sp; streamnum sp; }\n"
+                         "    return 0;\n"
+                         "}\n", 0, &gamefile, 0);
+    ck_assert_ptr_ne(vm, 0);
+    ck_assert_int_eq(vm->status, VM_QUIT);
+    ck_assert_str_eq((char*)vm->output.data, "27090");
+    close_vm(vm);
+    free_gamefile(gamefile);
+
+    ck_assert_ptr_eq(build_game("object a { x = 1; x = 2; } function main() { return 0; }", 0), 0);
+    ck_assert_ptr_eq(build_game("global a; object a { } function main() { return 0; }", 0), 0);
+    ck_assert_ptr_eq(build_game("object a { x = b; } function main() { return a.x; }", 0), 0);
+    ck_assert_ptr_eq(build_game("object a { } function main() { return a.; }", 0), 0);
+}
+END_TEST
+
+START_TEST(test_vm_dictionary)
+{
+    /* finds the word held in the buffer after the one global, using the
+       index when the dictionary has one */
+    const char *lookup =
+        "global used = 0;\n"
+        "function find(buf) {\n"
+        "    local index, start, count, c;\n"
+        "    asm {\n"
+        "        aload __dictionary 2 index;\n"
+        "        jz index whole;\n"
+        "        aloadb buf 0 c;\n"
+        "        mul c 2 c;\n"
+        "        aload index c start;\n"
+        "        add c 1 c;\n"
+        "        aload index c count;\n"
+        "        jump search;\n"
+        "    whole:\n"
+        "        add __dictionary 12 start;\n"
+        "        aload __dictionary 1 count;\n"
+        "    search:\n"
+        "        binarysearch buf 9 start 9 count 0 1 sp;\n"
+        "        return sp;\n"
+        "    }\n"
+        "}\n"
+        "function main() {\n"
+        "    local buf, a, b, c;\n"
+        "    used = 1;\n"
+        "    asm {\n"
+        "        aload 0 2 buf; add buf 4 buf;\n"
+        "        astoreb buf 0 't'; astoreb buf 1 'a'; astoreb buf 2 'k';\n"
+        "    }\n"
+        "    a = find(buf);\n"
+        "    asm { astoreb buf 3 'e'; }\n"
+        "    b = find(buf) == `take`;\n"
+        "    c = `northwestern` == `northwestward`;\n"
+        "    asm { setiosys 2 0; streamnum a; streamnum b; streamnum c; }\n"
+        "    return 0;\n"
+        "}\n"
+        "function words() { `lamp`; `take`; `north`; `northwestern`; `northwestward`; ";
+    for (int extra = 0; extra <= DICT_INDEX_MIN; extra += DICT_INDEX_MIN) {
+        char *source = malloc(strlen(lookup) + extra * 8 + 32);
+        strcpy(source, lookup);
+        for (int i = 0; i < extra; ++i) {
+            sprintf(&source[strlen(source)], "`w%02d`; ", i);
+        }
+        strcat(source, "return 0; }\n");
+
+        glulxfile_t *gamefile;
+        vm_t *vm = run_game_source(source, 0, &gamefile, 0);
+        free(source);
+        ck_assert_ptr_ne(vm, 0);
+        ck_assert_int_eq(vm->status, VM_QUIT);
+        ck_assert_str_eq((char*)vm->output.data, "011");
+
+        /* the two long words share an entry */
+        unsigned table = get_symbol(gamefile->global_symbols, DICTIONARY_TABLE)->position;
+        unsigned char *data = &gamefile->image.data[table];
+        ck_assert_int_eq(data[3], DICT_RESOLUTION);
+        ck_assert_int_eq(data[7], 4 + extra);
+        ck_assert_int_eq(data[11] != 0, extra >= DICT_INDEX_MIN);
+        ck_assert_uint_lt(table, gamefile->ram_start);
+        close_vm(vm);
+        free_gamefile(gamefile);
+    }
+}
+END_TEST
+
+START_TEST(test_vm_unicode_strings)
+{
+    const char *source =
+        "function main() {\n"
+        "    asm { setiosys 2 0; streamstr \"caf\xC3\xA9 \"; streamstr \"\xE2\x9C\x93\"; }\n"
+        "    return 0;\n"
+        "}\n";
+    glulxfile_t *gamefile;
+    vm_t *vm = run_game_source(source, 0, &gamefile, 0);
+    ck_assert_ptr_ne(vm, 0);
+    ck_assert_int_eq(vm->status, VM_QUIT);
+    ck_assert_str_eq((char*)vm->output.data, "caf\xC3\xA9 \xE2\x9C\x93");
+    /* only the string with a character past Latin-1 needs 32-bit characters */
+    unsigned char *image = gamefile->image.data;
+    ck_assert_int_eq(image[get_symbol(gamefile->strings, "caf\xC3\xA9 ")->position], 0xE0);
+    ck_assert_int_eq(image[get_symbol(gamefile->strings, "\xE2\x9C\x93")->position], 0xE2);
+    close_vm(vm);
+    free_gamefile(gamefile);
+
+    ck_assert_ptr_eq(build_game("function main() { return `\xE2\x9C\x93`; }", 0), 0);
+}
+END_TEST
+
+START_TEST(test_vm_blorb)
+{
+    const char *project_text =
+        "files blorbtest.g\n"
+        "sound 3 blorbtest.ogg\n"
+        "picture 1 blorbtest.png\n";
+    write_test_file("blorbtest.gproj", project_text, strlen(project_text));
+    write_test_file("blorbtest.png", "\x89PNG\r\n\x1A\n!", 9);
+    write_test_file("blorbtest.ogg", "OggS....", 8);
+    project_t *project = open_project("blorbtest.gproj");
+    ck_assert_ptr_ne(project, 0);
+    ck_assert_int_eq(project->file_count, 1);
+    ck_assert_int_eq(project->resources->usage, RESOURCE_SOUND);
+    ck_assert_int_eq(project->resources->next->number, 1);
+
+    glulxfile_t *gamefile = build_game("function main() { return 0; }", 0);
+    ck_assert_ptr_ne(gamefile, 0);
+    ck_assert_int_eq(write_blorb(gamefile, project, "blorbtest.gblorb"), 0);
+    size_t size;
+    unsigned char *blorb = read_test_file("blorbtest.gblorb", &size);
+    ck_assert_int_eq(memcmp(blorb, "FORM", 4), 0);
+    ck_assert_int_eq(blorb_word(&blorb[4]), size - 8);
+    ck_assert_int_eq(memcmp(&blorb[8], "IFRSRIdx", 8), 0);
+    /* the story, then the resources sorted pictures first */
+    ck_assert_int_eq(blorb_word(&blorb[20]), 3);
+    ck_assert_int_eq(memcmp(&blorb[24], "Exec", 4), 0);
+    ck_assert_int_eq(memcmp(&blorb[36], "Pict", 4), 0);
+    ck_assert_int_eq(blorb_word(&blorb[40]), 1);
+    ck_assert_int_eq(memcmp(&blorb[48], "Snd ", 4), 0);
+    ck_assert_int_eq(blorb_word(&blorb[52]), 3);
+    unsigned story = blorb_word(&blorb[32]);
+    ck_assert_int_eq(memcmp(&blorb[story], "GLUL", 4), 0);
+    ck_assert_int_eq(blorb_word(&blorb[story + 4]), gamefile->image.size);
+    ck_assert_int_eq(memcmp(&blorb[story + 8], gamefile->image.data, gamefile->image.size), 0);
+    /* the picture has an odd size, so is followed by a padding byte */
+    unsigned picture = blorb_word(&blorb[44]);
+    ck_assert_int_eq(memcmp(&blorb[picture], "PNG ", 4), 0);
+    ck_assert_int_eq(blorb_word(&blorb[picture + 4]), 9);
+    ck_assert_int_eq(memcmp(&blorb[picture + 8], "\x89PNG\r\n\x1A\n!\0", 10), 0);
+    unsigned sound = blorb_word(&blorb[56]);
+    ck_assert_int_eq(sound, picture + 18);
+    ck_assert_int_eq(memcmp(&blorb[sound], "OGGV", 4), 0);
+    ck_assert_int_eq(sound + 16, size);
+    free(blorb);
+    free_project(project);
+
+    /* a resource number may only be used once, and formats are checked */
+    project_text = "picture 1 blorbtest.png\npicture 1 blorbtest.png\n";
+    write_test_file("blorbtest.gproj", project_text, strlen(project_text));
+    project = open_project("blorbtest.gproj");
+    ck_assert_int_ne(write_blorb(gamefile, project, "blorbtest.gblorb"), 0);
+    free_project(project);
+    project_text = "picture 1 blorbtest.ogg\n";
+    write_test_file("blorbtest.gproj", project_text, strlen(project_text));
+    project = open_project("blorbtest.gproj");
+    ck_assert_int_ne(write_blorb(gamefile, project, "blorbtest.gblorb"), 0);
+    free_project(project);
+    project_text = "sound blorbtest.ogg\n";
+    write_test_file("blorbtest.gproj", project_text, strlen(project_text));
+    ck_assert_ptr_eq(open_project("blorbtest.gproj"), 0);
+
+    free_gamefile(gamefile);
+    remove("blorbtest.gproj");
+    remove("blorbtest.png");
+    remove("blorbtest.ogg");
+    remove("blorbtest.gblorb");
+}
+END_TEST
+
+START_TEST(test_vm_read_source)
+{
+    /* large enough to be lexed in several parts, with code in each part and
+       comments and strings running over the lines the parts begin on */
+    codebuf_t source = {0};
+    const char *head =
+        "function main() {\n"
+        "    asm { setiosys 2 0; }\n"
+        "    show(f1(1));\n"
+        "    show(last(5));\n"
+        "    return `apple` == `pear`;\n"
+        "}\n"
+        "function show(word) { asm { streamnum word; streamchar 32; } return; }\n";
+    for (const char *c = head; *c; ++c) {
+        codebuf_add_byte(&source, *c);
+    }
+    unsigned lines = 7, functions = 0;
+    char text[128];
+    while (source.size < 2 * LEX_CHUNK_SIZE + LEX_CHUNK_SIZE / 2) {
+        int length = snprintf(text, sizeof(text), "function f%u(n) { return n + %u; } "
+                              "/* a\ncomment */ function g%u() { return \"a\nstring\"; }\n",
+                              functions, functions, functions);
+        for (int i = 0; i < length; ++i) {
+            codebuf_add_byte(&source, text[i]);
+        }
+        /* mostly comments, so the test spends its time lexing */
+        for (int i = 0; i < 64; ++i) {
+            for (const char *c = "// a comment that goes on and on and on\n"; *c; ++c) {
+                codebuf_add_byte(&source, *c);
+            }
+        }
+        lines += 3 + 64;
+        ++functions;
+    }
+    const char *tail = "function last(word) { return f0(word); }\n";
+    for (const char *c = tail; *c; ++c) {
+        codebuf_add_byte(&source, *c);
+    }
+    write_test_file("readsourcetest.g", (char*)source.data, source.size);
+
+    unsigned char *images[2];
+    unsigned sizes[2];
+    unsigned thread_counts[2] = { 1, 4 };
+    for (int i = 0; i < 2; ++i) {
+        glulxfile_t *gamefile = calloc(sizeof(glulxfile_t), 1);
+        gamefile->global_symbols = calloc(sizeof(symboltable_t), 1);
+        /* bodies are parsed later from the text the lexer kept */
+        gamefile->lazy_parse = 1;
+        ck_assert_int_eq(read_source(gamefile, "readsourcetest.g", thread_counts[i]), 0);
+        index_dictionary(gamefile->global_symbols);
+        ck_assert_int_eq(remove_unreachable(gamefile), 0);
+        ck_assert_int_eq(assemble_game(gamefile, 1), 0);
+        ck_assert_int_eq(link_game(gamefile), 0);
+        sizes[i] = gamefile->image.size;
+        images[i] = malloc(sizes[i]);
+        memcpy(images[i], gamefile->image.data, sizes[i]);
+
+        vm_t *vm = open_vm(gamefile->image.data, gamefile->image.size);
+        ck_assert_ptr_ne(vm, 0);
+        run_vm(vm, 0);
+        codebuf_add_byte(&vm->output, 0);
+        ck_assert_int_eq(vm->status, VM_QUIT);
+        ck_assert_str_eq((char*)vm->output.data, "2 5 ");
+        close_vm(vm);
+        free_gamefile(gamefile);
+    }
+    ck_assert_int_eq(sizes[0], sizes[1]);
+    ck_assert_int_eq(memcmp(images[0], images[1], sizes[0]), 0);
+    free(images[0]);
+    free(images[1]);
+
+    /* an error in the last part is reported on its line in the whole file */
+    source.size -= strlen(tail);
+    tail = "function last(word) { return f0(word) }\n";
+    for (const char *c = tail; *c; ++c) {
+        codebuf_add_byte(&source, *c);
+    }
+    write_test_file("readsourcetest.g", (char*)source.data, source.size);
+    clear_diagnostics();
+    glulxfile_t *gamefile = calloc(sizeof(glulxfile_t), 1);
+    gamefile->global_symbols = calloc(sizeof(symboltable_t), 1);
+    ck_assert_int_ne(read_source(gamefile, "readsourcetest.g", 4), 0);
+    ck_assert_int_eq(diagnostic_count(DIAG_ERROR), 1);
+    FILE *out = tmpfile();
+    flush_diagnostics(out);
+    rewind(out);
+    char expected[64], found[128] = {0};
+    snprintf(expected, sizeof(expected), "readsourcetest.g:%u:39: ", lines + 1);
+    ck_assert_int_ne(fread(found, 1, sizeof(found) - 1, out), 0);
+    ck_assert_int_eq(strncmp(found, expected, strlen(expected)), 0);
+    fclose(out);
+    clear_diagnostics();
+    free_gamefile(gamefile);
+    free_codebuf(&source);
+    remove("readsourcetest.g");
+}
+END_TEST
+
+START_TEST(test_vm_parallel_assembly)
+{
+    /* many functions, some sharing their strings, so the workers steal from
+       each other and intern strings in whatever order they reach them */
+    codebuf_t source = {0};
+    char text[256];
+    for (unsigned i = 0; i < 300; ++i) {
+        int length = snprintf(text, sizeof(text),
+                              "function f%u(n) { if (n > %u) return \"big %u\"; "
+                              "asm { streamstr \"shared %u\"; } return f%u(n - 1) + %u; }\n",
+                              i, i % 7, i, i % 5, i ? i - 1 : 0, i);
+        for (int j = 0; j < length; ++j) {
+            codebuf_add_byte(&source, text[j]);
+        }
+    }
+    for (const char *c = "function main() { asm { setiosys 2 0; } return f299(3); }\n"; *c; ++c) {
+        codebuf_add_byte(&source, *c);
+    }
+
+    const unsigned thread_counts[2] = { 1, 4 };
+    unsigned char *images[2];
+    unsigned sizes[2];
+    for (int i = 0; i < 2; ++i) {
+        glulxfile_t *gamefile = calloc(sizeof(glulxfile_t), 1);
+        gamefile->global_symbols = calloc(sizeof(symboltable_t), 1);
+        lexer_t *lexer = open_lexer_string(gamefile, "test", (char*)source.data, source.size);
+        ck_assert_int_eq(parse_file(gamefile, lexer), 0);
+        ck_assert_int_eq(lexer_has_errors(lexer), 0);
+        close_lexer(lexer);
+        ck_assert_int_eq(assemble_game(gamefile, thread_counts[i]), 0);
+        ck_assert_int_eq(link_game(gamefile), 0);
+        sizes[i] = gamefile->image.size;
+        images[i] = malloc(sizes[i]);
+        memcpy(images[i], gamefile->image.data, sizes[i]);
+        free_gamefile(gamefile);
+    }
+    ck_assert_int_eq(sizes[0], sizes[1]);
+    ck_assert_int_eq(memcmp(images[0], images[1], sizes[0]), 0);
+    free(images[0]);
+    free(images[1]);
+    free_codebuf(&source);
+}
+END_TEST
+
+START_TEST(test_vm_document_edits)
+{
+    /* a long document, so an edit that moved every token after it would
+       touch thousands of them */
+    codebuf_t source = {0};
+    char text[128];
+    for (unsigned i = 0; i < 2000; ++i) {
+        int length = snprintf(text, sizeof(text), "function f%u(n) {\n    return n + %u;\n}\n",
+                              i, i);
+        for (int j = 0; j < length; ++j) {
+            codebuf_add_byte(&source, text[j]);
+        }
+    }
+    for (const char *c = "function main() { return f1999(1); } constant LAST = 1;\n"; *c; ++c) {
+        codebuf_add_byte(&source, *c);
+    }
+    size_t main_offset = source.size - 56;
+    document_t *document = open_document("test", (char*)source.data, source.size);
+    ck_assert_int_eq(document->has_errors, 0);
+    ck_assert_int_eq(document->part_count, 2002);
+    int line;
+    lexertoken_t *token = find_document_token(document, main_offset, &line);
+    ck_assert_ptr_ne(token, 0);
+    ck_assert_str_eq(token->data.text, "function");
+    ck_assert_int_eq(line, 6001);
+
+    /* edits inside a function's body only touch the tokens near them,
+       however they change its lines and columns */
+    ck_assert_int_eq(edit_document(document, 33, 0, " * 2", 4), 0);
+    ck_assert_uint_le(document->tokens_touched, 32);
+    ck_assert_int_eq(edit_document(document, 28, 0, "\n\n", 2), 0);
+    ck_assert_uint_le(document->tokens_touched, 32);
+    main_offset += 6;
+    ck_assert_int_eq(edit_document(document, main_offset + 25, 0, "    ", 4), 0);
+    ck_assert_uint_le(document->tokens_touched, 32);
+    token = find_document_token(document, main_offset, &line);
+    ck_assert_ptr_ne(token, 0);
+    ck_assert_str_eq(token->data.text, "function");
+    ck_assert_int_eq(line, 6003);
+    token = find_document_token(document, main_offset + 29, &line);
+    ck_assert_ptr_ne(token, 0);
+    ck_assert_str_eq(token->data.text, "f1999");
+    ck_assert_int_eq(token->col_no, 30);
+    token = find_document_token(document, main_offset + 41, &line);
+    ck_assert_ptr_ne(token, 0);
+    ck_assert_str_eq(token->data.text, "constant");
+    ck_assert_int_eq(token->col_no, 42);
+    ck_assert_int_eq(line, 6003);
+
+    ck_assert_int_ne(edit_document(document, 39, 0, "+", 1), 0);
+    ck_assert_int_eq(edit_document(document, 39, 1, "", 0), 0);
+    clear_diagnostics();
+
+    /* an edit that changes which functions there are parses the whole
+       document again */
+    ck_assert_int_eq(edit_document(document, 0, 0, "function g() { }\n", 17), 0);
+    ck_assert_uint_ge(document->tokens_touched, 2000);
+    ck_assert_int_eq(document->part_count, 2003);
+    main_offset += 17;
+    token = find_document_token(document, main_offset, &line);
+    ck_assert_ptr_ne(token, 0);
+    ck_assert_str_eq(token->data.text, "function");
+    ck_assert_int_eq(line, 6004);
+    token = find_document_token(document, main_offset + 41, &line);
+    ck_assert_ptr_ne(token, 0);
+    ck_assert_str_eq(token->data.text, "constant");
+
+    /* a closing brace removed from a body joins it to the next function */
+    ck_assert_int_ne(edit_document(document, 15, 1, "", 0), 0);
+    ck_assert_int_eq(edit_document(document, 15, 0, "}", 1), 0);
+    ck_assert_int_eq(document->part_count, 2003);
+    clear_diagnostics();
+    close_document(document);
+    free_codebuf(&source);
+}
+END_TEST
+
+START_TEST(test_vm_errors_and_limit)
+{
+    glulxfile_t *gamefile;
+    vm_t *vm = run_game_source("function main() { asm { jz sp done; done: return 0; } }", 0,
+                               &gamefile, 0);
+    ck_assert_ptr_ne(vm, 0);
+    ck_assert_int_eq(vm->status, VM_ERROR);
+    close_vm(vm);
+    free_gamefile(gamefile);
+
+    vm = run_game_source("function main() { asm { loop: jump loop; } }", 0, &gamefile, 100);
+    ck_assert_ptr_ne(vm, 0);
+    ck_assert_int_eq(vm->status, VM_LIMIT);
+    ck_assert_int_eq(vm->instruction_count, 100);
+    close_vm(vm);
+    free_gamefile(gamefile);
+}
+END_TEST
+
+
+Suite* vm_suite(void) {
+    Suite *s = suite_create("VM");
+    TCase *tc_core = tcase_create("Core");
+    tcase_add_test(tc_core, test_vm_output_and_counts);
+    tcase_add_test(tc_core, test_vm_arithmetic);
+    tcase_add_test(tc_core, test_vm_specialized_calls);
+    tcase_add_test(tc_core, test_vm_inlined_calls);
+    tcase_add_test(tc_core, test_vm_switch);
+    tcase_add_test(tc_core, test_vm_nested_statements);
+    tcase_add_test(tc_core, test_vm_error_recovery);
+    tcase_add_test(tc_core, test_vm_expressions);
+    tcase_add_test(tc_core, test_vm_frames);
+    tcase_add_test(tc_core, test_vm_memory_layout);
+    tcase_add_test(tc_core, test_vm_objects);
+    tcase_add_test(tc_core, test_vm_dictionary);
+    tcase_add_test(tc_core, test_vm_unicode_strings);
+    tcase_add_test(tc_core, test_vm_blorb);
+    tcase_add_test(tc_core, test_vm_read_source);
+    tcase_add_test(tc_core, test_vm_parallel_assembly);
+    tcase_add_test(tc_core, test_vm_document_edits);
+    tcase_add_test(tc_core, test_vm_errors_and_limit);
+    suite_add_tcase(s, tc_core);
+    return s;
+}
+
+int main(void) {
+
+    Suite *s = vm_suite();
+    SRunner *sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    int number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,156 @@
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <emmintrin.h>
+#define HAVE_SSE2
+#endif
+
+#include "gbuild.h"
+
+size_t ascii_length(const unsigned char *text, size_t length);
+size_t utf8_sequence_length(const unsigned char *text, size_t length);
+
+
+/*
+Returns the number of ASCII characters at the start of a text. Source code
+is mostly ASCII even in translated games, so this is where validation spends
+its time; with SSE2 sixteen characters are checked at once by testing their
+top bits together.
+*/
+size_t ascii_length(const unsigned char *text, size_t length) {
+    size_t pos = 0;
+#ifdef HAVE_SSE2
+    while (length - pos >= 16) {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)&text[pos]));
+        if (mask) {
+            return pos + __builtin_ctz(mask);
+        }
+        pos += 16;
+    }
+#endif
+    while (pos < length && text[pos] < 0x80) {
+        ++pos;
+    }
+    return pos;
+}
+
+/*
+Returns the number of bytes in the UTF-8 sequence at the start of a text, or
+zero if there is no valid sequence there. Overlong forms, surrogates and
+code points past U+10FFFF are not valid.
+*/
+size_t utf8_sequence_length(const unsigned char *text, size_t length) {
+    unsigned char first = text[0];
+    size_t size;
+    unsigned char low = 0x80, high = 0xBF;
+    if (first < 0x80) {
+        return 1;
+    } else if (first >= 0xC2 && first <= 0xDF) {
+        size = 2;
+    } else if (first >= 0xE0 && first <= 0xEF) {
+        size = 3;
+        if (first == 0xE0) low = 0xA0;
+        if (first == 0xED) high = 0x9F;
+    } else if (first >= 0xF0 && first <= 0xF4) {
+        size = 4;
+        if (first == 0xF0) low = 0x90;
+        if (first == 0xF4) high = 0x8F;
+    } else {
+        return 0;
+    }
+    if (length < size || text[1] < low || text[1] > high) {
+        return 0;
+    }
+    for (size_t i = 2; i < size; ++i) {
+        if (text[i] < 0x80 || text[i] > 0xBF) {
+            return 0;
+        }
+    }
+    return size;
+}
+
+/*
+Returns the offset of the first byte of a text that is not part of a valid
+UTF-8 sequence, or the length of the text if all of it is valid.
+*/
+size_t find_invalid_utf8(const char *text, size_t length) {
+    const unsigned char *bytes = (const unsigned char*)text;
+    size_t pos = 0;
+    while (1) {
+        pos += ascii_length(&bytes[pos], length - pos);
+        if (pos == length) {
+            return length;
+        }
+        size_t size = utf8_sequence_length(&bytes[pos], length - pos);
+        if (size == 0) {
+            return pos;
+        }
+        pos += size;
+    }
+}
+
+/*
+Decode the character at the start of a zero terminated UTF-8 text and move
+the text past it. A byte that does not begin a valid sequence is taken as a
+character on its own.
+*/
+unsigned decode_utf8(const char **text) {
+    const unsigned char *bytes = (const unsigned char*)*text;
+    /* a terminator ends any sequence it falls in */
+    size_t size = utf8_sequence_length(bytes, 4);
+    if (size <= 1) {
+        ++*text;
+        return bytes[0];
+    }
+    unsigned code_point = bytes[0] & (0x7F >> size);
+    for (size_t i = 1; i < size; ++i) {
+        code_point = (code_point << 6) | (bytes[i] & 0x3F);
+    }
+    *text += size;
+    return code_point;
+}
+
+/*
+Write the UTF-8 encoding of a code point, returning the number of bytes
+written, which is at most four.
+*/
+int encode_utf8(unsigned code_point, char *out) {
+    if (code_point < 0x80) {
+        out[0] = code_point;
+        return 1;
+    } else if (code_point < 0x800) {
+        out[0] = 0xC0 | (code_point >> 6);
+        out[1] = 0x80 | (code_point & 0x3F);
+        return 2;
+    } else if (code_point < 0x10000) {
+        out[0] = 0xE0 | (code_point >> 12);
+        out[1] = 0x80 | ((code_point >> 6) & 0x3F);
+        out[2] = 0x80 | (code_point & 0x3F);
+        return 3;
+    }
+    out[0] = 0xF0 | (code_point >> 18);
+    out[1] = 0x80 | ((code_point >> 12) & 0x3F);
+    out[2] = 0x80 | ((code_point >> 6) & 0x3F);
+    out[3] = 0x80 | (code_point & 0x3F);
+    return 4;
+}
+
+/*
+Convert a UTF-8 text to Latin-1, one byte per character, writing no more
+than the length of the text and a terminator. Returns the first character
+Latin-1 can't hold, or zero if there is none; characters up to it have been
+converted.
+*/
+unsigned utf8_to_latin1(const char *text, char *out) {
+    while (*text) {
+        unsigned c = decode_utf8(&text);
+        if (c > 0xFF) {
+            *out = 0;
+            return c;
+        }
+        *out++ = c;
+    }
+    *out = 0;
+    return 0;
+}
@@ -0,0 +1,1276 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gbuild.h"
+
+/*
+A small glulx interpreter used to run built games from the tests and report
+how many instructions they execute. Instructions are decoded using the same
+mnemonics table the assembler uses. Glk is reduced to a stub that collects
+printed text, and there is no saving, undo or heap.
+*/
+
+/* offsets of fields in the glulx header */
+#define HDR_MAGIC           0
+#define HDR_RAMSTART        8
+#define HDR_EXTSTART        12
+#define HDR_ENDMEM          16
+#define HDR_STACKSIZE       20
+#define HDR_STARTFUNC       24
+#define HDR_DECODINGTBL     28
+
+#define GLULX_MAGIC         0x476C756C
+#define GLULX_VERSION       0x00030102
+#define VM_VERSION          0x00000100
+
+/* opcodes are below this in the mnemonics table */
+#define MAX_OPCODE          0x200
+
+/* function types */
+#define FUNC_STACK_ARGS     0xC0
+#define FUNC_LOCALS_ARGS    0xC1
+
+/* string types */
+#define STRING_E0           0xE0
+#define STRING_E1           0xE1
+#define STRING_E2           0xE2
+
+/* where the result of a call is stored, as recorded in a call stub */
+#define DEST_DISCARD        0
+#define DEST_MEMORY         1
+#define DEST_LOCAL          2
+#define DEST_STACK          3
+
+/* io systems */
+#define IOSYS_NULL          0
+#define IOSYS_FILTER        1
+#define IOSYS_GLK           2
+
+/* options of the search opcodes */
+#define SEARCH_KEY_INDIRECT     0x01
+#define SEARCH_ZERO_TERMINATES  0x02
+#define SEARCH_RETURN_INDEX     0x04
+
+/* glk functions the stub understands */
+#define GLK_EXIT                0x0001
+#define GLK_WINDOW_OPEN         0x0023
+#define GLK_STREAM_GET_CURRENT  0x0048
+#define GLK_PUT_CHAR            0x0080
+#define GLK_PUT_CHAR_STREAM     0x0081
+#define GLK_PUT_STRING          0x0082
+#define GLK_PUT_BUFFER          0x0084
+#define GLK_PUT_CHAR_UNI        0x0128
+#define GLK_PUT_STRING_UNI      0x0129
+#define GLK_PUT_BUFFER_UNI      0x012A
+/* the only window and stream the stub pretends to have */
+#define GLK_STUB_ID             1
+
+#define MAX_GLK_ARGS            8
+
+/*
+An operand of the instruction being executed, as its addressing mode and the
+value that follows it.
+*/
+typedef struct VM_OPERAND {
+    int mode;
+    unsigned value;
+} vmoperand_t;
+
+/* mnemonic table position of each opcode; built on first use, which may be
+   from several threads each opening a machine */
+static int opcode_mnemonics[MAX_OPCODE];
+static pthread_once_t opcode_mnemonics_once = PTHREAD_ONCE_INIT;
+
+void vm_error(vm_t *vm, const char *format, ...);
+void build_opcode_mnemonics(void);
+void start_vm(vm_t *vm);
+unsigned read_mem(vm_t *vm, unsigned address, int width);
+void write_mem(vm_t *vm, unsigned address, unsigned value, int width);
+unsigned read_stack(vm_t *vm, unsigned address, int width);
+void write_stack(vm_t *vm, unsigned address, unsigned value, int width);
+void push(vm_t *vm, unsigned value);
+unsigned pop(vm_t *vm);
+unsigned load_operand(vm_t *vm, vmoperand_t *operand, int width);
+void store_operand(vm_t *vm, vmoperand_t *operand, unsigned value, int width);
+void store_dest(vm_t *vm, unsigned type, unsigned address, unsigned value);
+void push_stub(vm_t *vm, vmoperand_t *dest);
+void enter_function(vm_t *vm, unsigned address, unsigned argc, unsigned *args);
+void set_frame(vm_t *vm, unsigned frame_ptr);
+void leave_function(vm_t *vm, unsigned value);
+void branch(vm_t *vm, unsigned offset);
+void pop_args(vm_t *vm, unsigned argc, unsigned *args);
+vmfunction_t* add_vm_function(vm_t *vm, unsigned address);
+void put_char(vm_t *vm, unsigned c);
+void stream_char(vm_t *vm, unsigned c);
+void stream_num(vm_t *vm, int value);
+void stream_string(vm_t *vm, unsigned address);
+unsigned call_glk(vm_t *vm, unsigned selector, unsigned argc);
+unsigned gestalt(unsigned selector, unsigned arg);
+unsigned next_random(vm_t *vm, int range);
+int compare_key(vm_t *vm, unsigned key, unsigned key_size, unsigned address, int indirect);
+int is_zero_key(vm_t *vm, unsigned key_size, unsigned address);
+unsigned search(vm_t *vm, int opcode, unsigned *args);
+void execute_float(vm_t *vm, int opcode, unsigned *values, unsigned *results);
+void step(vm_t *vm);
+
+
+void vm_error(vm_t *vm, const char *format, ...) {
+    if (vm->status == VM_ERROR) return;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(vm->error, sizeof(vm->error), format, args);
+    va_end(args);
+    vm->status = VM_ERROR;
+}
+
+void build_opcode_mnemonics(void) {
+    for (int i = 0; i < MAX_OPCODE; ++i) {
+        opcode_mnemonics[i] = -1;
+    }
+    for (int i = 0; mnemonics[i].mnemonic; ++i) {
+        opcode_mnemonics[mnemonics[i].opcode] = i;
+    }
+}
+
+/*
+Load a story file into a new vm, ready to run from its start function.
+Returns null if the image is not a glulx story file.
+*/
+vm_t* open_vm(const unsigned char *image, unsigned size) {
+    if (size < GLULX_HEADER_SIZE) {
+        fprintf(stderr, "VM: story file is too short.\n");
+        return 0;
+    }
+    vm_t *vm = calloc(sizeof(vm_t), 1);
+    vm->image = malloc(size);
+    memcpy(vm->image, image, size);
+    vm->image_size = size;
+
+    unsigned magic = read_mem(vm, HDR_MAGIC, 4);
+    vm->ram_start = read_mem(vm, HDR_RAMSTART, 4);
+    vm->ext_start = read_mem(vm, HDR_EXTSTART, 4);
+    vm->end_mem = read_mem(vm, HDR_ENDMEM, 4);
+    vm->stack_size = read_mem(vm, HDR_STACKSIZE, 4);
+    vm->start_func = read_mem(vm, HDR_STARTFUNC, 4);
+    if (magic != GLULX_MAGIC || vm->ext_start > size || vm->ram_start > vm->ext_start
+            || vm->ext_start > vm->end_mem || vm->stack_size == 0) {
+        fprintf(stderr, "VM: not a glulx story file.\n");
+        free(vm->image);
+        free(vm);
+        return 0;
+    }
+
+    pthread_once(&opcode_mnemonics_once, build_opcode_mnemonics);
+    unsigned mnemonic_count = 0;
+    while (mnemonics[mnemonic_count].mnemonic) {
+        ++mnemonic_count;
+    }
+    vm->opcode_counts = calloc(sizeof(unsigned long), mnemonic_count);
+    vm->stack = malloc(vm->stack_size);
+    start_vm(vm);
+    return vm;
+}
+
+/*
+Set memory and the stack back to their starting state and call the start
+function. Used when the vm is opened and by restart.
+*/
+void start_vm(vm_t *vm) {
+    free(vm->memory);
+    vm->mem_size = vm->end_mem;
+    vm->memory = calloc(vm->mem_size, 1);
+    memcpy(vm->memory, vm->image, vm->ext_start);
+
+    vm->sp = 0;
+    vm->fp = 0;
+    vm->frame_count = 0;
+    vm->iosys = IOSYS_NULL;
+    vm->iosys_rock = 0;
+    vm->string_table = read_mem(vm, HDR_DECODINGTBL, 4);
+    vm->random_state = 1;
+    vm->status = VM_RUNNING;
+    enter_function(vm, vm->start_func, 0, 0);
+}
+
+void close_vm(vm_t *vm) {
+    free(vm->image);
+    free(vm->memory);
+    free(vm->stack);
+    free(vm->opcode_counts);
+    free(vm->functions);
+    free(vm->frames);
+    free_codebuf(&vm->output);
+    free(vm);
+}
+
+/*
+Run until the game quits, an error occurs or max_instructions have been
+executed, if it is not zero. Returns the reason the vm stopped.
+*/
+int run_vm(vm_t *vm, unsigned long max_instructions) {
+    unsigned long executed = 0;
+    while (vm->status == VM_RUNNING) {
+        if (max_instructions && executed >= max_instructions) {
+            vm->status = VM_LIMIT;
+            break;
+        }
+        step(vm);
+        ++executed;
+    }
+    return vm->status;
+}
+
+unsigned read_mem(vm_t *vm, unsigned address, int width) {
+    const unsigned char *memory = vm->memory ? vm->memory : vm->image;
+    unsigned size = vm->memory ? vm->mem_size : vm->image_size;
+    if (address > size || size - address < (unsigned)width) {
+        vm_error(vm, "read from $%X is outside of memory", address);
+        return 0;
+    }
+    unsigned value = 0;
+    for (int i = 0; i < width; ++i) {
+        value = (value << 8) | memory[address + i];
+    }
+    return value;
+}
+
+void write_mem(vm_t *vm, unsigned address, unsigned value, int width) {
+    if (address < vm->ram_start || address > vm->mem_size
+            || vm->mem_size - address < (unsigned)width) {
+        vm_error(vm, "write to $%X is outside of RAM", address);
+        return;
+    }
+    for (int i = width - 1; i >= 0; --i) {
+        vm->memory[address + i] = value & 0xFF;
+        value >>= 8;
+    }
+}
+
+unsigned read_stack(vm_t *vm, unsigned address, int width) {
+    unsigned value = 0;
+    for (int i = 0; i < width; ++i) {
+        value = (value << 8) | vm->stack[address + i];
+    }
+    return value;
+}
+
+void write_stack(vm_t *vm, unsigned address, unsigned value, int width) {
+    for (int i = width - 1; i >= 0; --i) {
+        vm->stack[address + i] = value & 0xFF;
+        value >>= 8;
+    }
+}
+
+void push(vm_t *vm, unsigned value) {
+    if (vm->sp + 4 > vm->stack_size) {
+        vm_error(vm, "stack overflow");
+        return;
+    }
+    write_stack(vm, vm->sp, value, 4);
+    vm->sp += 4;
+}
+
+unsigned pop(vm_t *vm) {
+    if (vm->sp < vm->values + 4) {
+        vm_error(vm, "stack underflow");
+        return 0;
+    }
+    vm->sp -= 4;
+    return read_stack(vm, vm->sp, 4);
+}
+
+/*
+Fetch the value of an operand. Width is the size of the value in memory or a
+local; values popped from the stack are always four bytes.
+*/
+unsigned load_operand(vm_t *vm, vmoperand_t *operand, int width) {
+    switch(operand->mode) {
+        case 0x0:
+            return 0;
+        case 0x1: case 0x2: case 0x3:
+            return operand->value;
+        case 0x5: case 0x6: case 0x7:
+            return read_mem(vm, operand->value, width);
+        case 0x8:
+            return pop(vm);
+        case 0x9: case 0xA: case 0xB:
+            if (vm->locals + operand->value + width > vm->values) {
+                vm_error(vm, "local at %u is outside of the frame", operand->value);
+                return 0;
+            }
+            return read_stack(vm, vm->locals + operand->value, width);
+        case 0xD: case 0xE: case 0xF:
+            return read_mem(vm, vm->ram_start + operand->value, width);
+    }
+    vm_error(vm, "bad operand mode %d", operand->mode);
+    return 0;
+}
+
+void store_operand(vm_t *vm, vmoperand_t *operand, unsigned value, int width) {
+    switch(operand->mode) {
+        case 0x0:
+            return;
+        case 0x5: case 0x6: case 0x7:
+            write_mem(vm, operand->value, value, width);
+            return;
+        case 0x8:
+            /* narrow values are pushed as whole words */
+            if (width < 4) {
+                value &= (1u << (width * 8)) - 1;
+            }
+            push(vm, value);
+            return;
+        case 0x9: case 0xA: case 0xB:
+            if (vm->locals + operand->value + width > vm->values) {
+                vm_error(vm, "local at %u is outside of the frame", operand->value);
+                return;
+            }
+            write_stack(vm, vm->locals + operand->value, value, width);
+            return;
+        case 0xD: case 0xE: case 0xF:
+            write_mem(vm, vm->ram_start + operand->value, value, width);
+            return;
+    }
+    vm_error(vm, "bad store operand mode %d", operand->mode);
+}
+
+void store_dest(vm_t *vm, unsigned type, unsigned address, unsigned value) {
+    vmoperand_t operand = { 0, address };
+    switch(type) {
+        case DEST_DISCARD:  operand.mode = 0x0; break;
+        case DEST_MEMORY:   operand.mode = 0x7; break;
+        case DEST_LOCAL:    operand.mode = 0xB; break;
+        case DEST_STACK:    operand.mode = 0x8; break;
+        default:
+            vm_error(vm, "unsupported call stub type %u", type);
+            return;
+    }
+    store_operand(vm, &operand, value, 4);
+}
+
+/*
+Push a call stub that will store a result where an operand would.
+*/
+void push_stub(vm_t *vm, vmoperand_t *dest) {
+    unsigned type = DEST_DISCARD, address = 0;
+    switch(dest->mode) {
+        case 0x0:
+            break;
+        case 0x5: case 0x6: case 0x7:
+            type = DEST_MEMORY;
+            address = dest->value;
+            break;
+        case 0x8:
+            type = DEST_STACK;
+            break;
+        case 0x9: case 0xA: case 0xB:
+            type = DEST_LOCAL;
+            address = dest->value;
+            break;
+        case 0xD: case 0xE: case 0xF:
+            type = DEST_MEMORY;
+            address = vm->ram_start + dest->value;
+            break;
+        default:
+            vm_error(vm, "bad store operand mode %d", dest->mode);
+            return;
+    }
+    push(vm, type);
+    push(vm, address);
+    push(vm, vm->pc);
+    push(vm, vm->fp);
+}
+
+/*
+Make the frame at frame_ptr the current one.
+*/
+void set_frame(vm_t *vm, unsigned frame_ptr) {
+    vm->fp = frame_ptr;
+    vm->locals = frame_ptr + read_stack(vm, frame_ptr + 4, 4);
+    vm->values = frame_ptr + read_stack(vm, frame_ptr, 4);
+}
+
+/*
+Build a new call frame for the function at address on top of the stack and
+begin executing it.
+*/
+void enter_function(vm_t *vm, unsigned address, unsigned argc, unsigned *args) {
+    int type = read_mem(vm, address, 1);
+    if (type != FUNC_STACK_ARGS && type != FUNC_LOCALS_ARGS) {
+        vm_error(vm, "no function at $%X", address);
+        return;
+    }
+
+    /* the format of the locals is copied into the frame as it is */
+    unsigned format = address + 1;
+    unsigned format_length = 0;
+    while (vm->status == VM_RUNNING && read_mem(vm, format + format_length, 1)) {
+        format_length += 2;
+    }
+    format_length += 2;
+    unsigned locals_pos = 8 + ((format_length + 3) & ~3u);
+
+    /* each local is aligned to its own size */
+    unsigned locals_size = 0;
+    for (unsigned i = 0; i + 2 < format_length; i += 2) {
+        int size = read_mem(vm, format + i, 1);
+        int count = read_mem(vm, format + i + 1, 1);
+        if (size != 1 && size != 2 && size != 4) {
+            vm_error(vm, "bad local size %d in function $%X", size, address);
+            return;
+        }
+        locals_size = (locals_size + size - 1) & ~(unsigned)(size - 1);
+        locals_size += size * count;
+    }
+    locals_size = (locals_size + 3) & ~3u;
+    unsigned frame_length = locals_pos + locals_size;
+
+    unsigned frame_ptr = vm->sp;
+    if (vm->status != VM_RUNNING || frame_ptr + frame_length > vm->stack_size) {
+        vm_error(vm, "stack overflow");
+        return;
+    }
+    memset(&vm->stack[frame_ptr], 0, frame_length);
+    write_stack(vm, frame_ptr, frame_length, 4);
+    write_stack(vm, frame_ptr + 4, locals_pos, 4);
+    for (unsigned i = 0; i < format_length; ++i) {
+        vm->stack[frame_ptr + 8 + i] = read_mem(vm, format + i, 1);
+    }
+    vm->sp = frame_ptr + frame_length;
+    set_frame(vm, frame_ptr);
+    vm->pc = format + format_length;
+
+    if (type == FUNC_LOCALS_ARGS) {
+        /* arguments fill the locals in order; extras are dropped */
+        unsigned offset = 0, arg = 0;
+        for (unsigned i = 0; i + 2 < format_length && arg < argc; i += 2) {
+            int size = vm->stack[frame_ptr + 8 + i];
+            int count = vm->stack[frame_ptr + 8 + i + 1];
+            offset = (offset + size - 1) & ~(unsigned)(size - 1);
+            for (int j = 0; j < count && arg < argc; ++j) {
+                write_stack(vm, vm->locals + offset, args[arg++], size);
+                offset += size;
+            }
+        }
+    } else {
+        for (unsigned i = argc; i > 0; --i) {
+            push(vm, args[i - 1]);
+        }
+        push(vm, argc);
+    }
+
+    vmfunction_t *function = add_vm_function(vm, address);
+    ++function->calls;
+    if (vm->frame_count >= vm->frame_capacity) {
+        vm->frame_capacity = vm->frame_capacity ? vm->frame_capacity * 2 : 64;
+        vm->frames = realloc(vm->frames, vm->frame_capacity * sizeof(vmframe_t));
+    }
+    vm->frames[vm->frame_count].frame_ptr = frame_ptr;
+    vm->frames[vm->frame_count].function = function;
+    ++vm->frame_count;
+}
+
+/*
+Return from the current function, storing value where its call stub says.
+Returning from the start function ends the game.
+*/
+void leave_function(vm_t *vm, unsigned value) {
+    vm->sp = vm->fp;
+    if (vm->frame_count) {
+        --vm->frame_count;
+    }
+    if (vm->sp == 0) {
+        vm->status = VM_QUIT;
+        return;
+    }
+    vm->values = 0;
+    unsigned frame_ptr = pop(vm);
+    unsigned pc = pop(vm);
+    unsigned address = pop(vm);
+    unsigned type = pop(vm);
+    set_frame(vm, frame_ptr);
+    vm->pc = pc;
+    store_dest(vm, type, address, value);
+}
+
+/*
+Take a branch from the end of the current instruction. Offsets of 0 and 1
+return that value from the current function instead.
+*/
+void branch(vm_t *vm, unsigned offset) {
+    if (offset == 0 || offset == 1) {
+        leave_function(vm, offset);
+    } else {
+        vm->pc += offset - 2;
+    }
+}
+
+/*
+Take a call's arguments from the stack; the first argument is on top.
+*/
+void pop_args(vm_t *vm, unsigned argc, unsigned *args) {
+    for (unsigned i = 0; i < argc; ++i) {
+        args[i] = pop(vm);
+    }
+}
+
+/*
+Find the statistics kept for the function at an address, or null if it was
+never called.
+*/
+vmfunction_t* vm_function(vm_t *vm, unsigned address) {
+    if (!vm->function_capacity) return 0;
+    unsigned mask = vm->function_capacity - 1;
+    for (unsigned i = (address * 2654435761u) & mask; ; i = (i + 1) & mask) {
+        if (vm->functions[i].address == address) return &vm->functions[i];
+        if (vm->functions[i].address == 0) return 0;
+    }
+}
+
+vmfunction_t* add_vm_function(vm_t *vm, unsigned address) {
+    vmfunction_t *function = vm_function(vm, address);
+    if (function) return function;
+
+    if ((vm->function_count + 1) * 2 > vm->function_capacity) {
+        vmfunction_t *old = vm->functions;
+        unsigned old_capacity = vm->function_capacity;
+        vm->function_capacity = old_capacity ? old_capacity * 2 : 64;
+        vm->functions = calloc(sizeof(vmfunction_t), vm->function_capacity);
+        vm->function_count = 0;
+        for (unsigned i = 0; i < old_capacity; ++i) {
+            if (old[i].address) {
+                *add_vm_function(vm, old[i].address) = old[i];
+            }
+        }
+        /* frames point into the table */
+        for (unsigned i = 0; i < vm->frame_count; ++i) {
+            vm->frames[i].function = vm_function(vm, vm->frames[i].function->address);
+        }
+        free(old);
+    }
+
+    unsigned mask = vm->function_capacity - 1;
+    unsigned i = (address * 2654435761u) & mask;
+    while (vm->functions[i].address) {
+        i = (i + 1) & mask;
+    }
+    vm->functions[i].address = address;
+    ++vm->function_count;
+    return &vm->functions[i];
+}
+
+/*
+Add a character to the output as UTF-8.
+*/
+void put_char(vm_t *vm, unsigned c) {
+    codebuf_t *out = &vm->output;
+    if (c < 0x80) {
+        codebuf_add_byte(out, c);
+    } else if (c < 0x800) {
+        codebuf_add_byte(out, 0xC0 | (c >> 6));
+        codebuf_add_byte(out, 0x80 | (c & 0x3F));
+    } else if (c < 0x10000) {
+        codebuf_add_byte(out, 0xE0 | (c >> 12));
+        codebuf_add_byte(out, 0x80 | ((c >> 6) & 0x3F));
+        codebuf_add_byte(out, 0x80 | (c & 0x3F));
+    } else {
+        codebuf_add_byte(out, 0xF0 | (c >> 18));
+        codebuf_add_byte(out, 0x80 | ((c >> 12) & 0x3F));
+        codebuf_add_byte(out, 0x80 | ((c >> 6) & 0x3F));
+        codebuf_add_byte(out, 0x80 | (c & 0x3F));
+    }
+}
+
+/*
+Send a character to the current io system.
+*/
+void stream_char(vm_t *vm, unsigned c) {
+    switch(vm->iosys) {
+        case IOSYS_NULL:
+            break;
+        case IOSYS_GLK:
+            put_char(vm, c);
+            break;
+        default:
+            vm_error(vm, "io system %u is not supported", vm->iosys);
+    }
+}
+
+void stream_num(vm_t *vm, int value) {
+    char buffer[16];
+    snprintf(buffer, sizeof(buffer), "%d", value);
+    for (const char *c = buffer; *c; ++c) {
+        stream_char(vm, *c);
+    }
+}
+
+void stream_string(vm_t *vm, unsigned address) {
+    int type = read_mem(vm, address, 1);
+    if (type == STRING_E0) {
+        for (unsigned c = address + 1; vm->status == VM_RUNNING; ++c) {
+            unsigned ch = read_mem(vm, c, 1);
+            if (!ch) break;
+            stream_char(vm, ch);
+        }
+    } else if (type == STRING_E2) {
+        for (unsigned c = address + 4; vm->status == VM_RUNNING; c += 4) {
+            unsigned ch = read_mem(vm, c, 4);
+            if (!ch) break;
+            stream_char(vm, ch);
+        }
+    } else if (type == STRING_E1) {
+        vm_error(vm, "compressed strings are not supported");
+    } else {
+        vm_error(vm, "no string at $%X", address);
+    }
+}
+
+/*
+The glk stub. There is a single window and stream, and everything printed to
+it is collected in the output. Functions the stub does not know return zero.
+*/
+unsigned call_glk(vm_t *vm, unsigned selector, unsigned argc) {
+    unsigned args[MAX_GLK_ARGS] = {0};
+    for (unsigned i = 0; i < argc; ++i) {
+        unsigned value = pop(vm);
+        if (i < MAX_GLK_ARGS) args[i] = value;
+    }
+
+    switch(selector) {
+        case GLK_EXIT:
+            vm->status = VM_QUIT;
+            return 0;
+        case GLK_WINDOW_OPEN:
+        case GLK_STREAM_GET_CURRENT:
+            return GLK_STUB_ID;
+        case GLK_PUT_CHAR:
+        case GLK_PUT_CHAR_UNI:
+            put_char(vm, selector == GLK_PUT_CHAR ? args[0] & 0xFF : args[0]);
+            return 0;
+        case GLK_PUT_CHAR_STREAM:
+            put_char(vm, args[1] & 0xFF);
+            return 0;
+        case GLK_PUT_STRING:
+            for (unsigned c = args[0]; vm->status == VM_RUNNING; ++c) {
+                unsigned ch = read_mem(vm, c, 1);
+                if (!ch) break;
+                put_char(vm, ch);
+            }
+            return 0;
+        case GLK_PUT_STRING_UNI:
+            for (unsigned c = args[0]; vm->status == VM_RUNNING; c += 4) {
+                unsigned ch = read_mem(vm, c, 4);
+                if (!ch) break;
+                put_char(vm, ch);
+            }
+            return 0;
+        case GLK_PUT_BUFFER:
+            for (unsigned i = 0; i < args[1] && vm->status == VM_RUNNING; ++i) {
+                put_char(vm, read_mem(vm, args[0] + i, 1));
+            }
+            return 0;
+        case GLK_PUT_BUFFER_UNI:
+            for (unsigned i = 0; i < args[1] && vm->status == VM_RUNNING; ++i) {
+                put_char(vm, read_mem(vm, args[0] + i * 4, 4));
+            }
+            return 0;
+    }
+    return 0;
+}
+
+unsigned gestalt(unsigned selector, unsigned arg) {
+    switch(selector) {
+        case 0:     return GLULX_VERSION;
+        case 1:     return VM_VERSION;
+        /* setmemsize */
+        case 2:     return 1;
+        /* io systems */
+        case 4:     return arg == IOSYS_NULL || arg == IOSYS_GLK;
+        /* unicode */
+        case 5:     return 1;
+        /* mzero and mcopy */
+        case 6:     return 1;
+        /* floating point */
+        case 11:    return 1;
+    }
+    return 0;
+}
+
+/*
+A xorshift generator. The sequence is always the same from the start of a
+run, so tests that use random numbers get the same results each time.
+*/
+unsigned next_random(vm_t *vm, int range) {
+    unsigned x = vm->random_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    vm->random_state = x;
+    if (range > 0) return x % range;
+    if (range < 0) return -(int)(x % -(unsigned)range);
+    return x;
+}
+
+/*
+Compare a search key with the key of a structure in memory, as unsigned big
+endian numbers. Returns less than, equal to or greater than zero as the key
+is less than, equal to or greater than the one in memory.
+*/
+int compare_key(vm_t *vm, unsigned key, unsigned key_size, unsigned address, int indirect) {
+    for (unsigned i = 0; i < key_size && vm->status == VM_RUNNING; ++i) {
+        unsigned a = indirect ? read_mem(vm, key + i, 1)
+                              : (key >> ((key_size - 1 - i) * 8)) & 0xFF;
+        unsigned b = read_mem(vm, address + i, 1);
+        if (a != b) return a < b ? -1 : 1;
+    }
+    return 0;
+}
+
+int is_zero_key(vm_t *vm, unsigned key_size, unsigned address) {
+    for (unsigned i = 0; i < key_size; ++i) {
+        if (read_mem(vm, address + i, 1)) return 0;
+    }
+    return 1;
+}
+
+/*
+Carry out linearsearch, binarysearch or linkedsearch with the loaded
+operands given.
+*/
+unsigned search(vm_t *vm, int opcode, unsigned *args) {
+    unsigned key = args[0], key_size = args[1], start = args[2];
+    unsigned options = opcode == 0x152 ? args[5] : args[6];
+    int indirect = options & SEARCH_KEY_INDIRECT;
+    int return_index = options & SEARCH_RETURN_INDEX;
+    unsigned not_found = return_index ? 0xFFFFFFFF : 0;
+    if (!indirect && key_size != 1 && key_size != 2 && key_size != 4) {
+        vm_error(vm, "direct search keys must be 1, 2 or 4 bytes");
+        return 0;
+    }
+
+    if (opcode == 0x150) {
+        /* linearsearch */
+        unsigned struct_size = args[3], count = args[4], key_offset = args[5];
+        for (unsigned i = 0; count == 0xFFFFFFFF || i < count; ++i) {
+            unsigned address = start + i * struct_size;
+            if (compare_key(vm, key, key_size, address + key_offset, indirect) == 0) {
+                return return_index ? i : address;
+            }
+            if ((options & SEARCH_ZERO_TERMINATES)
+                    && is_zero_key(vm, key_size, address + key_offset)) {
+                break;
+            }
+            if (vm->status != VM_RUNNING) break;
+        }
+        return not_found;
+    }
+
+    if (opcode == 0x151) {
+        /* binarysearch */
+        unsigned struct_size = args[3], count = args[4], key_offset = args[5];
+        unsigned low = 0, high = count;
+        while (low < high && vm->status == VM_RUNNING) {
+            unsigned middle = low + (high - low) / 2;
+            unsigned address = start + middle * struct_size;
+            int result = compare_key(vm, key, key_size, address + key_offset, indirect);
+            if (result == 0) return return_index ? middle : address;
+            if (result < 0) {
+                high = middle;
+            } else {
+                low = middle + 1;
+            }
+        }
+        return not_found;
+    }
+
+    /* linkedsearch */
+    unsigned key_offset = args[3], next_offset = args[4];
+    for (unsigned address = start; address && vm->status == VM_RUNNING;
+            address = read_mem(vm, address + next_offset, 4)) {
+        if (compare_key(vm, key, key_size, address + key_offset, indirect) == 0) {
+            return address;
+        }
+        if ((options & SEARCH_ZERO_TERMINATES)
+                && is_zero_key(vm, key_size, address + key_offset)) {
+            break;
+        }
+    }
+    return 0;
+}
+
+static float to_float(unsigned value) {
+    float result;
+    memcpy(&result, &value, 4);
+    return result;
+}
+
+static unsigned from_float(float value) {
+    unsigned result;
+    memcpy(&result, &value, 4);
+    return result;
+}
+
+/*
+Convert a float to an integer, rounding as given and saturating at the
+limits of an integer; NaN goes to the limit of its sign.
+*/
+static unsigned float_to_int(float value, int round_nearest) {
+    if (isnan(value)) {
+        return signbit(value) ? 0x80000000 : 0x7FFFFFFF;
+    }
+    value = round_nearest ? roundf(value) : truncf(value);
+    if (value >= 2147483648.0f) return 0x7FFFFFFF;
+    if (value < -2147483648.0f) return 0x80000000;
+    return (unsigned)(int)value;
+}
+
+/*
+Carry out a floating point instruction that stores its results. Jumps on
+floats are handled with the other jumps, so reaching one here is an error.
+*/
+void execute_float(vm_t *vm, int opcode, unsigned *values, unsigned *results) {
+    float a = to_float(values[0]);
+    float b = to_float(values[1]);
+    switch(opcode) {
+        case 0x190: results[0] = from_float((float)(int)values[0]); break;
+        case 0x191: results[0] = float_to_int(a, 0); break;
+        case 0x192: results[0] = float_to_int(a, 1); break;
+        case 0x198: results[0] = from_float(ceilf(a)); break;
+        case 0x199: results[0] = from_float(floorf(a)); break;
+        case 0x1A0: results[0] = from_float(a + b); break;
+        case 0x1A1: results[0] = from_float(a - b); break;
+        case 0x1A2: results[0] = from_float(a * b); break;
+        case 0x1A3: results[0] = from_float(a / b); break;
+        case 0x1A4: {
+            float remainder = fmodf(a, b);
+            results[0] = from_float(remainder);
+            /* the quotient is exact, so its sign must be worked out */
+            float quotient = fabsf((a - remainder) / b);
+            if (signbit(a) != signbit(b)) quotient = -quotient;
+            results[1] = from_float(quotient);
+            break;
+        }
+        case 0x1A8: results[0] = from_float(sqrtf(a)); break;
+        case 0x1A9: results[0] = from_float(expf(a)); break;
+        case 0x1AA: results[0] = from_float(logf(a)); break;
+        case 0x1AB: results[0] = from_float(powf(a, b)); break;
+        case 0x1B0: results[0] = from_float(sinf(a)); break;
+        case 0x1B1: results[0] = from_float(cosf(a)); break;
+        case 0x1B2: results[0] = from_float(tanf(a)); break;
+        case 0x1B3: results[0] = from_float(asinf(a)); break;
+        case 0x1B4: results[0] = from_float(acosf(a)); break;
+        case 0x1B5: results[0] = from_float(atanf(a)); break;
+        case 0x1B6: results[0] = from_float(atan2f(a, b)); break;
+        default:
+            vm_error(vm, "float opcode $%X is not supported", opcode);
+    }
+}
+
+/*
+Decode and execute one instruction.
+*/
+void step(vm_t *vm) {
+    unsigned start = vm->pc;
+    int opcode = read_mem(vm, vm->pc, 1);
+    if (opcode >= 0xC0) {
+        opcode = read_mem(vm, vm->pc, 4) & 0x0FFFFFFF;
+        vm->pc += 4;
+    } else if (opcode >= 0x80) {
+        opcode = read_mem(vm, vm->pc, 2) & 0x3FFF;
+        vm->pc += 2;
+    } else {
+        vm->pc += 1;
+    }
+    int index = opcode < MAX_OPCODE ? opcode_mnemonics[opcode] : -1;
+    if (vm->status != VM_RUNNING) return;
+    if (index < 0) {
+        vm_error(vm, "unknown opcode $%X at $%X", opcode, start);
+        return;
+    }
+    mnemonic_t *mnemonic = &mnemonics[index];
+
+    ++vm->instruction_count;
+    ++vm->opcode_counts[index];
+    if (vm->frame_count) {
+        ++vm->frames[vm->frame_count - 1].function->instructions;
+    }
+
+    /* addressing modes come two to a byte, followed by the operands */
+    vmoperand_t operands[MAX_OPERANDS];
+    unsigned mode_bytes = vm->pc;
+    vm->pc += (mnemonic->operands + 1) / 2;
+    for (int i = 0; i < mnemonic->operands; ++i) {
+        int mode = read_mem(vm, mode_bytes + i / 2, 1);
+        mode = (i & 1) ? mode >> 4 : mode & 0xF;
+        operands[i].mode = mode;
+        switch(mode) {
+            case 0x1: operands[i].value = (int)(signed char)read_mem(vm, vm->pc, 1); vm->pc += 1; break;
+            case 0x2: operands[i].value = (int)(short)read_mem(vm, vm->pc, 2); vm->pc += 2; break;
+            case 0x3: case 0x7: case 0xB: case 0xF:
+                operands[i].value = read_mem(vm, vm->pc, 4); vm->pc += 4; break;
+            case 0x5: case 0x9: case 0xD:
+                operands[i].value = read_mem(vm, vm->pc, 1); vm->pc += 1; break;
+            case 0x6: case 0xA: case 0xE:
+                operands[i].value = read_mem(vm, vm->pc, 2); vm->pc += 2; break;
+            case 0x0: case 0x8:
+                operands[i].value = 0; break;
+            default:
+                vm_error(vm, "bad operand mode %d at $%X", mode, start);
+                return;
+        }
+    }
+
+    /* copys and copyb move narrower values; everything else is a word */
+    int width = opcode == 0x41 ? 2 : opcode == 0x42 ? 1 : 4;
+    unsigned values[MAX_OPERANDS] = {0};
+    unsigned results[MAX_OPERANDS] = {0};
+    int loaded = 0;
+    for (int i = 0; i < mnemonic->operands; ++i) {
+        if (!(mnemonic->stores & (1 << i))) {
+            values[loaded++] = load_operand(vm, &operands[i], width);
+        }
+    }
+    if (vm->status != VM_RUNNING) return;
+
+    int a = values[0], b = values[1];
+    unsigned ua = values[0], ub = values[1];
+    switch(opcode) {
+        case 0x00: break;                                           /* nop */
+        case 0x10: results[0] = ua + ub; break;                     /* add */
+        case 0x11: results[0] = ua - ub; break;                     /* sub */
+        case 0x12: results[0] = ua * ub; break;                     /* mul */
+        case 0x13:                                                  /* div */
+        case 0x14:                                                  /* mod */
+            if (b == 0) {
+                vm_error(vm, "division by zero");
+                return;
+            }
+            if (b == -1) {
+                results[0] = opcode == 0x13 ? -ua : 0;
+            } else {
+                results[0] = opcode == 0x13 ? a / b : a % b;
+            }
+            break;
+        case 0x15: results[0] = -ua; break;                         /* neg */
+        case 0x18: results[0] = ua & ub; break;                     /* bitand */
+        case 0x19: results[0] = ua | ub; break;                     /* bitor */
+        case 0x1A: results[0] = ua ^ ub; break;                     /* bitxor */
+        case 0x1B: results[0] = ~ua; break;                         /* bitnot */
+        case 0x1C: results[0] = ub < 32 ? ua << ub : 0; break;      /* shiftl */
+        case 0x1D: results[0] = ub < 32 ? (unsigned)(a >> ub)       /* sshiftr */
+                                        : (a < 0 ? 0xFFFFFFFF : 0);
+                   break;
+        case 0x1E: results[0] = ub < 32 ? ua >> ub : 0; break;      /* ushiftr */
+
+        case 0x20: branch(vm, ua); break;                           /* jump */
+        case 0x22: if (a == 0) branch(vm, ub); break;               /* jz */
+        case 0x23: if (a != 0) branch(vm, ub); break;               /* jnz */
+        case 0x24: if (a == b) branch(vm, values[2]); break;        /* jeq */
+        case 0x25: if (a != b) branch(vm, values[2]); break;        /* jne */
+        case 0x26: if (a < b) branch(vm, values[2]); break;         /* jlt */
+        case 0x27: if (a >= b) branch(vm, values[2]); break;        /* jge */
+        case 0x28: if (a > b) branch(vm, values[2]); break;         /* jgt */
+        case 0x29: if (a <= b) branch(vm, values[2]); break;        /* jle */
+        case 0x2A: if (ua < ub) branch(vm, values[2]); break;       /* jltu */
+        case 0x2B: if (ua >= ub) branch(vm, values[2]); break;      /* jgeu */
+        case 0x2C: if (ua > ub) branch(vm, values[2]); break;       /* jgtu */
+        case 0x2D: if (ua <= ub) branch(vm, values[2]); break;      /* jleu */
+        case 0x104: vm->pc = ua; break;                             /* jumpabs */
+        case 0x1C0:                                                 /* jfeq */
+        case 0x1C1: {                                               /* jfne */
+            float fa = to_float(ua), fb = to_float(ub), fc = to_float(values[2]);
+            int equal = isinf(fa) && isinf(fb) ? fa == fb
+                      : fabsf(fa - fb) <= fabsf(fc);
+            if (equal == (opcode == 0x1C0)) branch(vm, values[3]);
+            break;
+        }
+        case 0x1C2: if (to_float(ua) < to_float(ub)) branch(vm, values[2]); break;
+        case 0x1C3: if (to_float(ua) <= to_float(ub)) branch(vm, values[2]); break;
+        case 0x1C4: if (to_float(ua) > to_float(ub)) branch(vm, values[2]); break;
+        case 0x1C5: if (to_float(ua) >= to_float(ub)) branch(vm, values[2]); break;
+        case 0x1C8: if (isnan(to_float(ua))) branch(vm, ub); break;
+        case 0x1C9: if (isinf(to_float(ua))) branch(vm, ub); break;
+
+        case 0x30: {                                                /* call */
+            unsigned args[256];
+            if (ub > 256) {
+                vm_error(vm, "too many arguments");
+                return;
+            }
+            pop_args(vm, ub, args);
+            push_stub(vm, &operands[2]);
+            enter_function(vm, ua, ub, args);
+            return;
+        }
+        case 0x160: case 0x161: case 0x162: case 0x163:             /* callf* */
+            push_stub(vm, &operands[mnemonic->operands - 1]);
+            enter_function(vm, ua, opcode - 0x160, &values[1]);
+            return;
+        case 0x31: leave_function(vm, ua); return;                  /* return */
+        case 0x34: {                                                /* tailcall */
+            unsigned args[256];
+            if (ub > 256) {
+                vm_error(vm, "too many arguments");
+                return;
+            }
+            pop_args(vm, ub, args);
+            vm->sp = vm->fp;
+            --vm->frame_count;
+            enter_function(vm, ua, ub, args);
+            return;
+        }
+        case 0x32:                                                  /* catch */
+            push_stub(vm, &operands[0]);
+            store_operand(vm, &operands[0], vm->sp, 4);
+            branch(vm, ua);
+            return;
+        case 0x33: {                                                /* throw */
+            if (ub + 16 > vm->sp || ub < 16) {
+                vm_error(vm, "bad catch token %u", ub);
+                return;
+            }
+            vm->sp = ub;
+            vm->values = 0;
+            unsigned frame_ptr = pop(vm);
+            unsigned pc = pop(vm);
+            unsigned address = pop(vm);
+            unsigned type = pop(vm);
+            while (vm->frame_count && vm->frames[vm->frame_count - 1].frame_ptr > frame_ptr) {
+                --vm->frame_count;
+            }
+            set_frame(vm, frame_ptr);
+            vm->pc = pc;
+            store_dest(vm, type, address, ua);
+            return;
+        }
+
+        case 0x40: case 0x41: case 0x42: results[0] = ua; break;    /* copy, copys, copyb */
+        case 0x44: results[0] = (int)(short)ua; break;              /* sexs */
+        case 0x45: results[0] = (int)(signed char)ua; break;        /* sexb */
+        case 0x48: results[0] = read_mem(vm, ua + 4 * ub, 4); break;    /* aload */
+        case 0x49: results[0] = read_mem(vm, ua + 2 * ub, 2); break;    /* aloads */
+        case 0x4A: results[0] = read_mem(vm, ua + ub, 1); break;        /* aloadb */
+        case 0x4B:                                                      /* aloadbit */
+            results[0] = (read_mem(vm, ua + (b >> 3), 1) >> (b & 7)) & 1;
+            break;
+        case 0x4C: write_mem(vm, ua + 4 * ub, values[2], 4); break;     /* astore */
+        case 0x4D: write_mem(vm, ua + 2 * ub, values[2], 2); break;     /* astores */
+        case 0x4E: write_mem(vm, ua + ub, values[2], 1); break;         /* astoreb */
+        case 0x4F: {                                                    /* astorebit */
+            unsigned address = ua + (b >> 3);
+            unsigned byte = read_mem(vm, address, 1);
+            byte = values[2] ? byte | (1 << (b & 7)) : byte & ~(1 << (b & 7));
+            write_mem(vm, address, byte, 1);
+            break;
+        }
+
+        case 0x50: results[0] = (vm->sp - vm->values) / 4; break;  /* stkcount */
+        case 0x51:                                                  /* stkpeek */
+            if (ua >= (vm->sp - vm->values) / 4) {
+                vm_error(vm, "stack underflow");
+                return;
+            }
+            results[0] = read_stack(vm, vm->sp - 4 * (ua + 1), 4);
+            break;
+        case 0x52: {                                                /* stkswap */
+            unsigned top = pop(vm), next = pop(vm);
+            push(vm, top);
+            push(vm, next);
+            break;
+        }
+        case 0x53: {                                                /* stkroll */
+            if (ua > (vm->sp - vm->values) / 4) {
+                vm_error(vm, "stack underflow");
+                return;
+            }
+            if (ua == 0) break;
+            int shift = b % a;
+            if (shift < 0) shift += a;
+            unsigned base = vm->sp - 4 * ua;
+            unsigned *rolled = malloc(ua * sizeof(unsigned));
+            for (unsigned i = 0; i < ua; ++i) {
+                rolled[(i + shift) % ua] = read_stack(vm, base + 4 * i, 4);
+            }
+            for (unsigned i = 0; i < ua; ++i) {
+                write_stack(vm, base + 4 * i, rolled[i], 4);
+            }
+            free(rolled);
+            break;
+        }
+        case 0x54: {                                                /* stkcopy */
+            if (ua > (vm->sp - vm->values) / 4) {
+                vm_error(vm, "stack underflow");
+                return;
+            }
+            unsigned base = vm->sp - 4 * ua;
+            for (unsigned i = 0; i < ua; ++i) {
+                push(vm, read_stack(vm, base + 4 * i, 4));
+            }
+            break;
+        }
+
+        case 0x70: stream_char(vm, ua & 0xFF); break;               /* streamchar */
+        case 0x71: stream_num(vm, a); break;                        /* streamnum */
+        case 0x72: stream_string(vm, ua); break;                    /* streamstr */
+        case 0x73: stream_char(vm, ua); break;                      /* streamunichar */
+
+        case 0x100: results[0] = gestalt(ua, ub); break;            /* gestalt */
+        case 0x101:                                                 /* debugtrap */
+            vm_error(vm, "debugtrap %u", ua);
+            return;
+        case 0x102: results[0] = vm->mem_size; break;               /* getmemsize */
+        case 0x103:                                                 /* setmemsize */
+            if (ua < vm->end_mem || ua % 256) {
+                results[0] = 1;
+            } else {
+                vm->memory = realloc(vm->memory, ua);
+                if (ua > vm->mem_size) {
+                    memset(&vm->memory[vm->mem_size], 0, ua - vm->mem_size);
+                }
+                vm->mem_size = ua;
+                results[0] = 0;
+            }
+            break;
+        case 0x110: results[0] = next_random(vm, a); break;         /* random */
+        case 0x111: vm->random_state = ua ? ua : 1; break;          /* setrandom */
+        case 0x120: vm->status = VM_QUIT; return;                   /* quit */
+        case 0x121: results[0] = 0; break;                          /* verify */
+        case 0x122: start_vm(vm); return;                           /* restart */
+        case 0x123: case 0x124: results[0] = 1; break;              /* save, restore */
+        case 0x125: case 0x126: results[0] = 1; break;              /* saveundo, restoreundo */
+        case 0x127: break;                                          /* protect */
+        case 0x130: results[0] = call_glk(vm, ua, ub); break;       /* glk */
+        case 0x140: results[0] = vm->string_table; break;           /* getstringtbl */
+        case 0x141: vm->string_table = ua; break;                   /* setstringtbl */
+        case 0x148:                                                 /* getiosys */
+            results[0] = vm->iosys;
+            results[1] = vm->iosys_rock;
+            break;
+        case 0x149:                                                 /* setiosys */
+            vm->iosys = ua == IOSYS_GLK ? IOSYS_GLK : IOSYS_NULL;
+            vm->iosys_rock = ub;
+            break;
+        case 0x150: case 0x151: case 0x152:                         /* searches */
+            results[0] = search(vm, opcode, values);
+            break;
+        case 0x170:                                                 /* mzero */
+            for (unsigned i = 0; i < ua && vm->status == VM_RUNNING; ++i) {
+                write_mem(vm, ub + i, 0, 1);
+            }
+            break;
+        case 0x171:                                                 /* mcopy */
+            if (ua && (ub > vm->mem_size || vm->mem_size - ub < ua
+                       || values[2] < vm->ram_start || values[2] > vm->mem_size
+                       || vm->mem_size - values[2] < ua)) {
+                vm_error(vm, "mcopy is outside of memory");
+                return;
+            }
+            memmove(&vm->memory[values[2]], &vm->memory[ub], ua);
+            break;
+        case 0x178: results[0] = 0; break;                          /* malloc */
+        case 0x179: break;                                          /* mfree */
+        case 0x180: case 0x181: break;                              /* accelfunc, accelparam */
+
+        default:
+            if (mnemonic->flags & MNE_FLOAT) {
+                execute_float(vm, opcode, values, results);
+                if (vm->status != VM_RUNNING) return;
+                break;
+            }
+            vm_error(vm, "opcode \"%s\" is not supported", mnemonic->mnemonic);
+            return;
+    }
+
+    /* a branch may have returned from the function, leaving nothing to
+       store; only instructions that do not branch store results */
+    int stored = 0;
+    for (int i = 0; i < mnemonic->operands && vm->status == VM_RUNNING; ++i) {
+        if (mnemonic->stores & (1 << i)) {
+            store_operand(vm, &operands[i], results[stored++], width);
+        }
+    }
+}
+
+/*
+The number of times a mnemonic was executed, for sorting the report.
+*/
+typedef struct VM_OPCODE_COUNT {
+    int mnemonic;
+    unsigned long count;
+} vmopcodecount_t;
+
+static int compare_opcode_counts(const void *a, const void *b) {
+    const vmopcodecount_t *first = a;
+    const vmopcodecount_t *second = b;
+    if (first->count != second->count) {
+        return first->count > second->count ? -1 : 1;
+    }
+    return first->mnemonic - second->mnemonic;
+}
+
+static int compare_functions(const void *a, const void *b) {
+    const vmfunction_t *first = *(const vmfunction_t**)a;
+    const vmfunction_t *second = *(const vmfunction_t**)b;
+    if (first->instructions != second->instructions) {
+        return first->instructions > second->instructions ? -1 : 1;
+    }
+    return first->address < second->address ? -1 : first->address > second->address;
+}
+
+/*
+Write how many instructions were executed in all, for each mnemonic and for
+each function, most executed first. Functions are named from the game they
+were built from if it is given.
+*/
+void print_vm_report(vm_t *vm, glulxfile_t *gamefile, FILE *out) {
+    fprintf(out, "Instructions executed: %lu\n", vm->instruction_count);
+
+    unsigned mnemonic_count = 0;
+    while (mnemonics[mnemonic_count].mnemonic) {
+        ++mnemonic_count;
+    }
+    vmopcodecount_t *counts = malloc(mnemonic_count * sizeof(vmopcodecount_t));
+    unsigned used = 0;
+    for (unsigned i = 0; i < mnemonic_count; ++i) {
+        if (vm->opcode_counts[i]) {
+            counts[used].mnemonic = i;
+            counts[used].count = vm->opcode_counts[i];
+            ++used;
+        }
+    }
+    qsort(counts, used, sizeof(vmopcodecount_t), compare_opcode_counts);
+    fprintf(out, "Instructions by mnemonic:\n");
+    for (unsigned i = 0; i < used; ++i) {
+        fprintf(out, "    %-15s %lu\n", mnemonics[counts[i].mnemonic].mnemonic,
+                counts[i].count);
+    }
+    free(counts);
+
+    vmfunction_t **functions = malloc((vm->function_count + 1) * sizeof(vmfunction_t*));
+    used = 0;
+    for (unsigned i = 0; i < vm->function_capacity; ++i) {
+        if (vm->functions[i].address) functions[used++] = &vm->functions[i];
+    }
+    qsort(functions, used, sizeof(vmfunction_t*), compare_functions);
+    fprintf(out, "Instructions by function:\n");
+    for (unsigned i = 0; i < used; ++i) {
+        const char *name = 0;
+        for (function_t *func = gamefile ? gamefile->functions : 0; func; func = func->next) {
+            if (func->position == functions[i]->address) {
+                name = func->name;
+                break;
+            }
+        }
+        if (name) {
+            fprintf(out, "    %-15s", name);
+        } else {
+            fprintf(out, "    $%-14X", functions[i]->address);
+        }
+        fprintf(out, " %lu in %lu calls\n", functions[i]->instructions, functions[i]->calls);
+    }
+    free(functions);
+}